@@ -0,0 +1,77 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Example client for byzanz-record --shm. It prints every frame it
+ * receives with the area that changed. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "byzanzshm.h"
+
+int
+main (int argc, char **argv)
+{
+  ByzanzShmConsumer *consumer;
+  ByzanzShmFrame frame;
+  GError *error = NULL;
+  guint64 next = 0;
+  guint i;
+
+  if (argc != 2) {
+    g_printerr ("usage: %s SOCKET\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  consumer = byzanz_shm_consumer_new (argv[1], &error);
+  if (consumer == NULL) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return EXIT_FAILURE;
+  }
+
+  while (byzanz_shm_consumer_wait (consumer, &error)) {
+    if (!byzanz_shm_consumer_begin (consumer, &frame))
+      continue;
+
+    g_print ("frame %" G_GUINT64_FORMAT " at %" G_GUINT64_FORMAT " ms, %ux%u",
+        frame.number, frame.msecs, frame.width, frame.height);
+    if (frame.number != next)
+      g_print (", %" G_GUINT64_FORMAT " frames missed", frame.number - next);
+    g_print ("\n");
+    for (i = 0; i < frame.n_rects; i++) {
+      g_print ("  changed %d %d %dx%d\n", frame.rects[i].x, frame.rects[i].y,
+          frame.rects[i].width, frame.rects[i].height);
+    }
+
+    /* a real client would copy the pixels here */
+    if (!byzanz_shm_consumer_end (consumer, &frame))
+      g_print ("  overwritten while reading\n");
+    next = frame.number + 1;
+  }
+
+  byzanz_shm_consumer_free (consumer);
+  if (error) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
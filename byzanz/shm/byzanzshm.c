@@ -0,0 +1,295 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzshm.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixsocketaddress.h>
+
+struct _ByzanzShmConsumer {
+  GSocket *             socket;         /* connection to the recorder, closed when it's done */
+  int                   eventfd;        /* signaled by the recorder after every frame */
+  guchar *              map;            /* the ring */
+  gsize                 size;           /* size of map */
+  const ByzanzShmHeader *header;        /* header at the start of map */
+};
+
+/* receives the ring and the eventfd, the recorder sends them with its version */
+static gboolean
+byzanz_shm_consumer_receive (ByzanzShmConsumer *consumer,
+                             GError **          error)
+{
+  GSocketControlMessage **messages = NULL;
+  GInputVector vector;
+  guint8 version = 0;
+  int i, n_messages = 0, n_fds = 0, *fds = NULL;
+  struct stat st;
+  gssize result;
+
+  vector.buffer = &version;
+  vector.size = 1;
+  result = g_socket_receive_message (consumer->socket, NULL, &vector, 1,
+      &messages, &n_messages, NULL, NULL, error);
+  if (result < 0)
+    return FALSE;
+
+  for (i = 0; i < n_messages; i++) {
+    if (fds == NULL && G_IS_UNIX_FD_MESSAGE (messages[i]))
+      fds = g_unix_fd_message_steal_fds (G_UNIX_FD_MESSAGE (messages[i]), &n_fds);
+    g_object_unref (messages[i]);
+  }
+  g_free (messages);
+
+  if (result == 0 || version != BYZANZ_SHM_VERSION || n_fds != 2) {
+    for (i = 0; i < n_fds; i++)
+      close (fds[i]);
+    g_free (fds);
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        "Not a recorder that publishes frames");
+    return FALSE;
+  }
+
+  consumer->eventfd = fds[1];
+  if (fstat (fds[0], &st) < 0 || (gsize) st.st_size < sizeof (ByzanzShmHeader)) {
+    close (fds[0]);
+    g_free (fds);
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+        "Invalid frame ring");
+    return FALSE;
+  }
+  consumer->size = st.st_size;
+  consumer->map = mmap (NULL, consumer->size, PROT_READ, MAP_SHARED, fds[0], 0);
+  close (fds[0]);
+  g_free (fds);
+  if (consumer->map == MAP_FAILED) {
+    int errsv = errno;
+    consumer->map = NULL;
+    g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+        g_strerror (errsv));
+    return FALSE;
+  }
+
+  consumer->header = (const ByzanzShmHeader *) consumer->map;
+  if (consumer->header->magic != BYZANZ_SHM_MAGIC ||
+      consumer->header->version != BYZANZ_SHM_VERSION ||
+      consumer->header->slot_offset + (gsize) consumer->header->n_slots * consumer->header->slot_size > consumer->size ||
+      consumer->header->data_offset + (gsize) consumer->header->stride * consumer->header->height > consumer->header->slot_size) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+        "Invalid frame ring");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * byzanz_shm_consumer_new:
+ * @path: the socket the recorder listens on
+ * @error: %NULL or location to take an error
+ *
+ * Connects to a recorder publishing its frames at @path and receives
+ * the ring from it.
+ *
+ * Returns: a new consumer or %NULL on error
+ **/
+ByzanzShmConsumer *
+byzanz_shm_consumer_new (const char *path,
+                         GError **   error)
+{
+  ByzanzShmConsumer *consumer;
+  GSocketAddress *address;
+  gboolean result;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  consumer = g_slice_new0 (ByzanzShmConsumer);
+  consumer->eventfd = -1;
+
+  consumer->socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_DEFAULT, error);
+  if (consumer->socket == NULL) {
+    byzanz_shm_consumer_free (consumer);
+    return NULL;
+  }
+
+  address = g_unix_socket_address_new (path);
+  result = g_socket_connect (consumer->socket, address, NULL, error) &&
+    byzanz_shm_consumer_receive (consumer, error);
+  g_object_unref (address);
+  if (!result) {
+    byzanz_shm_consumer_free (consumer);
+    return NULL;
+  }
+
+  return consumer;
+}
+
+void
+byzanz_shm_consumer_free (ByzanzShmConsumer *consumer)
+{
+  g_return_if_fail (consumer != NULL);
+
+  if (consumer->map)
+    munmap (consumer->map, consumer->size);
+  if (consumer->eventfd >= 0)
+    close (consumer->eventfd);
+  if (consumer->socket)
+    g_object_unref (consumer->socket);
+
+  g_slice_free (ByzanzShmConsumer, consumer);
+}
+
+/**
+ * byzanz_shm_consumer_get_fd:
+ * @consumer: a consumer
+ *
+ * Gets the file descriptor that becomes readable when a new frame was
+ * published, for use in a main loop. Call byzanz_shm_consumer_wait()
+ * when it is.
+ *
+ * Returns: the file descriptor
+ **/
+int
+byzanz_shm_consumer_get_fd (ByzanzShmConsumer *consumer)
+{
+  g_return_val_if_fail (consumer != NULL, -1);
+
+  return consumer->eventfd;
+}
+
+/**
+ * byzanz_shm_consumer_wait:
+ * @consumer: a consumer
+ * @error: %NULL or location to take an error
+ *
+ * Waits until the recorder publishes a new frame. Frames published since
+ * the last call are not waited for.
+ *
+ * Returns: %TRUE if there is a new frame, %FALSE if the recording ended
+ *          or an error occured
+ **/
+gboolean
+byzanz_shm_consumer_wait (ByzanzShmConsumer *consumer,
+                          GError **          error)
+{
+  GPollFD fds[2];
+  guint64 count;
+
+  g_return_val_if_fail (consumer != NULL, FALSE);
+
+  fds[0].fd = consumer->eventfd;
+  fds[0].events = G_IO_IN;
+  fds[1].fd = g_socket_get_fd (consumer->socket);
+  fds[1].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+
+  for (;;) {
+    fds[0].revents = fds[1].revents = 0;
+    if (g_poll (fds, 2, -1) < 0) {
+      int errsv = errno;
+      if (errsv == EINTR)
+        continue;
+      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+          g_strerror (errsv));
+      return FALSE;
+    }
+
+    /* the recorder never sends anything else, so the connection was closed */
+    if (fds[1].revents)
+      return FALSE;
+
+    if (read (consumer->eventfd, &count, sizeof (count)) == sizeof (count))
+      return TRUE;
+  }
+}
+
+/**
+ * byzanz_shm_consumer_begin:
+ * @consumer: a consumer
+ * @frame: the frame to fill in
+ *
+ * Gets the newest frame. Its data is used in place, so once you are done
+ * with it, check with byzanz_shm_consumer_end() that the recorder didn't
+ * reuse its slot in the meantime.
+ *
+ * Returns: %TRUE if @frame was filled in, %FALSE if no frame was published
+ *          yet
+ **/
+gboolean
+byzanz_shm_consumer_begin (ByzanzShmConsumer *consumer,
+                           ByzanzShmFrame *   frame)
+{
+  const ByzanzShmHeader *header;
+  const ByzanzShmSlot *slot;
+  gint latest, sequence;
+
+  g_return_val_if_fail (consumer != NULL, FALSE);
+  g_return_val_if_fail (frame != NULL, FALSE);
+
+  header = consumer->header;
+  do {
+    latest = g_atomic_int_get (&header->latest);
+    if (latest < 0 || (guint) latest >= header->n_slots)
+      return FALSE;
+    slot = (const ByzanzShmSlot *) (consumer->map + header->slot_offset + latest * header->slot_size);
+    sequence = g_atomic_int_get (&slot->sequence);
+  /* the recorder went round the ring since we looked at latest */
+  } while (sequence & 1);
+
+  frame->number = slot->number;
+  frame->msecs = slot->msecs;
+  frame->width = header->width;
+  frame->height = header->height;
+  frame->stride = header->stride;
+  frame->data = (const guchar *) slot + header->data_offset;
+  frame->n_rects = MIN (slot->n_rects, BYZANZ_SHM_MAX_RECTS);
+  frame->rects = slot->rects;
+  frame->slot = slot;
+  frame->sequence = sequence;
+
+  return TRUE;
+}
+
+/**
+ * byzanz_shm_consumer_end:
+ * @consumer: a consumer
+ * @frame: a frame filled in by byzanz_shm_consumer_begin()
+ *
+ * Checks if @frame stayed unchanged since byzanz_shm_consumer_begin().
+ * If it didn't, whatever was read from it must be discarded.
+ *
+ * Returns: %TRUE if @frame was valid all the time
+ **/
+gboolean
+byzanz_shm_consumer_end (ByzanzShmConsumer *    consumer,
+                         const ByzanzShmFrame * frame)
+{
+  g_return_val_if_fail (consumer != NULL, FALSE);
+  g_return_val_if_fail (frame != NULL, FALSE);
+
+  return g_atomic_int_get (&frame->slot->sequence) == frame->sequence;
+}
+
@@ -0,0 +1,102 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#ifndef __HAVE_BYZANZ_SHM_H__
+#define __HAVE_BYZANZ_SHM_H__
+
+/* The recorder publishes frames in a ring of slots in shared memory. It
+ * listens on a UNIX socket and sends every client that connects a memfd
+ * with the ring and an eventfd that is signaled after every frame. Slots
+ * are protected by a sequence number that is odd while the slot is being
+ * written, so readers can tell if a frame changed while they used it. */
+
+#define BYZANZ_SHM_MAGIC 0x5A4E5A42             /* "BZNZ" in little endian */
+#define BYZANZ_SHM_VERSION 1
+/* frames kept in the ring */
+#define BYZANZ_SHM_SLOTS 4
+/* damage with more rectangles is stored as its extents */
+#define BYZANZ_SHM_MAX_RECTS 64
+
+typedef struct _ByzanzShmHeader ByzanzShmHeader;
+typedef struct _ByzanzShmRect ByzanzShmRect;
+typedef struct _ByzanzShmSlot ByzanzShmSlot;
+
+struct _ByzanzShmHeader {
+  guint32               magic;          /* BYZANZ_SHM_MAGIC */
+  guint32               version;        /* BYZANZ_SHM_VERSION */
+  guint32               width;          /* width of the frames */
+  guint32               height;         /* height of the frames */
+  guint32               stride;         /* bytes per row of the frames, pixels are Cairo RGB24 */
+  guint32               n_slots;        /* number of slots */
+  guint32               slot_offset;    /* offset of the first slot from the header */
+  guint32               slot_size;      /* offset between slots */
+  guint32               data_offset;    /* offset of the pixels from their slot */
+  volatile gint         latest;         /* index of the slot with the newest frame or -1 */
+};
+
+struct _ByzanzShmRect {
+  gint32                x;
+  gint32                y;
+  gint32                width;
+  gint32                height;
+};
+
+struct _ByzanzShmSlot {
+  volatile gint         sequence;       /* odd while the slot is written */
+  guint32               n_rects;        /* number of rects */
+  guint64               number;         /* number of the frame, counting from 0 */
+  guint64               msecs;          /* timestamp of the frame */
+  ByzanzShmRect         rects[BYZANZ_SHM_MAX_RECTS]; /* area that changed since the frame before */
+};
+
+/* consumer side */
+
+typedef struct _ByzanzShmConsumer ByzanzShmConsumer;
+typedef struct _ByzanzShmFrame ByzanzShmFrame;
+
+struct _ByzanzShmFrame {
+  guint64               number;         /* number of the frame. If it isn't one more than the
+                                           last one seen, all of the frame may have changed */
+  guint64               msecs;          /* timestamp of the frame */
+  guint                 width;          /* width of data */
+  guint                 height;         /* height of data */
+  guint                 stride;         /* bytes per row of data */
+  const guchar *        data;           /* the pixels in Cairo RGB24 format */
+  guint                 n_rects;        /* number of rects */
+  const ByzanzShmRect * rects;          /* area that changed since the frame before */
+
+  /*< private >*/
+  const ByzanzShmSlot * slot;
+  gint                  sequence;
+};
+
+ByzanzShmConsumer *     byzanz_shm_consumer_new         (const char *           path,
+                                                         GError **              error);
+void                    byzanz_shm_consumer_free        (ByzanzShmConsumer *    consumer);
+
+int                     byzanz_shm_consumer_get_fd      (ByzanzShmConsumer *    consumer);
+gboolean                byzanz_shm_consumer_wait        (ByzanzShmConsumer *    consumer,
+                                                         GError **              error);
+gboolean                byzanz_shm_consumer_begin       (ByzanzShmConsumer *    consumer,
+                                                         ByzanzShmFrame *       frame);
+gboolean                byzanz_shm_consumer_end         (ByzanzShmConsumer *    consumer,
+                                                         const ByzanzShmFrame * frame);
+
+
+#endif /* __HAVE_BYZANZ_SHM_H__ */
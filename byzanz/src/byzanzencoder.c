@@ -21,24 +21,21 @@
 
 #include "byzanzencoder.h"
 
+#include <string.h>
 #include <glib/gi18n-lib.h>
 
-#include "byzanzserialize.h"
+#include "byzanzqueueinputstream.h"
 
 typedef struct _ByzanzEncoderJob ByzanzEncoderJob;
 struct _ByzanzEncoderJob {
-  GTimeVal		tv;		/* time this job was enqueued */
-  cairo_surface_t *	surface;	/* image to process */
-  cairo_region_t *	region;		/* relevant region of image */
+  ByzanzRecord		record;		/* record handed over by byzanz_encoder_push() */
+  gboolean		serialized;	/* the record must be read from the input stream instead */
 };
 
 static void
 byzanz_encoder_job_free (ByzanzEncoderJob *job)
 {
-  if (job->surface)
-    cairo_surface_destroy (job->surface);
-  if (job->region)
-    cairo_region_destroy (job->region);
+  byzanz_record_clear (&job->record);
 
   g_slice_free (ByzanzEncoderJob, job);
 }
@@ -67,6 +64,359 @@ byzanz_encoder_finished (gpointer data)
 
 /*** INSIDE THREAD ***/
 
+static gboolean
+byzanz_encoder_get_cursor_rect (ByzanzEncoder *         encoder,
+                                cairo_rectangle_int_t * rect)
+{
+  double xhot, yhot;
+
+  if (encoder->cursor == NULL)
+    return FALSE;
+
+  cairo_surface_get_device_offset (encoder->cursor, &xhot, &yhot);
+  rect->x = encoder->cursor_x - xhot;
+  rect->y = encoder->cursor_y - yhot;
+  rect->width = cairo_image_surface_get_width (encoder->cursor);
+  rect->height = cairo_image_surface_get_height (encoder->cursor);
+  return TRUE;
+}
+
+static void
+byzanz_encoder_damage_cursor (ByzanzEncoder *encoder)
+{
+  cairo_rectangle_int_t rect, bounds = { 0, 0, encoder->width, encoder->height };
+  cairo_region_t *region;
+
+  if (!byzanz_encoder_get_cursor_rect (encoder, &rect))
+    return;
+
+  region = cairo_region_create_rectangle (&rect);
+  cairo_region_intersect_rectangle (region, &bounds);
+  cairo_region_union (encoder->cursor_damage, region);
+  cairo_region_destroy (region);
+}
+
+static void
+byzanz_encoder_handle_cursor (ByzanzEncoder *      encoder,
+                              ByzanzRecord *       record)
+{
+  if (record->type == BYZANZ_RECORD_CURSOR_IMAGE) {
+    g_hash_table_insert (encoder->cursors, GUINT_TO_POINTER (record->cursor), record->surface);
+    record->surface = NULL;
+    return;
+  }
+
+  /* from now on the frame needs to be tracked without the cursor */
+  if (encoder->frame == NULL) {
+    encoder->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, encoder->width, encoder->height);
+    encoder->cursor_damage = cairo_region_create ();
+  }
+
+  byzanz_encoder_damage_cursor (encoder);
+  encoder->cursor = g_hash_table_lookup (encoder->cursors, GUINT_TO_POINTER (record->cursor));
+  encoder->cursor_x = record->x;
+  encoder->cursor_y = record->y;
+  encoder->cursor_msecs = record->msecs;
+  byzanz_encoder_damage_cursor (encoder);
+}
+
+static void
+byzanz_encoder_handle_copy (ByzanzEncoder *      encoder,
+                            const ByzanzRecord * record)
+{
+  cairo_region_t *moved;
+
+  cairo_surface_flush (encoder->frame);
+  byzanz_copy_region (cairo_image_surface_get_data (encoder->frame),
+      cairo_image_surface_get_stride (encoder->frame), sizeof (guint32),
+      record->region, record->dx, record->dy);
+  cairo_surface_mark_dirty (encoder->frame);
+
+  /* The encoders move their images, which contain the cursor. So the
+   * cursor got dragged along and may have been covered. */
+  byzanz_encoder_damage_cursor (encoder);
+  moved = cairo_region_copy (encoder->cursor_damage);
+  cairo_region_translate (moved, record->dx, record->dy);
+  cairo_region_intersect (moved, record->region);
+  cairo_region_union (encoder->cursor_damage, moved);
+  cairo_region_destroy (moved);
+  encoder->cursor_msecs = record->msecs;
+}
+
+static cairo_surface_t *
+byzanz_encoder_draw_cursor (ByzanzEncoder *        encoder,
+                            const cairo_region_t * region)
+{
+  cairo_rectangle_int_t extents, rect;
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  int i, num_rects;
+
+  cairo_region_get_extents (region, &extents);
+  surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, extents.width, extents.height);
+  cairo_surface_set_device_offset (surface, -extents.x, -extents.y);
+
+  cr = cairo_create (surface);
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_clip (cr);
+
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, encoder->frame, 0, 0);
+  cairo_paint (cr);
+
+  if (encoder->cursor) {
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+    cairo_set_source_surface (cr, encoder->cursor, encoder->cursor_x, encoder->cursor_y);
+    cairo_paint (cr);
+  }
+  cairo_destroy (cr);
+
+  return surface;
+}
+
+/* Turns the damage from cursor changes into an image record */
+static void
+byzanz_encoder_flush_cursor (ByzanzEncoder *encoder,
+                             ByzanzRecord * record)
+{
+  memset (record, 0, sizeof (ByzanzRecord));
+  record->type = BYZANZ_RECORD_IMAGE;
+  record->msecs = encoder->cursor_msecs;
+  record->region = encoder->cursor_damage;
+  record->surface = byzanz_encoder_draw_cursor (encoder, record->region);
+  encoder->cursor_damage = cairo_region_create ();
+}
+
+static void
+byzanz_encoder_handle_image (ByzanzEncoder *encoder,
+                             ByzanzRecord * record)
+{
+  cairo_rectangle_int_t rect;
+
+  byzanz_paint_region (encoder->frame, record->surface, record->region);
+
+  /* the image can be passed on unchanged if the cursor isn't involved */
+  if (cairo_region_is_empty (encoder->cursor_damage) &&
+      (!byzanz_encoder_get_cursor_rect (encoder, &rect) ||
+       cairo_region_contains_rectangle (record->region, &rect) == CAIRO_REGION_OVERLAP_OUT))
+    return;
+
+  cairo_region_union (encoder->cursor_damage, record->region);
+  cairo_surface_destroy (record->surface);
+  cairo_region_destroy (record->region);
+  byzanz_encoder_flush_cursor (encoder, record);
+}
+
+/* Gets the next record in the order it was produced, either from a job or
+ * from the input stream. */
+static gboolean
+byzanz_encoder_next_record (ByzanzEncoder * encoder,
+                            GInputStream *  input,
+                            ByzanzRecord *  record,
+                            GCancellable *  cancellable,
+                            GError **       error)
+{
+  ByzanzEncoderJob *job;
+  gboolean serialized;
+
+  if (!encoder->direct)
+    return byzanz_deserialize (input, encoder->width, encoder->height, encoder->flags, record, cancellable, error);
+
+  job = g_async_queue_pop (encoder->jobs);
+  serialized = job->serialized;
+  if (!serialized) {
+    *record = job->record;
+    g_mutex_lock (&encoder->lock);
+    encoder->pending_jobs--;
+    g_mutex_unlock (&encoder->lock);
+  }
+  g_slice_free (ByzanzEncoderJob, job);
+
+  if (serialized)
+    return byzanz_deserialize (input, encoder->width, encoder->height, encoder->flags, record, cancellable, error);
+
+  return TRUE;
+}
+
+/* Applies the image in @next on top of the one in @record, so that @record
+ * contains the newest pixels for both regions and the later timestamp. */
+static void
+byzanz_encoder_merge_image (ByzanzRecord *record,
+                            ByzanzRecord *next)
+{
+  cairo_rectangle_int_t extents;
+  cairo_surface_t *surface;
+  cairo_region_t *region;
+
+  region = cairo_region_copy (record->region);
+  cairo_region_union (region, next->region);
+  cairo_region_get_extents (region, &extents);
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, extents.width, extents.height);
+  cairo_surface_set_device_offset (surface, -extents.x, -extents.y);
+  byzanz_paint_region (surface, record->surface, record->region);
+  byzanz_paint_region (surface, next->surface, next->region);
+
+  byzanz_record_clear (record);
+  record->type = BYZANZ_RECORD_IMAGE;
+  record->msecs = next->msecs;
+  record->surface = surface;
+  record->region = region;
+  byzanz_record_clear (next);
+}
+
+/* Works like byzanz_encoder_next_record(), but merges consecutive images
+ * while more than max-backlog bytes are waiting in the queue we read from.
+ * A merged image never spans more than max-latency milliseconds. */
+static gboolean
+byzanz_encoder_deserialize (ByzanzEncoder * encoder,
+                            GInputStream *  input,
+                            ByzanzRecord *  record,
+                            GCancellable *  cancellable,
+                            GError **       error)
+{
+  guint64 max_backlog, max_latency, first_msecs;
+  ByzanzQueue *queue;
+  ByzanzRecord next;
+
+  if (encoder->has_raw_record) {
+    *record = encoder->raw_record;
+    encoder->has_raw_record = FALSE;
+  } else if (!byzanz_encoder_next_record (encoder, input, record, cancellable, error)) {
+    return FALSE;
+  }
+
+  if (record->type != BYZANZ_RECORD_IMAGE || record->surface == NULL ||
+      !BYZANZ_IS_QUEUE_INPUT_STREAM (input))
+    return TRUE;
+
+  g_mutex_lock (&encoder->lock);
+  max_backlog = encoder->max_backlog;
+  max_latency = encoder->max_latency;
+  g_mutex_unlock (&encoder->lock);
+  if (max_backlog == 0)
+    return TRUE;
+
+  /* merging moves the timestamp forward, so measure from the first image */
+  first_msecs = record->msecs;
+  queue = BYZANZ_QUEUE_INPUT_STREAM (input)->queue;
+  while (byzanz_queue_get_backlog (queue) > max_backlog) {
+    if (!byzanz_encoder_next_record (encoder, input, &next, cancellable, error)) {
+      byzanz_record_clear (record);
+      return FALSE;
+    }
+
+    /* copies and cursors must be applied in order, so keep them for later */
+    if (next.type != BYZANZ_RECORD_IMAGE || next.surface == NULL ||
+        next.msecs > first_msecs + max_latency) {
+      encoder->raw_record = next;
+      encoder->has_raw_record = TRUE;
+      break;
+    }
+
+    byzanz_encoder_merge_image (record, &next);
+    g_mutex_lock (&encoder->lock);
+    encoder->coalesced_frames++;
+    g_mutex_unlock (&encoder->lock);
+  }
+
+  return TRUE;
+}
+
+/**
+ * byzanz_encoder_read_header:
+ * @encoder: the encoder
+ * @input: stream to read from
+ * @width: (out): set to the width of the recording
+ * @height: (out): set to the height of the recording
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Reads the header of the recording. Encoders that read the input stream
+ * themselves must use this function and byzanz_encoder_read_record().
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_encoder_read_header (ByzanzEncoder * encoder,
+                            GInputStream *  input,
+                            guint *         width,
+                            guint *         height,
+                            GCancellable *  cancellable,
+                            GError **       error)
+{
+  if (!byzanz_deserialize_header (input, &encoder->width, &encoder->height, &encoder->flags, cancellable, error))
+    return FALSE;
+
+  *width = encoder->width;
+  *height = encoder->height;
+  return TRUE;
+}
+
+/**
+ * byzanz_encoder_read_record:
+ * @encoder: the encoder
+ * @input: stream to read from
+ * @record: the record to fill
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Works like byzanz_deserialize(), but only returns image and copy
+ * records. Cursor records are drawn into the images instead. A cursor
+ * change is merged with the image of the same timestamp, so it only causes
+ * an image of its own when nothing else changed.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_encoder_read_record (ByzanzEncoder * encoder,
+                            GInputStream *  input,
+                            ByzanzRecord *  record,
+                            GCancellable *  cancellable,
+                            GError **       error)
+{
+  for (;;) {
+    if (encoder->has_next_record) {
+      *record = encoder->next_record;
+      encoder->has_next_record = FALSE;
+    } else if (!byzanz_encoder_deserialize (encoder, input, record, cancellable, error)) {
+      return FALSE;
+    }
+
+    if (encoder->frame && !cairo_region_is_empty (encoder->cursor_damage) &&
+        (record->msecs > encoder->cursor_msecs ||
+         (record->type == BYZANZ_RECORD_IMAGE && record->surface == NULL))) {
+      encoder->next_record = *record;
+      encoder->has_next_record = TRUE;
+      byzanz_encoder_flush_cursor (encoder, record);
+      return TRUE;
+    }
+
+    switch (record->type) {
+      case BYZANZ_RECORD_CURSOR:
+      case BYZANZ_RECORD_CURSOR_IMAGE:
+        byzanz_encoder_handle_cursor (encoder, record);
+        byzanz_record_clear (record);
+        break;
+      case BYZANZ_RECORD_COPY:
+        if (encoder->frame)
+          byzanz_encoder_handle_copy (encoder, record);
+        return TRUE;
+      case BYZANZ_RECORD_IMAGE:
+        if (encoder->frame && record->surface)
+          byzanz_encoder_handle_image (encoder, record);
+        return TRUE;
+      default:
+        g_assert_not_reached ();
+        return FALSE;
+    }
+  }
+}
+
 static gboolean
 byzanz_encoder_run (ByzanzEncoder * encoder,
                     GInputStream *  input,
@@ -77,10 +427,10 @@ byzanz_encoder_run (ByzanzEncoder * encoder,
 {
   ByzanzEncoderClass *klass = BYZANZ_ENCODER_GET_CLASS (encoder);
   guint width, height;
-  cairo_surface_t *surface;
-  cairo_region_t *region;
-  guint64 msecs;
-  gboolean success;
+  ByzanzRecord record;
+  cairo_region_t *empty;
+  gboolean success, copied;
+  guint64 copied_msecs;
 
   if (record_audio) {
     g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -88,24 +438,64 @@ byzanz_encoder_run (ByzanzEncoder * encoder,
     return FALSE;
   }
 
-  if (!byzanz_deserialize_header (input, &width, &height, cancellable, error) ||
+  if (!byzanz_encoder_read_header (encoder, input, &width, &height, cancellable, error) ||
       !klass->setup (encoder, output, width, height, cancellable, error))
     return FALSE;
 
+  copied = FALSE;
+  copied_msecs = 0;
   for (;;) {
-    if (!byzanz_deserialize (input , &msecs, &surface, &region, cancellable, error))
-      return FALSE;
+    if (klass->cursor) {
+      if (!byzanz_encoder_deserialize (encoder, input, &record, cancellable, error))
+        return FALSE;
+    } else {
+      if (!byzanz_encoder_read_record (encoder, input, &record, cancellable, error))
+        return FALSE;
+    }
+
+    /* a copy without an image of the same time is a frame of its own */
+    if (copied && (record.msecs != copied_msecs ||
+          (record.type == BYZANZ_RECORD_IMAGE && record.surface == NULL))) {
+      copied = FALSE;
+      empty = cairo_region_create ();
+      success = klass->process (encoder, output, copied_msecs, NULL, empty, cancellable, error);
+      cairo_region_destroy (empty);
+      if (!success) {
+        byzanz_record_clear (&record);
+        return FALSE;
+      }
+    }
+
+    if (record.type == BYZANZ_RECORD_CURSOR ||
+        record.type == BYZANZ_RECORD_CURSOR_IMAGE) {
+      success = klass->cursor (encoder, output, &record, cancellable, error);
+      byzanz_record_clear (&record);
+      if (!success)
+        return FALSE;
+      continue;
+    }
+
+    if (record.type == BYZANZ_RECORD_COPY) {
+      success = klass->copy (encoder, output, record.msecs, record.region,
+          record.dx, record.dy, cancellable, error);
+      copied = TRUE;
+      copied_msecs = record.msecs;
+      byzanz_record_clear (&record);
+      if (!success)
+        return FALSE;
+      continue;
+    }
 
     /* quit */
-    if (surface == NULL) {
-      return klass->close (encoder, output, msecs, cancellable, error) &&
-        g_output_stream_close (output, cancellable, error);
+    if (record.surface == NULL) {
+      return klass->close (encoder, output, record.msecs, cancellable, error) &&
+        (output == NULL || g_output_stream_close (output, cancellable, error));
     }
 
     /* decode */
-    success = klass->process (encoder, output, msecs, surface, region, cancellable, error);
-    cairo_surface_destroy (surface);
-    cairo_region_destroy (region);
+    copied = FALSE;
+    success = klass->process (encoder, output, record.msecs, record.surface, record.region, cancellable, error);
+    byzanz_record_clear (&record);
     if (!success)
       return FALSE;
   }
@@ -134,7 +524,12 @@ enum {
   PROP_SOUND,
   PROP_CANCELLABLE,
   PROP_ERROR,
-  PROP_RUNNING
+  PROP_RUNNING,
+  PROP_DIRECT,
+  PROP_REALTIME,
+  PROP_MAX_BACKLOG,
+  PROP_MAX_LATENCY,
+  PROP_COALESCED_FRAMES
 };
 
 static void
@@ -217,6 +612,21 @@ byzanz_encoder_get_property (GObject *object, guint param_id, GValue *value,
     case PROP_RUNNING:
       g_value_set_boolean (value, encoder->thread != NULL);
       break;
+    case PROP_DIRECT:
+      g_value_set_boolean (value, encoder->direct);
+      break;
+    case PROP_REALTIME:
+      g_value_set_boolean (value, encoder->realtime);
+      break;
+    case PROP_MAX_BACKLOG:
+      g_value_set_uint64 (value, byzanz_encoder_get_max_backlog (encoder));
+      break;
+    case PROP_MAX_LATENCY:
+      g_value_set_uint64 (value, byzanz_encoder_get_max_latency (encoder));
+      break;
+    case PROP_COALESCED_FRAMES:
+      g_value_set_uint (value, byzanz_encoder_get_coalesced_frames (encoder));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -236,7 +646,6 @@ byzanz_encoder_set_property (GObject *object, guint param_id, const GValue *valu
       break;
     case PROP_OUTPUT:
       encoder->output_stream = g_value_dup_object (value);
-      g_assert (encoder->output_stream != NULL);
       break;
     case PROP_SOUND:
       encoder->record_audio = g_value_get_boolean (value);
@@ -244,6 +653,18 @@ byzanz_encoder_set_property (GObject *object, guint param_id, const GValue *valu
     case PROP_CANCELLABLE:
       encoder->cancellable = g_value_dup_object (value);
       break;
+    case PROP_DIRECT:
+      encoder->direct = g_value_get_boolean (value);
+      break;
+    case PROP_REALTIME:
+      encoder->realtime = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_BACKLOG:
+      byzanz_encoder_set_max_backlog (encoder, g_value_get_uint64 (value));
+      break;
+    case PROP_MAX_LATENCY:
+      byzanz_encoder_set_max_latency (encoder, g_value_get_uint64 (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -254,26 +675,60 @@ static void
 byzanz_encoder_finalize (GObject *object)
 {
   ByzanzEncoder *encoder = BYZANZ_ENCODER (object);
+  ByzanzEncoderJob *job;
 
   g_assert (encoder->thread == NULL);
 
   g_object_unref (encoder->input_stream);
-  g_object_unref (encoder->output_stream);
-  if (encoder->cancellable)
+  if (encoder->output_stream)
+    g_object_unref (encoder->output_stream);
+  if (encoder->cancellable) {
+    g_cancellable_disconnect (encoder->cancellable, encoder->cancelled_id);
     g_object_unref (encoder->cancellable);
+  }
   if (encoder->error)
     g_error_free (encoder->error);
 
+  while ((job = g_async_queue_try_pop (encoder->jobs)))
+    byzanz_encoder_job_free (job);
   g_async_queue_unref (encoder->jobs);
+  g_hash_table_destroy (encoder->cursors);
+  if (encoder->frame)
+    cairo_surface_destroy (encoder->frame);
+  if (encoder->cursor_damage)
+    cairo_region_destroy (encoder->cursor_damage);
+  if (encoder->has_next_record)
+    byzanz_record_clear (&encoder->next_record);
+  if (encoder->has_raw_record)
+    byzanz_record_clear (&encoder->raw_record);
+  g_mutex_clear (&encoder->lock);
 
   G_OBJECT_CLASS (byzanz_encoder_parent_class)->finalize (object);
 }
 
+/* wakes up a direct encoder waiting for jobs, it then notices the
+ * cancellation when reading from the input stream */
+static void
+byzanz_encoder_cancelled (GCancellable *cancellable,
+                          gpointer      data)
+{
+  ByzanzEncoder *encoder = data;
+  ByzanzEncoderJob *job;
+
+  job = g_slice_new0 (ByzanzEncoderJob);
+  job->serialized = TRUE;
+  g_async_queue_push (encoder->jobs, job);
+}
+
 static void
 byzanz_encoder_constructed (GObject *object)
 {
   ByzanzEncoder *encoder = BYZANZ_ENCODER (object);
 
+  if (encoder->direct && encoder->cancellable)
+    encoder->cancelled_id = g_cancellable_connect (encoder->cancellable,
+        G_CALLBACK (byzanz_encoder_cancelled), encoder, NULL);
+
   encoder->thread = g_thread_new ("encoder", byzanz_encoder_thread, encoder);
   if (encoder->thread)
     g_object_ref (encoder);
@@ -296,7 +751,7 @@ byzanz_encoder_class_init (ByzanzEncoderClass *klass)
       g_param_spec_object ("input", "input", "stream to read data from",
 	  G_TYPE_INPUT_STREAM, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
   g_object_class_install_property (object_class, PROP_OUTPUT,
-      g_param_spec_object ("output", "output", "stream to write data to",
+      g_param_spec_object ("output", "output", "stream to write data to or NULL if the encoder doesn't write to a stream",
 	  G_TYPE_OUTPUT_STREAM, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
   g_object_class_install_property (object_class, PROP_SOUND,
       g_param_spec_boolean ("record-audio", "record audio", "TRUE when recording audio",
@@ -310,6 +765,21 @@ byzanz_encoder_class_init (ByzanzEncoderClass *klass)
   g_object_class_install_property (object_class, PROP_RUNNING,
       g_param_spec_boolean ("running", "running", "TRUE while the encoding thread is running",
 	  TRUE, G_PARAM_READABLE));
+  g_object_class_install_property (object_class, PROP_DIRECT,
+      g_param_spec_boolean ("direct", "direct", "TRUE if records are handed over with byzanz_encoder_push()",
+	  FALSE, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class, PROP_REALTIME,
+      g_param_spec_boolean ("realtime", "realtime", "TRUE if encoding must keep up with a running capture",
+	  FALSE, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class, PROP_MAX_BACKLOG,
+      g_param_spec_uint64 ("max-backlog", "max backlog", "queued bytes before images get merged or 0 to never merge",
+	  0, G_MAXUINT64, BYZANZ_ENCODER_MAX_BACKLOG, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_MAX_LATENCY,
+      g_param_spec_uint64 ("max-latency", "max latency", "milliseconds a merged image may span",
+	  0, G_MAXUINT64, BYZANZ_ENCODER_MAX_LATENCY, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_COALESCED_FRAMES,
+      g_param_spec_uint ("coalesced-frames", "coalesced frames", "number of images that were merged into others",
+	  0, G_MAXUINT, 0, G_PARAM_READABLE));
 
   klass->run = byzanz_encoder_run;
 }
@@ -320,6 +790,11 @@ byzanz_encoder_init (GTypeInstance *instance, gpointer klass)
   ByzanzEncoder *encoder = BYZANZ_ENCODER (instance);
 
   encoder->jobs = g_async_queue_new ();
+  g_mutex_init (&encoder->lock);
+  encoder->max_backlog = BYZANZ_ENCODER_MAX_BACKLOG;
+  encoder->max_latency = BYZANZ_ENCODER_MAX_LATENCY;
+  encoder->cursors = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) cairo_surface_destroy);
 }
 
 ByzanzEncoder *
@@ -342,51 +817,56 @@ byzanz_encoder_new (GType           encoder_type,
   return encoder;
 }
 
-/*
-void
-byzanz_encoder_process (ByzanzEncoder *	 encoder,
-		        cairo_surface_t *surface,
-			const cairo_region_t *region,
-			const GTimeVal * total_elapsed)
+/**
+ * byzanz_encoder_push:
+ * @encoder: the encoder
+ * @record: the record to hand over
+ *
+ * Hands @record to a #ByzanzEncoder:direct encoder without serializing it.
+ * The encoder keeps references to the surface and region, so they must not
+ * be modified afterwards.
+ *
+ * Only %BYZANZ_ENCODER_MAX_JOBS records may be waiting at any time. If the
+ * encoder is that far behind, %FALSE is returned and the caller must
+ * serialize @record to the input stream instead, so that the queue can
+ * take care of it. The encoder still processes all records in order.
+ *
+ * Returns: %TRUE if the encoder took the record
+ **/
+gboolean
+byzanz_encoder_push (ByzanzEncoder *      encoder,
+                     const ByzanzRecord * record)
 {
   ByzanzEncoderJob *job;
+  gboolean full;
 
-  g_return_if_fail (BYZANZ_IS_ENCODER (encoder));
-  g_return_if_fail (surface != NULL);
-  g_return_if_fail (region != NULL);
-  g_return_if_fail (total_elapsed != NULL);
-
-  if (encoder->error)
-    return;
+  g_return_val_if_fail (BYZANZ_IS_ENCODER (encoder), FALSE);
+  g_return_val_if_fail (record != NULL, FALSE);
 
-  job = g_slice_new (ByzanzEncoderJob);
-  job->surface = cairo_surface_reference (surface);
-  job->region = cairo_region_copy (region);
-  job->tv = *total_elapsed;
+  /* nobody would pick the job up */
+  if (!encoder->direct || encoder->thread == NULL)
+    return FALSE;
 
+  g_mutex_lock (&encoder->lock);
+  full = encoder->pending_jobs >= BYZANZ_ENCODER_MAX_JOBS;
+  if (!full)
+    encoder->pending_jobs++;
+  g_mutex_unlock (&encoder->lock);
+
+  job = g_slice_new0 (ByzanzEncoderJob);
+  if (full) {
+    job->serialized = TRUE;
+  } else {
+    job->record = *record;
+    if (record->surface)
+      cairo_surface_reference (record->surface);
+    if (record->region)
+      job->record.region = cairo_region_copy (record->region);
+  }
   g_async_queue_push (encoder->jobs, job);
-}
 
-void
-byzanz_encoder_close (ByzanzEncoder *encoder,
-		      const GTimeVal * total_elapsed)
-{
-  ByzanzEncoderJob *job;
-
-  g_return_if_fail (BYZANZ_IS_ENCODER (encoder));
-  g_return_if_fail (total_elapsed != NULL);
-
-  if (encoder->error)
-    return;
-
-  job = g_slice_new (ByzanzEncoderJob);
-  job->surface = NULL;
-  job->region = NULL;
-  job->tv = *total_elapsed;
-
-  g_async_queue_push (encoder->jobs, job);
+  return !full;
 }
-*/
 
 gboolean
 byzanz_encoder_is_running (ByzanzEncoder *encoder)
@@ -404,6 +884,100 @@ byzanz_encoder_get_error (ByzanzEncoder *encoder)
   return encoder->error;
 }
 
+/**
+ * byzanz_encoder_set_max_backlog:
+ * @encoder: the encoder
+ * @max_backlog: bytes that may be waiting in the queue
+ *
+ * When the encoder reads from a #ByzanzQueue and falls behind by more than
+ * @max_backlog bytes, consecutive images are merged into one until it
+ * catches up. Use 0 to encode every image.
+ **/
+void
+byzanz_encoder_set_max_backlog (ByzanzEncoder *encoder,
+                                guint64        max_backlog)
+{
+  g_return_if_fail (BYZANZ_IS_ENCODER (encoder));
+
+  g_mutex_lock (&encoder->lock);
+  encoder->max_backlog = max_backlog;
+  g_mutex_unlock (&encoder->lock);
+
+  g_object_notify (G_OBJECT (encoder), "max-backlog");
+}
+
+guint64
+byzanz_encoder_get_max_backlog (ByzanzEncoder *encoder)
+{
+  guint64 result;
+
+  g_return_val_if_fail (BYZANZ_IS_ENCODER (encoder), 0);
+
+  g_mutex_lock (&encoder->lock);
+  result = encoder->max_backlog;
+  g_mutex_unlock (&encoder->lock);
+
+  return result;
+}
+
+/**
+ * byzanz_encoder_set_max_latency:
+ * @encoder: the encoder
+ * @max_latency: milliseconds
+ *
+ * Limits how far merged images may be apart, so that the recording still
+ * shows a change at least every @max_latency milliseconds.
+ **/
+void
+byzanz_encoder_set_max_latency (ByzanzEncoder *encoder,
+                                guint64        max_latency)
+{
+  g_return_if_fail (BYZANZ_IS_ENCODER (encoder));
+
+  g_mutex_lock (&encoder->lock);
+  encoder->max_latency = max_latency;
+  g_mutex_unlock (&encoder->lock);
+
+  g_object_notify (G_OBJECT (encoder), "max-latency");
+}
+
+guint64
+byzanz_encoder_get_max_latency (ByzanzEncoder *encoder)
+{
+  guint64 result;
+
+  g_return_val_if_fail (BYZANZ_IS_ENCODER (encoder), 0);
+
+  g_mutex_lock (&encoder->lock);
+  result = encoder->max_latency;
+  g_mutex_unlock (&encoder->lock);
+
+  return result;
+}
+
+/**
+ * byzanz_encoder_get_coalesced_frames:
+ * @encoder: the encoder
+ *
+ * Gets the number of images that were merged into others because the
+ * encoder fell behind. See byzanz_encoder_set_max_backlog().
+ *
+ * Returns: the number of merged images
+ **/
+guint
+byzanz_encoder_get_coalesced_frames (ByzanzEncoder *encoder)
+{
+  guint result;
+
+  g_return_val_if_fail (BYZANZ_IS_ENCODER (encoder), 0);
+
+  g_mutex_lock (&encoder->lock);
+  result = encoder->coalesced_frames;
+  g_mutex_unlock (&encoder->lock);
+
+  return result;
+}
+
 GtkFileFilter *
 byzanz_encoder_type_get_filter (GType encoder_type)
 {
@@ -430,7 +1004,9 @@ byzanz_encoder_type_get_filter (GType encoder_type)
 #include "byzanzencoderflv.h"
 #include "byzanzencodergif.h"
 #include "byzanzencoderogv.h"
+#include "byzanzencoderraw.h"
 #include "byzanzencoderwebm.h"
+#include "byzanzencodery4m.h"
 
 typedef GType (* TypeFunc) (void);
 static const TypeFunc functions[] = {
@@ -438,6 +1014,9 @@ static const TypeFunc functions[] = {
   byzanz_encoder_webm_get_type,
   byzanz_encoder_ogv_get_type,
   byzanz_encoder_flv_get_type,
+  /* for feeding other programs */
+  byzanz_encoder_y4m_get_type,
+  byzanz_encoder_raw_get_type,
   /* debug types */
   byzanz_encoder_byzanz_get_type,
 };
@@ -488,10 +1067,33 @@ byzanz_encoder_get_type_from_filter (GtkFileFilter *filter)
   return type;
 }
 
+static GType
+byzanz_encoder_get_type_from_info (const GtkFileFilterInfo *info)
+{
+  ByzanzEncoderIter iter;
+  GType type;
+
+  for (type = byzanz_encoder_type_iter_init (&iter);
+       type != G_TYPE_NONE;
+       type = byzanz_encoder_type_iter_next (&iter)) {
+    GtkFileFilter *filter = byzanz_encoder_type_get_filter (type);
+    if (filter == NULL)
+      continue;
+
+    if (gtk_file_filter_filter (filter, info)) {
+      g_object_unref (filter);
+      break;
+    }
+    
+    g_object_unref (filter);
+  }
+
+  return type;
+}
+
 GType
 byzanz_encoder_get_type_from_file (GFile *file)
 {
-  ByzanzEncoderIter iter;
   GtkFileFilterInfo info;
   GType type;
 
@@ -512,20 +1114,7 @@ byzanz_encoder_get_type_from_file (GFile *file)
   if (info.display_name)
     info.contains |= GTK_FILE_FILTER_DISPLAY_NAME;
 
-  for (type = byzanz_encoder_type_iter_init (&iter);
-       type != G_TYPE_NONE;
-       type = byzanz_encoder_type_iter_next (&iter)) {
-    GtkFileFilter *filter = byzanz_encoder_type_get_filter (type);
-    if (filter == NULL)
-      continue;
-
-    if (gtk_file_filter_filter (filter, &info)) {
-      g_object_unref (filter);
-      break;
-    }
-    
-    g_object_unref (filter);
-  }
+  type = byzanz_encoder_get_type_from_info (&info);
   if (type == G_TYPE_NONE)
     type = BYZANZ_ENCODER_DEFAULT_TYPE;
 
@@ -536,3 +1125,23 @@ byzanz_encoder_get_type_from_file (GFile *file)
   return type;
 }
 
+/* finds the encoder for files with the extension @format, or G_TYPE_NONE */
+GType
+byzanz_encoder_get_type_from_format (const char *format)
+{
+  GtkFileFilterInfo info = { 0, };
+  char *name;
+  GType type;
+
+  g_return_val_if_fail (format != NULL, G_TYPE_NONE);
+
+  name = g_strconcat ("recording.", format, NULL);
+  info.contains = GTK_FILE_FILTER_FILENAME | GTK_FILE_FILTER_DISPLAY_NAME;
+  info.filename = name;
+  info.display_name = name;
+  type = byzanz_encoder_get_type_from_info (&info);
+  g_free (name);
+
+  return type;
+}
+
@@ -21,6 +21,8 @@
 #include <gtk/gtk.h>
 #include <cairo.h>
 
+#include "byzanzserialize.h"
+
 #ifndef __HAVE_BYZANZ_ENCODER_H__
 #define __HAVE_BYZANZ_ENCODER_H__
 
@@ -28,6 +30,13 @@ typedef struct _ByzanzEncoder ByzanzEncoder;
 typedef struct _ByzanzEncoderClass ByzanzEncoderClass;
 typedef gpointer ByzanzEncoderIter;
 
+/* default for ByzanzEncoder:max-backlog, merge images before the queue spills to files */
+#define BYZANZ_ENCODER_MAX_BACKLOG (32 * 1024 * 1024)
+/* default for ByzanzEncoder:max-latency */
+#define BYZANZ_ENCODER_MAX_LATENCY 1000
+/* records a direct encoder may have waiting before they go through the queue */
+#define BYZANZ_ENCODER_MAX_JOBS 8
+
 #define BYZANZ_TYPE_ENCODER                    (byzanz_encoder_get_type())
 #define BYZANZ_IS_ENCODER(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_ENCODER))
 #define BYZANZ_IS_ENCODER_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_ENCODER))
@@ -40,13 +49,39 @@ struct _ByzanzEncoder {
   
   /*<private >*/
   GInputStream *        input_stream;           /* stream to read from in byzanzserialize.h format */
-  GOutputStream *       output_stream;          /* stream we write to (passed to the vfuncs) */
+  GOutputStream *       output_stream;          /* NULL or stream we write to (passed to the vfuncs) */
   gboolean              record_audio;           /* TRUE when we're recording audio */
   GCancellable *        cancellable;            /* cancellable to use in thread */
   GError *              error;                  /* NULL or the encoding error */
 
+  gboolean              direct;                 /* TRUE if records are handed over with byzanz_encoder_push() */
+  gboolean              realtime;               /* TRUE if encoding must keep up with a running capture */
   GAsyncQueue *         jobs;                   /* the stuff we still need to encode */
+  guint                 pending_jobs;           /* jobs holding a record. Must hold lock to access */
+  gulong                cancelled_id;           /* signal handler waking up the thread when cancelled */
   GThread *             thread;                 /* the encoding thread */
+
+  /* drawing cursor records into the images */
+  guint                 width;                  /* width of the recording */
+  guint                 height;                 /* height of the recording */
+  ByzanzSerializeFlags  flags;                  /* flags the recording was written with */
+  GHashTable *          cursors;                /* cursor id => cursor image */
+  cairo_surface_t *     frame;                  /* NULL or the current frame without the cursor */
+  cairo_surface_t *     cursor;                 /* NULL or the cursor image currently shown */
+  int                   cursor_x;               /* X position of the cursor's hotspot */
+  int                   cursor_y;               /* Y position of the cursor's hotspot */
+  cairo_region_t *      cursor_damage;          /* area that must be redrawn because the cursor changed */
+  guint64               cursor_msecs;           /* timestamp of the last cursor change */
+  ByzanzRecord          next_record;            /* record that was read ahead */
+  gboolean              has_next_record;        /* TRUE if next_record is set */
+
+  /* merging images when the encoder falls behind */
+  GMutex                lock;                   /* lock protecting pending_jobs and the settings and counter below */
+  guint64               max_backlog;            /* queued bytes before images get merged or 0 to never merge */
+  guint64               max_latency;            /* milliseconds a merged image may span */
+  guint                 coalesced_frames;       /* number of images that were merged into others */
+  ByzanzRecord          raw_record;             /* record that stopped the merging */
+  gboolean              has_raw_record;         /* TRUE if raw_record is set */
 };
 
 struct _ByzanzEncoderClass {
@@ -77,6 +112,23 @@ struct _ByzanzEncoderClass {
 						 const cairo_region_t *	region,
                                                  GCancellable *         cancellable,
 						 GError **		error);
+  /* called before process () with the image that has the same timestamp.
+   * If there is no such image, process () gets a NULL surface and an empty
+   * region once the next record arrives, so the copy still makes a frame. */
+  gboolean		(* copy)		(ByzanzEncoder *	encoder,
+						 GOutputStream *	stream,
+                                                 guint64                msecs,
+						 const cairo_region_t *	region,
+                                                 int                    dx,
+                                                 int                    dy,
+                                                 GCancellable *         cancellable,
+						 GError **		error);
+  /* if set, cursor records are passed here instead of being drawn into the images */
+  gboolean		(* cursor)		(ByzanzEncoder *	encoder,
+						 GOutputStream *	stream,
+                                                 const ByzanzRecord *   record,
+                                                 GCancellable *         cancellable,
+						 GError **		error);
   gboolean		(* close)		(ByzanzEncoder *	encoder,
 						 GOutputStream *	stream,
                                                  guint64                msecs,
@@ -91,22 +143,39 @@ ByzanzEncoder *	byzanz_encoder_new		(GType                  encoder_type,
                                                  GOutputStream *        output,
                                                  gboolean               record_audio,
                                                  GCancellable *         cancellable);
-/*
-void		byzanz_encoder_process		(ByzanzEncoder *	encoder,
-						 cairo_surface_t *	surface,
-						 const cairo_region_t *	region,
-						 const GTimeVal *	total_elapsed);
-void		byzanz_encoder_close		(ByzanzEncoder *	encoder,
-						 const GTimeVal *	total_elapsed);
-*/
+gboolean	byzanz_encoder_push		(ByzanzEncoder *	encoder,
+						 const ByzanzRecord *	record);
+/*< protected >*/
+gboolean        byzanz_encoder_read_header      (ByzanzEncoder *        encoder,
+                                                 GInputStream *         input,
+                                                 guint *                width,
+                                                 guint *                height,
+                                                 GCancellable *         cancellable,
+                                                 GError **              error);
+gboolean        byzanz_encoder_read_record      (ByzanzEncoder *        encoder,
+                                                 GInputStream *         input,
+                                                 ByzanzRecord *         record,
+                                                 GCancellable *         cancellable,
+                                                 GError **              error);
+
 gboolean        byzanz_encoder_is_running       (ByzanzEncoder *        encoder);
 const GError *  byzanz_encoder_get_error        (ByzanzEncoder *        encoder);
+void            byzanz_encoder_set_max_backlog  (ByzanzEncoder *        encoder,
+                                                 guint64                max_backlog);
+guint64         byzanz_encoder_get_max_backlog  (ByzanzEncoder *        encoder);
+void            byzanz_encoder_set_max_latency  (ByzanzEncoder *        encoder,
+                                                 guint64                max_latency);
+guint64         byzanz_encoder_get_max_latency  (ByzanzEncoder *        encoder);
+guint           byzanz_encoder_get_coalesced_frames
+                                                (ByzanzEncoder *        encoder);
 
 GtkFileFilter * byzanz_encoder_type_get_filter  (GType                  encoder_type);
 GType           byzanz_encoder_get_type_from_filter 
                                                 (GtkFileFilter *        filter);
 GType           byzanz_encoder_get_type_from_file
                                                 (GFile *                file);
+GType           byzanz_encoder_get_type_from_format
+                                                (const char *           format);
 GType           byzanz_encoder_type_iter_init   (ByzanzEncoderIter *    iter);
 GType           byzanz_encoder_type_iter_next   (ByzanzEncoderIter *    iter);
 
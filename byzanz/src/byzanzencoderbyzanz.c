@@ -26,6 +26,9 @@
 
 #include "byzanzserialize.h"
 
+/* time between keyframes in the index */
+#define BYZANZ_ENCODER_BYZANZ_KEYFRAME_INTERVAL 10000
+
 G_DEFINE_TYPE (ByzanzEncoderByzanz, byzanz_encoder_byzanz, BYZANZ_TYPE_ENCODER)
 
 static gboolean
@@ -36,7 +39,17 @@ byzanz_encoder_byzanz_setup (ByzanzEncoder * encoder,
                              GCancellable *  cancellable,
                              GError **	     error)
 {
-  return byzanz_serialize_header (stream, width, height, cancellable, error);
+  ByzanzEncoderByzanz *byzanz = BYZANZ_ENCODER_BYZANZ (encoder);
+  ByzanzSerializeFlags flags = BYZANZ_SERIALIZE_COMPRESS;
+
+  /* only index streams that know where the records end up */
+  if (G_IS_SEEKABLE (stream) && g_seekable_tell (G_SEEKABLE (stream)) >= 0) {
+    byzanz->index = byzanz_index_new (width, height);
+    byzanz->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+    flags |= BYZANZ_SERIALIZE_INDEX;
+  }
+
+  return byzanz_serialize_header (stream, width, height, flags, cancellable, error);
 }
 
 static gboolean
@@ -48,7 +61,86 @@ byzanz_encoder_byzanz_process (ByzanzEncoder *        encoder,
                                GCancellable *         cancellable,
                                GError **	      error)
 {
-  return byzanz_serialize (stream, msecs, surface, region, cancellable, error);
+  ByzanzEncoderByzanz *byzanz = BYZANZ_ENCODER_BYZANZ (encoder);
+  cairo_rectangle_int_t all = { 0, 0, encoder->width, encoder->height };
+  cairo_region_t *keyframe;
+  ByzanzIndexFlags flags;
+  goffset offset;
+  gboolean result;
+
+  /* a copy on its own was written already */
+  if (surface == NULL)
+    return TRUE;
+
+  if (byzanz->index == NULL)
+    return byzanz_serialize (stream, msecs, surface, region, BYZANZ_SERIALIZE_COMPRESS, cancellable, error);
+
+  byzanz_paint_region (byzanz->frame, surface, region);
+  offset = g_seekable_tell (G_SEEKABLE (stream));
+
+  if (msecs >= byzanz->next_keyframe ||
+      cairo_region_contains_rectangle (region, &all) == CAIRO_REGION_OVERLAP_IN) {
+    /* write all of the frame, so readers can start here */
+    keyframe = cairo_region_create_rectangle (&all);
+    result = byzanz_serialize (stream, msecs, byzanz->frame, keyframe, BYZANZ_SERIALIZE_COMPRESS, cancellable, error);
+    cairo_region_destroy (keyframe);
+    flags = BYZANZ_INDEX_KEYFRAME;
+    byzanz->next_keyframe = msecs + BYZANZ_ENCODER_BYZANZ_KEYFRAME_INTERVAL;
+  } else {
+    result = byzanz_serialize (stream, msecs, surface, region, BYZANZ_SERIALIZE_COMPRESS, cancellable, error);
+    flags = 0;
+  }
+
+  if (result)
+    byzanz_index_add_image (byzanz->index, msecs, offset, flags, byzanz->cursor, byzanz->cursor_x, byzanz->cursor_y);
+
+  return result;
+}
+
+static gboolean
+byzanz_encoder_byzanz_copy (ByzanzEncoder *        encoder,
+                            GOutputStream *        stream,
+                            guint64                msecs,
+                            const cairo_region_t * region,
+                            int                    dx,
+                            int                    dy,
+                            GCancellable *         cancellable,
+                            GError **	           error)
+{
+  ByzanzEncoderByzanz *byzanz = BYZANZ_ENCODER_BYZANZ (encoder);
+
+  if (byzanz->frame) {
+    cairo_surface_flush (byzanz->frame);
+    byzanz_copy_region (cairo_image_surface_get_data (byzanz->frame),
+        cairo_image_surface_get_stride (byzanz->frame), sizeof (guint32),
+        region, dx, dy);
+    cairo_surface_mark_dirty (byzanz->frame);
+  }
+
+  return byzanz_serialize_copy (stream, msecs, region, dx, dy, cancellable, error);
+}
+
+static gboolean
+byzanz_encoder_byzanz_cursor (ByzanzEncoder *        encoder,
+                              GOutputStream *        stream,
+                              const ByzanzRecord *   record,
+                              GCancellable *         cancellable,
+                              GError **	             error)
+{
+  ByzanzEncoderByzanz *byzanz = BYZANZ_ENCODER_BYZANZ (encoder);
+
+  if (record->type == BYZANZ_RECORD_CURSOR_IMAGE) {
+    if (byzanz->index)
+      byzanz_index_add_cursor_image (byzanz->index, record->cursor, g_seekable_tell (G_SEEKABLE (stream)));
+    return byzanz_serialize_cursor_image (stream, record->msecs, record->cursor,
+        record->surface, cancellable, error);
+  }
+
+  byzanz->cursor = record->cursor;
+  byzanz->cursor_x = record->x;
+  byzanz->cursor_y = record->y;
+  return byzanz_serialize_cursor (stream, record->msecs, record->cursor,
+      record->x, record->y, cancellable, error);
 }
 
 static gboolean
@@ -58,19 +150,46 @@ byzanz_encoder_byzanz_close (ByzanzEncoder *  encoder,
                              GCancellable *   cancellable,
                              GError **	      error)
 {
-  return byzanz_serialize (stream, msecs, NULL, NULL, cancellable, error);
+  ByzanzEncoderByzanz *byzanz = BYZANZ_ENCODER_BYZANZ (encoder);
+
+  if (!byzanz_serialize (stream, msecs, NULL, NULL, 0, cancellable, error))
+    return FALSE;
+
+  if (byzanz->index == NULL)
+    return TRUE;
+
+  byzanz_index_set_end (byzanz->index, msecs, g_seekable_tell (G_SEEKABLE (stream)));
+  return byzanz_index_write (byzanz->index, stream, cancellable, error);
+}
+
+static void
+byzanz_encoder_byzanz_finalize (GObject *object)
+{
+  ByzanzEncoderByzanz *byzanz = BYZANZ_ENCODER_BYZANZ (object);
+
+  if (byzanz->index)
+    byzanz_index_free (byzanz->index);
+  if (byzanz->frame)
+    cairo_surface_destroy (byzanz->frame);
+
+  G_OBJECT_CLASS (byzanz_encoder_byzanz_parent_class)->finalize (object);
 }
 
 static void
 byzanz_encoder_byzanz_class_init (ByzanzEncoderByzanzClass *klass)
 {
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
   ByzanzEncoderClass *encoder_class = BYZANZ_ENCODER_CLASS (klass);
 
+  object_class->finalize = byzanz_encoder_byzanz_finalize;
+
   /* We don't use the run vfunc and just g_output_stream_slice() here,
    * because this way we get data verification.
    */
   encoder_class->setup = byzanz_encoder_byzanz_setup;
   encoder_class->process = byzanz_encoder_byzanz_process;
+  encoder_class->copy = byzanz_encoder_byzanz_copy;
+  encoder_class->cursor = byzanz_encoder_byzanz_cursor;
   encoder_class->close = byzanz_encoder_byzanz_close;
 
   encoder_class->filter = gtk_file_filter_new ();
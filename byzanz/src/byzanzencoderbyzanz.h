@@ -16,6 +16,7 @@
  */
 
 #include "byzanzencoder.h"
+#include "byzanzindex.h"
 
 #ifndef __HAVE_BYZANZ_ENCODER_BYZANZ_H__
 #define __HAVE_BYZANZ_ENCODER_BYZANZ_H__
@@ -32,6 +33,13 @@ typedef struct _ByzanzEncoderByzanzClass ByzanzEncoderByzanzClass;
 
 struct _ByzanzEncoderByzanz {
   ByzanzEncoder         encoder;
+
+  ByzanzIndex *         index;          /* index of the written records or NULL if output can't tell offsets */
+  cairo_surface_t *     frame;          /* current contents for writing keyframes */
+  guint64               next_keyframe;  /* timestamp from which on the next image is written as a keyframe */
+  guint                 cursor;         /* id of the current cursor */
+  int                   cursor_x;       /* X position of the current cursor */
+  int                   cursor_y;       /* Y position of the current cursor */
 };
 
 struct _ByzanzEncoderByzanzClass {
@@ -42,6 +42,7 @@ byzanz_encoder_flv_class_init (ByzanzEncoderFlvClass *klass)
   gstreamer_class->audio_pipeline_string = 
     "autoaudiosrc name=audiosrc ! audioconvert ! audio/x-raw-int,width=16 ! queue ! flvmux name=muxer ! giostreamsink name=sink "
     "appsrc name=src ! videoconvert ! avenc_flashsv buffer-size=8388608 ! muxer.";
+  gstreamer_class->variable_frame_rate = TRUE;
 }
 
 static void
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#include "byzanzserialize.h"
 #include "gifenc.h"
 
 G_DEFINE_TYPE (ByzanzEncoderGif, byzanz_encoder_gif, BYZANZ_TYPE_ENCODER)
@@ -112,19 +113,26 @@ byzanz_encoder_gif_encode_image (ByzanzEncoderGif *      gif,
                                  const cairo_region_t *  region,
                                  cairo_rectangle_int_t * area_out)
 {
-  cairo_rectangle_int_t extents, area, rect;
+  cairo_rectangle_int_t extents, clear, area, rect;
   guint8 transparent;
   guint i, n_rects, stride, width;
+  int y;
 
   cairo_region_get_extents (region, &extents);
   transparent = gifenc_palette_get_alpha_index (gif->gifenc->palette);
-  stride = cairo_image_surface_get_stride (surface);
+  /* surface is NULL when only copies changed the image */
+  stride = surface ? cairo_image_surface_get_stride (surface) : 0;
   width = gifenc_get_width (gif->gifenc);
 
   /* clear area */
   /* FIXME: only do this in parts not captured by region */
-  for (i = extents.y; i < (guint) (extents.y + extents.height); i++) {
-    memset (gif->cached_tmp + width * i + extents.x, transparent, extents.width);
+  clear = extents;
+  if (gif->copied) {
+    cairo_region_get_extents (gif->copied, &area);
+    gdk_rectangle_union ((const GdkRectangle*) &clear, (const GdkRectangle*) &area, (GdkRectangle*) &clear);
+  }
+  for (i = clear.y; i < (guint) (clear.y + clear.height); i++) {
+    memset (gif->cached_tmp + width * i + clear.x, transparent, clear.width);
   }
 
   /* render changed parts */
@@ -148,6 +156,26 @@ byzanz_encoder_gif_encode_image (ByzanzEncoderGif *      gif,
     }
   }
 
+  /* copied parts were already moved in image_data, they need to be in the
+   * image, too. Dithering only left pixels transparent that equal image_data. */
+  if (gif->copied) {
+    n_rects = cairo_region_num_rectangles (gif->copied);
+    for (i = 0; i < n_rects; i++) {
+      cairo_region_get_rectangle (gif->copied, i, &rect);
+      for (y = rect.y; y < rect.y + rect.height; y++) {
+        memcpy (gif->cached_tmp + width * y + rect.x,
+            gif->image_data + width * y + rect.x, rect.width);
+      }
+    }
+    cairo_region_get_extents (gif->copied, &area);
+    if (area_out->width > 0 && area_out->height > 0)
+      gdk_rectangle_union ((const GdkRectangle*)area_out, (const GdkRectangle*) &area, (GdkRectangle*)area_out);
+    else
+      *area_out = area;
+    cairo_region_destroy (gif->copied);
+    gif->copied = NULL;
+  }
+
   return area_out->width > 0 && area_out->height > 0;
 }
 
@@ -176,6 +204,9 @@ byzanz_encoder_gif_process (ByzanzEncoder *        encoder,
   cairo_rectangle_int_t area;
 
   if (!gif->has_quantized) {
+    /* copies are ignored until there is an image */
+    if (surface == NULL)
+      return TRUE;
     if (!byzanz_encoder_gif_quantize (gif, surface, error))
       return FALSE;
     gif->cached_time = msecs;
@@ -194,6 +225,33 @@ byzanz_encoder_gif_process (ByzanzEncoder *        encoder,
   return TRUE;
 }
 
+static gboolean
+byzanz_encoder_gif_copy (ByzanzEncoder *        encoder,
+                         GOutputStream *        stream,
+                         guint64                msecs,
+                         const cairo_region_t * region,
+                         int                    dx,
+                         int                    dy,
+                         GCancellable *         cancellable,
+                         GError **	        error)
+{
+  ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
+
+  /* nothing to copy from yet */
+  if (!gif->has_quantized)
+    return TRUE;
+
+  /* Moving the already dithered pixels is not just faster than dithering
+   * them again, it also avoids flickering from changed dither patterns. */
+  byzanz_copy_region (gif->image_data, gifenc_get_width (gif->gifenc), 1, region, dx, dy);
+  if (gif->copied)
+    cairo_region_union (gif->copied, region);
+  else
+    gif->copied = cairo_region_copy (region);
+
+  return TRUE;
+}
+
 static gboolean
 byzanz_encoder_gif_close (ByzanzEncoder *  encoder,
                           GOutputStream *  stream,
@@ -223,6 +281,8 @@ byzanz_encoder_gif_finalize (GObject *object)
   g_free (gif->image_data);
   g_free (gif->cached_data);
   g_free (gif->cached_tmp);
+  if (gif->copied)
+    cairo_region_destroy (gif->copied);
   if (gif->gifenc)
     gifenc_free (gif->gifenc);
 
@@ -239,6 +299,7 @@ byzanz_encoder_gif_class_init (ByzanzEncoderGifClass *klass)
 
   encoder_class->setup = byzanz_encoder_gif_setup;
   encoder_class->process = byzanz_encoder_gif_process;
+  encoder_class->copy = byzanz_encoder_gif_copy;
   encoder_class->close = byzanz_encoder_gif_close;
 
   encoder_class->filter = gtk_file_filter_new ();
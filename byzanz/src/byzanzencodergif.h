@@ -44,6 +44,8 @@ struct _ByzanzEncoderGif {
   guint64               cached_time;    /* timestamp the cached image corresponds to */
 
   guint8 *		cached_tmp;	/* temporary data to swap cached_data with */
+
+  cairo_region_t *      copied;         /* NULL or region moved by copies since the last image */
 };
 
 struct _ByzanzEncoderGifClass {
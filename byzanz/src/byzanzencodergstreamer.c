@@ -24,75 +24,271 @@
 #include <glib/gi18n-lib.h>
 #include <gst/video/video.h>
 
+#include "byzanzscale.h"
 #include "byzanzserialize.h"
 
+enum {
+  PROP_0,
+  PROP_KEEPALIVE,
+  PROP_LAG
+};
+
 G_DEFINE_TYPE (ByzanzEncoderGStreamer, byzanz_encoder_gstreamer, BYZANZ_TYPE_ENCODER)
 
-static void
-byzanz_encoder_gstreamer_need_data (GstAppSrc *src, guint length, gpointer data)
+static cairo_surface_t *
+byzanz_encoder_gstreamer_create_surface (ByzanzEncoderGStreamer *gst)
 {
-  ByzanzEncoder *encoder = data;
-  ByzanzEncoderGStreamer *gst = data;
-  GstBuffer *buffer;
-  cairo_t *cr;
-  cairo_surface_t *surface;
-  cairo_region_t *region;
-  GError *error = NULL;
-  guint64 msecs;
-  int i, num_rects;
+  gsize stride;
 
-  if (!byzanz_deserialize (encoder->input_stream, &msecs, &surface, &region, encoder->cancellable, &error)) {
-    gst_element_message_full (GST_ELEMENT (src), GST_MESSAGE_ERROR,
-        error->domain, error->code, g_strdup (error->message), NULL, __FILE__, GST_FUNCTION, __LINE__);
-    g_error_free (error);
-    return;
+  if (gst->frame == NULL)
+    return cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+        GST_VIDEO_INFO_WIDTH (&gst->info), GST_VIDEO_INFO_HEIGHT (&gst->info));
+
+  /* I420 frames only use the surface as memory, so the buffers can keep
+   * them alive just like BGRx frames */
+  stride = GST_VIDEO_INFO_PLANE_STRIDE (&gst->info, 0);
+  return cairo_image_surface_create (CAIRO_FORMAT_A8, stride,
+      (GST_VIDEO_INFO_SIZE (&gst->info) + stride - 1) / stride);
+}
+
+static void
+byzanz_encoder_gstreamer_convert (ByzanzEncoderGStreamer *    gst,
+                                  ByzanzEncoderGStreamerSlot *slot)
+{
+  guchar *data, *planes[3];
+  gsize strides[3];
+  guint i;
+
+  cairo_surface_flush (slot->surface);
+  data = cairo_image_surface_get_data (slot->surface);
+  for (i = 0; i < 3; i++) {
+    planes[i] = data + GST_VIDEO_INFO_PLANE_OFFSET (&gst->info, i);
+    strides[i] = GST_VIDEO_INFO_PLANE_STRIDE (&gst->info, i);
   }
+  byzanz_convert_region_i420 (planes, strides, gst->frame, slot->stale);
+  cairo_surface_mark_dirty (slot->surface);
+}
 
-  if (surface == NULL) {
-    gst_app_src_end_of_stream (gst->src);
-    if (gst->audiosrc)
-      gst_element_send_event (gst->audiosrc, gst_event_new_eos ());
-    return;
+/* Gets a slot that the pipeline doesn't use anymore and makes it the
+ * current one. Only the areas that changed since the slot was last used
+ * need to be copied, instead of the whole frame. When converting to I420,
+ * they are converted from the current image instead. */
+static ByzanzEncoderGStreamerSlot *
+byzanz_encoder_gstreamer_get_slot (ByzanzEncoderGStreamer *gst)
+{
+  ByzanzEncoderGStreamerSlot *slot, *current;
+  cairo_rectangle_int_t rect = { 0, 0, 0, 0 };
+  guint i;
+
+  for (i = 0; i < gst->slots->len; i++) {
+    slot = &g_array_index (gst->slots, ByzanzEncoderGStreamerSlot, i);
+    if (cairo_surface_get_reference_count (slot->surface) == 1)
+      break;
   }
 
-  if (cairo_surface_get_reference_count (gst->surface) > 1) {
-    cairo_surface_t *copy = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
-        cairo_image_surface_get_width (gst->surface), cairo_image_surface_get_height (gst->surface));
-    
-    cr = cairo_create (copy);
-    cairo_set_source_surface (cr, gst->surface, 0, 0);
-    cairo_paint (cr);
-    cairo_destroy (cr);
+  /* all frames are still in the pipeline, so add another one */
+  if (i == gst->slots->len) {
+    ByzanzEncoderGStreamerSlot new_slot;
 
-    cairo_surface_destroy (gst->surface);
-    gst->surface = copy;
+    rect.width = GST_VIDEO_INFO_WIDTH (&gst->info);
+    rect.height = GST_VIDEO_INFO_HEIGHT (&gst->info);
+    new_slot.surface = byzanz_encoder_gstreamer_create_surface (gst);
+    new_slot.stale = cairo_region_create_rectangle (&rect);
+    g_array_append_val (gst->slots, new_slot);
   }
-  cr = cairo_create (gst->surface);
-  cairo_set_source_surface (cr, surface, 0, 0);
 
-  num_rects = cairo_region_num_rectangles (region);
-  for (i = 0; i < num_rects; i++) {
-    cairo_rectangle_int_t rect;
-    cairo_region_get_rectangle (region, i, &rect);
-    cairo_rectangle (cr, rect.x, rect.y,
-                     rect.width, rect.height);
+  slot = &g_array_index (gst->slots, ByzanzEncoderGStreamerSlot, i);
+  current = &g_array_index (gst->slots, ByzanzEncoderGStreamerSlot, gst->current);
+  if (!cairo_region_is_empty (slot->stale)) {
+    if (gst->frame)
+      byzanz_encoder_gstreamer_convert (gst, slot);
+    else
+      byzanz_paint_region (slot->surface, current->surface, slot->stale);
+    cairo_region_destroy (slot->stale);
+    slot->stale = cairo_region_create ();
   }
+  gst->current = i;
 
-  cairo_fill (cr);
-  cairo_destroy (cr);
+  return slot;
+}
+
+/* Marks @region as changed in all slots but the current one, which was
+ * drawn to. When converting to I420, the image was drawn to instead. */
+static void
+byzanz_encoder_gstreamer_damage (ByzanzEncoderGStreamer *gst,
+                                 const cairo_region_t *  region)
+{
+  ByzanzEncoderGStreamerSlot *slot;
+  guint i;
+
+  for (i = 0; i < gst->slots->len; i++) {
+    if (i == gst->current && gst->frame == NULL)
+      continue;
+    slot = &g_array_index (gst->slots, ByzanzEncoderGStreamerSlot, i);
+    cairo_region_union (slot->stale, region);
+  }
+}
+
+static GstBuffer *
+byzanz_encoder_gstreamer_wrap (ByzanzEncoderGStreamer *gst,
+                               cairo_surface_t *       surface,
+                               guint64                 msecs)
+{
+  GstBuffer *buffer;
+  gsize size;
 
-  /* create a buffer and send it */
-  /* FIXME: stride just works? */
-  cairo_surface_reference (gst->surface);
+  /* the buffer keeps the surface alive, its slot can be reused once it's gone */
+  size = GST_VIDEO_INFO_SIZE (&gst->info);
+  cairo_surface_reference (surface);
   buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
-                                        cairo_image_surface_get_data (gst->surface),
-                                        cairo_image_surface_get_stride (gst->surface) * cairo_image_surface_get_height (gst->surface),
-                                        0,
-                                        cairo_image_surface_get_stride (gst->surface) * cairo_image_surface_get_height (gst->surface),
-                                        gst->surface,
+                                        cairo_image_surface_get_data (surface),
+                                        size, 0, size,
+                                        surface,
                                         (GDestroyNotify) cairo_surface_destroy);
   GST_BUFFER_TIMESTAMP (buffer) = msecs * GST_MSECOND;
-  gst_app_src_push_buffer (gst->src, buffer);
+
+  return buffer;
+}
+
+/* Pushes the held back frame, now that the next one arrives at @msecs.
+ * Variable frame rate pipelines only get a frame when something changed,
+ * so the frame is repeated whenever nothing changed for keepalive
+ * milliseconds. */
+static void
+byzanz_encoder_gstreamer_flush (ByzanzEncoderGStreamer *gst,
+                                guint64                 msecs)
+{
+  ByzanzEncoderGStreamerClass *klass = BYZANZ_ENCODER_GSTREAMER_GET_CLASS (gst);
+  ByzanzEncoderGStreamerSlot *current;
+  GstClockTime timestamp, keepalive;
+  GstBuffer *repeat;
+
+  if (gst->pending == NULL)
+    return;
+
+  current = &g_array_index (gst->slots, ByzanzEncoderGStreamerSlot, gst->current);
+  timestamp = GST_BUFFER_TIMESTAMP (gst->pending);
+  keepalive = klass->variable_frame_rate ? g_atomic_int_get (&gst->keepalive) * GST_MSECOND : 0;
+  while (keepalive > 0 && msecs * GST_MSECOND > timestamp + keepalive) {
+    timestamp += keepalive;
+    repeat = byzanz_encoder_gstreamer_wrap (gst, current->surface, timestamp / GST_MSECOND);
+    GST_BUFFER_DURATION (gst->pending) = keepalive;
+    gst_app_src_push_buffer (gst->src, gst->pending);
+    gst->pending = repeat;
+  }
+
+  GST_BUFFER_DURATION (gst->pending) = MAX (msecs * GST_MSECOND, timestamp) - timestamp;
+  gst_app_src_push_buffer (gst->src, gst->pending);
+  gst->pending = NULL;
+}
+
+/* Measures how far encoding is behind the capture of the image taken
+ * at @msecs and lets the subclass speed up or slow down accordingly. */
+static void
+byzanz_encoder_gstreamer_update_lag (ByzanzEncoderGStreamer *gst,
+                                     guint64                 msecs)
+{
+  ByzanzEncoderGStreamerClass *klass = BYZANZ_ENCODER_GSTREAMER_GET_CLASS (gst);
+  gint64 now;
+  guint lag;
+
+  if (gst->videoenc == NULL)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (gst->origin == 0)
+    gst->origin = now - (gint64) msecs * 1000;
+  lag = MAX (now - gst->origin - (gint64) msecs * 1000, 0) / 1000;
+  g_atomic_int_set (&gst->lag, lag);
+
+  if (lag / BYZANZ_ENCODER_GSTREAMER_LAG_STEP == gst->lag_step)
+    return;
+  gst->lag_step = lag / BYZANZ_ENCODER_GSTREAMER_LAG_STEP;
+  if (klass->tune)
+    klass->tune (gst, gst->videoenc, lag);
+}
+
+static void
+byzanz_encoder_gstreamer_need_data (GstAppSrc *src, guint length, gpointer data)
+{
+  ByzanzEncoder *encoder = data;
+  ByzanzEncoderGStreamer *gst = data;
+  ByzanzEncoderGStreamerSlot *slot = NULL;
+  cairo_surface_t *target = NULL;
+  cairo_region_t *changed;
+  ByzanzRecord record;
+  GError *error = NULL;
+  guint64 msecs = 0;
+
+  changed = cairo_region_create ();
+  for (;;) {
+    if (gst->has_next_record) {
+      record = gst->next_record;
+      gst->has_next_record = FALSE;
+    } else if (!byzanz_encoder_read_record (encoder, encoder->input_stream, &record, encoder->cancellable, &error)) {
+      gst_element_message_full (GST_ELEMENT (src), GST_MESSAGE_ERROR,
+          error->domain, error->code, g_strdup (error->message), NULL, __FILE__, GST_FUNCTION, __LINE__);
+      g_error_free (error);
+      cairo_region_destroy (changed);
+      return;
+    }
+
+    /* A copy is only merged with an image taken at the same time.
+     * Otherwise it is a frame of its own, and the record is kept for
+     * the next one. */
+    if (target != NULL &&
+        (record.msecs != msecs || (record.type == BYZANZ_RECORD_IMAGE && record.surface == NULL))) {
+      gst->next_record = record;
+      gst->has_next_record = TRUE;
+      break;
+    }
+
+    if (target == NULL)
+      byzanz_encoder_gstreamer_flush (gst, record.msecs);
+
+    if (record.type == BYZANZ_RECORD_IMAGE && record.surface == NULL) {
+      gst_app_src_end_of_stream (gst->src);
+      if (gst->audiosrc)
+        gst_element_send_event (gst->audiosrc, gst_event_new_eos ());
+      cairo_region_destroy (changed);
+      return;
+    }
+
+    if (target == NULL) {
+      if (gst->frame) {
+        target = gst->frame;
+      } else {
+        slot = byzanz_encoder_gstreamer_get_slot (gst);
+        target = slot->surface;
+      }
+    }
+    msecs = record.msecs;
+    cairo_region_union (changed, record.region);
+
+    if (record.type != BYZANZ_RECORD_COPY) {
+      byzanz_paint_region (target, record.surface, record.region);
+      byzanz_record_clear (&record);
+      break;
+    }
+
+    /* apply the copy and see if an image follows */
+    cairo_surface_flush (target);
+    byzanz_copy_region (cairo_image_surface_get_data (target),
+        cairo_image_surface_get_stride (target), sizeof (guint32),
+        record.region, record.dx, record.dy);
+    cairo_surface_mark_dirty (target);
+    byzanz_record_clear (&record);
+  }
+
+  cairo_surface_flush (target);
+  byzanz_encoder_gstreamer_damage (gst, changed);
+  if (gst->frame)
+    slot = byzanz_encoder_gstreamer_get_slot (gst);
+  cairo_region_destroy (changed);
+  byzanz_encoder_gstreamer_update_lag (gst, msecs);
+
+  /* the duration is only known when the next frame arrives */
+  gst->pending = byzanz_encoder_gstreamer_wrap (gst, slot->surface, msecs);
 }
 
 static GstAppSrcCallbacks callbacks = {
@@ -109,15 +305,42 @@ byzanz_encoder_gstreamer_run (ByzanzEncoder * encoder,
 {
   ByzanzEncoderGStreamer *gstreamer = BYZANZ_ENCODER_GSTREAMER (encoder);
   ByzanzEncoderGStreamerClass *klass = BYZANZ_ENCODER_GSTREAMER_GET_CLASS (encoder);
+  ByzanzEncoderGStreamerSlot slot;
+  cairo_rectangle_int_t area = { 0, 0, 0, 0 };
   GstElement *sink;
   guint width, height;
   GstMessage *message;
   GstBus *bus;
 
-  if (!byzanz_deserialize_header (input, &width, &height, cancellable, error))
+  if (!byzanz_encoder_read_header (encoder, input, &width, &height, cancellable, error))
     return FALSE;
+  area.width = width;
+  area.height = height;
+
+  if (klass->i420) {
+    gst_video_info_set_format (&gstreamer->info, GST_VIDEO_FORMAT_I420, width, height);
+    /* byzanz_convert_region_i420() uses BT.601 */
+    gst_video_colorimetry_from_string (&gstreamer->info.colorimetry, GST_VIDEO_COLORIMETRY_BT601);
+    gstreamer->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+  } else {
+    gst_video_info_set_format (&gstreamer->info,
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+                               GST_VIDEO_FORMAT_BGRx,
+#elif G_BYTE_ORDER == G_BIG_ENDIAN
+                               GST_VIDEO_FORMAT_xRGB,
+#else
+#error "Please add the Cairo caps format here"
+#endif
+                               width, height);
+  }
 
-  gstreamer->surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+  slot.surface = byzanz_encoder_gstreamer_create_surface (gstreamer);
+  /* the image starts out black, its conversion doesn't */
+  if (gstreamer->frame)
+    slot.stale = cairo_region_create_rectangle (&area);
+  else
+    slot.stale = cairo_region_create ();
+  g_array_append_val (gstreamer->slots, slot);
 
   g_assert (klass->pipeline_string);
   if (record_audio) {
@@ -142,18 +365,13 @@ byzanz_encoder_gstreamer_run (ByzanzEncoder * encoder,
   g_assert (sink);
   g_object_set (sink, "stream", output, NULL);
   g_object_unref (sink);
+  if (encoder->realtime && klass->realtime) {
+    gstreamer->videoenc = gst_bin_get_by_name (GST_BIN (gstreamer->pipeline), "videoenc");
+    g_assert (gstreamer->videoenc);
+    klass->realtime (gstreamer, gstreamer->videoenc);
+  }
 
-  gstreamer->caps = gst_caps_new_simple ("video/x-raw",
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-                                         "format", G_TYPE_STRING, "BGRx",
-#elif G_BYTE_ORDER == G_BIG_ENDIAN
-                                         "format", G_TYPE_STRING, "xRGB",
-#else
-#error "Please add the Cairo caps format here"
-#endif
-                                         "width", G_TYPE_INT, width,
-                                         "height", G_TYPE_INT, height,
-                                         "framerate", GST_TYPE_FRACTION, 0, 1, NULL);
+  gstreamer->caps = gst_video_info_to_caps (&gstreamer->info);
   g_assert (gst_caps_is_fixed (gstreamer->caps));
 
   gst_app_src_set_caps (gstreamer->src, gstreamer->caps);
@@ -189,6 +407,8 @@ static void
 byzanz_encoder_gstreamer_finalize (GObject *object)
 {
   ByzanzEncoderGStreamer *gstreamer = BYZANZ_ENCODER_GSTREAMER (object);
+  ByzanzEncoderGStreamerSlot *slot;
+  guint i;
 
   if (gstreamer->pipeline) {
     gst_element_set_state (gstreamer->pipeline, GST_STATE_NULL);
@@ -196,15 +416,200 @@ byzanz_encoder_gstreamer_finalize (GObject *object)
   }
   if (gstreamer->src)
     g_object_unref (gstreamer->src);
+  if (gstreamer->videoenc)
+    g_object_unref (gstreamer->videoenc);
   if (gstreamer->caps)
     gst_caps_unref (gstreamer->caps);
-
-  if (gstreamer->surface)
-    cairo_surface_destroy (gstreamer->surface);
+  if (gstreamer->pending)
+    gst_buffer_unref (gstreamer->pending);
+  if (gstreamer->has_next_record)
+    byzanz_record_clear (&gstreamer->next_record);
+  if (gstreamer->frame)
+    cairo_surface_destroy (gstreamer->frame);
+
+  for (i = 0; i < gstreamer->slots->len; i++) {
+    slot = &g_array_index (gstreamer->slots, ByzanzEncoderGStreamerSlot, i);
+    cairo_surface_destroy (slot->surface);
+    cairo_region_destroy (slot->stale);
+  }
+  g_array_free (gstreamer->slots, TRUE);
 
   G_OBJECT_CLASS (byzanz_encoder_gstreamer_parent_class)->finalize (object);
 }
 
+/**
+ * byzanz_encoder_gstreamer_can_concat:
+ * @type: an encoder type
+ *
+ * Checks if files created by encoders of @type can be joined with
+ * byzanz_encoder_gstreamer_concat().
+ *
+ * Returns: %TRUE if the files can be joined
+ **/
+gboolean
+byzanz_encoder_gstreamer_can_concat (GType type)
+{
+  ByzanzEncoderGStreamerClass *klass;
+  gboolean result;
+
+  if (!g_type_is_a (type, BYZANZ_TYPE_ENCODER_GSTREAMER))
+    return FALSE;
+
+  klass = g_type_class_ref (type);
+  result = klass->demuxer != NULL;
+  g_type_class_unref (klass);
+
+  return result;
+}
+
+static void
+byzanz_encoder_gstreamer_demuxer_pad_added (GstElement *demuxer,
+                                            GstPad *    pad,
+                                            GstPad *    sinkpad)
+{
+  if (gst_pad_is_linked (sinkpad))
+    return;
+
+  gst_pad_link (pad, sinkpad);
+}
+
+/**
+ * byzanz_encoder_gstreamer_concat:
+ * @type: type of the encoder that created @files
+ * @files: the files to join
+ * @n_files: number of files
+ * @stream: stream to write the result to
+ * @error: %NULL or location to take an error
+ *
+ * Joins the video streams of @files without encoding them again. Every
+ * file must start with a keyframe. This function blocks until it is done.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_encoder_gstreamer_concat (GType           type,
+                                 GFile **        files,
+                                 guint           n_files,
+                                 GOutputStream * stream,
+                                 GError **       error)
+{
+  ByzanzEncoderGStreamerClass *klass;
+  GstElement *pipeline, *concat, *muxer, *sink, *src, *demuxer;
+  GstPad **pads, *srcpad, *muxpad;
+  GstMessage *message;
+  GstBus *bus;
+  gboolean result;
+  char *path;
+  guint i;
+
+  g_return_val_if_fail (byzanz_encoder_gstreamer_can_concat (type), FALSE);
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
+
+  klass = g_type_class_ref (type);
+  pipeline = gst_pipeline_new (NULL);
+  concat = gst_element_factory_make ("concat", NULL);
+  muxer = gst_element_factory_make (klass->muxer, NULL);
+  sink = gst_element_factory_make ("giostreamsink", NULL);
+  if (concat == NULL || muxer == NULL || sink == NULL) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        _("Failed to create GStreamer elements for joining files"));
+    if (concat)
+      gst_object_unref (concat);
+    if (muxer)
+      gst_object_unref (muxer);
+    if (sink)
+      gst_object_unref (sink);
+    gst_object_unref (pipeline);
+    g_type_class_unref (klass);
+    return FALSE;
+  }
+  g_object_set (sink, "stream", stream, NULL);
+  gst_bin_add_many (GST_BIN (pipeline), concat, muxer, sink, NULL);
+
+  srcpad = gst_element_get_static_pad (concat, "src");
+  muxpad = gst_element_get_request_pad (muxer, "video_%u");
+  gst_pad_link (srcpad, muxpad);
+  gst_object_unref (srcpad);
+  gst_element_link (muxer, sink);
+
+  /* concat plays its pads in the order they were requested */
+  pads = g_new (GstPad *, n_files);
+  for (i = 0; i < n_files; i++) {
+    src = gst_element_factory_make ("filesrc", NULL);
+    demuxer = gst_element_factory_make (klass->demuxer, NULL);
+    path = g_file_get_path (files[i]);
+    g_object_set (src, "location", path, NULL);
+    g_free (path);
+    gst_bin_add_many (GST_BIN (pipeline), src, demuxer, NULL);
+    gst_element_link (src, demuxer);
+    pads[i] = gst_element_get_request_pad (concat, "sink_%u");
+    g_signal_connect (demuxer, "pad-added",
+        G_CALLBACK (byzanz_encoder_gstreamer_demuxer_pad_added), pads[i]);
+  }
+
+  if (gst_element_set_state (pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, _("Failed to start GStreamer pipeline"));
+    result = FALSE;
+  } else {
+    bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+    message = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+    g_object_unref (bus);
+
+    result = GST_MESSAGE_TYPE (message) != GST_MESSAGE_ERROR;
+    if (!result)
+      gst_message_parse_error (message, error, NULL);
+    gst_message_unref (message);
+  }
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  for (i = 0; i < n_files; i++) {
+    gst_element_release_request_pad (concat, pads[i]);
+    gst_object_unref (pads[i]);
+  }
+  g_free (pads);
+  gst_element_release_request_pad (muxer, muxpad);
+  gst_object_unref (muxpad);
+  gst_object_unref (pipeline);
+  g_type_class_unref (klass);
+
+  return result;
+}
+
+static void
+byzanz_encoder_gstreamer_get_property (GObject *object, guint param_id, GValue *value, 
+    GParamSpec * pspec)
+{
+  ByzanzEncoderGStreamer *gstreamer = BYZANZ_ENCODER_GSTREAMER (object);
+
+  switch (param_id) {
+    case PROP_KEEPALIVE:
+      g_value_set_uint (value, g_atomic_int_get (&gstreamer->keepalive));
+      break;
+    case PROP_LAG:
+      g_value_set_uint (value, g_atomic_int_get (&gstreamer->lag));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+      break;
+  }
+}
+
+static void
+byzanz_encoder_gstreamer_set_property (GObject *object, guint param_id, const GValue *value, 
+    GParamSpec * pspec)
+{
+  ByzanzEncoderGStreamer *gstreamer = BYZANZ_ENCODER_GSTREAMER (object);
+
+  switch (param_id) {
+    case PROP_KEEPALIVE:
+      g_atomic_int_set (&gstreamer->keepalive, g_value_get_uint (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+      break;
+  }
+}
+
 static void
 byzanz_encoder_gstreamer_class_init (ByzanzEncoderGStreamerClass *klass)
 {
@@ -213,13 +618,24 @@ byzanz_encoder_gstreamer_class_init (ByzanzEncoderGStreamerClass *klass)
 
   gst_init (NULL, NULL);
 
+  object_class->get_property = byzanz_encoder_gstreamer_get_property;
+  object_class->set_property = byzanz_encoder_gstreamer_set_property;
   object_class->finalize = byzanz_encoder_gstreamer_finalize;
 
   encoder_class->run = byzanz_encoder_gstreamer_run;
+
+  g_object_class_install_property (object_class, PROP_KEEPALIVE,
+      g_param_spec_uint ("keepalive", "keepalive", "milliseconds before an unchanged frame is repeated or 0 to never repeat",
+	  0, G_MAXUINT, BYZANZ_ENCODER_GSTREAMER_KEEPALIVE, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_LAG,
+      g_param_spec_uint ("lag", "lag", "milliseconds the last image was encoded after it was captured",
+	  0, G_MAXUINT, 0, G_PARAM_READABLE));
 }
 
 static void
 byzanz_encoder_gstreamer_init (ByzanzEncoderGStreamer *encoder_gstreamer)
 {
+  encoder_gstreamer->slots = g_array_new (FALSE, FALSE, sizeof (ByzanzEncoderGStreamerSlot));
+  encoder_gstreamer->keepalive = BYZANZ_ENCODER_GSTREAMER_KEEPALIVE;
 }
 
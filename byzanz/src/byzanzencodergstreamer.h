@@ -19,6 +19,7 @@
 
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
 
 #ifndef __HAVE_BYZANZ_ENCODER_GSTREAMER_H__
 #define __HAVE_BYZANZ_ENCODER_GSTREAMER_H__
@@ -33,12 +34,36 @@ typedef struct _ByzanzEncoderGStreamerClass ByzanzEncoderGStreamerClass;
 #define BYZANZ_ENCODER_GSTREAMER_CLASS(klass)            (G_TYPE_CHECK_CLASS_CAST ((klass), BYZANZ_TYPE_ENCODER_GSTREAMER, ByzanzEncoderGStreamerClass))
 #define BYZANZ_ENCODER_GSTREAMER_GET_CLASS(obj)          (G_TYPE_INSTANCE_GET_CLASS ((obj), BYZANZ_TYPE_ENCODER_GSTREAMER, ByzanzEncoderGStreamerClass))
 
+/* default for ByzanzEncoderGStreamer:keepalive */
+#define BYZANZ_ENCODER_GSTREAMER_KEEPALIVE 1000
+/* realtime encoders are tuned again whenever their lag changes by this many milliseconds */
+#define BYZANZ_ENCODER_GSTREAMER_LAG_STEP 1000
+
+typedef struct _ByzanzEncoderGStreamerSlot ByzanzEncoderGStreamerSlot;
+struct _ByzanzEncoderGStreamerSlot {
+  cairo_surface_t *     surface;        /* frame, also referenced by the buffers still using it */
+  cairo_region_t *      stale;          /* area where surface differs from the current frame */
+};
+
 struct _ByzanzEncoderGStreamer {
   ByzanzEncoder         encoder;
 
-  cairo_surface_t *     surface;        /* last surface pushed down the pipeline */
+  GstVideoInfo          info;           /* format of the frames pushed down the pipeline */
+  cairo_surface_t *     frame;          /* NULL or the current image when converting to I420 ourselves */
+  GArray *              slots;          /* ByzanzEncoderGStreamerSlot, frames reused for buffers */
+  guint                 current;        /* index of the slot pushed down the pipeline last */
+  GstBuffer *           pending;        /* NULL or last frame, held back until its duration is known */
+  ByzanzRecord          next_record;    /* record read after a copy that belongs to the next frame */
+  gboolean              has_next_record; /* TRUE if next_record is set */
+  volatile gint         keepalive;      /* milliseconds before an unchanged frame is repeated */
   GTimeVal              start_time;     /* timestamp of first image */
 
+  /* keeping up with a running capture */
+  GstElement *          videoenc;       /* NULL or the element named "videoenc" in the pipeline */
+  gint64                origin;         /* monotonic time of the capture's timestamp 0 or 0 if unknown */
+  volatile gint         lag;            /* milliseconds the last image was encoded after it was captured */
+  guint                 lag_step;       /* lag in BYZANZ_ENCODER_GSTREAMER_LAG_STEP units when last tuned */
+
   GstElement *          pipeline;       /* The pipeline */
   GstElement *          audiosrc;       /* the source we record audio from */
   GstAppSrc *           src;            /* the source we feed with images */
@@ -50,9 +75,28 @@ struct _ByzanzEncoderGStreamerClass {
 
   const char *          pipeline_string;
   const char *          audio_pipeline_string;
+  gboolean              variable_frame_rate; /* pipeline passes timestamps through instead of forcing a rate */
+  gboolean              i420;           /* pipeline takes I420 frames, only changed areas get converted */
+  const char *          demuxer;        /* demuxer for joining files or NULL if the format can't be joined */
+  const char *          muxer;          /* muxer for joining files */
+
+  /* for realtime encoders: called before the pipeline starts */
+  void                  (* realtime)    (ByzanzEncoderGStreamer *       gstreamer,
+                                         GstElement *                   videoenc);
+  /* for realtime encoders: called when the lag changed, so speed can be traded for quality */
+  void                  (* tune)        (ByzanzEncoderGStreamer *       gstreamer,
+                                         GstElement *                   videoenc,
+                                         guint                          lag);
 };
 
 GType		byzanz_encoder_gstreamer_get_type		(void) G_GNUC_CONST;
 
+gboolean	byzanz_encoder_gstreamer_can_concat		(GType		type);
+gboolean	byzanz_encoder_gstreamer_concat			(GType		type,
+								 GFile **	files,
+								 guint		n_files,
+								 GOutputStream *stream,
+								 GError **	error);
+
 
 #endif /* __HAVE_BYZANZ_ENCODER_GSTREAMER_H__ */
@@ -0,0 +1,210 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzencoderraw.h"
+
+#include <glib/gi18n.h>
+
+#include "byzanzserialize.h"
+
+G_DEFINE_TYPE (ByzanzEncoderRaw, byzanz_encoder_raw, BYZANZ_TYPE_ENCODER)
+
+/* value of start before the first record */
+#define BYZANZ_ENCODER_RAW_NO_START G_MAXUINT64
+
+/* Writes the current image for every frame that starts before @msecs.
+ * Only the areas that changed since the last frame get converted. */
+static gboolean
+byzanz_encoder_raw_write_frames (ByzanzEncoderRaw * raw,
+                                 GOutputStream *    stream,
+                                 guint64            msecs,
+                                 GCancellable *     cancellable,
+                                 GError **          error)
+{
+  ByzanzEncoderRawClass *klass = BYZANZ_ENCODER_RAW_GET_CLASS (raw);
+
+  /* the recording starts with its first record */
+  if (raw->start == BYZANZ_ENCODER_RAW_NO_START)
+    raw->start = msecs;
+
+  while (raw->frames * 1000 < (msecs - raw->start) * BYZANZ_ENCODER_RAW_FRAME_RATE) {
+    if (raw->data == NULL) {
+      cairo_surface_flush (raw->frame);
+      if (!g_output_stream_write_all (stream, cairo_image_surface_get_data (raw->frame),
+            raw->size, NULL, cancellable, error))
+        return FALSE;
+    } else {
+      if (!cairo_region_is_empty (raw->changed)) {
+        klass->convert (raw, raw->changed);
+        cairo_region_destroy (raw->changed);
+        raw->changed = cairo_region_create ();
+      }
+      if (!g_output_stream_write_all (stream, raw->data, raw->size, NULL, cancellable, error))
+        return FALSE;
+    }
+    raw->frames++;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_raw_header (ByzanzEncoderRaw * raw,
+                           GOutputStream *    stream,
+                           guint              width,
+                           guint              height,
+                           GCancellable *     cancellable,
+                           GError **          error)
+{
+  /* the image is written as it is */
+  raw->size = (gsize) cairo_image_surface_get_stride (raw->frame) * height;
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_raw_setup (ByzanzEncoder * encoder,
+                          GOutputStream * stream,
+                          guint           width,
+                          guint           height,
+                          GCancellable *  cancellable,
+                          GError **	  error)
+{
+  ByzanzEncoderRaw *raw = BYZANZ_ENCODER_RAW (encoder);
+  ByzanzEncoderRawClass *klass = BYZANZ_ENCODER_RAW_GET_CLASS (raw);
+  cairo_rectangle_int_t all = { 0, 0, width, height };
+
+  raw->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+  raw->changed = cairo_region_create_rectangle (&all);
+
+  return klass->header (raw, stream, width, height, cancellable, error);
+}
+
+static gboolean
+byzanz_encoder_raw_process (ByzanzEncoder *        encoder,
+                            GOutputStream *        stream,
+                            guint64                msecs,
+                            cairo_surface_t *      surface,
+                            const cairo_region_t * region,
+                            GCancellable *         cancellable,
+                            GError **	           error)
+{
+  ByzanzEncoderRaw *raw = BYZANZ_ENCODER_RAW (encoder);
+
+  if (!byzanz_encoder_raw_write_frames (raw, stream, msecs, cancellable, error))
+    return FALSE;
+
+  /* after a copy on its own, the frame already changed */
+  if (surface == NULL)
+    return TRUE;
+
+  byzanz_paint_region (raw->frame, surface, region);
+  cairo_region_union (raw->changed, region);
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_raw_copy (ByzanzEncoder *        encoder,
+                         GOutputStream *        stream,
+                         guint64                msecs,
+                         const cairo_region_t * region,
+                         int                    dx,
+                         int                    dy,
+                         GCancellable *         cancellable,
+                         GError **	        error)
+{
+  ByzanzEncoderRaw *raw = BYZANZ_ENCODER_RAW (encoder);
+
+  if (!byzanz_encoder_raw_write_frames (raw, stream, msecs, cancellable, error))
+    return FALSE;
+
+  cairo_surface_flush (raw->frame);
+  byzanz_copy_region (cairo_image_surface_get_data (raw->frame),
+      cairo_image_surface_get_stride (raw->frame), sizeof (guint32),
+      region, dx, dy);
+  cairo_surface_mark_dirty (raw->frame);
+  cairo_region_union (raw->changed, region);
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_raw_close (ByzanzEncoder *  encoder,
+                          GOutputStream *  stream,
+                          guint64          msecs,
+                          GCancellable *   cancellable,
+                          GError **	   error)
+{
+  ByzanzEncoderRaw *raw = BYZANZ_ENCODER_RAW (encoder);
+
+  if (!byzanz_encoder_raw_write_frames (raw, stream, msecs, cancellable, error))
+    return FALSE;
+
+  /* even the shortest recording has a frame */
+  if (raw->frames == 0)
+    return byzanz_encoder_raw_write_frames (raw, stream,
+        raw->start + 1000 / BYZANZ_ENCODER_RAW_FRAME_RATE, cancellable, error);
+
+  return TRUE;
+}
+
+static void
+byzanz_encoder_raw_finalize (GObject *object)
+{
+  ByzanzEncoderRaw *raw = BYZANZ_ENCODER_RAW (object);
+
+  if (raw->frame)
+    cairo_surface_destroy (raw->frame);
+  if (raw->changed)
+    cairo_region_destroy (raw->changed);
+  g_free (raw->data);
+
+  G_OBJECT_CLASS (byzanz_encoder_raw_parent_class)->finalize (object);
+}
+
+static void
+byzanz_encoder_raw_class_init (ByzanzEncoderRawClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ByzanzEncoderClass *encoder_class = BYZANZ_ENCODER_CLASS (klass);
+
+  object_class->finalize = byzanz_encoder_raw_finalize;
+
+  encoder_class->setup = byzanz_encoder_raw_setup;
+  encoder_class->process = byzanz_encoder_raw_process;
+  encoder_class->copy = byzanz_encoder_raw_copy;
+  encoder_class->close = byzanz_encoder_raw_close;
+
+  klass->header = byzanz_encoder_raw_header;
+
+  encoder_class->filter = gtk_file_filter_new ();
+  g_object_ref_sink (encoder_class->filter);
+  gtk_file_filter_set_name (encoder_class->filter, _("Raw video"));
+  gtk_file_filter_add_pattern (encoder_class->filter, "*.raw");
+}
+
+static void
+byzanz_encoder_raw_init (ByzanzEncoderRaw *encoder_raw)
+{
+  encoder_raw->start = BYZANZ_ENCODER_RAW_NO_START;
+}
+
@@ -0,0 +1,65 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "byzanzencoder.h"
+
+#ifndef __HAVE_BYZANZ_ENCODER_RAW_H__
+#define __HAVE_BYZANZ_ENCODER_RAW_H__
+
+typedef struct _ByzanzEncoderRaw ByzanzEncoderRaw;
+typedef struct _ByzanzEncoderRawClass ByzanzEncoderRawClass;
+
+#define BYZANZ_TYPE_ENCODER_RAW                    (byzanz_encoder_raw_get_type())
+#define BYZANZ_IS_ENCODER_RAW(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_ENCODER_RAW))
+#define BYZANZ_IS_ENCODER_RAW_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_ENCODER_RAW))
+#define BYZANZ_ENCODER_RAW(obj)                    (G_TYPE_CHECK_INSTANCE_CAST ((obj), BYZANZ_TYPE_ENCODER_RAW, ByzanzEncoderRaw))
+#define BYZANZ_ENCODER_RAW_CLASS(klass)            (G_TYPE_CHECK_CLASS_CAST ((klass), BYZANZ_TYPE_ENCODER_RAW, ByzanzEncoderRawClass))
+#define BYZANZ_ENCODER_RAW_GET_CLASS(obj)          (G_TYPE_INSTANCE_GET_CLASS ((obj), BYZANZ_TYPE_ENCODER_RAW, ByzanzEncoderRawClass))
+
+/* frames per second written, images are repeated to fill the time between them */
+#define BYZANZ_ENCODER_RAW_FRAME_RATE 25
+
+struct _ByzanzEncoderRaw {
+  ByzanzEncoder         encoder;
+
+  cairo_surface_t *     frame;          /* the current image */
+  cairo_region_t *      changed;        /* area of frame that changed since the last frame was written */
+  guchar *              data;           /* NULL or the frame as written, if it differs from the image */
+  gsize                 size;           /* size of data */
+  guint64               start;          /* timestamp of the first record */
+  guint64               frames;         /* number of frames written */
+};
+
+struct _ByzanzEncoderRawClass {
+  ByzanzEncoderClass    encoder_class;
+
+  /* writes the stream header, allocates data and sets the size */
+  gboolean              (* header)      (ByzanzEncoderRaw *     raw,
+                                         GOutputStream *        stream,
+                                         guint                  width,
+                                         guint                  height,
+                                         GCancellable *         cancellable,
+                                         GError **              error);
+  /* updates data from the changed region of frame */
+  void                  (* convert)     (ByzanzEncoderRaw *     raw,
+                                         const cairo_region_t * region);
+};
+
+GType		byzanz_encoder_raw_get_type		(void) G_GNUC_CONST;
+
+
+#endif /* __HAVE_BYZANZ_ENCODER_RAW_H__ */
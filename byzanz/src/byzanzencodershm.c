@@ -0,0 +1,504 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* for memfd_create() and file sealing */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzencodershm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+#include <gio/gunixfdlist.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "byzanzserialize.h"
+
+#define BYZANZ_ENCODER_SHM_ALIGN(x, n) (((x) + (n) - 1) / (n) * (n))
+
+enum {
+  PROP_0,
+  PROP_PATH
+};
+
+G_DEFINE_TYPE (ByzanzEncoderShm, byzanz_encoder_shm, BYZANZ_TYPE_ENCODER)
+
+static void
+byzanz_encoder_shm_set_error_from_errno (GError **  error,
+                                         const char *message)
+{
+  int errsv = errno;
+
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+      "%s: %s", message, g_strerror (errsv));
+}
+
+static int
+byzanz_encoder_shm_create_memfd (gsize     size,
+                                 GError ** error)
+{
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create ("byzanz-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    byzanz_encoder_shm_set_error_from_errno (error, _("Could not create shared memory"));
+    return -1;
+  }
+#else
+  char *name;
+
+  fd = g_file_open_tmp ("byzanz-frames-XXXXXX", &name, error);
+  if (fd < 0)
+    return -1;
+  g_unlink (name);
+  g_free (name);
+#endif
+
+  if (ftruncate (fd, size) < 0) {
+    byzanz_encoder_shm_set_error_from_errno (error, _("Could not create shared memory"));
+    close (fd);
+    return -1;
+  }
+#ifdef HAVE_MEMFD_CREATE
+  /* clients can rely on the ring staying as large as it is */
+  fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+  return fd;
+}
+
+static ByzanzShmSlot *
+byzanz_encoder_shm_get_slot (ByzanzEncoderShm *shm,
+                             guint             i)
+{
+  return (ByzanzShmSlot *) (shm->map + shm->header->slot_offset + i * shm->header->slot_size);
+}
+
+static void
+byzanz_encoder_shm_remove_client (ByzanzEncoderShm *shm,
+                                  guint             i)
+{
+  ByzanzEncoderShmClient *client = &g_array_index (shm->clients, ByzanzEncoderShmClient, i);
+
+  g_socket_close (client->socket, NULL);
+  g_object_unref (client->socket);
+  close (client->eventfd);
+  g_array_remove_index_fast (shm->clients, i);
+}
+
+/* Hands a new client the ring and its eventfd */
+static gboolean
+byzanz_encoder_shm_send_ring (ByzanzEncoderShm *       shm,
+                              ByzanzEncoderShmClient * client)
+{
+  GSocketControlMessage *message;
+  GOutputVector vector;
+  GUnixFDList *list;
+  guint8 version = BYZANZ_SHM_VERSION;
+  gssize sent;
+
+  client->eventfd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (client->eventfd < 0)
+    return FALSE;
+
+  list = g_unix_fd_list_new ();
+  g_unix_fd_list_append (list, shm->memfd, NULL);
+  g_unix_fd_list_append (list, client->eventfd, NULL);
+  message = g_unix_fd_message_new_with_fd_list (list);
+  g_object_unref (list);
+  vector.buffer = &version;
+  vector.size = 1;
+  g_socket_set_blocking (client->socket, TRUE);
+  sent = g_socket_send_message (client->socket, NULL, &vector, 1, &message, 1, 0, NULL, NULL);
+  g_object_unref (message);
+  if (sent != 1) {
+    close (client->eventfd);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Accepts clients in a thread of its own, so they get the ring right away
+ * and don't have to wait until something changes on screen. Clients that
+ * fail are just dropped. */
+static gpointer
+byzanz_encoder_shm_accept (gpointer data)
+{
+  ByzanzEncoderShm *shm = data;
+  ByzanzEncoderShmClient client;
+
+  for (;;) {
+    /* fails when cancelled by byzanz_encoder_shm_stop_accepting() */
+    client.socket = g_socket_accept (shm->listener, shm->accept_cancellable, NULL);
+    if (client.socket == NULL)
+      return NULL;
+
+    if (!byzanz_encoder_shm_send_ring (shm, &client)) {
+      g_object_unref (client.socket);
+      continue;
+    }
+
+    g_mutex_lock (&shm->lock);
+    g_array_append_val (shm->clients, client);
+    g_mutex_unlock (&shm->lock);
+  }
+}
+
+static void
+byzanz_encoder_shm_stop_accepting (ByzanzEncoderShm *shm)
+{
+  if (shm->accept_thread == NULL)
+    return;
+
+  g_cancellable_cancel (shm->accept_cancellable);
+  g_thread_join (shm->accept_thread);
+  shm->accept_thread = NULL;
+}
+
+/* Makes the current image the next frame in the ring, copying only what
+ * changed since the ring's slot was last used, and wakes up the clients */
+static void
+byzanz_encoder_shm_publish (ByzanzEncoderShm *shm,
+                            guint64           msecs)
+{
+  ByzanzEncoderShmClient *client;
+  cairo_rectangle_int_t rect;
+  ByzanzShmSlot *slot;
+  guchar *data, *src;
+  gsize stride;
+  guint i, index;
+  int j, y, n_rects;
+
+  index = shm->frames % BYZANZ_SHM_SLOTS;
+  slot = byzanz_encoder_shm_get_slot (shm, index);
+  for (i = 0; i < BYZANZ_SHM_SLOTS; i++)
+    cairo_region_union (shm->stale[i], shm->changed);
+
+  g_atomic_int_inc (&slot->sequence);
+
+  cairo_surface_flush (shm->frame);
+  src = cairo_image_surface_get_data (shm->frame);
+  stride = shm->header->stride;
+  data = (guchar *) slot + shm->header->data_offset;
+  n_rects = cairo_region_num_rectangles (shm->stale[index]);
+  for (j = 0; j < n_rects; j++) {
+    cairo_region_get_rectangle (shm->stale[index], j, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+      memcpy (data + y * stride + rect.x * sizeof (guint32),
+          src + y * stride + rect.x * sizeof (guint32),
+          rect.width * sizeof (guint32));
+    }
+  }
+  cairo_region_destroy (shm->stale[index]);
+  shm->stale[index] = cairo_region_create ();
+
+  n_rects = cairo_region_num_rectangles (shm->changed);
+  if (n_rects > BYZANZ_SHM_MAX_RECTS) {
+    cairo_region_get_extents (shm->changed, &rect);
+    slot->rects[0].x = rect.x;
+    slot->rects[0].y = rect.y;
+    slot->rects[0].width = rect.width;
+    slot->rects[0].height = rect.height;
+    slot->n_rects = 1;
+  } else {
+    for (j = 0; j < n_rects; j++) {
+      cairo_region_get_rectangle (shm->changed, j, &rect);
+      slot->rects[j].x = rect.x;
+      slot->rects[j].y = rect.y;
+      slot->rects[j].width = rect.width;
+      slot->rects[j].height = rect.height;
+    }
+    slot->n_rects = n_rects;
+  }
+  slot->number = shm->frames;
+  slot->msecs = msecs;
+
+  g_atomic_int_inc (&slot->sequence);
+  g_atomic_int_set (&shm->header->latest, index);
+  shm->frames++;
+  cairo_region_destroy (shm->changed);
+  shm->changed = cairo_region_create ();
+
+  g_mutex_lock (&shm->lock);
+  for (i = 0; i < shm->clients->len; i++) {
+    client = &g_array_index (shm->clients, ByzanzEncoderShmClient, i);
+    if (g_socket_condition_check (client->socket, G_IO_HUP | G_IO_ERR)) {
+      byzanz_encoder_shm_remove_client (shm, i);
+      i--;
+      continue;
+    }
+    /* if the client doesn't keep up, the counter just grows */
+    eventfd_write (client->eventfd, 1);
+  }
+  g_mutex_unlock (&shm->lock);
+}
+
+static gboolean
+byzanz_encoder_shm_listen (ByzanzEncoderShm *shm,
+                           GError **         error)
+{
+  GSocketAddress *address;
+  struct stat st;
+  gboolean result;
+
+  /* remove the socket a previous recording left behind */
+  if (g_lstat (shm->path, &st) == 0 && S_ISSOCK (st.st_mode))
+    g_unlink (shm->path);
+
+  shm->listener = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_DEFAULT, error);
+  if (shm->listener == NULL)
+    return FALSE;
+
+  address = g_unix_socket_address_new (shm->path);
+  result = g_socket_bind (shm->listener, address, FALSE, error) &&
+    g_socket_listen (shm->listener, error);
+  g_object_unref (address);
+  if (!result)
+    return FALSE;
+
+  shm->accept_thread = g_thread_try_new ("byzanz shm", byzanz_encoder_shm_accept, shm, error);
+  return shm->accept_thread != NULL;
+}
+
+static gboolean
+byzanz_encoder_shm_setup (ByzanzEncoder * encoder,
+                          GOutputStream * stream,
+                          guint           width,
+                          guint           height,
+                          GCancellable *  cancellable,
+                          GError **	  error)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (encoder);
+  cairo_rectangle_int_t all = { 0, 0, width, height };
+  ByzanzShmHeader *header;
+  guint i, stride, slot_size, data_offset, slot_offset;
+
+  if (shm->path == NULL) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        _("No socket given to publish frames on"));
+    return FALSE;
+  }
+
+  shm->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+  shm->changed = cairo_region_create_rectangle (&all);
+  for (i = 0; i < BYZANZ_SHM_SLOTS; i++)
+    shm->stale[i] = cairo_region_create ();
+
+  /* keep the pixels cache line aligned */
+  stride = cairo_image_surface_get_stride (shm->frame);
+  slot_offset = BYZANZ_ENCODER_SHM_ALIGN (sizeof (ByzanzShmHeader), 64);
+  data_offset = BYZANZ_ENCODER_SHM_ALIGN (sizeof (ByzanzShmSlot), 64);
+  slot_size = BYZANZ_ENCODER_SHM_ALIGN (data_offset + stride * height, 4096);
+  shm->size = slot_offset + BYZANZ_SHM_SLOTS * slot_size;
+
+  shm->memfd = byzanz_encoder_shm_create_memfd (shm->size, error);
+  if (shm->memfd < 0)
+    return FALSE;
+  shm->map = mmap (NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+  if (shm->map == MAP_FAILED) {
+    shm->map = NULL;
+    byzanz_encoder_shm_set_error_from_errno (error, _("Could not map shared memory"));
+    return FALSE;
+  }
+
+  header = shm->header = (ByzanzShmHeader *) shm->map;
+  header->magic = BYZANZ_SHM_MAGIC;
+  header->version = BYZANZ_SHM_VERSION;
+  header->width = width;
+  header->height = height;
+  header->stride = stride;
+  header->n_slots = BYZANZ_SHM_SLOTS;
+  header->slot_offset = slot_offset;
+  header->slot_size = slot_size;
+  header->data_offset = data_offset;
+  g_atomic_int_set (&header->latest, -1);
+
+  return byzanz_encoder_shm_listen (shm, error);
+}
+
+static gboolean
+byzanz_encoder_shm_process (ByzanzEncoder *        encoder,
+                            GOutputStream *        stream,
+                            guint64                msecs,
+                            cairo_surface_t *      surface,
+                            const cairo_region_t * region,
+                            GCancellable *         cancellable,
+                            GError **	           error)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (encoder);
+
+  /* without a surface, only copies changed the frame */
+  if (surface) {
+    byzanz_paint_region (shm->frame, surface, region);
+    cairo_region_union (shm->changed, region);
+  }
+  byzanz_encoder_shm_publish (shm, msecs);
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_shm_copy (ByzanzEncoder *        encoder,
+                         GOutputStream *        stream,
+                         guint64                msecs,
+                         const cairo_region_t * region,
+                         int                    dx,
+                         int                    dy,
+                         GCancellable *         cancellable,
+                         GError **	        error)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (encoder);
+
+  /* process () publishes this */
+  cairo_surface_flush (shm->frame);
+  byzanz_copy_region (cairo_image_surface_get_data (shm->frame),
+      cairo_image_surface_get_stride (shm->frame), sizeof (guint32),
+      region, dx, dy);
+  cairo_surface_mark_dirty (shm->frame);
+  cairo_region_union (shm->changed, region);
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_shm_close (ByzanzEncoder *  encoder,
+                          GOutputStream *  stream,
+                          guint64          msecs,
+                          GCancellable *   cancellable,
+                          GError **	   error)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (encoder);
+
+  byzanz_encoder_shm_stop_accepting (shm);
+  /* clients notice the end when their connection is closed */
+  while (shm->clients->len > 0)
+    byzanz_encoder_shm_remove_client (shm, 0);
+  g_socket_close (shm->listener, NULL);
+  g_unlink (shm->path);
+
+  return TRUE;
+}
+
+static void
+byzanz_encoder_shm_finalize (GObject *object)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (object);
+  guint i;
+
+  byzanz_encoder_shm_stop_accepting (shm);
+  g_object_unref (shm->accept_cancellable);
+  while (shm->clients->len > 0)
+    byzanz_encoder_shm_remove_client (shm, 0);
+  g_array_free (shm->clients, TRUE);
+  g_mutex_clear (&shm->lock);
+  if (shm->listener)
+    g_object_unref (shm->listener);
+
+  if (shm->map)
+    munmap (shm->map, shm->size);
+  if (shm->memfd >= 0)
+    close (shm->memfd);
+
+  if (shm->frame)
+    cairo_surface_destroy (shm->frame);
+  if (shm->changed)
+    cairo_region_destroy (shm->changed);
+  for (i = 0; i < BYZANZ_SHM_SLOTS; i++) {
+    if (shm->stale[i])
+      cairo_region_destroy (shm->stale[i]);
+  }
+  g_free (shm->path);
+
+  G_OBJECT_CLASS (byzanz_encoder_shm_parent_class)->finalize (object);
+}
+
+static void
+byzanz_encoder_shm_get_property (GObject *object, guint param_id, GValue *value, 
+    GParamSpec * pspec)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (object);
+
+  switch (param_id) {
+    case PROP_PATH:
+      g_value_set_string (value, shm->path);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+      break;
+  }
+}
+
+static void
+byzanz_encoder_shm_set_property (GObject *object, guint param_id, const GValue *value, 
+    GParamSpec * pspec)
+{
+  ByzanzEncoderShm *shm = BYZANZ_ENCODER_SHM (object);
+
+  switch (param_id) {
+    case PROP_PATH:
+      shm->path = g_value_dup_string (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+      break;
+  }
+}
+
+static void
+byzanz_encoder_shm_class_init (ByzanzEncoderShmClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ByzanzEncoderClass *encoder_class = BYZANZ_ENCODER_CLASS (klass);
+
+  object_class->get_property = byzanz_encoder_shm_get_property;
+  object_class->set_property = byzanz_encoder_shm_set_property;
+  object_class->finalize = byzanz_encoder_shm_finalize;
+
+  /* no filter, frames are never written to files */
+  encoder_class->setup = byzanz_encoder_shm_setup;
+  encoder_class->process = byzanz_encoder_shm_process;
+  encoder_class->copy = byzanz_encoder_shm_copy;
+  encoder_class->close = byzanz_encoder_shm_close;
+
+  g_object_class_install_property (object_class, PROP_PATH,
+      g_param_spec_string ("path", "path", "path of the socket clients connect to",
+	  NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+}
+
+static void
+byzanz_encoder_shm_init (ByzanzEncoderShm *shm)
+{
+  shm->clients = g_array_new (FALSE, FALSE, sizeof (ByzanzEncoderShmClient));
+  g_mutex_init (&shm->lock);
+  shm->accept_cancellable = g_cancellable_new ();
+  shm->memfd = -1;
+}
+
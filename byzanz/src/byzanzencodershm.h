@@ -0,0 +1,68 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "byzanzencoder.h"
+#include "byzanzshm.h"
+
+#ifndef __HAVE_BYZANZ_ENCODER_SHM_H__
+#define __HAVE_BYZANZ_ENCODER_SHM_H__
+
+typedef struct _ByzanzEncoderShm ByzanzEncoderShm;
+typedef struct _ByzanzEncoderShmClass ByzanzEncoderShmClass;
+
+#define BYZANZ_TYPE_ENCODER_SHM                    (byzanz_encoder_shm_get_type())
+#define BYZANZ_IS_ENCODER_SHM(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_ENCODER_SHM))
+#define BYZANZ_IS_ENCODER_SHM_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_ENCODER_SHM))
+#define BYZANZ_ENCODER_SHM(obj)                    (G_TYPE_CHECK_INSTANCE_CAST ((obj), BYZANZ_TYPE_ENCODER_SHM, ByzanzEncoderShm))
+#define BYZANZ_ENCODER_SHM_CLASS(klass)            (G_TYPE_CHECK_CLASS_CAST ((klass), BYZANZ_TYPE_ENCODER_SHM, ByzanzEncoderShmClass))
+#define BYZANZ_ENCODER_SHM_GET_CLASS(obj)          (G_TYPE_INSTANCE_GET_CLASS ((obj), BYZANZ_TYPE_ENCODER_SHM, ByzanzEncoderShmClass))
+
+typedef struct _ByzanzEncoderShmClient ByzanzEncoderShmClient;
+struct _ByzanzEncoderShmClient {
+  GSocket *             socket;         /* connection to the client */
+  int                   eventfd;        /* signaled after every frame */
+};
+
+struct _ByzanzEncoderShm {
+  ByzanzEncoder         encoder;
+
+  char *                path;           /* path of the socket to listen on */
+  GSocket *             listener;       /* socket accepting clients */
+  GThread *             accept_thread;  /* thread accepting clients or NULL */
+  GCancellable *        accept_cancellable; /* stops accept_thread */
+  GMutex                lock;           /* lock protecting clients */
+  GArray *              clients;        /* ByzanzEncoderShmClient */
+
+  int                   memfd;          /* file descriptor of the ring or -1 */
+  guchar *              map;            /* the ring */
+  gsize                 size;           /* size of map */
+  ByzanzShmHeader *     header;         /* header at the start of map */
+
+  cairo_surface_t *     frame;          /* the current image */
+  cairo_region_t *      changed;        /* area of frame that changed since the last frame was published */
+  cairo_region_t *      stale[BYZANZ_SHM_SLOTS]; /* area where the slots differ from frame */
+  guint64               frames;         /* number of frames published */
+};
+
+struct _ByzanzEncoderShmClass {
+  ByzanzEncoderClass    encoder_class;
+};
+
+GType		byzanz_encoder_shm_get_type		(void) G_GNUC_CONST;
+
+
+#endif /* __HAVE_BYZANZ_ENCODER_SHM_H__ */
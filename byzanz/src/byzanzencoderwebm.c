@@ -25,6 +25,37 @@
 
 G_DEFINE_TYPE (ByzanzEncoderWebm, byzanz_encoder_webm, BYZANZ_TYPE_ENCODER_GSTREAMER)
 
+/* vp8enc's deadline for realtime encoding, in microseconds */
+#define BYZANZ_ENCODER_WEBM_DEADLINE_REALTIME 1
+
+static void
+byzanz_encoder_webm_realtime (ByzanzEncoderGStreamer *gstreamer,
+                              GstElement *            videoenc)
+{
+  guint threads, partitions;
+
+  /* token partitions let every thread work on its own part of the frame,
+   * there can be 1, 2, 4 or 8 of them */
+  threads = g_get_num_processors ();
+  partitions = 0;
+  while (partitions < 3 && (2u << partitions) <= threads)
+    partitions++;
+
+  g_object_set (videoenc, "deadline", (gint64) BYZANZ_ENCODER_WEBM_DEADLINE_REALTIME,
+      "threads", (int) threads, "token-partitions", partitions,
+      "lag-in-frames", 0, "cpu-used", 4, NULL);
+}
+
+static void
+byzanz_encoder_webm_tune (ByzanzEncoderGStreamer *gstreamer,
+                          GstElement *            videoenc,
+                          guint                   lag)
+{
+  /* give up quality for speed the further we fall behind */
+  g_object_set (videoenc, "cpu-used",
+      (int) MIN (4 + 4 * (lag / BYZANZ_ENCODER_GSTREAMER_LAG_STEP), 16), NULL);
+}
+
 static void
 byzanz_encoder_webm_class_init (ByzanzEncoderWebmClass *klass)
 {
@@ -37,13 +68,18 @@ byzanz_encoder_webm_class_init (ByzanzEncoderWebmClass *klass)
   gtk_file_filter_add_mime_type (encoder_class->filter, "video/webm");
   gtk_file_filter_add_pattern (encoder_class->filter, "*.webm");
 
+  /* WebM stores a timestamp per frame, so only changes need to be encoded */
   gstreamer_class->pipeline_string = 
-    "appsrc name=src ! videoconvert ! videorate ! "
-    "video/x-raw,format=I420,framerate=25/1 ! vp8enc ! webmmux ! giostreamsink name=sink";
+    "appsrc name=src ! vp8enc name=videoenc ! webmmux ! giostreamsink name=sink";
   gstreamer_class->audio_pipeline_string = 
     "autoaudiosrc name=audiosrc ! audioconvert ! vorbisenc ! queue ! webmmux name=muxer ! giostreamsink name=sink "
-    "appsrc name=src ! videoconvert ! videorate ! "
-    "video/x-raw,format=I420,framerate=25/1 ! vp8enc ! queue ! muxer.";
+    "appsrc name=src ! vp8enc name=videoenc ! queue ! muxer.";
+  gstreamer_class->variable_frame_rate = TRUE;
+  gstreamer_class->i420 = TRUE;
+  gstreamer_class->demuxer = "matroskademux";
+  gstreamer_class->muxer = "webmmux";
+  gstreamer_class->realtime = byzanz_encoder_webm_realtime;
+  gstreamer_class->tune = byzanz_encoder_webm_tune;
 }
 
 static void
@@ -0,0 +1,99 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzencodery4m.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+#include "byzanzscale.h"
+#include "byzanzserialize.h"
+
+#define BYZANZ_ENCODER_Y4M_FRAME "FRAME\n"
+
+G_DEFINE_TYPE (ByzanzEncoderY4m, byzanz_encoder_y4m, BYZANZ_TYPE_ENCODER_RAW)
+
+static gboolean
+byzanz_encoder_y4m_header (ByzanzEncoderRaw * raw,
+                           GOutputStream *    stream,
+                           guint              width,
+                           guint              height,
+                           GCancellable *     cancellable,
+                           GError **          error)
+{
+  ByzanzEncoderY4m *y4m = BYZANZ_ENCODER_Y4M (raw);
+  gsize frame_length;
+  char *header;
+  gboolean result;
+
+  /* C420jpeg is 4:2:0 with the chroma samples centered between the pixels,
+   * as byzanz_convert_region_i420() averages them */
+  header = g_strdup_printf ("YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n",
+      width, height, BYZANZ_ENCODER_RAW_FRAME_RATE);
+  result = g_output_stream_write_all (stream, header, strlen (header), NULL, cancellable, error);
+  g_free (header);
+  if (!result)
+    return FALSE;
+
+  /* every frame is written in one go, including its header */
+  frame_length = strlen (BYZANZ_ENCODER_Y4M_FRAME);
+  y4m->strides[0] = width;
+  y4m->strides[1] = y4m->strides[2] = (width + 1) / 2;
+  raw->size = frame_length + y4m->strides[0] * height + 2 * y4m->strides[1] * ((height + 1) / 2);
+  raw->data = g_malloc (raw->size);
+  memcpy (raw->data, BYZANZ_ENCODER_Y4M_FRAME, frame_length);
+  y4m->planes[0] = raw->data + frame_length;
+  y4m->planes[1] = y4m->planes[0] + y4m->strides[0] * height;
+  y4m->planes[2] = y4m->planes[1] + y4m->strides[1] * ((height + 1) / 2);
+
+  return TRUE;
+}
+
+static void
+byzanz_encoder_y4m_convert (ByzanzEncoderRaw *     raw,
+                            const cairo_region_t * region)
+{
+  ByzanzEncoderY4m *y4m = BYZANZ_ENCODER_Y4M (raw);
+
+  byzanz_convert_region_i420 (y4m->planes, y4m->strides, raw->frame, region);
+}
+
+static void
+byzanz_encoder_y4m_class_init (ByzanzEncoderY4mClass *klass)
+{
+  ByzanzEncoderClass *encoder_class = BYZANZ_ENCODER_CLASS (klass);
+  ByzanzEncoderRawClass *raw_class = BYZANZ_ENCODER_RAW_CLASS (klass);
+
+  raw_class->header = byzanz_encoder_y4m_header;
+  raw_class->convert = byzanz_encoder_y4m_convert;
+
+  encoder_class->filter = gtk_file_filter_new ();
+  g_object_ref_sink (encoder_class->filter);
+  gtk_file_filter_set_name (encoder_class->filter, _("YUV4MPEG2 video"));
+  gtk_file_filter_add_mime_type (encoder_class->filter, "video/x-yuv4mpeg");
+  gtk_file_filter_add_pattern (encoder_class->filter, "*.y4m");
+}
+
+static void
+byzanz_encoder_y4m_init (ByzanzEncoderY4m *encoder_y4m)
+{
+}
+
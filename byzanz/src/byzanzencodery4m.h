@@ -0,0 +1,47 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "byzanzencoderraw.h"
+
+#ifndef __HAVE_BYZANZ_ENCODER_Y4M_H__
+#define __HAVE_BYZANZ_ENCODER_Y4M_H__
+
+typedef struct _ByzanzEncoderY4m ByzanzEncoderY4m;
+typedef struct _ByzanzEncoderY4mClass ByzanzEncoderY4mClass;
+
+#define BYZANZ_TYPE_ENCODER_Y4M                    (byzanz_encoder_y4m_get_type())
+#define BYZANZ_IS_ENCODER_Y4M(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_ENCODER_Y4M))
+#define BYZANZ_IS_ENCODER_Y4M_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_ENCODER_Y4M))
+#define BYZANZ_ENCODER_Y4M(obj)                    (G_TYPE_CHECK_INSTANCE_CAST ((obj), BYZANZ_TYPE_ENCODER_Y4M, ByzanzEncoderY4m))
+#define BYZANZ_ENCODER_Y4M_CLASS(klass)            (G_TYPE_CHECK_CLASS_CAST ((klass), BYZANZ_TYPE_ENCODER_Y4M, ByzanzEncoderY4mClass))
+#define BYZANZ_ENCODER_Y4M_GET_CLASS(obj)          (G_TYPE_INSTANCE_GET_CLASS ((obj), BYZANZ_TYPE_ENCODER_Y4M, ByzanzEncoderY4mClass))
+
+struct _ByzanzEncoderY4m {
+  ByzanzEncoderRaw      encoder;
+
+  guchar *              planes[3];      /* Y, U and V planes inside the frame data */
+  gsize                 strides[3];     /* strides of the planes */
+};
+
+struct _ByzanzEncoderY4mClass {
+  ByzanzEncoderRawClass encoder_class;
+};
+
+GType		byzanz_encoder_y4m_get_type		(void) G_GNUC_CONST;
+
+
+#endif /* __HAVE_BYZANZ_ENCODER_Y4M_H__ */
@@ -0,0 +1,140 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzhash.h"
+
+#include <string.h>
+
+/* This is the xxHash64 algorithm. It is not cryptographically secure, but it
+ * runs 4 independent lanes over 32 byte stripes, which is what makes it fast
+ * enough to checksum every captured pixel. */
+
+#define PRIME1 G_GUINT64_CONSTANT (11400714785074694791)
+#define PRIME2 G_GUINT64_CONSTANT (14029467366897019727)
+#define PRIME3 G_GUINT64_CONSTANT (1609587929392839161)
+#define PRIME4 G_GUINT64_CONSTANT (9650029242287828579)
+#define PRIME5 G_GUINT64_CONSTANT (2870177450012600261)
+
+#define ROTATE(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline guint64
+read64 (const guchar *data)
+{
+  guint64 result;
+
+  /* the data is only guaranteed to be 4-byte aligned */
+  memcpy (&result, data, sizeof (guint64));
+  return result;
+}
+
+static inline guint32
+read32 (const guchar *data)
+{
+  guint32 result;
+
+  memcpy (&result, data, sizeof (guint32));
+  return result;
+}
+
+static inline guint64
+round64 (guint64 acc, guint64 input)
+{
+  acc += input * PRIME2;
+  acc = ROTATE (acc, 31);
+  return acc * PRIME1;
+}
+
+static inline guint64
+merge64 (guint64 acc, guint64 val)
+{
+  acc ^= round64 (0, val);
+  return acc * PRIME1 + PRIME4;
+}
+
+/**
+ * byzanz_hash:
+ * @data: the data to hash
+ * @len: number of bytes in @data
+ * @seed: seed value. Can be used to chain multiple calls together by
+ *        passing the result of the previous call.
+ *
+ * Computes a fast 64bit checksum of the given data.
+ *
+ * Returns: the checksum
+ **/
+guint64
+byzanz_hash (const guchar *data,
+             gsize         len,
+             guint64       seed)
+{
+  const guchar *end = data + len;
+  guint64 result;
+
+  if (len >= 32) {
+    const guchar *limit = end - 32;
+    guint64 v1 = seed + PRIME1 + PRIME2;
+    guint64 v2 = seed + PRIME2;
+    guint64 v3 = seed;
+    guint64 v4 = seed - PRIME1;
+
+    do {
+      v1 = round64 (v1, read64 (data));
+      v2 = round64 (v2, read64 (data + 8));
+      v3 = round64 (v3, read64 (data + 16));
+      v4 = round64 (v4, read64 (data + 24));
+      data += 32;
+    } while (data <= limit);
+
+    result = ROTATE (v1, 1) + ROTATE (v2, 7) + ROTATE (v3, 12) + ROTATE (v4, 18);
+    result = merge64 (result, v1);
+    result = merge64 (result, v2);
+    result = merge64 (result, v3);
+    result = merge64 (result, v4);
+  } else {
+    result = seed + PRIME5;
+  }
+
+  result += len;
+
+  while (data + 8 <= end) {
+    result ^= round64 (0, read64 (data));
+    result = ROTATE (result, 27) * PRIME1 + PRIME4;
+    data += 8;
+  }
+  if (data + 4 <= end) {
+    result ^= (guint64) read32 (data) * PRIME1;
+    result = ROTATE (result, 23) * PRIME2 + PRIME3;
+    data += 4;
+  }
+  while (data < end) {
+    result ^= *data * PRIME5;
+    result = ROTATE (result, 11) * PRIME1;
+    data++;
+  }
+
+  result ^= result >> 33;
+  result *= PRIME2;
+  result ^= result >> 29;
+  result *= PRIME3;
+  result ^= result >> 32;
+
+  return result;
+}
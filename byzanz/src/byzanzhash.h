@@ -0,0 +1,29 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#ifndef __HAVE_BYZANZ_HASH_H__
+#define __HAVE_BYZANZ_HASH_H__
+
+
+guint64                 byzanz_hash                     (const guchar *         data,
+                                                         gsize                  len,
+                                                         guint64                seed);
+
+
+#endif /* __HAVE_BYZANZ_HASH_H__ */
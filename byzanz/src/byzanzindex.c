@@ -0,0 +1,662 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzindex.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+#include "byzanzserialize.h"
+
+/* The index follows the end of stream record of recordings with the
+ * BYZANZ_SERIALIZE_INDEX header flag. It consists of all the
+ * ByzanzIndexEntry and ByzanzIndexCursor structs and a trailer with the
+ * offset of the index, the duration, the number of entries and cursors
+ * and INDEX_MAGIC. Like the records, all numbers are in the byte order
+ * the header declares. */
+#define INDEX_MAGIC "BYZINDEX"
+#define INDEX_TRAILER_SIZE (2 * sizeof (guint64) + 2 * sizeof (guint32) + 8)
+
+ByzanzIndex *
+byzanz_index_new (guint width,
+                  guint height)
+{
+  ByzanzIndex *index;
+
+  index = g_slice_new0 (ByzanzIndex);
+  index->width = width;
+  index->height = height;
+  /* what byzanz_serialize_header() declares */
+  index->byte_order = G_BYTE_ORDER;
+  index->entries = g_array_new (FALSE, FALSE, sizeof (ByzanzIndexEntry));
+  index->cursors = g_array_new (FALSE, FALSE, sizeof (ByzanzIndexCursor));
+  index->cursor_images = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) cairo_surface_destroy);
+
+  return index;
+}
+
+void
+byzanz_index_free (ByzanzIndex *index)
+{
+  g_return_if_fail (index != NULL);
+
+  g_array_free (index->entries, TRUE);
+  g_array_free (index->cursors, TRUE);
+  g_hash_table_destroy (index->cursor_images);
+
+  g_slice_free (ByzanzIndex, index);
+}
+
+void
+byzanz_index_add_image (ByzanzIndex *    index,
+                        guint64          msecs,
+                        guint64          offset,
+                        ByzanzIndexFlags flags,
+                        guint            cursor,
+                        int              x,
+                        int              y)
+{
+  ByzanzIndexEntry entry;
+
+  g_return_if_fail (index != NULL);
+
+  entry.msecs = msecs;
+  entry.offset = offset;
+  entry.flags = flags;
+  entry.cursor = cursor;
+  entry.x = x;
+  entry.y = y;
+  g_array_append_val (index->entries, entry);
+}
+
+void
+byzanz_index_add_cursor_image (ByzanzIndex *index,
+                               guint        cursor,
+                               guint64      offset)
+{
+  ByzanzIndexCursor entry;
+
+  g_return_if_fail (index != NULL);
+  g_return_if_fail (cursor != 0);
+
+  entry.cursor = cursor;
+  entry.padding = 0;
+  entry.offset = offset;
+  g_array_append_val (index->cursors, entry);
+}
+
+void
+byzanz_index_set_end (ByzanzIndex *index,
+                      guint64      msecs,
+                      guint64      offset)
+{
+  g_return_if_fail (index != NULL);
+
+  index->duration = msecs;
+  index->end = offset;
+}
+
+/* converts the entries between the byte order of the recording and ours */
+static void
+byzanz_index_swap_entries (ByzanzIndex *index)
+{
+  ByzanzIndexEntry *entry;
+  ByzanzIndexCursor *cursor;
+  guint i;
+
+  if (index->byte_order == G_BYTE_ORDER)
+    return;
+
+  for (i = 0; i < index->entries->len; i++) {
+    entry = &g_array_index (index->entries, ByzanzIndexEntry, i);
+    entry->msecs = GUINT64_SWAP_LE_BE (entry->msecs);
+    entry->offset = GUINT64_SWAP_LE_BE (entry->offset);
+    entry->flags = GUINT32_SWAP_LE_BE (entry->flags);
+    entry->cursor = GUINT32_SWAP_LE_BE (entry->cursor);
+    entry->x = (gint32) GUINT32_SWAP_LE_BE ((guint32) entry->x);
+    entry->y = (gint32) GUINT32_SWAP_LE_BE ((guint32) entry->y);
+  }
+  for (i = 0; i < index->cursors->len; i++) {
+    cursor = &g_array_index (index->cursors, ByzanzIndexCursor, i);
+    cursor->cursor = GUINT32_SWAP_LE_BE (cursor->cursor);
+    cursor->offset = GUINT64_SWAP_LE_BE (cursor->offset);
+  }
+}
+
+/* converts the trailer between the byte order of the recording and ours */
+static void
+byzanz_index_swap_trailer (ByzanzIndex *index,
+                           guint64      offsets[2],
+                           guint32      counts[2])
+{
+  guint i;
+
+  if (index->byte_order == G_BYTE_ORDER)
+    return;
+
+  for (i = 0; i < 2; i++) {
+    offsets[i] = GUINT64_SWAP_LE_BE (offsets[i]);
+    counts[i] = GUINT32_SWAP_LE_BE (counts[i]);
+  }
+}
+
+/**
+ * byzanz_index_write:
+ * @index: the index
+ * @stream: stream to write to, positioned after the end of stream record
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Appends @index to a recording. byzanz_index_set_end() must have been
+ * called before and the header of the recording must have the
+ * BYZANZ_SERIALIZE_INDEX flag, see byzanz_serialize_add_flags().
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_index_write (ByzanzIndex *   index,
+                    GOutputStream * stream,
+                    GCancellable *  cancellable,
+                    GError **       error)
+{
+  guint64 offsets[2];
+  guint32 counts[2];
+  gboolean result;
+
+  g_return_val_if_fail (index != NULL, FALSE);
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
+
+  offsets[0] = index->end;
+  offsets[1] = index->duration;
+  counts[0] = index->entries->len;
+  counts[1] = index->cursors->len;
+  byzanz_index_swap_trailer (index, offsets, counts);
+
+  byzanz_index_swap_entries (index);
+  result = g_output_stream_write_all (stream, index->entries->data,
+        index->entries->len * sizeof (ByzanzIndexEntry), NULL, cancellable, error) &&
+    g_output_stream_write_all (stream, index->cursors->data,
+        index->cursors->len * sizeof (ByzanzIndexCursor), NULL, cancellable, error) &&
+    g_output_stream_write_all (stream, offsets, sizeof (offsets), NULL, cancellable, error) &&
+    g_output_stream_write_all (stream, counts, sizeof (counts), NULL, cancellable, error) &&
+    g_output_stream_write_all (stream, INDEX_MAGIC, 8, NULL, cancellable, error);
+  byzanz_index_swap_entries (index);
+
+  return result;
+}
+
+/* Tries to read the index at the end of the stream. Returns FALSE without
+ * setting an error if there is none. */
+static gboolean
+byzanz_index_read_stored (ByzanzIndex *  index,
+                          GInputStream * stream,
+                          goffset        start,
+                          GCancellable * cancellable,
+                          GError **      error)
+{
+  GSeekable *seekable = G_SEEKABLE (stream);
+  guint64 offsets[2];
+  guint32 counts[2];
+  char magic[8];
+  goffset size;
+
+  if (!g_seekable_seek (seekable, 0, G_SEEK_END, cancellable, error))
+    return FALSE;
+  size = g_seekable_tell (seekable);
+  if (size < start + (goffset) INDEX_TRAILER_SIZE)
+    return FALSE;
+
+  if (!g_seekable_seek (seekable, size - INDEX_TRAILER_SIZE, G_SEEK_SET, cancellable, error) ||
+      !g_input_stream_read_all (stream, offsets, sizeof (offsets), NULL, cancellable, error) ||
+      !g_input_stream_read_all (stream, counts, sizeof (counts), NULL, cancellable, error) ||
+      !g_input_stream_read_all (stream, magic, sizeof (magic), NULL, cancellable, error))
+    return FALSE;
+  byzanz_index_swap_trailer (index, offsets, counts);
+
+  if (memcmp (magic, INDEX_MAGIC, 8) != 0 ||
+      offsets[0] < (guint64) start ||
+      offsets[0] + counts[0] * sizeof (ByzanzIndexEntry) + counts[1] * sizeof (ByzanzIndexCursor)
+          + INDEX_TRAILER_SIZE != (guint64) size)
+    return FALSE;
+
+  g_array_set_size (index->entries, counts[0]);
+  g_array_set_size (index->cursors, counts[1]);
+  if (!g_seekable_seek (seekable, offsets[0], G_SEEK_SET, cancellable, error) ||
+      !g_input_stream_read_all (stream, index->entries->data,
+          counts[0] * sizeof (ByzanzIndexEntry), NULL, cancellable, error) ||
+      !g_input_stream_read_all (stream, index->cursors->data,
+          counts[1] * sizeof (ByzanzIndexCursor), NULL, cancellable, error)) {
+    g_array_set_size (index->entries, 0);
+    g_array_set_size (index->cursors, 0);
+    return FALSE;
+  }
+  byzanz_index_swap_entries (index);
+
+  byzanz_index_set_end (index, offsets[1], offsets[0]);
+  index->stored = TRUE;
+  return TRUE;
+}
+
+/* Reads through all records to build the index. Images covering the
+ * whole recording become keyframes. */
+static gboolean
+byzanz_index_scan (ByzanzIndex *  index,
+                   GInputStream * stream,
+                   goffset        start,
+                   GCancellable * cancellable,
+                   GError **      error)
+{
+  GSeekable *seekable = G_SEEKABLE (stream);
+  cairo_rectangle_int_t all = { 0, 0, index->width, index->height };
+  ByzanzRecord record;
+  ByzanzIndexFlags flags;
+  guint cursor = 0;
+  int x = 0, y = 0;
+  goffset offset;
+
+  if (!g_seekable_seek (seekable, start, G_SEEK_SET, cancellable, error))
+    return FALSE;
+
+  for (;;) {
+    offset = g_seekable_tell (seekable);
+    if (!byzanz_deserialize (stream, index->width, index->height, index->flags, &record, cancellable, error))
+      return FALSE;
+
+    switch (record.type) {
+      case BYZANZ_RECORD_IMAGE:
+        if (record.surface == NULL) {
+          byzanz_index_set_end (index, record.msecs, g_seekable_tell (seekable));
+          return TRUE;
+        }
+        flags = 0;
+        if (cairo_region_contains_rectangle (record.region, &all) == CAIRO_REGION_OVERLAP_IN)
+          flags |= BYZANZ_INDEX_KEYFRAME;
+        byzanz_index_add_image (index, record.msecs, offset, flags, cursor, x, y);
+        break;
+      case BYZANZ_RECORD_CURSOR:
+        cursor = record.cursor;
+        x = record.x;
+        y = record.y;
+        break;
+      case BYZANZ_RECORD_CURSOR_IMAGE:
+        byzanz_index_add_cursor_image (index, record.cursor, offset);
+        break;
+      case BYZANZ_RECORD_COPY:
+        break;
+      default:
+        g_assert_not_reached ();
+        break;
+    }
+    byzanz_record_clear (&record);
+  }
+}
+
+/**
+ * byzanz_index_read:
+ * @stream: a seekable stream containing a recording
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Reads the index of the recording in @stream. If the recording doesn't
+ * contain one, it is built by reading all of the recording. The
+ * stored member of the returned index tells which one happened.
+ *
+ * Returns: the index or %NULL on error
+ **/
+ByzanzIndex *
+byzanz_index_read (GInputStream * stream,
+                   GCancellable * cancellable,
+                   GError **      error)
+{
+  ByzanzIndex *index;
+  GError *err = NULL;
+  ByzanzSerializeFlags flags;
+  guint width, height;
+  goffset start;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (stream), NULL);
+
+  if (!G_IS_SEEKABLE (stream) || !g_seekable_can_seek (G_SEEKABLE (stream))) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        _("Recording is not seekable"));
+    return NULL;
+  }
+
+  if (!g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, cancellable, error) ||
+      !byzanz_deserialize_header (stream, &width, &height, &flags, cancellable, error))
+    return NULL;
+  start = g_seekable_tell (G_SEEKABLE (stream));
+
+  index = byzanz_index_new (width, height);
+  index->flags = flags;
+  if (!(flags & BYZANZ_SERIALIZE_INDEX) ||
+      !byzanz_index_read_stored (index, stream, start, cancellable, &err)) {
+    if (err != NULL ||
+        !byzanz_index_scan (index, stream, start, cancellable, &err)) {
+      g_propagate_error (error, err);
+      byzanz_index_free (index);
+      return NULL;
+    }
+  }
+
+  return index;
+}
+
+guint64
+byzanz_index_get_duration (ByzanzIndex *index)
+{
+  g_return_val_if_fail (index != NULL, 0);
+
+  return index->duration;
+}
+
+static cairo_surface_t *
+byzanz_index_get_cursor_image (ByzanzIndex *  index,
+                               GInputStream * stream,
+                               guint          cursor,
+                               GCancellable * cancellable,
+                               GError **      error)
+{
+  ByzanzIndexCursor *entry;
+  ByzanzRecord record;
+  cairo_surface_t *image;
+  guint i;
+
+  image = g_hash_table_lookup (index->cursor_images, GUINT_TO_POINTER (cursor));
+  if (image)
+    return image;
+
+  for (i = 0; i < index->cursors->len; i++) {
+    entry = &g_array_index (index->cursors, ByzanzIndexCursor, i);
+    if (entry->cursor == cursor)
+      break;
+  }
+  if (i == index->cursors->len)
+    return NULL;
+
+  if (!g_seekable_seek (G_SEEKABLE (stream), entry->offset, G_SEEK_SET, cancellable, error) ||
+      !byzanz_deserialize (stream, index->width, index->height, index->flags, &record, cancellable, error))
+    return NULL;
+  if (record.type != BYZANZ_RECORD_CURSOR_IMAGE || record.cursor != cursor) {
+    byzanz_record_clear (&record);
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        _("Invalid index in recording"));
+    return NULL;
+  }
+
+  image = record.surface;
+  record.surface = NULL;
+  byzanz_record_clear (&record);
+  g_hash_table_insert (index->cursor_images, GUINT_TO_POINTER (cursor), image);
+  return image;
+}
+
+/* Composes the frame at msecs without the cursor and returns the cursor
+ * state at that time. next is set to the first record after msecs, which
+ * is the end of stream record if there is none. */
+static cairo_surface_t *
+byzanz_index_replay (ByzanzIndex *  index,
+                     GInputStream * stream,
+                     guint64        msecs,
+                     guint *        cursor,
+                     int *          x,
+                     int *          y,
+                     ByzanzRecord * next,
+                     GCancellable * cancellable,
+                     GError **      error)
+{
+  ByzanzIndexEntry *entry;
+  ByzanzRecord record;
+  cairo_surface_t *frame;
+  guint start, end, middle;
+
+  frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, index->width, index->height);
+  if (index->entries->len == 0) {
+    *cursor = 0;
+    *x = *y = 0;
+    memset (next, 0, sizeof (ByzanzRecord));
+    next->type = BYZANZ_RECORD_IMAGE;
+    next->msecs = index->duration;
+    return frame;
+  }
+
+  /* find the last image at or before msecs and go back to its keyframe */
+  start = 0;
+  end = index->entries->len;
+  while (end - start > 1) {
+    middle = (start + end) / 2;
+    if (g_array_index (index->entries, ByzanzIndexEntry, middle).msecs <= msecs)
+      start = middle;
+    else
+      end = middle;
+  }
+  while (start > 0 &&
+      !(g_array_index (index->entries, ByzanzIndexEntry, start).flags & BYZANZ_INDEX_KEYFRAME))
+    start--;
+  entry = &g_array_index (index->entries, ByzanzIndexEntry, start);
+  *cursor = entry->cursor;
+  *x = entry->x;
+  *y = entry->y;
+
+  if (!g_seekable_seek (G_SEEKABLE (stream), entry->offset, G_SEEK_SET, cancellable, error))
+    goto fail;
+
+  for (;;) {
+    if (!byzanz_deserialize (stream, index->width, index->height, index->flags, &record, cancellable, error))
+      goto fail;
+    if (record.msecs > msecs ||
+        (record.type == BYZANZ_RECORD_IMAGE && record.surface == NULL)) {
+      *next = record;
+      return frame;
+    }
+
+    switch (record.type) {
+      case BYZANZ_RECORD_IMAGE:
+        byzanz_paint_region (frame, record.surface, record.region);
+        break;
+      case BYZANZ_RECORD_COPY:
+        cairo_surface_flush (frame);
+        byzanz_copy_region (cairo_image_surface_get_data (frame),
+            cairo_image_surface_get_stride (frame), sizeof (guint32),
+            record.region, record.dx, record.dy);
+        cairo_surface_mark_dirty (frame);
+        break;
+      case BYZANZ_RECORD_CURSOR:
+        *cursor = record.cursor;
+        *x = record.x;
+        *y = record.y;
+        break;
+      case BYZANZ_RECORD_CURSOR_IMAGE:
+        break;
+      default:
+        g_assert_not_reached ();
+        break;
+    }
+    byzanz_record_clear (&record);
+  }
+
+fail:
+  cairo_surface_destroy (frame);
+  return NULL;
+}
+
+/**
+ * byzanz_index_get_frame:
+ * @index: the index of the recording in @stream
+ * @stream: a seekable stream containing the recording
+ * @msecs: the time to get the frame for
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Composes what the recording showed at @msecs, including the cursor. Only
+ * the records since the last keyframe before @msecs need to be read.
+ *
+ * Returns: a new RGB24 image surface or %NULL on error
+ **/
+cairo_surface_t *
+byzanz_index_get_frame (ByzanzIndex *  index,
+                        GInputStream * stream,
+                        guint64        msecs,
+                        GCancellable * cancellable,
+                        GError **      error)
+{
+  ByzanzRecord next;
+  cairo_surface_t *frame, *image;
+  guint cursor;
+  int x, y;
+  cairo_t *cr;
+
+  g_return_val_if_fail (index != NULL, NULL);
+  g_return_val_if_fail (G_IS_SEEKABLE (stream), NULL);
+
+  frame = byzanz_index_replay (index, stream, msecs, &cursor, &x, &y, &next, cancellable, error);
+  if (frame == NULL)
+    return NULL;
+  byzanz_record_clear (&next);
+
+  if (cursor != 0) {
+    image = byzanz_index_get_cursor_image (index, stream, cursor, cancellable, error);
+    if (image == NULL && error && *error) {
+      cairo_surface_destroy (frame);
+      return NULL;
+    }
+    if (image) {
+      cr = cairo_create (frame);
+      cairo_set_source_surface (cr, image, x, y);
+      cairo_paint (cr);
+      cairo_destroy (cr);
+    }
+  }
+
+  return frame;
+}
+
+/**
+ * byzanz_index_write_segment:
+ * @index: the index of the recording in @input
+ * @input: a seekable stream containing the recording
+ * @output: stream to write the segment to
+ * @start: time the segment starts
+ * @end: time the segment ends
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Writes the part of the recording between @start and @end as a new
+ * recording starting at time 0. It starts with a keyframe, so it can be
+ * processed independently of the rest of the recording.
+ * This function only reads from @index, so it can be called from multiple
+ * threads at once, as long as every thread uses its own @input.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_index_write_segment (ByzanzIndex *   index,
+                            GInputStream *  input,
+                            GOutputStream * output,
+                            guint64         start,
+                            guint64         end,
+                            GCancellable *  cancellable,
+                            GError **       error)
+{
+  cairo_rectangle_int_t all = { 0, 0, index->width, index->height };
+  ByzanzIndexCursor *entry;
+  ByzanzRecord record;
+  cairo_region_t *region;
+  cairo_surface_t *frame;
+  gboolean result;
+  guint i, cursor;
+  int x, y;
+
+  g_return_val_if_fail (index != NULL, FALSE);
+  g_return_val_if_fail (G_IS_SEEKABLE (input), FALSE);
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (output), FALSE);
+  g_return_val_if_fail (start < end, FALSE);
+
+  if (!byzanz_serialize_header (output, index->width, index->height,
+        BYZANZ_SERIALIZE_COMPRESS, cancellable, error))
+    return FALSE;
+
+  /* cursor images may have been defined anywhere before, so copy all */
+  for (i = 0; i < index->cursors->len; i++) {
+    entry = &g_array_index (index->cursors, ByzanzIndexCursor, i);
+    if (!g_seekable_seek (G_SEEKABLE (input), entry->offset, G_SEEK_SET, cancellable, error) ||
+        !byzanz_deserialize (input, index->width, index->height, index->flags, &record, cancellable, error))
+      return FALSE;
+    result = record.type == BYZANZ_RECORD_CURSOR_IMAGE;
+    if (result)
+      result = byzanz_serialize_cursor_image (output, 0, record.cursor, record.surface,
+          cancellable, error);
+    else
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+          _("Invalid index in recording"));
+    byzanz_record_clear (&record);
+    if (!result)
+      return FALSE;
+  }
+
+  frame = byzanz_index_replay (index, input, start, &cursor, &x, &y, &record, cancellable, error);
+  if (frame == NULL)
+    return FALSE;
+
+  /* Always start with the cursor, in case cursor records follow later.
+   * Readers need to know about them from the start. */
+  region = cairo_region_create_rectangle (&all);
+  result = byzanz_serialize_cursor (output, 0, cursor, x, y, cancellable, error) &&
+      byzanz_serialize (output, 0, frame, region, BYZANZ_SERIALIZE_COMPRESS, cancellable, error);
+  cairo_region_destroy (region);
+  cairo_surface_destroy (frame);
+
+  while (result && record.msecs < end &&
+         (record.type != BYZANZ_RECORD_IMAGE || record.surface != NULL)) {
+    record.msecs -= start;
+    switch (record.type) {
+      case BYZANZ_RECORD_IMAGE:
+        result = byzanz_serialize (output, record.msecs, record.surface, record.region,
+            BYZANZ_SERIALIZE_COMPRESS, cancellable, error);
+        break;
+      case BYZANZ_RECORD_COPY:
+        result = byzanz_serialize_copy (output, record.msecs, record.region,
+            record.dx, record.dy, cancellable, error);
+        break;
+      case BYZANZ_RECORD_CURSOR:
+        result = byzanz_serialize_cursor (output, record.msecs, record.cursor,
+            record.x, record.y, cancellable, error);
+        break;
+      case BYZANZ_RECORD_CURSOR_IMAGE:
+        /* already written */
+        break;
+      default:
+        g_assert_not_reached ();
+        break;
+    }
+    byzanz_record_clear (&record);
+    if (result)
+      result = byzanz_deserialize (input, index->width, index->height, index->flags, &record, cancellable, error);
+  }
+  if (!result)
+    return FALSE;
+
+  end = MIN (end, MAX (record.msecs, start));
+  byzanz_record_clear (&record);
+  return byzanz_serialize (output, end - start, NULL, NULL, 0, cancellable, error);
+}
+
@@ -0,0 +1,102 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gio/gio.h>
+#include <cairo.h>
+
+#include "byzanzserialize.h"
+
+#ifndef __HAVE_BYZANZ_INDEX_H__
+#define __HAVE_BYZANZ_INDEX_H__
+
+typedef enum {
+  BYZANZ_INDEX_KEYFRAME = (1 << 0)
+} ByzanzIndexFlags;
+
+typedef struct _ByzanzIndexEntry ByzanzIndexEntry;
+struct _ByzanzIndexEntry {
+  guint64               msecs;          /* timestamp of the image record */
+  guint64               offset;         /* offset of the image record in the file */
+  guint32               flags;          /* ByzanzIndexFlags */
+  guint32               cursor;         /* id of the cursor shown with this image or 0 */
+  gint32                x;              /* X position of the cursor's hotspot */
+  gint32                y;              /* Y position of the cursor's hotspot */
+};
+
+typedef struct _ByzanzIndexCursor ByzanzIndexCursor;
+struct _ByzanzIndexCursor {
+  guint32               cursor;         /* id of the cursor */
+  guint32               padding;
+  guint64               offset;         /* offset of the cursor image record in the file */
+};
+
+typedef struct _ByzanzIndex ByzanzIndex;
+struct _ByzanzIndex {
+  guint                 width;          /* width of the recording */
+  guint                 height;         /* height of the recording */
+  ByzanzSerializeFlags  flags;          /* flags of the recording the index was read from */
+  int                   byte_order;     /* G_LITTLE_ENDIAN or G_BIG_ENDIAN, as declared by the recording */
+  GArray *              entries;        /* ByzanzIndexEntry for every image record */
+  GArray *              cursors;        /* ByzanzIndexCursor for every cursor image */
+  guint64               end;            /* offset after the end of stream record */
+  guint64               duration;       /* timestamp of the end of stream record */
+  gboolean              stored;         /* TRUE if the index was read from the file */
+  GHashTable *          cursor_images;  /* id => cursor image loaded by byzanz_index_get_frame() */
+};
+
+ByzanzIndex *           byzanz_index_new                (guint                  width,
+                                                         guint                  height);
+void                    byzanz_index_free               (ByzanzIndex *          index);
+
+void                    byzanz_index_add_image          (ByzanzIndex *          index,
+                                                         guint64                msecs,
+                                                         guint64                offset,
+                                                         ByzanzIndexFlags       flags,
+                                                         guint                  cursor,
+                                                         int                    x,
+                                                         int                    y);
+void                    byzanz_index_add_cursor_image   (ByzanzIndex *          index,
+                                                         guint                  cursor,
+                                                         guint64                offset);
+void                    byzanz_index_set_end            (ByzanzIndex *          index,
+                                                         guint64                msecs,
+                                                         guint64                offset);
+
+gboolean                byzanz_index_write              (ByzanzIndex *          index,
+                                                         GOutputStream *        stream,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+ByzanzIndex *           byzanz_index_read               (GInputStream *         stream,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+
+guint64                 byzanz_index_get_duration       (ByzanzIndex *          index);
+cairo_surface_t *       byzanz_index_get_frame          (ByzanzIndex *          index,
+                                                         GInputStream *         stream,
+                                                         guint64                msecs,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+gboolean                byzanz_index_write_segment      (ByzanzIndex *          index,
+                                                         GInputStream *         input,
+                                                         GOutputStream *        output,
+                                                         guint64                start,
+                                                         guint64                end,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+
+
+#endif /* __HAVE_BYZANZ_INDEX_H__ */
@@ -0,0 +1,268 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzlayercomposite.h"
+
+#include <gdk/gdkx.h>
+#include <cairo-xlib.h>
+#include <X11/extensions/Xcomposite.h>
+
+G_DEFINE_TYPE (ByzanzLayerComposite, byzanz_layer_composite, BYZANZ_TYPE_LAYER)
+
+static void
+byzanz_layer_composite_invalidate_all (ByzanzLayerComposite *clayer)
+{
+  ByzanzLayer *layer = BYZANZ_LAYER (clayer);
+
+  cairo_region_union_rectangle (clayer->invalid, &layer->recorder->area);
+  byzanz_layer_invalidate (layer);
+}
+
+static void
+byzanz_layer_composite_release_pixmap (ByzanzLayerComposite *clayer)
+{
+  GdkDisplay *display = gdk_window_get_display (BYZANZ_LAYER (clayer)->recorder->window);
+
+  if (clayer->surface) {
+    cairo_surface_destroy (clayer->surface);
+    clayer->surface = NULL;
+  }
+  if (clayer->pixmap != None) {
+    gdk_x11_display_error_trap_push (display);
+    XFreePixmap (GDK_DISPLAY_XDISPLAY (display), clayer->pixmap);
+    gdk_x11_display_error_trap_pop_ignored (display);
+    clayer->pixmap = None;
+  }
+}
+
+/* The pixmap only stays valid until the window gets resized or unmapped,
+ * so we name a new one whenever we need it. */
+static gboolean
+byzanz_layer_composite_ensure_pixmap (ByzanzLayerComposite *clayer)
+{
+  GdkWindow *window = BYZANZ_LAYER (clayer)->recorder->window;
+  GdkDisplay *display = gdk_window_get_display (window);
+  Display *dpy = GDK_DISPLAY_XDISPLAY (display);
+  XWindowAttributes attrs;
+
+  if (clayer->surface)
+    return TRUE;
+
+  gdk_x11_display_error_trap_push (display);
+  if (!XGetWindowAttributes (dpy, GDK_WINDOW_XID (window), &attrs) ||
+      attrs.map_state != IsViewable) {
+    gdk_x11_display_error_trap_pop_ignored (display);
+    return FALSE;
+  }
+  clayer->pixmap = XCompositeNameWindowPixmap (dpy, GDK_WINDOW_XID (window));
+  if (gdk_x11_display_error_trap_pop (display)) {
+    clayer->pixmap = None;
+    return FALSE;
+  }
+
+  clayer->width = attrs.width;
+  clayer->height = attrs.height;
+  clayer->surface = cairo_xlib_surface_create (dpy, clayer->pixmap, attrs.visual,
+      attrs.width, attrs.height);
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_layer_composite_event (ByzanzLayer * layer,
+                              GdkXEvent *   gdkxevent)
+{
+  XEvent *xevent = gdkxevent;
+  XDamageNotifyEvent *event = (XDamageNotifyEvent *) gdkxevent;
+  ByzanzLayerComposite *clayer = BYZANZ_LAYER_COMPOSITE (layer);
+
+  if (event->type == layer->recorder->damage_event_base + XDamageNotify && 
+      event->damage == clayer->damage) {
+    cairo_rectangle_int_t rect;
+
+    rect.x = event->area.x;
+    rect.y = event->area.y;
+    rect.width = event->area.width;
+    rect.height = event->area.height;
+    if (gdk_rectangle_intersect ((GdkRectangle*) &rect,
+                                 (GdkRectangle*) &layer->recorder->area,
+                                 (GdkRectangle*) &rect)) {
+      cairo_region_union_rectangle (clayer->invalid, &rect);
+      byzanz_layer_invalidate (layer);
+    }
+    return TRUE;
+  }
+
+  /* Moving the window doesn't change its pixmap, but resizing, mapping
+   * and unmapping does. Don't eat these events, GDK wants them, too. */
+  switch (xevent->type) {
+    case ConfigureNotify:
+      if (xevent->xconfigure.width != clayer->width ||
+          xevent->xconfigure.height != clayer->height) {
+        byzanz_layer_composite_release_pixmap (clayer);
+        byzanz_layer_composite_invalidate_all (clayer);
+      }
+      break;
+    case MapNotify:
+      byzanz_layer_composite_invalidate_all (clayer);
+      break;
+    case UnmapNotify:
+    case DestroyNotify:
+      byzanz_layer_composite_release_pixmap (clayer);
+      break;
+    default:
+      break;
+  }
+
+  return FALSE;
+}
+
+static cairo_region_t *
+byzanz_layer_composite_snapshot (ByzanzLayer *layer)
+{
+  Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (layer->recorder->window));
+  ByzanzLayerComposite *clayer = BYZANZ_LAYER_COMPOSITE (layer);
+  cairo_region_t *region;
+
+  if (cairo_region_is_empty (clayer->invalid))
+    return NULL;
+
+  /* We repaint everything that got reported, so we can clear all damage */
+  XDamageSubtract (dpy, clayer->damage, None, None);
+
+  region = clayer->invalid;
+  clayer->invalid = cairo_region_create ();
+  return region;
+}
+
+static void
+byzanz_layer_composite_render (ByzanzLayer *layer,
+                               cairo_t *    cr)
+{
+  ByzanzLayerComposite *clayer = BYZANZ_LAYER_COMPOSITE (layer);
+  cairo_rectangle_int_t *area = &layer->recorder->area;
+
+  /* an unmapped window keeps its last contents */
+  if (!byzanz_layer_composite_ensure_pixmap (clayer))
+    return;
+
+  /* The recorded area doesn't follow a resize. What a window that shrank
+   * doesn't cover anymore is recorded as black, not as it was before. */
+  if (clayer->width < area->x + area->width ||
+      clayer->height < area->y + area->height) {
+    cairo_save (cr);
+    cairo_set_fill_rule (cr, CAIRO_FILL_RULE_EVEN_ODD);
+    cairo_rectangle (cr, area->x, area->y, area->width, area->height);
+    cairo_rectangle (cr, 0, 0, clayer->width, clayer->height);
+    cairo_set_source_rgb (cr, 0, 0, 0);
+    cairo_fill (cr);
+    cairo_restore (cr);
+  }
+
+  cairo_set_source_surface (cr, clayer->surface, 0, 0);
+  cairo_paint (cr);
+}
+
+static void
+byzanz_layer_composite_finalize (GObject *object)
+{
+  GdkWindow *window = BYZANZ_LAYER (object)->recorder->window;
+  GdkDisplay *display = gdk_window_get_display (window);
+  Display *dpy = GDK_DISPLAY_XDISPLAY (display);
+  ByzanzLayerComposite *clayer = BYZANZ_LAYER_COMPOSITE (object);
+
+  byzanz_layer_composite_release_pixmap (clayer);
+
+  /* the window might be gone already */
+  gdk_x11_display_error_trap_push (display);
+  XDamageDestroy (dpy, clayer->damage);
+  XCompositeUnredirectWindow (dpy, GDK_WINDOW_XID (window), CompositeRedirectAutomatic);
+  gdk_x11_display_error_trap_pop_ignored (display);
+
+  cairo_region_destroy (clayer->invalid);
+
+  G_OBJECT_CLASS (byzanz_layer_composite_parent_class)->finalize (object);
+}
+
+static void
+byzanz_layer_composite_constructed (GObject *object)
+{
+  ByzanzLayer *layer = BYZANZ_LAYER (object);
+  GdkWindow *window = layer->recorder->window;
+  Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (window));
+  ByzanzLayerComposite *clayer = BYZANZ_LAYER_COMPOSITE (object);
+
+  /* Redirecting keeps the window contents in an offscreen pixmap, even when
+   * other windows cover it. Automatic redirection means the X server still
+   * shows the window on screen. */
+  XCompositeRedirectWindow (dpy, gdk_x11_window_get_xid (window), CompositeRedirectAutomatic);
+  clayer->damage = XDamageCreate (dpy, gdk_x11_window_get_xid (window), XDamageReportDeltaRectangles);
+  gdk_window_set_events (window, gdk_window_get_events (window) | GDK_STRUCTURE_MASK);
+  cairo_region_union_rectangle (clayer->invalid, &layer->recorder->area);
+
+  G_OBJECT_CLASS (byzanz_layer_composite_parent_class)->constructed (object);
+}
+
+static void
+byzanz_layer_composite_class_init (ByzanzLayerCompositeClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ByzanzLayerClass *layer_class = BYZANZ_LAYER_CLASS (klass);
+
+  object_class->finalize = byzanz_layer_composite_finalize;
+  object_class->constructed = byzanz_layer_composite_constructed;
+
+  layer_class->event = byzanz_layer_composite_event;
+  layer_class->snapshot = byzanz_layer_composite_snapshot;
+  layer_class->render = byzanz_layer_composite_render;
+}
+
+static void
+byzanz_layer_composite_init (ByzanzLayerComposite *clayer)
+{
+  clayer->invalid = cairo_region_create ();
+  clayer->pixmap = None;
+}
+
+/**
+ * byzanz_layer_composite_is_supported:
+ * @display: the display to check
+ *
+ * Checks if the X server supports naming window pixmaps, which was added in
+ * version 0.2 of the Composite extension.
+ *
+ * Returns: %TRUE if #ByzanzLayerComposite can be used on @display
+ **/
+gboolean
+byzanz_layer_composite_is_supported (GdkDisplay *display)
+{
+  Display *dpy = GDK_DISPLAY_XDISPLAY (display);
+  int event_base, error_base, major, minor;
+
+  if (!XCompositeQueryExtension (dpy, &event_base, &error_base))
+    return FALSE;
+
+  major = 0;
+  minor = 2;
+  XCompositeQueryVersion (dpy, &major, &minor);
+
+  return major > 0 || minor >= 2;
+}
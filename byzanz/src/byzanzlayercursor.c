@@ -21,10 +21,28 @@
 
 #include "byzanzlayercursor.h"
 
+#include <string.h>
 #include <gdk/gdkx.h>
+#include <X11/extensions/XInput2.h>
+
+#include "byzanzhash.h"
+
+typedef struct _ByzanzCursorEntry ByzanzCursorEntry;
+struct _ByzanzCursorEntry {
+  gulong                serial;         /* serial of the cursor */
+  guint64               hash;           /* checksum of the image */
+  cairo_surface_t *     surface;        /* the image, shared by entries with the same hash */
+};
 
 G_DEFINE_TYPE (ByzanzLayerCursor, byzanz_layer_cursor, BYZANZ_TYPE_LAYER)
 
+static void
+byzanz_cursor_entry_free (ByzanzCursorEntry *entry)
+{
+  cairo_surface_destroy (entry->surface);
+  g_slice_free (ByzanzCursorEntry, entry);
+}
+
 static cairo_surface_t *
 create_surface_for_cursor (XFixesCursorImage *cursor)
 {
@@ -57,20 +75,113 @@ create_surface_for_cursor (XFixesCursorImage *cursor)
   return surface;
 }
 
+static guint64
+byzanz_layer_cursor_hash_surface (cairo_surface_t *surface)
+{
+  double xhot, yhot;
+  const guchar *data;
+  guint64 hash;
+  int y, width, height, stride;
+
+  cairo_surface_get_device_offset (surface, &xhot, &yhot);
+  width = cairo_image_surface_get_width (surface);
+  height = cairo_image_surface_get_height (surface);
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+
+  hash = ((guint64) width << 48) ^ ((guint64) height << 32) ^
+    ((guint64) (guint16) xhot << 16) ^ (guint16) yhot;
+  for (y = 0; y < height; y++)
+    hash = byzanz_hash (data + y * stride, width * sizeof (guint32), hash);
+
+  return hash;
+}
+
+static void
+byzanz_layer_cursor_set_cursor_next (ByzanzLayerCursor *clayer,
+                                     cairo_surface_t *  surface)
+{
+  if (surface)
+    cairo_surface_reference (surface);
+  if (clayer->cursor_next)
+    cairo_surface_destroy (clayer->cursor_next);
+  clayer->cursor_next = surface;
+}
+
+static void
+byzanz_layer_cursor_take_cursor_next (ByzanzLayerCursor *clayer)
+{
+  if (clayer->cursor_next)
+    cairo_surface_reference (clayer->cursor_next);
+  if (clayer->cursor)
+    cairo_surface_destroy (clayer->cursor);
+  clayer->cursor = clayer->cursor_next;
+}
+
+/* Animated cursors use a new serial for every frame, so images are shared
+ * between serials with the same contents and only the most recently used
+ * serials are kept. */
 static cairo_surface_t *
 byzanz_layer_cursor_read_cursor (ByzanzLayerCursor *clayer)
 {
   Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (BYZANZ_LAYER (clayer)->recorder->window));
   XFixesCursorImage *cursor;
+  ByzanzCursorEntry *entry;
+  GList *walk;
 
   cursor = XFixesGetCursorImage (dpy);
-  if (cursor) {
-    cairo_surface_t *surface = create_surface_for_cursor (cursor);
-    g_hash_table_insert (clayer->cursors, cursor, surface);
-    return surface;
-  } else {
+  if (cursor == NULL)
     return NULL;
+
+  entry = g_slice_new (ByzanzCursorEntry);
+  entry->serial = cursor->cursor_serial;
+  entry->surface = create_surface_for_cursor (cursor);
+  entry->hash = byzanz_layer_cursor_hash_surface (entry->surface);
+  XFree (cursor);
+
+  for (walk = clayer->cache.head; walk; walk = walk->next) {
+    ByzanzCursorEntry *cached = walk->data;
+
+    if (cached->hash == entry->hash) {
+      cairo_surface_destroy (entry->surface);
+      entry->surface = cairo_surface_reference (cached->surface);
+      break;
+    }
+  }
+
+  walk = g_hash_table_lookup (clayer->cursors, GUINT_TO_POINTER (entry->serial));
+  if (walk) {
+    byzanz_cursor_entry_free (walk->data);
+    g_queue_delete_link (&clayer->cache, walk);
   }
+  g_queue_push_head (&clayer->cache, entry);
+  g_hash_table_insert (clayer->cursors, GUINT_TO_POINTER (entry->serial), clayer->cache.head);
+
+  if (clayer->cache.length > BYZANZ_LAYER_CURSOR_CACHE_SIZE) {
+    ByzanzCursorEntry *oldest = g_queue_pop_tail (&clayer->cache);
+
+    g_hash_table_remove (clayer->cursors, GUINT_TO_POINTER (oldest->serial));
+    byzanz_cursor_entry_free (oldest);
+  }
+
+  return entry->surface;
+}
+
+/* Returns the image for the cursor with the given serial, reading it from
+ * the server only if it isn't known yet. */
+static cairo_surface_t *
+byzanz_layer_cursor_lookup_cursor (ByzanzLayerCursor *clayer,
+                                   gulong             serial)
+{
+  GList *link;
+
+  link = g_hash_table_lookup (clayer->cursors, GUINT_TO_POINTER (serial));
+  if (link == NULL)
+    return byzanz_layer_cursor_read_cursor (clayer);
+
+  g_queue_unlink (&clayer->cache, link);
+  g_queue_push_head_link (&clayer->cache, link);
+  return ((ByzanzCursorEntry *) link->data)->surface;
 }
 
 static gboolean
@@ -81,12 +192,8 @@ byzanz_layer_cursor_event (ByzanzLayer * layer,
   XFixesCursorNotifyEvent *event = gdkxevent;
 
   if (event->type == layer->recorder->fixes_event_base + XFixesCursorNotify) {
-    XFixesCursorImage hack;
-
-    hack.cursor_serial = event->cursor_serial;
-    clayer->cursor_next = g_hash_table_lookup (clayer->cursors, &hack);
-    if (clayer->cursor_next == NULL)
-      clayer->cursor_next = byzanz_layer_cursor_read_cursor (clayer);
+    byzanz_layer_cursor_set_cursor_next (clayer,
+        byzanz_layer_cursor_lookup_cursor (clayer, event->cursor_serial));
     if (clayer->cursor_next != clayer->cursor)
       byzanz_layer_invalidate (layer);
     return TRUE;
@@ -122,13 +229,96 @@ byzanz_layer_cursor_poll (gpointer data)
 static void
 byzanz_layer_cursor_setup_poll (ByzanzLayerCursor *clayer)
 {
-  if (clayer->poll_source != 0)
+  if (clayer->poll_source != 0 || clayer->xi_motion)
     return;
 
   /* FIXME: Is 10ms ok or is it too much? */
   clayer->poll_source = g_timeout_add (10, byzanz_layer_cursor_poll, clayer);
 }
 
+static GdkFilterReturn
+byzanz_layer_cursor_filter_events (GdkXEvent *gdkxevent, GdkEvent *event, gpointer data)
+{
+  ByzanzLayerCursor *clayer = data;
+  XGenericEventCookie *cookie = &((XEvent *) gdkxevent)->xcookie;
+
+  if (cookie->type == GenericEvent &&
+      cookie->extension == clayer->xi_opcode &&
+      cookie->evtype == XI_RawMotion) {
+    /* The position is only queried in the next snapshot, so motion is
+     * coalesced to the frame rate. */
+    clayer->moved = TRUE;
+    byzanz_layer_invalidate (BYZANZ_LAYER (clayer));
+  }
+
+  return GDK_FILTER_CONTINUE;
+}
+
+/* Raw events are only ever delivered to the root window, but they are
+ * delivered no matter where the pointer is and whether it's grabbed.
+ * Selecting replaces the whole mask, so keep the events other code in
+ * this process selected and only touch the bit we added ourselves. */
+static void
+byzanz_layer_cursor_select_motion (ByzanzLayerCursor *clayer, gboolean select)
+{
+  GdkWindow *window = BYZANZ_LAYER (clayer)->recorder->window;
+  Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (window));
+  Window root = GDK_WINDOW_XID (gdk_screen_get_root_window (gdk_window_get_screen (window)));
+  XIEventMask mask, *selected;
+  int i, n_selected;
+
+  mask.deviceid = XIAllMasterDevices;
+  mask.mask_len = XIMaskLen (XI_LASTEVENT);
+  mask.mask = NULL;
+  selected = XIGetSelectedEvents (dpy, root, &n_selected);
+  for (i = 0; selected && i < n_selected; i++) {
+    if (selected[i].deviceid != XIAllMasterDevices)
+      continue;
+    mask.mask_len = MAX (mask.mask_len, selected[i].mask_len);
+    mask.mask = g_malloc0 (mask.mask_len);
+    memcpy (mask.mask, selected[i].mask, selected[i].mask_len);
+    break;
+  }
+  if (selected)
+    XFree (selected);
+  if (mask.mask == NULL)
+    mask.mask = g_malloc0 (mask.mask_len);
+
+  if (select && !XIMaskIsSet (mask.mask, XI_RawMotion)) {
+    XISetMask (mask.mask, XI_RawMotion);
+    XISelectEvents (dpy, root, &mask, 1);
+    clayer->xi_selected = TRUE;
+  } else if (!select && clayer->xi_selected) {
+    XIClearMask (mask.mask, XI_RawMotion);
+    XISelectEvents (dpy, root, &mask, 1);
+    clayer->xi_selected = FALSE;
+  }
+
+  g_free (mask.mask);
+}
+
+static gboolean
+byzanz_layer_cursor_setup_xinput (ByzanzLayerCursor *clayer)
+{
+  Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (BYZANZ_LAYER (clayer)->recorder->window));
+  int event_base, error_base, major, minor;
+
+  if (!XQueryExtension (dpy, "XInputExtension", &clayer->xi_opcode, &event_base, &error_base))
+    return FALSE;
+
+  /* Before 2.1, raw events went to the grabbing client only, so the
+   * cursor would freeze during drags. */
+  major = 2;
+  minor = 2;
+  if (XIQueryVersion (dpy, &major, &minor) != Success ||
+      major < 2 || (major == 2 && minor < 1))
+    return FALSE;
+
+  byzanz_layer_cursor_select_motion (clayer, TRUE);
+  gdk_window_add_filter (NULL, byzanz_layer_cursor_filter_events, clayer);
+  return TRUE;
+}
+
 static void
 byzanz_layer_cursor_invalidate_cursor (cairo_region_t *region, cairo_surface_t *surface, int x, int y)
 {
@@ -159,6 +349,12 @@ byzanz_layer_cursor_snapshot (ByzanzLayer *layer)
   GdkDisplay *display;
   GdkWindow *window;
 
+  /* without motion events the position must be queried every time */
+  if (clayer->xi_motion && !clayer->moved &&
+      clayer->cursor_next == clayer->cursor)
+    return NULL;
+  clayer->moved = FALSE;
+
   window = layer->recorder->window;
   display = gdk_window_get_display (window);
   device_manager = gdk_display_get_device_manager (display);
@@ -169,6 +365,16 @@ byzanz_layer_cursor_snapshot (ByzanzLayer *layer)
       clayer->cursor_next == clayer->cursor)
     return NULL;
 
+  if (layer->recorder->cursor_metadata) {
+    /* the cursor is not part of the images, so nothing needs to be read */
+    byzanz_layer_cursor_take_cursor_next (clayer);
+    clayer->cursor_x = x;
+    clayer->cursor_y = y;
+    byzanz_layer_cursor_setup_poll (clayer);
+    byzanz_recorder_set_cursor (layer->recorder, clayer->cursor, x, y);
+    return NULL;
+  }
+
   region = cairo_region_create ();
   byzanz_layer_cursor_invalidate_cursor (region, clayer->cursor, clayer->cursor_x, clayer->cursor_y);
   byzanz_layer_cursor_invalidate_cursor (region, clayer->cursor_next, x, y);
@@ -176,7 +382,7 @@ byzanz_layer_cursor_snapshot (ByzanzLayer *layer)
   cairo_region_intersect (region, area);
   cairo_region_destroy (area);
 
-  clayer->cursor = clayer->cursor_next;
+  byzanz_layer_cursor_take_cursor_next (clayer);
   clayer->cursor_x = x;
   clayer->cursor_y = y;
   byzanz_layer_cursor_setup_poll (clayer);
@@ -191,7 +397,8 @@ byzanz_layer_cursor_render (ByzanzLayer *layer,
   ByzanzLayerCursor *clayer = BYZANZ_LAYER_CURSOR (layer);
   cairo_surface_t *cursor_surface;
 
-  if (clayer->cursor == NULL)
+  if (clayer->cursor == NULL ||
+      layer->recorder->cursor_metadata)
     return;
 
   cursor_surface = clayer->cursor;
@@ -212,8 +419,18 @@ byzanz_layer_cursor_finalize (GObject *object)
   Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (window));
 
   XFixesSelectCursorInput (dpy, GDK_WINDOW_XID (window), 0);
+  if (clayer->xi_motion) {
+    gdk_window_remove_filter (NULL, byzanz_layer_cursor_filter_events, clayer);
+    byzanz_layer_cursor_select_motion (clayer, FALSE);
+  }
 
   g_hash_table_destroy (clayer->cursors);
+  g_queue_foreach (&clayer->cache, (GFunc) byzanz_cursor_entry_free, NULL);
+  g_queue_clear (&clayer->cache);
+  if (clayer->cursor)
+    cairo_surface_destroy (clayer->cursor);
+  if (clayer->cursor_next)
+    cairo_surface_destroy (clayer->cursor_next);
 
   if (clayer->poll_source != 0) {
     g_source_remove (clayer->poll_source);
@@ -230,7 +447,10 @@ byzanz_layer_cursor_constructed (GObject *object)
   Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_window_get_display (window));
 
   XFixesSelectCursorInput (dpy, GDK_WINDOW_XID (window), XFixesDisplayCursorNotifyMask);
-  byzanz_layer_cursor_read_cursor (clayer);
+  byzanz_layer_cursor_set_cursor_next (clayer, byzanz_layer_cursor_read_cursor (clayer));
+  /* fall back to polling if the server can't tell us about motion */
+  clayer->xi_motion = byzanz_layer_cursor_setup_xinput (clayer);
+  clayer->moved = TRUE;
   byzanz_layer_cursor_setup_poll (clayer);
 
   G_OBJECT_CLASS (byzanz_layer_cursor_parent_class)->constructed (object);
@@ -250,23 +470,9 @@ byzanz_layer_cursor_class_init (ByzanzLayerCursorClass *klass)
   layer_class->render = byzanz_layer_cursor_render;
 }
 
-static guint
-byzanz_cursor_hash (gconstpointer key)
-{
-  return (guint) ((const XFixesCursorImage *) key)->cursor_serial;
-}
-
-static gboolean
-byzanz_cursor_equal (gconstpointer c1, gconstpointer c2)
-{
-  return ((const XFixesCursorImage *) c1)->cursor_serial == 
-    ((const XFixesCursorImage *) c2)->cursor_serial;
-}
-
 static void
 byzanz_layer_cursor_init (ByzanzLayerCursor *clayer)
 {
-  clayer->cursors = g_hash_table_new_full (byzanz_cursor_hash,
-      byzanz_cursor_equal, NULL, (GDestroyNotify) cairo_surface_destroy);
+  clayer->cursors = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_queue_init (&clayer->cache);
 }
-
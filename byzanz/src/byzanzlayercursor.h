@@ -22,6 +22,9 @@
 #ifndef __HAVE_BYZANZ_LAYER_CURSOR_H__
 #define __HAVE_BYZANZ_LAYER_CURSOR_H__
 
+/* number of cursor serials to remember */
+#define BYZANZ_LAYER_CURSOR_CACHE_SIZE 32
+
 typedef struct _ByzanzLayerCursor ByzanzLayerCursor;
 typedef struct _ByzanzLayerCursorClass ByzanzLayerCursorClass;
 
@@ -40,9 +43,14 @@ struct _ByzanzLayerCursor {
   int                   cursor_x;               /* last recorded X position of cursor */
   int                   cursor_y;               /* last recorded Y position of cursor */
 
-  GHashTable *          cursors;                /* all cursors we know about already */
+  GHashTable *          cursors;                /* cursor serial => link in cache */
+  GQueue                cache;                  /* ByzanzCursorEntry, most recently used first */
 
   guint                 poll_source;            /* source used for querying mouse position */
+  int                   xi_opcode;              /* opcode of the XInput extension */
+  gboolean              xi_motion;              /* TRUE if XInput reports pointer motion, no polling needed */
+  gboolean              xi_selected;            /* TRUE if we added raw motion to the root window's event mask */
+  gboolean              moved;                  /* pointer moved since the last snapshot */
 };
 
 struct _ByzanzLayerCursorClass {
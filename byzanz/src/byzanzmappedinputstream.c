@@ -0,0 +1,236 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzmappedinputstream.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+static void byzanz_mapped_input_stream_seekable_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ByzanzMappedInputStream, byzanz_mapped_input_stream, G_TYPE_INPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE, byzanz_mapped_input_stream_seekable_init))
+
+static goffset
+byzanz_mapped_input_stream_tell (GSeekable *seekable)
+{
+  return BYZANZ_MAPPED_INPUT_STREAM (seekable)->offset;
+}
+
+static gboolean
+byzanz_mapped_input_stream_can_seek (GSeekable *seekable)
+{
+  return TRUE;
+}
+
+static gboolean
+byzanz_mapped_input_stream_seek (GSeekable *    seekable,
+                                 goffset        offset,
+                                 GSeekType      type,
+                                 GCancellable * cancellable,
+                                 GError **      error)
+{
+  ByzanzMappedInputStream *stream = BYZANZ_MAPPED_INPUT_STREAM (seekable);
+
+  switch (type) {
+    case G_SEEK_CUR:
+      offset += stream->offset;
+      break;
+    case G_SEEK_END:
+      offset += stream->size;
+      break;
+    case G_SEEK_SET:
+      break;
+    default:
+      g_assert_not_reached ();
+      break;
+  }
+
+  if (offset < 0 || (gsize) offset > stream->size) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        _("Invalid seek request"));
+    return FALSE;
+  }
+
+  stream->offset = offset;
+  return TRUE;
+}
+
+static gboolean
+byzanz_mapped_input_stream_can_truncate (GSeekable *seekable)
+{
+  return FALSE;
+}
+
+static gboolean
+byzanz_mapped_input_stream_truncate (GSeekable *    seekable,
+                                     goffset        offset,
+                                     GCancellable * cancellable,
+                                     GError **      error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+      _("Cannot truncate input streams"));
+  return FALSE;
+}
+
+static void
+byzanz_mapped_input_stream_seekable_init (GSeekableIface *iface)
+{
+  iface->tell = byzanz_mapped_input_stream_tell;
+  iface->can_seek = byzanz_mapped_input_stream_can_seek;
+  iface->seek = byzanz_mapped_input_stream_seek;
+  iface->can_truncate = byzanz_mapped_input_stream_can_truncate;
+  iface->truncate_fn = byzanz_mapped_input_stream_truncate;
+}
+
+static void
+byzanz_mapped_input_stream_finalize (GObject *object)
+{
+  ByzanzMappedInputStream *stream = BYZANZ_MAPPED_INPUT_STREAM (object);
+
+  if (stream->file)
+    g_mapped_file_unref (stream->file);
+
+  G_OBJECT_CLASS (byzanz_mapped_input_stream_parent_class)->finalize (object);
+}
+
+static gssize
+byzanz_mapped_input_stream_read (GInputStream *input_stream,
+				 void *	       buffer,
+				 gsize         count,
+				 GCancellable *cancellable,
+				 GError **     error)
+{
+  ByzanzMappedInputStream *stream = BYZANZ_MAPPED_INPUT_STREAM (input_stream);
+
+  count = MIN (count, stream->size - stream->offset);
+  memcpy (buffer, stream->data + stream->offset, count);
+  stream->offset += count;
+
+  return count;
+}
+
+static gssize
+byzanz_mapped_input_stream_skip (GInputStream *input_stream,
+				 gsize         count,
+				 GCancellable *cancellable,
+				 GError **     error)
+{
+  ByzanzMappedInputStream *stream = BYZANZ_MAPPED_INPUT_STREAM (input_stream);
+
+  count = MIN (count, stream->size - stream->offset);
+  stream->offset += count;
+
+  return count;
+}
+
+static gboolean
+byzanz_mapped_input_stream_close (GInputStream * input_stream,
+				  GCancellable * cancellable,
+				  GError **      error)
+{
+  /* The mapping stays alive until all surfaces using it are gone,
+   * so there's nothing to do here. */
+  return TRUE;
+}
+
+static void
+byzanz_mapped_input_stream_class_init (ByzanzMappedInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *input_stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = byzanz_mapped_input_stream_finalize;
+
+  input_stream_class->read_fn = byzanz_mapped_input_stream_read;
+  input_stream_class->skip = byzanz_mapped_input_stream_skip;
+  input_stream_class->close_fn = byzanz_mapped_input_stream_close;
+}
+
+static void
+byzanz_mapped_input_stream_init (ByzanzMappedInputStream *mapped_input_stream)
+{
+}
+
+/**
+ * byzanz_mapped_input_stream_new:
+ * @filename: the file to read
+ * @error: %NULL or location to take an error
+ *
+ * Creates an input stream that maps @filename into memory. The mapping is
+ * private and writable, so surfaces created from it with
+ * byzanz_mapped_input_stream_peek() can be drawn to without changing the
+ * file.
+ *
+ * Returns: a new input stream or %NULL on error
+ **/
+GInputStream *
+byzanz_mapped_input_stream_new (const char *filename,
+                                GError **   error)
+{
+  ByzanzMappedInputStream *stream;
+  GMappedFile *file;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  file = g_mapped_file_new (filename, TRUE, error);
+  if (file == NULL)
+    return NULL;
+
+  stream = g_object_new (BYZANZ_TYPE_MAPPED_INPUT_STREAM, NULL);
+  stream->file = file;
+  stream->data = (const guchar *) g_mapped_file_get_contents (file);
+  stream->size = g_mapped_file_get_length (file);
+
+  return G_INPUT_STREAM (stream);
+}
+
+GMappedFile *
+byzanz_mapped_input_stream_get_file (ByzanzMappedInputStream *stream)
+{
+  g_return_val_if_fail (BYZANZ_IS_MAPPED_INPUT_STREAM (stream), NULL);
+
+  return stream->file;
+}
+
+/**
+ * byzanz_mapped_input_stream_peek:
+ * @stream: the stream
+ * @size: number of bytes to look at
+ *
+ * Gets the next @size bytes of @stream without reading them. The memory
+ * belongs to the mapping returned by byzanz_mapped_input_stream_get_file()
+ * and stays valid as long as a reference to it is held.
+ *
+ * Returns: the data or %NULL if fewer than @size bytes are left
+ **/
+gconstpointer
+byzanz_mapped_input_stream_peek (ByzanzMappedInputStream *stream,
+                                 gsize                    size)
+{
+  g_return_val_if_fail (BYZANZ_IS_MAPPED_INPUT_STREAM (stream), NULL);
+
+  if (size > stream->size - stream->offset)
+    return NULL;
+
+  return stream->data + stream->offset;
+}
+
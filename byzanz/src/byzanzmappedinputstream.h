@@ -0,0 +1,56 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gio/gio.h>
+
+#ifndef __HAVE_BYZANZ_MAPPED_INPUT_STREAM_H__
+#define __HAVE_BYZANZ_MAPPED_INPUT_STREAM_H__
+
+typedef struct _ByzanzMappedInputStream ByzanzMappedInputStream;
+typedef struct _ByzanzMappedInputStreamClass ByzanzMappedInputStreamClass;
+
+#define BYZANZ_TYPE_MAPPED_INPUT_STREAM                    (byzanz_mapped_input_stream_get_type())
+#define BYZANZ_IS_MAPPED_INPUT_STREAM(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_MAPPED_INPUT_STREAM))
+#define BYZANZ_IS_MAPPED_INPUT_STREAM_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_MAPPED_INPUT_STREAM))
+#define BYZANZ_MAPPED_INPUT_STREAM(obj)                    (G_TYPE_CHECK_INSTANCE_CAST ((obj), BYZANZ_TYPE_MAPPED_INPUT_STREAM, ByzanzMappedInputStream))
+#define BYZANZ_MAPPED_INPUT_STREAM_CLASS(klass)            (G_TYPE_CHECK_CLASS_CAST ((klass), BYZANZ_TYPE_MAPPED_INPUT_STREAM, ByzanzMappedInputStreamClass))
+#define BYZANZ_MAPPED_INPUT_STREAM_GET_CLASS(obj)          (G_TYPE_INSTANCE_GET_CLASS ((obj), BYZANZ_TYPE_MAPPED_INPUT_STREAM, ByzanzMappedInputStreamClass))
+
+struct _ByzanzMappedInputStream {
+  GInputStream  	input_stream;
+
+  GMappedFile *		file;		/* the mapping we read from */
+  const guchar *	data;		/* contents of file */
+  gsize			size;		/* size of data */
+  gsize			offset;		/* bytes we've already read */
+};
+
+struct _ByzanzMappedInputStreamClass {
+  GInputStreamClass	input_stream_class;
+};
+
+GType		byzanz_mapped_input_stream_get_type		(void) G_GNUC_CONST;
+
+GInputStream *	byzanz_mapped_input_stream_new			(const char *			filename,
+								 GError **			error);
+
+GMappedFile *	byzanz_mapped_input_stream_get_file		(ByzanzMappedInputStream *	stream);
+gconstpointer	byzanz_mapped_input_stream_peek			(ByzanzMappedInputStream *	stream,
+								 gsize				size);
+
+
+#endif /* __HAVE_BYZANZ_MAPPED_INPUT_STREAM_H__ */
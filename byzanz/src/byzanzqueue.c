@@ -21,6 +21,8 @@
 
 #include "byzanzqueue.h"
 
+#include <unistd.h>
+
 #include "byzanzqueueinputstream.h"
 #include "byzanzqueueoutputstream.h"
 
@@ -28,6 +30,7 @@ enum {
   PROP_0,
   PROP_INPUT,
   PROP_OUTPUT,
+  PROP_MAX_MEMORY
 };
 
 G_DEFINE_TYPE (ByzanzQueue, byzanz_queue, G_TYPE_OBJECT)
@@ -45,6 +48,9 @@ byzanz_queue_get_property (GObject *object, guint param_id, GValue *value,
     case PROP_OUTPUT:
       g_value_set_object (value, queue->output);
       break;
+    case PROP_MAX_MEMORY:
+      g_value_set_uint64 (value, byzanz_queue_get_max_memory (queue));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -55,9 +61,12 @@ static void
 byzanz_queue_set_property (GObject *object, guint param_id, const GValue *value, 
     GParamSpec * pspec)
 {
-  //ByzanzQueue *queue = BYZANZ_QUEUE (object);
+  ByzanzQueue *queue = BYZANZ_QUEUE (object);
 
   switch (param_id) {
+    case PROP_MAX_MEMORY:
+      byzanz_queue_set_max_memory (queue, g_value_get_uint64 (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -86,11 +95,13 @@ static void
 byzanz_queue_finalize (GObject *object)
 {
   ByzanzQueue *queue = BYZANZ_QUEUE (object);
-  GFile *file;
+  ByzanzQueueChunk *chunk;
 
-  while ((file = g_async_queue_try_pop (queue->files)))
-    g_file_delete (file, NULL, NULL);
-  g_async_queue_unref (queue->files);
+  while ((chunk = g_queue_pop_head (&queue->chunks)))
+    byzanz_queue_chunk_free (queue, chunk);
+  g_mutex_clear (&queue->lock);
+  g_cond_clear (&queue->cond);
+  g_free (queue->spare);
 
   G_OBJECT_CLASS (byzanz_queue_parent_class)->dispose (object);
 }
@@ -111,12 +122,18 @@ byzanz_queue_class_init (ByzanzQueueClass *klass)
   g_object_class_install_property (object_class, PROP_OUTPUT,
       g_param_spec_object ("outputstream", "output stream", "stream to use for writing to the cache",
 	  G_TYPE_OUTPUT_STREAM, G_PARAM_READABLE));
+  g_object_class_install_property (object_class, PROP_MAX_MEMORY,
+      g_param_spec_uint64 ("max-memory", "max memory", "memory to use before spilling to files",
+	  0, G_MAXSIZE, BYZANZ_QUEUE_MAX_MEMORY, G_PARAM_READWRITE));
 }
 
 static void
 byzanz_queue_init (ByzanzQueue *queue)
 {
-  queue->files = g_async_queue_new ();
+  g_mutex_init (&queue->lock);
+  g_cond_init (&queue->cond);
+  g_queue_init (&queue->chunks);
+  queue->max_memory = BYZANZ_QUEUE_MAX_MEMORY;
 
   queue->input = byzanz_queue_input_stream_new (queue);
   queue->output = byzanz_queue_output_stream_new (queue);
@@ -146,3 +163,184 @@ byzanz_queue_get_input_stream (ByzanzQueue *queue)
   return queue->input;
 }
 
+/**
+ * byzanz_queue_set_max_memory:
+ * @queue: the queue
+ * @max_memory: bytes of memory the queue may use
+ *
+ * Data is kept in memory as long as the reader keeps up. Only when more
+ * than @max_memory bytes are waiting, the data is written to temporary
+ * files. Use 0 to always use files.
+ **/
+void
+byzanz_queue_set_max_memory (ByzanzQueue *queue,
+                             gsize        max_memory)
+{
+  g_return_if_fail (BYZANZ_IS_QUEUE (queue));
+
+  g_mutex_lock (&queue->lock);
+  queue->max_memory = max_memory;
+  g_mutex_unlock (&queue->lock);
+
+  g_object_notify (G_OBJECT (queue), "max-memory");
+}
+
+gsize
+byzanz_queue_get_max_memory (ByzanzQueue *queue)
+{
+  gsize result;
+
+  g_return_val_if_fail (BYZANZ_IS_QUEUE (queue), 0);
+
+  g_mutex_lock (&queue->lock);
+  result = queue->max_memory;
+  g_mutex_unlock (&queue->lock);
+
+  return result;
+}
+
+/**
+ * byzanz_queue_get_backlog:
+ * @queue: the queue
+ *
+ * Gets the number of bytes that were written to the queue but not read
+ * yet. Readers can use this to find out if they're falling behind.
+ *
+ * Returns: the number of bytes waiting to be read
+ **/
+guint64
+byzanz_queue_get_backlog (ByzanzQueue *queue)
+{
+  guint64 result;
+
+  g_return_val_if_fail (BYZANZ_IS_QUEUE (queue), 0);
+
+  g_mutex_lock (&queue->lock);
+  result = queue->backlog;
+  g_mutex_unlock (&queue->lock);
+
+  return result;
+}
+
+/* Creates a new chunk and appends it to the queue. Must be called with
+ * the lock held. */
+ByzanzQueueChunk *
+byzanz_queue_chunk_new (ByzanzQueue *queue,
+                        GError **    error)
+{
+  ByzanzQueueChunk *chunk;
+  char *filename;
+  int fd;
+
+  chunk = g_slice_new0 (ByzanzQueueChunk);
+
+  if (queue->memory + BYZANZ_QUEUE_MEMORY_CHUNK_SIZE <= queue->max_memory) {
+    if (queue->spare) {
+      chunk->data = queue->spare;
+      queue->spare = NULL;
+    } else {
+      chunk->data = g_malloc (BYZANZ_QUEUE_MEMORY_CHUNK_SIZE);
+    }
+    queue->memory += BYZANZ_QUEUE_MEMORY_CHUNK_SIZE;
+  } else {
+    /* the reader is too far behind, spill to disk */
+    fd = g_file_open_tmp ("byzanzcacheXXXXXX", &filename, error);
+    if (fd < 0) {
+      g_slice_free (ByzanzQueueChunk, chunk);
+      return NULL;
+    }
+    close (fd);
+    chunk->file = g_file_new_for_path (filename);
+    g_free (filename);
+  }
+
+  g_queue_push_tail (&queue->chunks, chunk);
+  byzanz_queue_notify_unlocked (queue);
+  return chunk;
+}
+
+/* Must be called without the lock held. */
+void
+byzanz_queue_chunk_free (ByzanzQueue *     queue,
+                         ByzanzQueueChunk *chunk)
+{
+  if (chunk->file) {
+    g_file_delete (chunk->file, NULL, NULL);
+    g_object_unref (chunk->file);
+  } else {
+    g_mutex_lock (&queue->lock);
+    queue->memory -= BYZANZ_QUEUE_MEMORY_CHUNK_SIZE;
+    /* keep one chunk around, so a steady stream doesn't allocate */
+    if (queue->spare == NULL) {
+      queue->spare = chunk->data;
+      chunk->data = NULL;
+    }
+    g_mutex_unlock (&queue->lock);
+    g_free (chunk->data);
+  }
+
+  g_slice_free (ByzanzQueueChunk, chunk);
+}
+
+gsize
+byzanz_queue_chunk_get_size (ByzanzQueueChunk *chunk)
+{
+  return chunk->file ? BYZANZ_QUEUE_FILE_SIZE : BYZANZ_QUEUE_MEMORY_CHUNK_SIZE;
+}
+
+/* Wakes up the reader. Must be called with the lock held. */
+void
+byzanz_queue_notify_unlocked (ByzanzQueue *queue)
+{
+  queue->generation++;
+  g_cond_broadcast (&queue->cond);
+}
+
+static void
+byzanz_queue_cancelled (GCancellable *cancellable,
+                        gpointer      data)
+{
+  ByzanzQueue *queue = data;
+
+  g_mutex_lock (&queue->lock);
+  g_cond_broadcast (&queue->cond);
+  g_mutex_unlock (&queue->lock);
+}
+
+/**
+ * byzanz_queue_wait:
+ * @queue: the queue
+ * @generation: value of the generation when there was nothing to read
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Blocks until the writer did something after @generation was read or
+ * @cancellable is cancelled. Must be called without the lock held.
+ *
+ * Returns: %FALSE if cancelled
+ **/
+gboolean
+byzanz_queue_wait (ByzanzQueue *  queue,
+                   guint          generation,
+                   GCancellable * cancellable,
+                   GError **      error)
+{
+  gulong handler;
+
+  /* the callback takes the lock, so connect before taking it */
+  if (cancellable)
+    handler = g_cancellable_connect (cancellable, G_CALLBACK (byzanz_queue_cancelled), queue, NULL);
+  else
+    handler = 0;
+
+  g_mutex_lock (&queue->lock);
+  while (queue->generation == generation &&
+         !g_cancellable_is_cancelled (cancellable))
+    g_cond_wait (&queue->cond, &queue->lock);
+  g_mutex_unlock (&queue->lock);
+
+  if (handler)
+    g_cancellable_disconnect (cancellable, handler);
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
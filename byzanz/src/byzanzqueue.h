@@ -24,6 +24,16 @@ typedef struct _ByzanzQueue ByzanzQueue;
 typedef struct _ByzanzQueueClass ByzanzQueueClass;
 
 #define BYZANZ_QUEUE_FILE_SIZE 16 * 1024 * 1024
+#define BYZANZ_QUEUE_MEMORY_CHUNK_SIZE (4 * 1024 * 1024)
+/* default for ByzanzQueue:max-memory */
+#define BYZANZ_QUEUE_MAX_MEMORY (64 * 1024 * 1024)
+
+typedef struct _ByzanzQueueChunk ByzanzQueueChunk;
+struct _ByzanzQueueChunk {
+  GFile *               file;           /* file this chunk is stored in or %NULL if it's kept in memory */
+  guchar *              data;           /* BYZANZ_QUEUE_MEMORY_CHUNK_SIZE bytes of memory if file is %NULL */
+  gsize                 length;         /* bytes written to data so far. Must hold lock to access */
+};
 
 #define BYZANZ_TYPE_QUEUE                    (byzanz_queue_get_type())
 #define BYZANZ_IS_QUEUE(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_QUEUE))
@@ -40,9 +50,16 @@ struct _ByzanzQueue {
 
   volatile int		shared_count;	/* shared ref count of queue, output and input stream */
 
-  GAsyncQueue *		files;		/* the files that still need to be processed */
-  guint			output_closed:1;/* the output stream is closed. Must take async queue lock to access */
-  guint			input_closed:1; /* the input stream is closed. Must take async queue lock to access */
+  GMutex                lock;           /* lock protecting the shared state */
+  GCond                 cond;           /* signalled when generation changes */
+  guint                 generation;     /* changed whenever the writer did something. Must hold lock to access */
+  GQueue		chunks;		/* the chunks that still need to be processed. Must hold lock to access */
+  guint			output_closed:1;/* the output stream is closed. Must hold lock to access */
+  guint			input_closed:1; /* the input stream is closed. Must hold lock to access */
+  gsize                 max_memory;     /* memory chunks may use up to this much, after that files are used */
+  gsize                 memory;         /* memory used by chunks. Must hold lock to access */
+  guchar *              spare;          /* memory of a processed chunk kept for reuse. Must hold lock to access */
+  guint64               backlog;        /* bytes written but not read yet. Must hold lock to access */
 };
 
 struct _ByzanzQueueClass {
@@ -56,5 +73,22 @@ ByzanzQueue *	byzanz_queue_new		(void);
 GOutputStream *	byzanz_queue_get_output_stream	(ByzanzQueue *	queue);
 GInputStream *	byzanz_queue_get_input_stream	(ByzanzQueue *	queue);
 
+void            byzanz_queue_set_max_memory     (ByzanzQueue *  queue,
+                                                 gsize          max_memory);
+gsize           byzanz_queue_get_max_memory     (ByzanzQueue *  queue);
+guint64         byzanz_queue_get_backlog        (ByzanzQueue *  queue);
+
+/* for the streams */
+ByzanzQueueChunk *byzanz_queue_chunk_new        (ByzanzQueue *  queue,
+                                                 GError **      error);
+void            byzanz_queue_chunk_free         (ByzanzQueue *  queue,
+                                                 ByzanzQueueChunk *chunk);
+gsize           byzanz_queue_chunk_get_size     (ByzanzQueueChunk *chunk);
+void            byzanz_queue_notify_unlocked    (ByzanzQueue *  queue);
+gboolean        byzanz_queue_wait               (ByzanzQueue *  queue,
+                                                 guint          generation,
+                                                 GCancellable * cancellable,
+                                                 GError **      error);
+
 
 #endif /* __HAVE_BYZANZ_QUEUE_H__ */
@@ -21,6 +21,8 @@
 
 #include "byzanzqueueinputstream.h"
 
+#include <string.h>
+
 G_DEFINE_TYPE (ByzanzQueueInputStream, byzanz_queue_input_stream, G_TYPE_INPUT_STREAM)
 
 static gboolean
@@ -28,14 +30,19 @@ byzanz_queue_input_stream_close_input (ByzanzQueueInputStream *stream,
 				       GCancellable *	       cancellable,
 				       GError **               error)
 {
-  if (stream->input == NULL)
+  if (stream->chunk == NULL)
     return TRUE;
 
-  if (!g_input_stream_close (stream->input, cancellable, error))
-    return FALSE;
+  if (stream->input) {
+    if (!g_input_stream_close (stream->input, cancellable, error))
+      return FALSE;
+
+    g_object_unref (stream->input);
+    stream->input = NULL;
+  }
 
-  g_object_unref (stream->input);
-  stream->input = NULL;
+  byzanz_queue_chunk_free (stream->queue, stream->chunk);
+  stream->chunk = NULL;
   stream->input_bytes = 0;
   return TRUE;
 }
@@ -61,107 +68,146 @@ byzanz_queue_input_stream_finalize (GObject *object)
 {
   ByzanzQueueInputStream *stream = BYZANZ_QUEUE_INPUT_STREAM (object);
 
-  if (!byzanz_queue_input_stream_close_input (stream, NULL, NULL))
+  if (!byzanz_queue_input_stream_close_input (stream, NULL, NULL)) {
     g_object_unref (stream->input);
+    byzanz_queue_chunk_free (stream->queue, stream->chunk);
+  }
 
   G_OBJECT_CLASS (byzanz_queue_input_stream_parent_class)->finalize (object);
 }
 
-static gboolean
-byzanz_queue_input_stream_wait (ByzanzQueueInputStream *stream,
-			        GCancellable *		cancellable,
-				GError **		error)
-{
-  GPollFD fd;
-  guint n_fds;
-  
-  /* FIXME: Use a file monitor here */
-
-  /* Do the same thing that the UNIX tail program does: sleep a second */
-  n_fds = 0;
-  if (cancellable)
-    {
-      g_cancellable_make_pollfd (cancellable, &fd);
-      n_fds++;
-    }
-
-  g_poll (&fd, n_fds, 1000);
-
-  return !g_cancellable_set_error_if_cancelled (cancellable, error);
-}
-
 static gboolean
 byzanz_queue_input_stream_ensure_input (ByzanzQueueInputStream *stream,
 					GCancellable *          cancellable,
 					GError **               error)
 {
-  GFile *file;
+  ByzanzQueueChunk *chunk;
+  guint generation;
 
-  if (stream->input_bytes >= BYZANZ_QUEUE_FILE_SIZE)
+  if (stream->chunk != NULL &&
+      stream->input_bytes >= (goffset) byzanz_queue_chunk_get_size (stream->chunk))
     {
       if (!byzanz_queue_input_stream_close_input (stream, cancellable, error))
 	return FALSE;
-      stream->input = NULL;
     }
 
-  if (stream->input != NULL)
+  if (stream->chunk != NULL)
     return TRUE;
 
-  g_async_queue_lock (stream->queue->files);
+  g_mutex_lock (&stream->queue->lock);
   do {
-    file = g_async_queue_try_pop_unlocked (stream->queue->files);
-    if (file != NULL || stream->queue->output_closed)
+    chunk = g_queue_pop_head (&stream->queue->chunks);
+    if (chunk != NULL || stream->queue->output_closed)
       break;
     
-    g_async_queue_unlock (stream->queue->files);
-    if (!byzanz_queue_input_stream_wait (stream, cancellable, error))
+    generation = stream->queue->generation;
+    g_mutex_unlock (&stream->queue->lock);
+    if (!byzanz_queue_wait (stream->queue, generation, cancellable, error))
       return FALSE;
-    g_async_queue_lock (stream->queue->files);
+    g_mutex_lock (&stream->queue->lock);
   
   } while (TRUE);
-  g_async_queue_unlock (stream->queue->files);
+  g_mutex_unlock (&stream->queue->lock);
 
-  if (file == NULL)
+  if (chunk == NULL)
     return TRUE;
 
-  stream->input = G_INPUT_STREAM (g_file_read (file, cancellable, error));
-  g_file_delete (file, NULL, NULL);
-  g_object_unref (file);
+  if (chunk->file) {
+    stream->input = G_INPUT_STREAM (g_file_read (chunk->file, cancellable, error));
+    if (stream->input == NULL) {
+      byzanz_queue_chunk_free (stream->queue, chunk);
+      return FALSE;
+    }
+  }
+  stream->chunk = chunk;
 
-  return stream->input != NULL;
+  return TRUE;
 }
 
+/* Reads from a chunk in memory, returns 0 if the writer hasn't written
+ * anything new yet. */
+static gsize
+byzanz_queue_input_stream_read_memory (ByzanzQueueInputStream *stream,
+                                       void *                  buffer,
+                                       gsize                   count)
+{
+  gsize available;
+
+  g_mutex_lock (&stream->queue->lock);
+  available = stream->chunk->length - stream->input_bytes;
+  g_mutex_unlock (&stream->queue->lock);
+
+  count = MIN (count, available);
+  if (buffer)
+    memcpy (buffer, stream->chunk->data + stream->input_bytes, count);
+
+  return count;
+}
+
+/* skips if buffer is %NULL */
 static gssize
-byzanz_queue_input_stream_read (GInputStream *input_stream,
-				void *	      buffer,
-				gsize         count,
-				GCancellable *cancellable,
-				GError **     error)
+byzanz_queue_input_stream_read_or_skip (ByzanzQueueInputStream *stream,
+                                        void *                  buffer,
+                                        gsize                   count,
+                                        GCancellable *          cancellable,
+                                        GError **               error)
 {
-  ByzanzQueueInputStream *stream = BYZANZ_QUEUE_INPUT_STREAM (input_stream);
+  gboolean closed;
+  guint generation;
   gssize result;
 
-retry:
-  if (!byzanz_queue_input_stream_ensure_input (stream, cancellable, error))
-    return -1;
+  for (;;) {
+    if (!byzanz_queue_input_stream_ensure_input (stream, cancellable, error))
+      return -1;
+
+    /* No more data to read from the queue */
+    if (stream->chunk == NULL)
+      return 0;
+
+    /* remember what the writer did so far, so we know when to look again */
+    g_mutex_lock (&stream->queue->lock);
+    generation = stream->queue->generation;
+    closed = stream->queue->output_closed;
+    g_mutex_unlock (&stream->queue->lock);
+
+    if (stream->input) {
+      if (buffer)
+        result = g_input_stream_read (stream->input, buffer, count, cancellable, error);
+      else
+        result = g_input_stream_skip (stream->input, count, cancellable, error);
+      if (result == -1)
+        return -1;
+    } else {
+      result = byzanz_queue_input_stream_read_memory (stream, buffer, count);
+    }
 
-  /* No more data to read from the queue */
-  if (stream->input == NULL)
-    return 0;
+    if (result > 0) {
+      stream->input_bytes += result;
+      g_mutex_lock (&stream->queue->lock);
+      stream->queue->backlog -= result;
+      g_mutex_unlock (&stream->queue->lock);
+      return result;
+    }
 
-  result = g_input_stream_read (stream->input, buffer, count, cancellable, error);
-  if (result == -1)
-    return -1;
+    /* the writer is done, there won't be any more data in this chunk */
+    if (closed)
+      return 0;
 
-  /* no data in file. Let's wait for more. */
-  if (result == 0) {
-    if (!byzanz_queue_input_stream_wait (stream, cancellable, error))
+    /* no data in chunk. Let's wait for more. */
+    if (!byzanz_queue_wait (stream->queue, generation, cancellable, error))
       return -1;
-    goto retry;
   }
+}
 
-  stream->input_bytes += result;
-  return result;
+static gssize
+byzanz_queue_input_stream_read (GInputStream *input_stream,
+				void *	      buffer,
+				gsize         count,
+				GCancellable *cancellable,
+				GError **     error)
+{
+  return byzanz_queue_input_stream_read_or_skip (BYZANZ_QUEUE_INPUT_STREAM (input_stream),
+      buffer, count, cancellable, error);
 }
 
 static gssize
@@ -170,30 +216,8 @@ byzanz_queue_input_stream_skip (GInputStream *input_stream,
 				GCancellable *cancellable,
 				GError **     error)
 {
-  ByzanzQueueInputStream *stream = BYZANZ_QUEUE_INPUT_STREAM (input_stream);
-  gssize result;
-
-retry:
-  if (!byzanz_queue_input_stream_ensure_input (stream, cancellable, error))
-    return -1;
-
-  /* No more data to read from the queue */
-  if (stream->input == NULL)
-    return 0;
-
-  result = g_input_stream_skip (stream->input, count, cancellable, error);
-  if (result == -1)
-    return -1;
-
-  /* no data in file. Let's wait for more. */
-  if (result == 0) {
-    if (!byzanz_queue_input_stream_wait (stream, cancellable, error))
-      return -1;
-    goto retry;
-  }
-
-  stream->input_bytes += result;
-  return result;
+  return byzanz_queue_input_stream_read_or_skip (BYZANZ_QUEUE_INPUT_STREAM (input_stream),
+      NULL, count, cancellable, error);
 }
 
 static gboolean
@@ -202,21 +226,24 @@ byzanz_queue_input_stream_close (GInputStream * input_stream,
 				 GError **      error)
 {
   ByzanzQueueInputStream *stream = BYZANZ_QUEUE_INPUT_STREAM (input_stream);
-  GFile *file;
+  ByzanzQueueChunk *chunk;
 
-  if (!byzanz_queue_input_stream_close_input (stream, cancellable, error))
-    return FALSE;
-
-  g_async_queue_lock (stream->queue->files);
+  /* mark as closed first, so the writer stops touching its chunk */
+  g_mutex_lock (&stream->queue->lock);
   stream->queue->input_closed = TRUE;
-  file = g_async_queue_try_pop_unlocked (stream->queue->files);
-  g_async_queue_unlock (stream->queue->files);
-
-  while (file) {
-    g_file_delete (file, NULL, NULL);
-    file = g_async_queue_try_pop (stream->queue->files);
+  chunk = g_queue_pop_head (&stream->queue->chunks);
+  g_mutex_unlock (&stream->queue->lock);
+
+  while (chunk) {
+    byzanz_queue_chunk_free (stream->queue, chunk);
+    g_mutex_lock (&stream->queue->lock);
+    chunk = g_queue_pop_head (&stream->queue->chunks);
+    g_mutex_unlock (&stream->queue->lock);
   }
 
+  if (!byzanz_queue_input_stream_close_input (stream, cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
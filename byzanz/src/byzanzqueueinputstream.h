@@ -34,8 +34,9 @@ struct _ByzanzQueueInputStream {
   GInputStream  	input_stream;
 
   ByzanzQueue *		queue;		/* queue we belong to */
-  GInputStream *	input;		/* stream we're reading from or NULL if we need to open one */
-  goffset		input_bytes;	/* bytes we've already read from input */
+  ByzanzQueueChunk *    chunk;          /* chunk we're reading from or NULL if we need to get one */
+  GInputStream *	input;		/* stream we're reading from if chunk is a file */
+  goffset		input_bytes;	/* bytes we've already read from chunk */
 };
 
 struct _ByzanzQueueInputStreamClass {
@@ -21,7 +21,7 @@
 
 #include "byzanzqueueoutputstream.h"
 
-#include <unistd.h>
+#include <string.h>
 
 G_DEFINE_TYPE (ByzanzQueueOutputStream, byzanz_queue_output_stream, G_TYPE_OUTPUT_STREAM)
 
@@ -57,50 +57,49 @@ byzanz_queue_output_stream_ensure_output (ByzanzQueueOutputStream *stream,
 					  GCancellable *           cancellable,
 					  GError **                error)
 {
-  GFile *file;
-  int fd;
-  char *filename;
+  ByzanzQueueChunk *chunk;
 
-  if (stream->output_bytes == 0 && stream->output)
+  if (stream->output_bytes == 0 && stream->chunk)
     {
-      if (!g_output_stream_close (stream->output, cancellable, error))
-	return FALSE;
-      g_object_unref (stream->output);
-      stream->output = NULL;
+      if (stream->output)
+        {
+          if (!g_output_stream_close (stream->output, cancellable, error))
+            return FALSE;
+          g_object_unref (stream->output);
+          stream->output = NULL;
+        }
+      stream->chunk = NULL;
     }
 
-  if (stream->output != NULL)
+  if (stream->chunk != NULL)
     return TRUE;
 
-  g_async_queue_lock (stream->queue->files);
+  g_mutex_lock (&stream->queue->lock);
 
   if (stream->queue->input_closed) {
-    g_async_queue_unlock (stream->queue->files);
+    g_mutex_unlock (&stream->queue->lock);
     return TRUE;
   }
 
-  fd = g_file_open_tmp ("byzanzcacheXXXXXX", &filename, error);
-  if (fd < 0) {
-    file = NULL;
-  } else {
-    close (fd);
-    file = g_file_new_for_path (filename);
-    g_free (filename);
-    g_object_ref (file);
-    g_async_queue_push_unlocked (stream->queue->files, file);
-  }
+  chunk = byzanz_queue_chunk_new (stream->queue, error);
+  if (chunk && chunk->file)
+    g_object_ref (chunk->file);
 
-  g_async_queue_unlock (stream->queue->files);
+  g_mutex_unlock (&stream->queue->lock);
 
-  if (file == NULL)
+  if (chunk == NULL)
     return FALSE;
 
-  stream->output = G_OUTPUT_STREAM (g_file_append_to (file, G_FILE_CREATE_PRIVATE, cancellable, error));
-  g_object_unref (file);
-  if (stream->output == NULL)
-    return FALSE;
+  if (chunk->file) {
+    /* the chunk might be gone already if the input was closed, so use our own reference */
+    stream->output = G_OUTPUT_STREAM (g_file_append_to (chunk->file, G_FILE_CREATE_PRIVATE, cancellable, error));
+    g_object_unref (chunk->file);
+    if (stream->output == NULL)
+      return FALSE;
+  }
 
-  stream->output_bytes = BYZANZ_QUEUE_FILE_SIZE;
+  stream->chunk = chunk;
+  stream->output_bytes = byzanz_queue_chunk_get_size (chunk);
   return TRUE;
 }
 
@@ -118,13 +117,33 @@ byzanz_queue_output_stream_write (GOutputStream *output_stream,
     return -1;
 
   /* will happen if input stream is closed, and there's no need to continue writing */
-  if (stream->output == NULL)
+  if (stream->chunk == NULL)
     return count;
 
-  result = g_output_stream_write (stream->output, buffer, 
-      MIN ((goffset) count, stream->output_bytes), cancellable, error);
-  if (result == -1)
-    return -1;
+  if (stream->output) {
+    result = g_output_stream_write (stream->output, buffer, 
+        MIN ((goffset) count, stream->output_bytes), cancellable, error);
+    if (result == -1)
+      return -1;
+    g_mutex_lock (&stream->queue->lock);
+    stream->queue->backlog += result;
+    byzanz_queue_notify_unlocked (stream->queue);
+    g_mutex_unlock (&stream->queue->lock);
+  } else {
+    result = MIN ((goffset) count, stream->output_bytes);
+    g_mutex_lock (&stream->queue->lock);
+    if (stream->queue->input_closed) {
+      /* the chunk was freed by the reader */
+      g_mutex_unlock (&stream->queue->lock);
+      stream->chunk = NULL;
+      return count;
+    }
+    memcpy (stream->chunk->data + stream->chunk->length, buffer, result);
+    stream->chunk->length += result;
+    stream->queue->backlog += result;
+    byzanz_queue_notify_unlocked (stream->queue);
+    g_mutex_unlock (&stream->queue->lock);
+  }
 
   stream->output_bytes -= result;
   return result;
@@ -141,9 +160,10 @@ byzanz_queue_output_stream_close (GOutputStream *output_stream,
       !g_output_stream_close (stream->output, cancellable, error))
     return FALSE;
 
-  g_async_queue_lock (stream->queue->files);
+  g_mutex_lock (&stream->queue->lock);
   stream->queue->output_closed = TRUE;
-  g_async_queue_unlock (stream->queue->files);
+  byzanz_queue_notify_unlocked (stream->queue);
+  g_mutex_unlock (&stream->queue->lock);
   return TRUE;
 }
 
@@ -34,8 +34,9 @@ struct _ByzanzQueueOutputStream {
   GOutputStream		output_stream;
 
   ByzanzQueue *		queue;		/* queue we belong to */
-  GOutputStream *	output;		/* stream we're writing to or %NULL if we need to open one */
-  goffset		output_bytes;	/* bytes we may still write to output */
+  ByzanzQueueChunk *    chunk;          /* chunk we're writing to or %NULL if we need a new one */
+  GOutputStream *	output;		/* stream we're writing to if chunk is a file */
+  goffset		output_bytes;	/* bytes we may still write to chunk */
 };
 
 struct _ByzanzQueueOutputStreamClass {
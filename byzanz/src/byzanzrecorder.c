@@ -21,24 +21,34 @@
 
 #include "byzanzrecorder.h"
 
+#include <string.h>
+
 #include <gdk/gdkx.h>
 
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
 
+#include "byzanzhash.h"
 #include "byzanzlayer.h"
+#include "byzanzlayercomposite.h"
 #include "byzanzlayercursor.h"
 #include "byzanzlayerwindow.h"
+#include "byzanzscale.h"
 
 enum {
   PROP_0,
   PROP_WINDOW,
   PROP_AREA,
   PROP_RECORDING,
+  PROP_SCALE,
+  PROP_CURSOR_METADATA,
+  PROP_TIME_LAPSE
 };
 
 enum {
   IMAGE,
+  COPY,
+  CURSOR,
   LAST_SIGNAL
 };
 
@@ -68,6 +78,568 @@ byzanz_recorder_get_invalid_region (ByzanzRecorder *recorder)
   return invalid;
 }
 
+/* Grows the region so that it only contains full tiles. We can only compare
+ * complete tiles against their previous contents. */
+static void
+byzanz_recorder_align_to_tiles (ByzanzRecorder *recorder, cairo_region_t *region)
+{
+  cairo_rectangle_int_t rect;
+  cairo_region_t *aligned;
+  int i, num_rects, x2, y2;
+
+  aligned = cairo_region_create ();
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    rect.x -= recorder->area.x;
+    rect.y -= recorder->area.y;
+    x2 = rect.x + rect.width;
+    y2 = rect.y + rect.height;
+    rect.x -= rect.x % BYZANZ_RECORDER_TILE_SIZE;
+    rect.y -= rect.y % BYZANZ_RECORDER_TILE_SIZE;
+    x2 = MIN (recorder->area.width,
+        (x2 + BYZANZ_RECORDER_TILE_SIZE - 1) / BYZANZ_RECORDER_TILE_SIZE * BYZANZ_RECORDER_TILE_SIZE);
+    y2 = MIN (recorder->area.height,
+        (y2 + BYZANZ_RECORDER_TILE_SIZE - 1) / BYZANZ_RECORDER_TILE_SIZE * BYZANZ_RECORDER_TILE_SIZE);
+    rect.width = x2 - rect.x;
+    rect.height = y2 - rect.y;
+    rect.x += recorder->area.x;
+    rect.y += recorder->area.y;
+    cairo_region_union_rectangle (aligned, &rect);
+  }
+
+  cairo_region_union (region, aligned);
+  cairo_region_destroy (aligned);
+}
+
+/* Damage only tells us that something was drawn, not that anything changed.
+ * Compare the checksums of all captured tiles with the ones we recorded last
+ * time and remove those from the region that are still the same.
+ * The region must be in area coordinates and aligned to tiles. */
+static void
+byzanz_recorder_discard_unchanged (ByzanzRecorder *       recorder,
+                                   cairo_surface_t *      surface,
+                                   cairo_region_t *       region)
+{
+  cairo_rectangle_int_t rect, tile;
+  cairo_region_t *unchanged;
+  double x_offset, y_offset;
+  guint64 hash, *checksum;
+  const guchar *data;
+  int i, num_rects, x, y, row, stride;
+
+  cairo_surface_flush (surface);
+  cairo_surface_get_device_offset (surface, &x_offset, &y_offset);
+  stride = cairo_image_surface_get_stride (surface);
+
+  unchanged = cairo_region_create ();
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y += BYZANZ_RECORDER_TILE_SIZE) {
+      for (x = rect.x; x < rect.x + rect.width; x += BYZANZ_RECORDER_TILE_SIZE) {
+        tile.x = x;
+        tile.y = y;
+        tile.width = MIN (BYZANZ_RECORDER_TILE_SIZE, rect.x + rect.width - x);
+        tile.height = MIN (BYZANZ_RECORDER_TILE_SIZE, rect.y + rect.height - y);
+
+        data = cairo_image_surface_get_data (surface)
+          + stride * (tile.y + (int) y_offset)
+          + sizeof (guint32) * (tile.x + (int) x_offset);
+        hash = 0;
+        for (row = 0; row < tile.height; row++) {
+          hash = byzanz_hash (data, tile.width * sizeof (guint32), hash);
+          data += stride;
+        }
+
+        checksum = &recorder->tiles[(y / BYZANZ_RECORDER_TILE_SIZE) * recorder->n_tiles_x
+                                    + x / BYZANZ_RECORDER_TILE_SIZE];
+        if (*checksum == hash)
+          cairo_region_union_rectangle (unchanged, &tile);
+        else
+          *checksum = hash;
+      }
+    }
+  }
+
+  cairo_region_subtract (region, unchanged);
+  cairo_region_destroy (unchanged);
+}
+
+/* Keeps recorder->frame up to date with the contents of area */
+static void
+byzanz_recorder_update_frame (ByzanzRecorder *       recorder,
+                              cairo_surface_t *      surface,
+                              const cairo_region_t * region)
+{
+  cairo_t *cr;
+  int i, num_rects;
+
+  cr = cairo_create (recorder->frame);
+  cairo_set_source_surface (cr, surface, 0, 0);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle (region, i, &rect);
+    cairo_rectangle (cr, rect.x, rect.y,
+                     rect.width, rect.height);
+  }
+
+  cairo_fill (cr);
+  cairo_destroy (cr);
+  cairo_surface_flush (recorder->frame);
+}
+
+/* Makes last_frame equal to frame again after a snapshot was processed */
+static void
+byzanz_recorder_commit_frame (ByzanzRecorder *       recorder,
+                              const cairo_region_t * region)
+{
+  cairo_rectangle_int_t rect;
+  guchar *data, *last_data;
+  int i, y, num_rects, stride;
+
+  stride = cairo_image_surface_get_stride (recorder->frame);
+  data = cairo_image_surface_get_data (recorder->frame);
+  last_data = cairo_image_surface_get_data (recorder->last_frame);
+
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+      memcpy (last_data + y * stride + rect.x * sizeof (guint32),
+          data + y * stride + rect.x * sizeof (guint32),
+          rect.width * sizeof (guint32));
+    }
+  }
+}
+
+/* Clears the table used for looking up @n_keys hashes. The table is
+ * allocated once for the whole area, but only as much of it is used as
+ * the lookups need. Returns the mask to apply to hashes. */
+static guint
+byzanz_recorder_vote_reset (ByzanzRecorder *recorder,
+                            guint           n_keys)
+{
+  guint size = 1 << g_bit_storage (2 * n_keys - 1);
+
+  memset (recorder->vote_values, 0, size * sizeof (int));
+  return size - 1;
+}
+
+static void
+byzanz_recorder_vote_insert (ByzanzRecorder *recorder,
+                             guint           mask,
+                             guint64         hash,
+                             int             pos)
+{
+  guint i;
+
+  for (i = hash & mask; recorder->vote_values[i] != 0; i = (i + 1) & mask) {
+    if (recorder->vote_keys[i] == hash) {
+      recorder->vote_values[i] = -1;
+      return;
+    }
+  }
+  recorder->vote_keys[i] = hash;
+  recorder->vote_values[i] = pos + 1;
+}
+
+/* Returns the position of @hash or -1 if it isn't known or not unique */
+static int
+byzanz_recorder_vote_lookup (ByzanzRecorder *recorder,
+                             guint           mask,
+                             guint64         hash)
+{
+  guint i;
+
+  for (i = hash & mask; recorder->vote_values[i] != 0; i = (i + 1) & mask) {
+    if (recorder->vote_keys[i] == hash)
+      return recorder->vote_values[i] > 0 ? recorder->vote_values[i] - 1 : -1;
+  }
+  return -1;
+}
+
+/* Finds the offset most rows in extents moved by when scrolling vertically.
+ * Every row of the last frame that is unique gets looked up by its hash.
+ * Like horizontal scrolling, only a sample of the current rows votes. */
+#define ROW_STEP 4
+static gboolean
+byzanz_recorder_vote_vertical (ByzanzRecorder *              recorder,
+                               const cairo_rectangle_int_t * extents,
+                               int *                         dy_out)
+{
+  guint *votes = recorder->votes;
+  guchar *data, *last_data;
+  gsize len;
+  guint mask;
+  int y, yo, stride, best;
+
+  stride = cairo_image_surface_get_stride (recorder->frame);
+  data = cairo_image_surface_get_data (recorder->frame) + extents->x * sizeof (guint32);
+  last_data = cairo_image_surface_get_data (recorder->last_frame) + extents->x * sizeof (guint32);
+  len = extents->width * sizeof (guint32);
+
+  mask = byzanz_recorder_vote_reset (recorder, extents->height);
+  for (y = 0; y < extents->height; y++) {
+    byzanz_recorder_vote_insert (recorder, mask,
+        byzanz_hash (last_data + (extents->y + y) * stride, len, 0), y);
+  }
+
+  memset (votes, 0, 2 * extents->height * sizeof (guint));
+  for (y = 0; y < extents->height; y += ROW_STEP) {
+    yo = byzanz_recorder_vote_lookup (recorder, mask,
+        byzanz_hash (data + (extents->y + y) * stride, len, 0));
+    if (yo >= 0 && yo != y)
+      votes[y - yo + extents->height]++;
+  }
+
+  best = 0;
+  for (y = 1; y < 2 * extents->height; y++) {
+    if (votes[y] > votes[best])
+      best = y;
+  }
+
+  *dy_out = best - extents->height;
+  return votes[best] > 0;
+}
+#undef ROW_STEP
+
+/* Finds the offset contents moved by when scrolling horizontally. Looking
+ * at every column would be too expensive, so this only compares short runs
+ * of pixels in a few rows. */
+#define WINDOW_SIZE 16
+static gboolean
+byzanz_recorder_vote_horizontal (ByzanzRecorder *              recorder,
+                                 const cairo_rectangle_int_t * extents,
+                                 int *                         dx_out)
+{
+  guint *votes = recorder->votes;
+  guchar *data, *last_data;
+  guint mask;
+  int x, xo, y, i, stride, best, n_windows;
+
+  n_windows = extents->width - WINDOW_SIZE + 1;
+  if (n_windows <= 0)
+    return FALSE;
+
+  stride = cairo_image_surface_get_stride (recorder->frame);
+  memset (votes, 0, 2 * extents->width * sizeof (guint));
+
+  for (i = 1; i <= 3; i++) {
+    y = extents->y + extents->height * i / 4;
+    data = cairo_image_surface_get_data (recorder->frame) + y * stride + extents->x * sizeof (guint32);
+    last_data = cairo_image_surface_get_data (recorder->last_frame) + y * stride + extents->x * sizeof (guint32);
+
+    mask = byzanz_recorder_vote_reset (recorder, n_windows);
+    for (x = 0; x < n_windows; x++) {
+      byzanz_recorder_vote_insert (recorder, mask,
+          byzanz_hash (last_data + x * sizeof (guint32), WINDOW_SIZE * sizeof (guint32), 0), x);
+    }
+
+    for (x = 0; x < n_windows; x += WINDOW_SIZE) {
+      xo = byzanz_recorder_vote_lookup (recorder, mask,
+          byzanz_hash (data + x * sizeof (guint32), WINDOW_SIZE * sizeof (guint32), 0));
+      if (xo >= 0 && xo != x)
+        votes[x - xo + extents->width]++;
+    }
+  }
+
+  best = 0;
+  for (x = 1; x < 2 * extents->width; x++) {
+    if (votes[x] > votes[best])
+      best = x;
+  }
+
+  *dx_out = best - extents->width;
+  return votes[best] > 0;
+}
+#undef WINDOW_SIZE
+
+/* Checks which rows really moved by dx, dy and finds the largest block of them */
+static gboolean
+byzanz_recorder_verify_copy (ByzanzRecorder *              recorder,
+                             const cairo_rectangle_int_t * extents,
+                             int                           dx,
+                             int                           dy,
+                             cairo_rectangle_int_t *       copy)
+{
+  cairo_rectangle_int_t dest;
+  guchar *data, *last_data;
+  int y, stride, start, best_start, best_height;
+
+  dest.x = extents->x + MAX (dx, 0);
+  dest.y = extents->y + MAX (dy, 0);
+  dest.width = extents->width - ABS (dx);
+  dest.height = extents->height - ABS (dy);
+  if (dest.width < BYZANZ_RECORDER_COPY_MIN_SIZE || dest.height < BYZANZ_RECORDER_COPY_MIN_SIZE)
+    return FALSE;
+
+  stride = cairo_image_surface_get_stride (recorder->frame);
+  data = cairo_image_surface_get_data (recorder->frame) + dest.x * sizeof (guint32);
+  last_data = cairo_image_surface_get_data (recorder->last_frame) + (dest.x - dx) * sizeof (guint32);
+
+  best_start = start = dest.y;
+  best_height = 0;
+  for (y = dest.y; y <= dest.y + dest.height; y++) {
+    if (y < dest.y + dest.height &&
+        memcmp (data + y * stride, last_data + (y - dy) * stride, dest.width * sizeof (guint32)) == 0)
+      continue;
+    if (y - start > best_height) {
+      best_start = start;
+      best_height = y - start;
+    }
+    start = y + 1;
+  }
+
+  if (best_height < BYZANZ_RECORDER_COPY_MIN_SIZE)
+    return FALSE;
+
+  copy->x = dest.x;
+  copy->y = best_start;
+  copy->width = dest.width;
+  copy->height = best_height;
+  return TRUE;
+}
+
+/* Detects if the invalid region was caused by contents that scrolled and
+ * returns the region that can be copied from the last frame. */
+static cairo_region_t *
+byzanz_recorder_find_copy (ByzanzRecorder *       recorder,
+                           const cairo_region_t * invalid,
+                           int *                  dx,
+                           int *                  dy)
+{
+  cairo_rectangle_int_t extents, copy;
+  cairo_region_t *region;
+
+  cairo_region_get_extents (invalid, &extents);
+  if (extents.width < BYZANZ_RECORDER_COPY_MIN_SIZE ||
+      extents.height < BYZANZ_RECORDER_COPY_MIN_SIZE)
+    return NULL;
+
+  if (byzanz_recorder_vote_vertical (recorder, &extents, dy) &&
+      byzanz_recorder_verify_copy (recorder, &extents, 0, *dy, &copy)) {
+    *dx = 0;
+  } else if (byzanz_recorder_vote_horizontal (recorder, &extents, dx) &&
+             byzanz_recorder_verify_copy (recorder, &extents, *dx, 0, &copy)) {
+    *dy = 0;
+  } else {
+    return NULL;
+  }
+
+  region = cairo_region_create_rectangle (&copy);
+  cairo_region_intersect (region, invalid);
+  if (cairo_region_is_empty (region)) {
+    cairo_region_destroy (region);
+    return NULL;
+  }
+
+  return region;
+}
+
+/* Converts a region to the scaled grid. The outer region contains every
+ * scaled pixel touched by region, the inner one only those completely
+ * covered. Pixels in the remainder of the last row and column get dropped. */
+static cairo_region_t *
+byzanz_recorder_scale_region (ByzanzRecorder *       recorder,
+                              const cairo_region_t * region,
+                              gboolean               inner)
+{
+  cairo_rectangle_int_t rect;
+  cairo_region_t *scaled;
+  guint width, height;
+  int i, num_rects, x2, y2, s;
+
+  s = recorder->scale;
+  if (s == 1)
+    return cairo_region_copy (region);
+
+  byzanz_recorder_get_scaled_size (recorder, &width, &height);
+  scaled = cairo_region_create ();
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    x2 = rect.x + rect.width;
+    y2 = rect.y + rect.height;
+    if (inner) {
+      rect.x = (rect.x + s - 1) / s;
+      rect.y = (rect.y + s - 1) / s;
+      x2 /= s;
+      y2 /= s;
+    } else {
+      rect.x /= s;
+      rect.y /= s;
+      x2 = (x2 + s - 1) / s;
+      y2 = (y2 + s - 1) / s;
+    }
+    x2 = MIN (x2, (int) width);
+    y2 = MIN (y2, (int) height);
+    if (x2 <= rect.x || y2 <= rect.y)
+      continue;
+    rect.width = x2 - rect.x;
+    rect.height = y2 - rect.y;
+    cairo_region_union_rectangle (scaled, &rect);
+  }
+
+  return scaled;
+}
+
+/* Creates the scaled image for the given region of the scaled grid. The
+ * pixels are taken from the complete frame, because the edges of the
+ * region need pixels that were not part of the snapshot. */
+static cairo_surface_t *
+byzanz_recorder_scale_frame (ByzanzRecorder *       recorder,
+                             const cairo_region_t * region)
+{
+  cairo_rectangle_int_t extents, rect;
+  cairo_surface_t *surface;
+  guchar *data, *frame_data;
+  int i, num_rects, stride, frame_stride, s;
+
+  s = recorder->scale;
+  cairo_region_get_extents (region, &extents);
+  surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, extents.width, extents.height);
+  cairo_surface_set_device_offset (surface, -extents.x, -extents.y);
+
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  frame_data = cairo_image_surface_get_data (recorder->frame);
+  frame_stride = cairo_image_surface_get_stride (recorder->frame);
+
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    byzanz_scale_box (data + (rect.y - extents.y) * stride + (rect.x - extents.x) * sizeof (guint32),
+        stride,
+        frame_data + rect.y * s * frame_stride + rect.x * s * sizeof (guint32),
+        frame_stride,
+        rect.width, rect.height, s);
+  }
+  cairo_surface_mark_dirty (surface);
+
+  return surface;
+}
+
+/* Emits the signals for the changed region, including copies and
+ * converting to the scaled grid. */
+static void
+byzanz_recorder_emit (ByzanzRecorder *       recorder,
+                      cairo_surface_t *      surface,
+                      const cairo_region_t * invalid,
+                      const GTimeVal *       tv)
+{
+  cairo_region_t *copy, *image;
+  int dx, dy;
+
+  copy = byzanz_recorder_find_copy (recorder, invalid, &dx, &dy);
+  if (copy && recorder->scale > 1) {
+    cairo_region_t *scaled;
+
+    /* only whole scaled pixels can be moved */
+    if (dx % (int) recorder->scale == 0 && dy % (int) recorder->scale == 0)
+      scaled = byzanz_recorder_scale_region (recorder, copy, TRUE);
+    else
+      scaled = NULL;
+    cairo_region_destroy (copy);
+    copy = NULL;
+    if (scaled && !cairo_region_is_empty (scaled)) {
+      copy = scaled;
+      dx /= (int) recorder->scale;
+      dy /= (int) recorder->scale;
+    } else if (scaled) {
+      cairo_region_destroy (scaled);
+    }
+  }
+
+  image = byzanz_recorder_scale_region (recorder, invalid, FALSE);
+  if (cairo_region_is_empty (image)) {
+    /* only the dropped pixels at the edge changed */
+    cairo_region_destroy (image);
+    if (copy)
+      cairo_region_destroy (copy);
+    return;
+  }
+
+  if (copy) {
+    g_signal_emit (recorder, signals[COPY], 0, copy, dx, dy, tv);
+    cairo_region_subtract (image, copy);
+    cairo_region_destroy (copy);
+    /* everything scrolled, nothing else to send */
+    if (cairo_region_is_empty (image)) {
+      cairo_region_destroy (image);
+      return;
+    }
+  }
+
+  if (recorder->scale > 1)
+    surface = byzanz_recorder_scale_frame (recorder, image);
+  else
+    cairo_surface_reference (surface);
+
+  g_signal_emit (recorder, signals[IMAGE], 0, surface, image, tv);
+
+  cairo_surface_destroy (surface);
+  cairo_region_destroy (image);
+}
+
+/* Shrinks the cursor image by the scale factor. The result is rounded up
+ * so that even tiny cursors stay visible. */
+static cairo_surface_t *
+byzanz_recorder_scale_cursor (ByzanzRecorder *  recorder,
+                              cairo_surface_t * cursor)
+{
+  cairo_surface_t *surface;
+  double xhot, yhot;
+  cairo_t *cr;
+  int s;
+
+  s = recorder->scale;
+  cairo_surface_get_device_offset (cursor, &xhot, &yhot);
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+      (cairo_image_surface_get_width (cursor) + s - 1) / s,
+      (cairo_image_surface_get_height (cursor) + s - 1) / s);
+
+  cr = cairo_create (surface);
+  cairo_scale (cr, 1.0 / s, 1.0 / s);
+  cairo_set_source_surface (cr, cursor, xhot, yhot);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  cairo_surface_set_device_offset (surface, (int) xhot / s, (int) yhot / s);
+
+  return surface;
+}
+
+static void
+byzanz_recorder_emit_cursor (ByzanzRecorder *recorder,
+                             const GTimeVal *tv)
+{
+  cairo_surface_t *cursor;
+  int x, y;
+
+  x = recorder->cursor_x - recorder->area.x;
+  y = recorder->cursor_y - recorder->area.y;
+  cursor = recorder->cursor;
+  if (recorder->scale > 1) {
+    if (cursor)
+      cursor = byzanz_recorder_scale_cursor (recorder, cursor);
+    /* round towards negative infinity for positions left of or above the area */
+    x = x >= 0 ? x / (int) recorder->scale : -((-x + (int) recorder->scale - 1) / (int) recorder->scale);
+    y = y >= 0 ? y / (int) recorder->scale : -((-y + (int) recorder->scale - 1) / (int) recorder->scale);
+  } else if (cursor) {
+    cairo_surface_reference (cursor);
+  }
+
+  recorder->cursor_changed = FALSE;
+  g_signal_emit (recorder, signals[CURSOR], 0, cursor, x, y, tv);
+
+  if (cursor)
+    cairo_surface_destroy (cursor);
+}
+
 static cairo_surface_t *
 ensure_image_surface (cairo_surface_t *surface, const cairo_region_t *region)
 {
@@ -155,6 +727,35 @@ byzanz_recorder_create_snapshot (ByzanzRecorder *recorder, const cairo_region_t
   return surface;
 }
 
+/**
+ * byzanz_recorder_get_time:
+ * @recorder: the recorder
+ * @tv: (out): set to the timestamp
+ *
+ * Gets the timestamp for a snapshot taken now. In time-lapse mode, the
+ * time between snapshots is shrunk so every one of them plays as a frame
+ * at the normal frame rate. Everything that is recorded alongside the
+ * snapshots must use these timestamps, too.
+ **/
+void
+byzanz_recorder_get_time (ByzanzRecorder *recorder,
+                          GTimeVal *      tv)
+{
+  gint64 elapsed;
+
+  g_return_if_fail (BYZANZ_IS_RECORDER (recorder));
+  g_return_if_fail (tv != NULL);
+
+  g_get_current_time (tv);
+  if (recorder->time_lapse == 0)
+    return;
+
+  elapsed = (gint64) (tv->tv_sec - recorder->start_time.tv_sec) * G_USEC_PER_SEC +
+    tv->tv_usec - recorder->start_time.tv_usec;
+  *tv = recorder->start_time;
+  g_time_val_add (tv, elapsed * (BYZANZ_RECORDER_FRAME_RATE_MS) / recorder->time_lapse);
+}
+
 static gboolean byzanz_recorder_snapshot (ByzanzRecorder *recorder);
 static gboolean
 byzanz_recorder_next_image (gpointer data)
@@ -184,20 +785,42 @@ byzanz_recorder_snapshot (ByzanzRecorder *recorder)
   invalid = byzanz_recorder_get_invalid_region (recorder);
   if (cairo_region_is_empty (invalid)) {
     cairo_region_destroy (invalid);
-    return FALSE;
-  }
-
-  surface = byzanz_recorder_create_snapshot (recorder, invalid);
-  g_get_current_time (&tv);
-  cairo_region_translate (invalid, -recorder->area.x, -recorder->area.y);
+    if (!recorder->cursor_changed)
+      return FALSE;
+    /* only the cursor changed, no need to read the screen */
+    byzanz_recorder_get_time (recorder, &tv);
+    byzanz_recorder_emit_cursor (recorder, &tv);
+  } else {
+    byzanz_recorder_align_to_tiles (recorder, invalid);
+    surface = byzanz_recorder_create_snapshot (recorder, invalid);
+    byzanz_recorder_get_time (recorder, &tv);
+    cairo_region_translate (invalid, -recorder->area.x, -recorder->area.y);
+
+    byzanz_recorder_discard_unchanged (recorder, surface, invalid);
+    if (cairo_region_is_empty (invalid) && !recorder->cursor_changed) {
+      cairo_surface_destroy (surface);
+      cairo_region_destroy (invalid);
+      return FALSE;
+    }
 
-  g_signal_emit (recorder, signals[IMAGE], 0, surface, invalid, &tv);
+    /* the cursor goes first, so readers can draw it on top of the image
+     * with the same timestamp */
+    if (recorder->cursor_changed)
+      byzanz_recorder_emit_cursor (recorder, &tv);
+    if (!cairo_region_is_empty (invalid)) {
+      byzanz_recorder_update_frame (recorder, surface, invalid);
+      byzanz_recorder_emit (recorder, surface, invalid, &tv);
+      byzanz_recorder_commit_frame (recorder, invalid);
+    }
 
-  cairo_surface_destroy (surface);
-  cairo_region_destroy (invalid);
+    cairo_surface_destroy (surface);
+    cairo_region_destroy (invalid);
+  }
 
+  /* damage keeps accumulating until the timer fires */
   recorder->next_image_source = gdk_threads_add_timeout_full (G_PRIORITY_HIGH_IDLE,
-      BYZANZ_RECORDER_FRAME_RATE_MS, byzanz_recorder_next_image, recorder, NULL);
+      recorder->time_lapse ? recorder->time_lapse : BYZANZ_RECORDER_FRAME_RATE_MS,
+      byzanz_recorder_next_image, recorder, NULL);
 
   return TRUE;
 }
@@ -274,6 +897,15 @@ byzanz_recorder_set_property (GObject *object, guint param_id, const GValue *val
     case PROP_RECORDING:
       byzanz_recorder_set_recording (recorder, g_value_get_boolean (value));
       break;
+    case PROP_SCALE:
+      byzanz_recorder_set_scale (recorder, g_value_get_uint (value));
+      break;
+    case PROP_CURSOR_METADATA:
+      byzanz_recorder_set_cursor_metadata (recorder, g_value_get_boolean (value));
+      break;
+    case PROP_TIME_LAPSE:
+      byzanz_recorder_set_time_lapse (recorder, g_value_get_uint (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -296,6 +928,15 @@ byzanz_recorder_get_property (GObject *object, guint param_id, GValue *value,
     case PROP_RECORDING:
       g_value_set_boolean (value, byzanz_recorder_get_recording (recorder));
       break;
+    case PROP_SCALE:
+      g_value_set_uint (value, recorder->scale);
+      break;
+    case PROP_CURSOR_METADATA:
+      g_value_set_boolean (value, recorder->cursor_metadata);
+      break;
+    case PROP_TIME_LAPSE:
+      g_value_set_uint (value, recorder->time_lapse);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -306,9 +947,31 @@ static void
 byzanz_recorder_constructed (GObject *object)
 {
   ByzanzRecorder *recorder = BYZANZ_RECORDER (object);
-
-  g_sequence_append (recorder->layers,
-      g_object_new (BYZANZ_TYPE_LAYER_WINDOW, "recorder", recorder, NULL));
+  guint n_votes, size;
+
+  recorder->n_tiles_x = (recorder->area.width + BYZANZ_RECORDER_TILE_SIZE - 1) / BYZANZ_RECORDER_TILE_SIZE;
+  recorder->tiles = g_new0 (guint64, recorder->n_tiles_x *
+      ((recorder->area.height + BYZANZ_RECORDER_TILE_SIZE - 1) / BYZANZ_RECORDER_TILE_SIZE));
+  recorder->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+      recorder->area.width, recorder->area.height);
+  recorder->last_frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+      recorder->area.width, recorder->area.height);
+  /* enough for looking up every row or column of the area when scrolling */
+  n_votes = MAX (recorder->area.width, recorder->area.height);
+  size = 1 << g_bit_storage (2 * n_votes - 1);
+  recorder->vote_keys = g_new (guint64, size);
+  recorder->vote_values = g_new (int, size);
+  recorder->votes = g_new (guint, 2 * n_votes);
+
+  /* Single windows are recorded from their own contents, so that other
+   * windows can't cover them. */
+  if (gdk_window_get_window_type (recorder->window) == GDK_WINDOW_FOREIGN &&
+      byzanz_layer_composite_is_supported (gdk_window_get_display (recorder->window)))
+    g_sequence_append (recorder->layers,
+        g_object_new (BYZANZ_TYPE_LAYER_COMPOSITE, "recorder", recorder, NULL));
+  else
+    g_sequence_append (recorder->layers,
+        g_object_new (BYZANZ_TYPE_LAYER_WINDOW, "recorder", recorder, NULL));
   g_sequence_append (recorder->layers,
       g_object_new (BYZANZ_TYPE_LAYER_CURSOR, "recorder", recorder, NULL));
 
@@ -339,6 +1002,14 @@ byzanz_recorder_finalize (GObject *object)
       byzanz_recorder_filter_events, recorder);
   g_object_unref (recorder->window);
   g_sequence_free (recorder->layers);
+  g_free (recorder->tiles);
+  g_free (recorder->vote_keys);
+  g_free (recorder->vote_values);
+  g_free (recorder->votes);
+  cairo_surface_destroy (recorder->frame);
+  cairo_surface_destroy (recorder->last_frame);
+  if (recorder->cursor)
+    cairo_surface_destroy (recorder->cursor);
 
   G_OBJECT_CLASS (byzanz_recorder_parent_class)->finalize (object);
 }
@@ -363,17 +1034,35 @@ byzanz_recorder_class_init (ByzanzRecorderClass *klass)
   g_object_class_install_property (object_class, PROP_RECORDING,
       g_param_spec_boolean ("recording", "recording", "TRUE when actively recording",
 	  FALSE, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class, PROP_SCALE,
+      g_param_spec_uint ("scale", "scale", "factor to shrink the recorded images by",
+	  1, G_MAXUINT, 1, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_CURSOR_METADATA,
+      g_param_spec_boolean ("cursor-metadata", "cursor metadata", "emit the cursor separately instead of drawing it",
+	  FALSE, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_TIME_LAPSE,
+      g_param_spec_uint ("time-lapse", "time lapse", "milliseconds between snapshots in time-lapse mode or 0",
+	  0, G_MAXUINT, 0, G_PARAM_READWRITE));
 
   signals[IMAGE] = g_signal_new ("image", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
       G_STRUCT_OFFSET (ByzanzRecorderClass, image), NULL, NULL, NULL,
       G_TYPE_NONE, 3, 
       G_TYPE_POINTER, G_TYPE_POINTER, G_TYPE_POINTER);
+  signals[COPY] = g_signal_new ("copy", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+      G_STRUCT_OFFSET (ByzanzRecorderClass, copy), NULL, NULL, NULL,
+      G_TYPE_NONE, 4, 
+      G_TYPE_POINTER, G_TYPE_INT, G_TYPE_INT, G_TYPE_POINTER);
+  signals[CURSOR] = g_signal_new ("cursor", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+      G_STRUCT_OFFSET (ByzanzRecorderClass, cursor), NULL, NULL, NULL,
+      G_TYPE_NONE, 4, 
+      G_TYPE_POINTER, G_TYPE_INT, G_TYPE_INT, G_TYPE_POINTER);
 }
 
 static void
 byzanz_recorder_init (ByzanzRecorder *recorder)
 {
   recorder->layers = g_sequence_new (g_object_unref);
+  recorder->scale = 1;
 }
 
 ByzanzRecorder *
@@ -394,8 +1083,13 @@ byzanz_recorder_set_recording (ByzanzRecorder *recorder, gboolean recording)
     return;
 
   recorder->recording = recording;
-  if (recording)
+  if (recording) {
+    g_get_current_time (&recorder->start_time);
+    /* make sure readers know the cursor from the start */
+    if (recorder->cursor_metadata)
+      recorder->cursor_changed = TRUE;
     byzanz_recorder_snapshot (recorder);
+  }
   g_object_notify (G_OBJECT (recorder), "recording");
 }
 
@@ -418,3 +1112,134 @@ byzanz_recorder_queue_snapshot (ByzanzRecorder *recorder)
   }
 }
 
+void
+byzanz_recorder_set_scale (ByzanzRecorder *recorder, guint scale)
+{
+  g_return_if_fail (BYZANZ_IS_RECORDER (recorder));
+  g_return_if_fail (!recorder->recording);
+  g_return_if_fail (scale > 0);
+  g_return_if_fail (scale <= (guint) recorder->area.width);
+  g_return_if_fail (scale <= (guint) recorder->area.height);
+
+  if (recorder->scale == scale)
+    return;
+
+  recorder->scale = scale;
+  g_object_notify (G_OBJECT (recorder), "scale");
+}
+
+guint
+byzanz_recorder_get_scale (ByzanzRecorder *recorder)
+{
+  g_return_val_if_fail (BYZANZ_IS_RECORDER (recorder), 1);
+
+  return recorder->scale;
+}
+
+/**
+ * byzanz_recorder_get_scaled_size:
+ * @recorder: the recorder
+ * @width: (out): set to the width of the emitted images
+ * @height: (out): set to the height of the emitted images
+ *
+ * Queries the size of the images the recorder emits. This is the size of
+ * the recorded area divided by the scale.
+ **/
+void
+byzanz_recorder_get_scaled_size (ByzanzRecorder *recorder,
+                                 guint *         width,
+                                 guint *         height)
+{
+  g_return_if_fail (BYZANZ_IS_RECORDER (recorder));
+
+  if (width)
+    *width = recorder->area.width / recorder->scale;
+  if (height)
+    *height = recorder->area.height / recorder->scale;
+}
+
+/**
+ * byzanz_recorder_set_time_lapse:
+ * @recorder: the recorder
+ * @time_lapse: milliseconds between snapshots or 0 to record normally
+ *
+ * In time-lapse mode, the screen is only read every @time_lapse
+ * milliseconds and the damage in between is collected into one image.
+ * Snapshots where nothing changed are skipped. The timestamps are
+ * rescaled so that every @time_lapse milliseconds play as one frame at
+ * %BYZANZ_RECORDER_FRAME_RATE_MS. This can only be changed while not
+ * recording.
+ **/
+void
+byzanz_recorder_set_time_lapse (ByzanzRecorder *recorder,
+                                guint           time_lapse)
+{
+  g_return_if_fail (BYZANZ_IS_RECORDER (recorder));
+  g_return_if_fail (!recorder->recording);
+
+  if (recorder->time_lapse == time_lapse)
+    return;
+
+  recorder->time_lapse = time_lapse;
+  g_object_notify (G_OBJECT (recorder), "time-lapse");
+}
+
+guint
+byzanz_recorder_get_time_lapse (ByzanzRecorder *recorder)
+{
+  g_return_val_if_fail (BYZANZ_IS_RECORDER (recorder), 0);
+
+  return recorder->time_lapse;
+}
+
+/**
+ * byzanz_recorder_set_cursor_metadata:
+ * @recorder: the recorder
+ * @cursor_metadata: %TRUE to emit the cursor separately
+ *
+ * In cursor metadata mode, the cursor is not drawn into the images.
+ * Instead the recorder emits the ByzanzRecorder::cursor signal whenever
+ * the cursor moves or changes its shape. Moving the pointer then no
+ * longer causes the screen to be read. This can only be changed while
+ * not recording.
+ **/
+void
+byzanz_recorder_set_cursor_metadata (ByzanzRecorder *recorder,
+                                     gboolean        cursor_metadata)
+{
+  g_return_if_fail (BYZANZ_IS_RECORDER (recorder));
+  g_return_if_fail (!recorder->recording);
+
+  if (recorder->cursor_metadata == cursor_metadata)
+    return;
+
+  recorder->cursor_metadata = cursor_metadata;
+  g_object_notify (G_OBJECT (recorder), "cursor-metadata");
+}
+
+gboolean
+byzanz_recorder_get_cursor_metadata (ByzanzRecorder *recorder)
+{
+  g_return_val_if_fail (BYZANZ_IS_RECORDER (recorder), FALSE);
+
+  return recorder->cursor_metadata;
+}
+
+/* for the cursor layer: x and y are in window coordinates */
+void
+byzanz_recorder_set_cursor (ByzanzRecorder * recorder,
+                            cairo_surface_t *cursor,
+                            int              x,
+                            int              y)
+{
+  g_return_if_fail (BYZANZ_IS_RECORDER (recorder));
+
+  if (cursor)
+    cairo_surface_reference (cursor);
+  if (recorder->cursor)
+    cairo_surface_destroy (recorder->cursor);
+  recorder->cursor = cursor;
+  recorder->cursor_x = x;
+  recorder->cursor_y = y;
+  recorder->cursor_changed = TRUE;
+}
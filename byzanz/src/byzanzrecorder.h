@@ -26,6 +26,12 @@ typedef struct _ByzanzRecorderClass ByzanzRecorderClass;
 /* 25 fps */
 #define BYZANZ_RECORDER_FRAME_RATE_MS 1000 / 25
 
+/* size of the tiles used for detecting unchanged content */
+#define BYZANZ_RECORDER_TILE_SIZE 32
+
+/* minimum width and height of an area to be detected as scrolled */
+#define BYZANZ_RECORDER_COPY_MIN_SIZE 64
+
 #define BYZANZ_TYPE_RECORDER                    (byzanz_recorder_get_type())
 #define BYZANZ_IS_RECORDER(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_RECORDER))
 #define BYZANZ_IS_RECORDER_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_RECORDER))
@@ -47,7 +53,26 @@ struct _ByzanzRecorder {
 
   GSequence *           layers;                 /* sequence of ByzanzLayer, ordered by layer depth */
 
+  guint64 *             tiles;                  /* checksums of the last recorded contents of every tile */
+  guint                 n_tiles_x;              /* number of tiles in a row of area */
+  guint                 scale;                  /* factor to shrink emitted images by */
+
+  cairo_surface_t *     frame;                  /* contents of area after the current snapshot */
+  cairo_surface_t *     last_frame;             /* contents of area after the last snapshot */
+  guint64 *             vote_keys;              /* hashes of rows or runs of pixels in last_frame */
+  int *                 vote_values;            /* for every key 0 if unused, -1 if not unique or its position + 1 */
+  guint *               votes;                  /* number of votes for every offset */
+
+  gboolean              cursor_metadata;        /* emit the cursor instead of drawing it into the images */
+  cairo_surface_t *     cursor;                 /* cursor to emit or NULL if none */
+  int                   cursor_x;               /* X position of the cursor's hotspot in window coordinates */
+  int                   cursor_y;               /* Y position of the cursor's hotspot in window coordinates */
+  gboolean              cursor_changed;         /* the cursor changed since it was emitted last */
+
   guint                 next_image_source;      /* timer that fires when enough time after the last frame has elapsed */
+
+  guint                 time_lapse;             /* milliseconds between snapshots in time-lapse mode or 0 */
+  GTimeVal              start_time;             /* when recording started, time-lapse timestamps are relative to it */
 };
 
 struct _ByzanzRecorderClass {
@@ -57,6 +82,16 @@ struct _ByzanzRecorderClass {
                                                          cairo_surface_t *       surface,
                                                          const cairo_surface_t * region,
                                                          const GTimeVal *        tv);
+  void                  (* copy)                        (ByzanzRecorder *        recorder,
+                                                         const cairo_region_t *  region,
+                                                         int                     dx,
+                                                         int                     dy,
+                                                         const GTimeVal *        tv);
+  void                  (* cursor)                      (ByzanzRecorder *        recorder,
+                                                         cairo_surface_t *       cursor,
+                                                         int                     x,
+                                                         int                     y,
+                                                         const GTimeVal *        tv);
 };
 
 GType		        byzanz_recorder_get_type	(void) G_GNUC_CONST;
@@ -70,5 +105,28 @@ gboolean                byzanz_recorder_get_recording   (ByzanzRecorder *
 
 void                    byzanz_recorder_queue_snapshot  (ByzanzRecorder *       recorder);
 
+void                    byzanz_recorder_set_scale       (ByzanzRecorder *       recorder,
+                                                         guint                  scale);
+guint                   byzanz_recorder_get_scale       (ByzanzRecorder *       recorder);
+void                    byzanz_recorder_get_scaled_size (ByzanzRecorder *       recorder,
+                                                         guint *                width,
+                                                         guint *                height);
+
+void                    byzanz_recorder_set_time_lapse  (ByzanzRecorder *       recorder,
+                                                         guint                  time_lapse);
+guint                   byzanz_recorder_get_time_lapse  (ByzanzRecorder *       recorder);
+void                    byzanz_recorder_get_time        (ByzanzRecorder *       recorder,
+                                                         GTimeVal *             tv);
+
+void                    byzanz_recorder_set_cursor_metadata
+                                                        (ByzanzRecorder *       recorder,
+                                                         gboolean               cursor_metadata);
+gboolean                byzanz_recorder_get_cursor_metadata
+                                                        (ByzanzRecorder *       recorder);
+void                    byzanz_recorder_set_cursor      (ByzanzRecorder *       recorder,
+                                                         cairo_surface_t *      cursor,
+                                                         int                    x,
+                                                         int                    y);
+
 
 #endif /* __HAVE_BYZANZ_RECORDER_H__ */
@@ -0,0 +1,391 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzreplay.h"
+
+#include <string.h>
+
+/* Recordings are kept as a list of segments, each starting with a
+ * keyframe holding the cursor - once one was seen - and the whole image,
+ * followed by the serialized records. Old segments can be dropped as a
+ * whole then, and the oldest remaining one is where a snapshot starts. */
+
+static void
+byzanz_replay_segment_free (ByzanzReplaySegment *segment)
+{
+  if (segment->data)
+    g_bytes_unref (segment->data);
+  g_array_unref (segment->offsets);
+  g_slice_free (ByzanzReplaySegment, segment);
+}
+
+/**
+ * byzanz_replay_new:
+ * @width: width of the recording
+ * @height: height of the recording
+ * @duration: milliseconds of the recording to keep at least
+ * @budget: bytes the kept recording may use
+ *
+ * Creates a ring that keeps the last @duration milliseconds of a
+ * recording in memory. When @budget is exceeded, older parts are dropped
+ * even if they are still within @duration.
+ *
+ * Returns: a new #ByzanzReplay
+ **/
+ByzanzReplay *
+byzanz_replay_new (guint   width,
+                   guint   height,
+                   guint64 duration,
+                   gsize   budget)
+{
+  ByzanzReplay *replay;
+
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (height > 0, NULL);
+
+  replay = g_slice_new0 (ByzanzReplay);
+  replay->width = width;
+  replay->height = height;
+  replay->duration = duration;
+  replay->budget = budget;
+  replay->frame = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+  replay->cursor_images = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) g_bytes_unref);
+  g_queue_init (&replay->segments);
+
+  return replay;
+}
+
+void
+byzanz_replay_free (ByzanzReplay *replay)
+{
+  g_return_if_fail (replay != NULL);
+
+  g_queue_foreach (&replay->segments, (GFunc) byzanz_replay_segment_free, NULL);
+  g_queue_clear (&replay->segments);
+  if (replay->output)
+    g_object_unref (replay->output);
+  g_hash_table_destroy (replay->cursor_images);
+  cairo_surface_destroy (replay->frame);
+
+  g_slice_free (ByzanzReplay, replay);
+}
+
+/* Finishes the segment that is written and drops the oldest segments
+ * the recording doesn't need anymore at @msecs */
+static void
+byzanz_replay_finish_segment (ByzanzReplay *replay,
+                              guint64       msecs)
+{
+  ByzanzReplaySegment *segment, *next;
+
+  if (replay->output == NULL)
+    return;
+
+  segment = g_queue_peek_tail (&replay->segments);
+  g_output_stream_close (replay->output, NULL, NULL);
+  segment->data = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (replay->output));
+  g_object_unref (replay->output);
+  replay->output = NULL;
+  replay->size += g_bytes_get_size (segment->data);
+
+  while (g_queue_get_length (&replay->segments) > 1) {
+    segment = g_queue_peek_head (&replay->segments);
+    next = g_queue_peek_nth (&replay->segments, 1);
+    /* the segments after this one cover enough without it? */
+    if (msecs - next->msecs < replay->duration && replay->size <= replay->budget)
+      break;
+    replay->size -= g_bytes_get_size (segment->data);
+    byzanz_replay_segment_free (g_queue_pop_head (&replay->segments));
+  }
+}
+
+/* Remembers where the record written to the last segment at @offset
+ * starts, so snapshots can find its timestamp without parsing the data */
+static void
+byzanz_replay_add_offset (ByzanzReplay *replay,
+                          gsize         offset)
+{
+  ByzanzReplaySegment *segment;
+
+  segment = g_queue_peek_tail (&replay->segments);
+  g_array_append_val (segment->offsets, offset);
+}
+
+static gsize
+byzanz_replay_get_offset (ByzanzReplay *replay)
+{
+  return g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (replay->output));
+}
+
+static gboolean
+byzanz_replay_start_segment (ByzanzReplay *replay,
+                             guint64       msecs,
+                             GError **     error)
+{
+  cairo_rectangle_int_t all = { 0, 0, replay->width, replay->height };
+  ByzanzReplaySegment *segment;
+  cairo_region_t *region;
+  gboolean result;
+
+  segment = g_slice_new0 (ByzanzReplaySegment);
+  segment->msecs = msecs;
+  segment->offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+  g_queue_push_tail (&replay->segments, segment);
+  replay->output = g_memory_output_stream_new_resizable ();
+
+  /* recordings without cursor records don't get one made up either */
+  if (replay->have_cursor) {
+    byzanz_replay_add_offset (replay, 0);
+    if (!byzanz_serialize_cursor (replay->output, msecs, replay->cursor,
+          replay->cursor_x, replay->cursor_y, NULL, error))
+      return FALSE;
+  }
+
+  byzanz_replay_add_offset (replay, byzanz_replay_get_offset (replay));
+  region = cairo_region_create_rectangle (&all);
+  result = byzanz_serialize (replay->output, msecs, replay->frame, region,
+      BYZANZ_SERIALIZE_COMPRESS, NULL, error);
+  cairo_region_destroy (region);
+
+  return result;
+}
+
+/**
+ * byzanz_replay_add:
+ * @replay: the replay
+ * @record: the next record of the recording
+ * @error: %NULL or location to take an error
+ *
+ * Adds @record to the recording kept in @replay. Every
+ * %BYZANZ_REPLAY_KEYFRAME_INTERVAL milliseconds a new segment is started
+ * and the segments that aren't needed anymore are dropped.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_replay_add (ByzanzReplay *       replay,
+                   const ByzanzRecord * record,
+                   GError **            error)
+{
+  ByzanzReplaySegment *segment;
+  GOutputStream *stream;
+  gsize offset;
+  gboolean result;
+
+  g_return_val_if_fail (replay != NULL, FALSE);
+  g_return_val_if_fail (record != NULL, FALSE);
+
+  switch (record->type) {
+    case BYZANZ_RECORD_IMAGE:
+      if (record->surface == NULL)
+        return TRUE;
+      byzanz_paint_region (replay->frame, record->surface, record->region);
+      segment = g_queue_peek_tail (&replay->segments);
+      /* Large segments start over early, so the budget is kept in
+       * reasonably small steps. The keyframe contains the image. */
+      if (replay->output == NULL ||
+          record->msecs >= segment->msecs + BYZANZ_REPLAY_KEYFRAME_INTERVAL ||
+          g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (replay->output)) > replay->budget / 4) {
+        byzanz_replay_finish_segment (replay, record->msecs);
+        return byzanz_replay_start_segment (replay, record->msecs, error);
+      }
+      offset = byzanz_replay_get_offset (replay);
+      result = byzanz_serialize (replay->output, record->msecs, record->surface, record->region,
+          BYZANZ_SERIALIZE_COMPRESS, NULL, error);
+      break;
+    case BYZANZ_RECORD_COPY:
+      cairo_surface_flush (replay->frame);
+      byzanz_copy_region (cairo_image_surface_get_data (replay->frame),
+          cairo_image_surface_get_stride (replay->frame), sizeof (guint32),
+          record->region, record->dx, record->dy);
+      cairo_surface_mark_dirty (replay->frame);
+      if (replay->output == NULL)
+        return TRUE;
+      offset = byzanz_replay_get_offset (replay);
+      result = byzanz_serialize_copy (replay->output, record->msecs, record->region,
+          record->dx, record->dy, NULL, error);
+      break;
+    case BYZANZ_RECORD_CURSOR:
+      replay->have_cursor = TRUE;
+      replay->cursor = record->cursor;
+      replay->cursor_x = record->x;
+      replay->cursor_y = record->y;
+      if (replay->output == NULL)
+        return TRUE;
+      offset = byzanz_replay_get_offset (replay);
+      result = byzanz_serialize_cursor (replay->output, record->msecs, record->cursor,
+          record->x, record->y, NULL, error);
+      break;
+    case BYZANZ_RECORD_CURSOR_IMAGE:
+      /* kept aside, segments may refer to them long after they were defined */
+      stream = g_memory_output_stream_new_resizable ();
+      if (!byzanz_serialize_cursor_image (stream, 0, record->cursor, record->surface, NULL, error)) {
+        g_object_unref (stream);
+        return FALSE;
+      }
+      g_output_stream_close (stream, NULL, NULL);
+      g_hash_table_insert (replay->cursor_images, GUINT_TO_POINTER (record->cursor),
+          g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (stream)));
+      g_object_unref (stream);
+      return TRUE;
+    default:
+      g_assert_not_reached ();
+      return FALSE;
+  }
+
+  if (result)
+    byzanz_replay_add_offset (replay, offset);
+  return result;
+}
+
+/**
+ * byzanz_replay_snapshot:
+ * @replay: the replay
+ * @msecs: the current time
+ *
+ * Takes a snapshot of the recording kept in @replay up to @msecs. The
+ * snapshot shares the finished segments with @replay, so this is cheap.
+ *
+ * Returns: a new snapshot or %NULL if nothing was recorded yet
+ **/
+ByzanzReplaySnapshot *
+byzanz_replay_snapshot (ByzanzReplay *replay,
+                        guint64       msecs)
+{
+  ByzanzReplaySnapshot *snapshot;
+  ByzanzReplaySegment *segment;
+  GMemoryOutputStream *stream;
+  GHashTableIter iter;
+  gpointer bytes;
+  GArray *offsets;
+  GList *walk;
+
+  g_return_val_if_fail (replay != NULL, NULL);
+
+  if (replay->output == NULL)
+    return NULL;
+
+  snapshot = g_slice_new0 (ByzanzReplaySnapshot);
+  snapshot->width = replay->width;
+  snapshot->height = replay->height;
+  segment = g_queue_peek_head (&replay->segments);
+  snapshot->start = segment->msecs;
+  snapshot->end = MAX (msecs, snapshot->start);
+
+  snapshot->cursor_images = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  g_hash_table_iter_init (&iter, replay->cursor_images);
+  while (g_hash_table_iter_next (&iter, NULL, &bytes))
+    g_ptr_array_add (snapshot->cursor_images, g_bytes_ref (bytes));
+
+  snapshot->segments = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  snapshot->offsets = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  for (walk = replay->segments.head; walk; walk = walk->next) {
+    segment = walk->data;
+    if (segment->data) {
+      g_ptr_array_add (snapshot->segments, g_bytes_ref (segment->data));
+      g_ptr_array_add (snapshot->offsets, g_array_ref (segment->offsets));
+    } else {
+      /* the segment that is still written */
+      stream = G_MEMORY_OUTPUT_STREAM (replay->output);
+      g_ptr_array_add (snapshot->segments, g_bytes_new (g_memory_output_stream_get_data (stream),
+            g_memory_output_stream_get_data_size (stream)));
+      offsets = g_array_sized_new (FALSE, FALSE, sizeof (gsize), segment->offsets->len);
+      g_array_append_vals (offsets, segment->offsets->data, segment->offsets->len);
+      g_ptr_array_add (snapshot->offsets, offsets);
+    }
+  }
+
+  return snapshot;
+}
+
+void
+byzanz_replay_snapshot_free (ByzanzReplaySnapshot *snapshot)
+{
+  g_return_if_fail (snapshot != NULL);
+
+  g_ptr_array_free (snapshot->cursor_images, TRUE);
+  g_ptr_array_free (snapshot->segments, TRUE);
+  g_ptr_array_free (snapshot->offsets, TRUE);
+  g_slice_free (ByzanzReplaySnapshot, snapshot);
+}
+
+/**
+ * byzanz_replay_snapshot_write:
+ * @snapshot: the snapshot
+ * @output: stream to write the recording to
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Writes @snapshot as a recording starting at time 0. The snapshot is
+ * not modified, so this function can be called from any thread.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_replay_snapshot_write (ByzanzReplaySnapshot * snapshot,
+                              GOutputStream *        output,
+                              GCancellable *         cancellable,
+                              GError **              error)
+{
+  const guint8 *data;
+  GArray *offsets;
+  GBytes *bytes;
+  gsize start, end;
+  guint64 msecs;
+  guint i, j;
+
+  g_return_val_if_fail (snapshot != NULL, FALSE);
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (output), FALSE);
+
+  if (!byzanz_serialize_header (output, snapshot->width, snapshot->height,
+        BYZANZ_SERIALIZE_COMPRESS, cancellable, error))
+    return FALSE;
+
+  /* these are serialized at time 0 already */
+  for (i = 0; i < snapshot->cursor_images->len; i++) {
+    bytes = g_ptr_array_index (snapshot->cursor_images, i);
+    if (!g_output_stream_write_all (output, g_bytes_get_data (bytes, NULL),
+          g_bytes_get_size (bytes), NULL, cancellable, error))
+      return FALSE;
+  }
+
+  /* Every record starts with its timestamp, so only that needs to be
+   * rebased. The rest is copied as is, compressed images and all. */
+  for (i = 0; i < snapshot->segments->len; i++) {
+    bytes = g_ptr_array_index (snapshot->segments, i);
+    offsets = g_ptr_array_index (snapshot->offsets, i);
+    data = g_bytes_get_data (bytes, NULL);
+    for (j = 0; j < offsets->len; j++) {
+      start = g_array_index (offsets, gsize, j);
+      end = j + 1 < offsets->len ? g_array_index (offsets, gsize, j + 1) : g_bytes_get_size (bytes);
+      memcpy (&msecs, data + start, sizeof (guint64));
+      msecs -= snapshot->start;
+      if (!g_output_stream_write_all (output, &msecs, sizeof (guint64), NULL, cancellable, error) ||
+          !g_output_stream_write_all (output, data + start + sizeof (guint64),
+            end - start - sizeof (guint64), NULL, cancellable, error))
+        return FALSE;
+    }
+  }
+
+  return byzanz_serialize (output, snapshot->end - snapshot->start, NULL, NULL, 0, cancellable, error);
+}
+
@@ -0,0 +1,87 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gio/gio.h>
+#include <cairo.h>
+
+#include "byzanzserialize.h"
+
+#ifndef __HAVE_BYZANZ_REPLAY_H__
+#define __HAVE_BYZANZ_REPLAY_H__
+
+/* time between keyframes, old recordings are dropped in steps of this */
+#define BYZANZ_REPLAY_KEYFRAME_INTERVAL 5000
+/* default for ByzanzSession:replay-budget */
+#define BYZANZ_REPLAY_BUDGET (64 * 1024 * 1024)
+
+typedef struct _ByzanzReplaySegment ByzanzReplaySegment;
+struct _ByzanzReplaySegment {
+  guint64               msecs;          /* timestamp of the keyframe the segment starts with */
+  GBytes *              data;           /* serialized records, NULL while the segment is written */
+  GArray *              offsets;        /* gsize offset of every record in the data */
+};
+
+typedef struct _ByzanzReplay ByzanzReplay;
+struct _ByzanzReplay {
+  guint                 width;          /* width of the recording */
+  guint                 height;         /* height of the recording */
+  guint64               duration;       /* milliseconds that should at least be kept */
+  gsize                 budget;         /* bytes the segments may use */
+
+  cairo_surface_t *     frame;          /* current image, keyframes are made from it */
+  GHashTable *          cursor_images;  /* cursor id => GBytes of the serialized cursor image */
+  gboolean              have_cursor;    /* TRUE once a cursor record was added */
+  guint                 cursor;         /* id of the current cursor or 0 */
+  int                   cursor_x;       /* X position of the cursor's hotspot */
+  int                   cursor_y;       /* Y position of the cursor's hotspot */
+
+  GQueue                segments;       /* ByzanzReplaySegment, oldest first */
+  GOutputStream *       output;         /* NULL or stream writing the last segment */
+  gsize                 size;           /* bytes used by the finished segments */
+};
+
+typedef struct _ByzanzReplaySnapshot ByzanzReplaySnapshot;
+struct _ByzanzReplaySnapshot {
+  guint                 width;          /* width of the recording */
+  guint                 height;         /* height of the recording */
+  guint64               start;          /* timestamp of the first keyframe */
+  guint64               end;            /* timestamp the snapshot was taken at */
+  GPtrArray *           cursor_images;  /* GBytes of the serialized cursor images */
+  GPtrArray *           segments;       /* GBytes of the segments */
+  GPtrArray *           offsets;        /* GArray of the record offsets for every segment */
+};
+
+ByzanzReplay *          byzanz_replay_new               (guint                  width,
+                                                         guint                  height,
+                                                         guint64                duration,
+                                                         gsize                  budget);
+void                    byzanz_replay_free              (ByzanzReplay *         replay);
+
+gboolean                byzanz_replay_add               (ByzanzReplay *         replay,
+                                                         const ByzanzRecord *   record,
+                                                         GError **              error);
+ByzanzReplaySnapshot *  byzanz_replay_snapshot          (ByzanzReplay *         replay,
+                                                         guint64                msecs);
+
+void                    byzanz_replay_snapshot_free     (ByzanzReplaySnapshot * snapshot);
+gboolean                byzanz_replay_snapshot_write    (ByzanzReplaySnapshot * snapshot,
+                                                         GOutputStream *        output,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+
+
+#endif /* __HAVE_BYZANZ_REPLAY_H__ */
@@ -0,0 +1,345 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "byzanzscale.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static void
+byzanz_scale_box_generic (guchar *       dest,
+                          gsize          dest_stride,
+                          const guchar * src,
+                          gsize          src_stride,
+                          guint          width,
+                          guint          height,
+                          guint          factor)
+{
+  guint x, y, i, j, c, sum[4], n;
+  const guchar *block;
+
+  n = factor * factor;
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++) {
+      sum[0] = sum[1] = sum[2] = sum[3] = n / 2;
+      block = src + x * factor * 4;
+      for (j = 0; j < factor; j++) {
+        for (i = 0; i < factor * 4; i += 4) {
+          for (c = 0; c < 4; c++)
+            sum[c] += block[i + c];
+        }
+        block += src_stride;
+      }
+      for (c = 0; c < 4; c++)
+        dest[x * 4 + c] = sum[c] / n;
+    }
+    dest += dest_stride;
+    src += src_stride * factor;
+  }
+}
+
+#ifdef __SSE2__
+/* sums up the two pixels in v and puts the result in the lower 64 bits */
+#define SUM_PAIR(v) _mm_add_epi16 ((v), _mm_srli_si128 ((v), 8))
+
+static void
+byzanz_scale_box_2_sse2 (guchar *       dest,
+                         gsize          dest_stride,
+                         const guchar * src,
+                         gsize          src_stride,
+                         guint          width,
+                         guint          height)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i round = _mm_set1_epi16 (2);
+  __m128i top, bottom, a, b, c, d;
+  guint x, y;
+
+  for (y = 0; y < height; y++) {
+    const guchar *row0 = src;
+    const guchar *row1 = src + src_stride;
+
+    /* 8 source pixels become 4 destination pixels */
+    for (x = 0; x + 4 <= width; x += 4) {
+      top = _mm_loadu_si128 ((const __m128i *) (const void *) (row0 + x * 8));
+      bottom = _mm_loadu_si128 ((const __m128i *) (const void *) (row1 + x * 8));
+      a = _mm_add_epi16 (_mm_unpacklo_epi8 (top, zero), _mm_unpacklo_epi8 (bottom, zero));
+      b = _mm_add_epi16 (_mm_unpackhi_epi8 (top, zero), _mm_unpackhi_epi8 (bottom, zero));
+      top = _mm_loadu_si128 ((const __m128i *) (const void *) (row0 + x * 8 + 16));
+      bottom = _mm_loadu_si128 ((const __m128i *) (const void *) (row1 + x * 8 + 16));
+      c = _mm_add_epi16 (_mm_unpacklo_epi8 (top, zero), _mm_unpacklo_epi8 (bottom, zero));
+      d = _mm_add_epi16 (_mm_unpackhi_epi8 (top, zero), _mm_unpackhi_epi8 (bottom, zero));
+
+      a = _mm_unpacklo_epi64 (SUM_PAIR (a), SUM_PAIR (b));
+      c = _mm_unpacklo_epi64 (SUM_PAIR (c), SUM_PAIR (d));
+      a = _mm_srli_epi16 (_mm_add_epi16 (a, round), 2);
+      c = _mm_srli_epi16 (_mm_add_epi16 (c, round), 2);
+      _mm_storeu_si128 ((__m128i *) (void *) (dest + x * 4), _mm_packus_epi16 (a, c));
+    }
+    if (x < width)
+      byzanz_scale_box_generic (dest + x * 4, dest_stride, src + x * 8, src_stride, width - x, 1, 2);
+
+    dest += dest_stride;
+    src += src_stride * 2;
+  }
+}
+
+#undef SUM_PAIR
+#endif
+
+/**
+ * byzanz_scale_box:
+ * @dest: destination data
+ * @dest_stride: rowstride of @dest
+ * @src: source data
+ * @src_stride: rowstride of @src
+ * @width: width of the destination in pixels
+ * @height: height of the destination in pixels
+ * @factor: scale factor
+ *
+ * Downscales 32bit pixels by averaging every @factor x @factor block of @src
+ * into one pixel of @dest. Halving the size is by far the most common case,
+ * so it is vectorized where possible.
+ **/
+void
+byzanz_scale_box (guchar *       dest,
+                  gsize          dest_stride,
+                  const guchar * src,
+                  gsize          src_stride,
+                  guint          width,
+                  guint          height,
+                  guint          factor)
+{
+  g_return_if_fail (factor > 0);
+
+#ifdef __SSE2__
+  if (factor == 2) {
+    byzanz_scale_box_2_sse2 (dest, dest_stride, src, src_stride, width, height);
+    return;
+  }
+#endif
+
+  byzanz_scale_box_generic (dest, dest_stride, src, src_stride, width, height, factor);
+}
+
+/* BT.601 studio range, U and V take the sum of a 2x2 block */
+#define BYZANZ_Y(r, g, b) ((66 * (r) + 129 * (g) + 25 * (b) + 128 + (16 << 8)) >> 8)
+#define BYZANZ_U(r, g, b) ((-38 * (r) - 74 * (g) + 112 * (b) + 512 + (128 << 10)) >> 10)
+#define BYZANZ_V(r, g, b) ((112 * (r) - 94 * (g) - 18 * (b) + 512 + (128 << 10)) >> 10)
+#define BYZANZ_R(p) (((p) >> 16) & 0xFF)
+#define BYZANZ_G(p) (((p) >> 8) & 0xFF)
+#define BYZANZ_B(p) ((p) & 0xFF)
+
+/* converts the pixels from x to end of two rows, the last column is
+ * repeated if width is odd */
+static void
+byzanz_convert_i420_generic (guchar *        luma1,
+                             guchar *        luma2,
+                             guchar *        u,
+                             guchar *        v,
+                             const guint32 * src1,
+                             const guint32 * src2,
+                             int             x,
+                             int             end,
+                             int             width)
+{
+  for (; x < end; x += 2) {
+    int x2 = MIN (x + 1, width - 1);
+    guint32 p1 = src1[x], p2 = src1[x2], p3 = src2[x], p4 = src2[x2];
+    guint r = BYZANZ_R (p1) + BYZANZ_R (p2) + BYZANZ_R (p3) + BYZANZ_R (p4);
+    guint g = BYZANZ_G (p1) + BYZANZ_G (p2) + BYZANZ_G (p3) + BYZANZ_G (p4);
+    guint b = BYZANZ_B (p1) + BYZANZ_B (p2) + BYZANZ_B (p3) + BYZANZ_B (p4);
+
+    luma1[x] = BYZANZ_Y (BYZANZ_R (p1), BYZANZ_G (p1), BYZANZ_B (p1));
+    luma1[x2] = BYZANZ_Y (BYZANZ_R (p2), BYZANZ_G (p2), BYZANZ_B (p2));
+    luma2[x] = BYZANZ_Y (BYZANZ_R (p3), BYZANZ_G (p3), BYZANZ_B (p3));
+    luma2[x2] = BYZANZ_Y (BYZANZ_R (p4), BYZANZ_G (p4), BYZANZ_B (p4));
+    u[x / 2] = BYZANZ_U ((int) r, (int) g, (int) b);
+    v[x / 2] = BYZANZ_V ((int) r, (int) g, (int) b);
+  }
+}
+
+#ifdef __SSE2__
+/* sums up the two pixels in v and puts the result in the lower 64 bits */
+#define SUM_PAIR(v) _mm_add_epi16 ((v), _mm_srli_si128 ((v), 8))
+
+/* Multiplies the B, G, R and X words of two pixels with coeffs and returns
+ * the sums in 32bit elements 0 and 2. */
+static inline __m128i
+byzanz_dot_sse2 (__m128i pixels,
+                 __m128i coeffs)
+{
+  pixels = _mm_madd_epi16 (pixels, coeffs);
+  return _mm_add_epi32 (pixels, _mm_srli_epi64 (pixels, 32));
+}
+
+/* puts elements 0 and 2 of a and b into one register */
+static inline __m128i
+byzanz_even_sse2 (__m128i a,
+                  __m128i b)
+{
+  return _mm_unpacklo_epi64 (_mm_shuffle_epi32 (a, _MM_SHUFFLE (3, 1, 2, 0)),
+      _mm_shuffle_epi32 (b, _MM_SHUFFLE (3, 1, 2, 0)));
+}
+
+/* the Y values of 4 pixels as 32bit integers */
+static inline __m128i
+byzanz_luma_sse2 (__m128i pixels)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i coeffs = _mm_setr_epi16 (25, 129, 66, 0, 25, 129, 66, 0);
+  const __m128i bias = _mm_set1_epi32 (128 + (16 << 8));
+  __m128i luma;
+
+  luma = byzanz_even_sse2 (byzanz_dot_sse2 (_mm_unpacklo_epi8 (pixels, zero), coeffs),
+      byzanz_dot_sse2 (_mm_unpackhi_epi8 (pixels, zero), coeffs));
+  return _mm_srai_epi32 (_mm_add_epi32 (luma, bias), 8);
+}
+
+/* Does 8 pixels at once, the rest is left to the generic version. Pixels
+ * are B, G, R, X in memory on the little endian machines with SSE2. */
+static void
+byzanz_convert_i420_sse2 (guchar *        luma1,
+                          guchar *        luma2,
+                          guchar *        u,
+                          guchar *        v,
+                          const guint32 * src1,
+                          const guint32 * src2,
+                          int             x,
+                          int             end,
+                          int             width)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i u_coeffs = _mm_setr_epi16 (112, -74, -38, 0, 112, -74, -38, 0);
+  const __m128i v_coeffs = _mm_setr_epi16 (-18, -94, 112, 0, -18, -94, 112, 0);
+  const __m128i bias = _mm_set1_epi32 (512 + (128 << 10));
+  __m128i top0, top1, bottom0, bottom1, a, b, c, d, cu, cv;
+  guint32 chroma;
+
+  for (; x + 8 <= end; x += 8) {
+    top0 = _mm_loadu_si128 ((const __m128i *) (const void *) (src1 + x));
+    top1 = _mm_loadu_si128 ((const __m128i *) (const void *) (src1 + x + 4));
+    bottom0 = _mm_loadu_si128 ((const __m128i *) (const void *) (src2 + x));
+    bottom1 = _mm_loadu_si128 ((const __m128i *) (const void *) (src2 + x + 4));
+
+    a = _mm_packs_epi32 (byzanz_luma_sse2 (top0), byzanz_luma_sse2 (top1));
+    _mm_storel_epi64 ((__m128i *) (void *) (luma1 + x), _mm_packus_epi16 (a, zero));
+    a = _mm_packs_epi32 (byzanz_luma_sse2 (bottom0), byzanz_luma_sse2 (bottom1));
+    _mm_storel_epi64 ((__m128i *) (void *) (luma2 + x), _mm_packus_epi16 (a, zero));
+
+    /* the sums of the four 2x2 blocks, two per register */
+    a = _mm_add_epi16 (_mm_unpacklo_epi8 (top0, zero), _mm_unpacklo_epi8 (bottom0, zero));
+    b = _mm_add_epi16 (_mm_unpackhi_epi8 (top0, zero), _mm_unpackhi_epi8 (bottom0, zero));
+    c = _mm_add_epi16 (_mm_unpacklo_epi8 (top1, zero), _mm_unpacklo_epi8 (bottom1, zero));
+    d = _mm_add_epi16 (_mm_unpackhi_epi8 (top1, zero), _mm_unpackhi_epi8 (bottom1, zero));
+    a = _mm_unpacklo_epi64 (SUM_PAIR (a), SUM_PAIR (b));
+    c = _mm_unpacklo_epi64 (SUM_PAIR (c), SUM_PAIR (d));
+
+    cu = byzanz_even_sse2 (byzanz_dot_sse2 (a, u_coeffs), byzanz_dot_sse2 (c, u_coeffs));
+    cv = byzanz_even_sse2 (byzanz_dot_sse2 (a, v_coeffs), byzanz_dot_sse2 (c, v_coeffs));
+    cu = _mm_srai_epi32 (_mm_add_epi32 (cu, bias), 10);
+    cv = _mm_srai_epi32 (_mm_add_epi32 (cv, bias), 10);
+    a = _mm_packus_epi16 (_mm_packs_epi32 (cu, cv), zero);
+    chroma = _mm_cvtsi128_si32 (a);
+    memcpy (u + x / 2, &chroma, sizeof (guint32));
+    chroma = _mm_cvtsi128_si32 (_mm_srli_si128 (a, 4));
+    memcpy (v + x / 2, &chroma, sizeof (guint32));
+  }
+
+  byzanz_convert_i420_generic (luma1, luma2, u, v, src1, src2, x, end, width);
+}
+
+#undef SUM_PAIR
+#endif
+
+/**
+ * byzanz_convert_region_i420:
+ * @planes: the Y, U and V planes to write to
+ * @strides: the strides of @planes
+ * @source: the RGB24 image surface to convert
+ * @region: the area to convert
+ *
+ * Converts @region of @source to I420. The chroma planes have half the
+ * resolution, so @region is extended to whole 2x2 blocks first.
+ **/
+void
+byzanz_convert_region_i420 (guchar *               planes[3],
+                            const gsize            strides[3],
+                            cairo_surface_t *      source,
+                            const cairo_region_t * region)
+{
+  cairo_rectangle_int_t rect, area = { 0, 0, 0, 0 };
+  cairo_region_t *blocks;
+  const guint32 *src1, *src2;
+  guchar *luma1, *luma2, *u, *v;
+  const guchar *data;
+  gsize stride;
+  int i, y, y2, num_rects;
+
+  g_return_if_fail (planes != NULL);
+  g_return_if_fail (strides != NULL);
+  g_return_if_fail (source != NULL);
+  g_return_if_fail (region != NULL);
+
+  cairo_surface_flush (source);
+  data = cairo_image_surface_get_data (source);
+  stride = cairo_image_surface_get_stride (source);
+  area.width = cairo_image_surface_get_width (source);
+  area.height = cairo_image_surface_get_height (source);
+
+  blocks = cairo_region_create ();
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    rect.width += rect.x & 1;
+    rect.height += rect.y & 1;
+    rect.x &= ~1;
+    rect.y &= ~1;
+    rect.width += rect.width & 1;
+    rect.height += rect.height & 1;
+    cairo_region_union_rectangle (blocks, &rect);
+  }
+  cairo_region_intersect_rectangle (blocks, &area);
+
+  num_rects = cairo_region_num_rectangles (blocks);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (blocks, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y += 2) {
+      /* the last row is repeated for odd sizes */
+      y2 = MIN (y + 1, area.height - 1);
+      src1 = (const guint32 *) (const void *) (data + y * stride);
+      src2 = (const guint32 *) (const void *) (data + y2 * stride);
+      luma1 = planes[0] + y * strides[0];
+      luma2 = planes[0] + y2 * strides[0];
+      u = planes[1] + y / 2 * strides[1];
+      v = planes[2] + y / 2 * strides[2];
+#ifdef __SSE2__
+      byzanz_convert_i420_sse2 (luma1, luma2, u, v, src1, src2, rect.x, rect.x + rect.width, area.width);
+#else
+      byzanz_convert_i420_generic (luma1, luma2, u, v, src1, src2, rect.x, rect.x + rect.width, area.width);
+#endif
+    }
+  }
+  cairo_region_destroy (blocks);
+}
@@ -24,7 +24,99 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#include "byzanzmappedinputstream.h"
+
+/* The header is IDENTIFICATION, a 'V' and then the byte order, version and
+ * flags followed by width and height. Version 0 files had the byte order
+ * directly after IDENTIFICATION, readers that only know that format will
+ * reject newer files. Since version 2 a padding byte follows the flags, so
+ * that all records and their pixels start at 4 byte aligned offsets and
+ * can be used in place when the file is mapped into memory. Streams with
+ * the BYZANZ_SERIALIZE_INDEX flag have an index after the end of stream
+ * record, see byzanzindex.c.
+ * Every record starts with its timestamp and a 32bit word containing the
+ * record type in the upper 8 bits and the number of rectangles in the rest.
+ * Version 0 files only contain image records.
+ * Cursor records contain no rectangles, but the cursor id and position.
+ * Cursor image records define the image for a cursor id before its first
+ * use. When a stream contains cursor records, its first record is one.
+ * Image records with the RECORD_COMPRESSED bit set store every row as the
+ * number of 32bit words that follow and the row XORed with the row above
+ * and run length encoded. A word with the top bit set is a run of the
+ * following word, otherwise it is the number of literal words that follow.
+ * Only streams with the BYZANZ_SERIALIZE_COMPRESS header flag may contain
+ * them, so older readers reject those streams. */
 #define IDENTIFICATION "ByzanzRecording"
+#define VERSIONED 'V'
+#define VERSION 2
+
+#define RECORD_TYPE_SHIFT 24
+#define RECORD_N_RECTS_MASK ((1 << RECORD_TYPE_SHIFT) - 1)
+#define RECORD_COMPRESSED (1U << 31)
+
+#define RLE_RUN (1U << 31)
+/* shorter runs are stored as literals, they wouldn't save anything */
+#define RLE_MIN_RUN 3
+
+/* Records are assembled in a per-thread scratch buffer of this size, so
+ * that small rectangles and rows don't each cause a write. */
+#define BYZANZ_SERIALIZE_BUFFER_SIZE (256 * 1024)
+
+typedef struct _ByzanzWriter ByzanzWriter;
+struct _ByzanzWriter {
+  GOutputStream *       stream;         /* stream to write to */
+  guchar *              data;           /* the scratch buffer */
+  gsize                 length;         /* bytes of data in use */
+};
+
+static GPrivate scratch_buffer = G_PRIVATE_INIT (g_free);
+
+static void
+byzanz_writer_init (ByzanzWriter * writer,
+                    GOutputStream *stream)
+{
+  writer->stream = stream;
+  writer->data = g_private_get (&scratch_buffer);
+  if (writer->data == NULL) {
+    writer->data = g_malloc (BYZANZ_SERIALIZE_BUFFER_SIZE);
+    g_private_set (&scratch_buffer, writer->data);
+  }
+  writer->length = 0;
+}
+
+static gboolean
+byzanz_writer_flush (ByzanzWriter * writer,
+                     GCancellable * cancellable,
+                     GError **      error)
+{
+  gsize length = writer->length;
+
+  writer->length = 0;
+  if (length == 0)
+    return TRUE;
+
+  return g_output_stream_write_all (writer->stream, writer->data, length, NULL, cancellable, error);
+}
+
+/* data that doesn't fit into the buffer is written directly */
+static gboolean
+byzanz_writer_write (ByzanzWriter * writer,
+                     gconstpointer  data,
+                     gsize          size,
+                     GCancellable * cancellable,
+                     GError **      error)
+{
+  if (writer->length + size > BYZANZ_SERIALIZE_BUFFER_SIZE &&
+      !byzanz_writer_flush (writer, cancellable, error))
+    return FALSE;
+
+  if (size >= BYZANZ_SERIALIZE_BUFFER_SIZE)
+    return g_output_stream_write_all (writer->stream, data, size, NULL, cancellable, error);
+
+  memcpy (writer->data + writer->length, data, size);
+  writer->length += size;
+  return TRUE;
+}
 
 static guchar
 byte_order_to_uchar (void)
@@ -41,14 +133,15 @@ byte_order_to_uchar (void)
 }
 
 gboolean
-byzanz_serialize_header (GOutputStream * stream,
-                         guint           width,
-                         guint           height,
-                         GCancellable *  cancellable,
-                         GError **       error)
+byzanz_serialize_header (GOutputStream *       stream,
+                         guint                 width,
+                         guint                 height,
+                         ByzanzSerializeFlags  flags,
+                         GCancellable *        cancellable,
+                         GError **             error)
 {
   guint32 w, h;
-  guchar endian;
+  guchar version[5];
 
   g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
   g_return_val_if_fail (width <= G_MAXUINT32, FALSE);
@@ -56,29 +149,93 @@ byzanz_serialize_header (GOutputStream * stream,
 
   w = width;
   h = height;
-  endian = byte_order_to_uchar ();
+  version[0] = VERSIONED;
+  version[1] = byte_order_to_uchar ();
+  version[2] = VERSION;
+  version[3] = flags;
+  version[4] = 0; /* padding */
 
   return g_output_stream_write_all (stream, IDENTIFICATION, strlen (IDENTIFICATION), NULL, cancellable, error) &&
-    g_output_stream_write_all (stream, &endian, sizeof (guchar), NULL, cancellable, error) &&
+    g_output_stream_write_all (stream, version, sizeof (version), NULL, cancellable, error) &&
     g_output_stream_write_all (stream, &w, sizeof (guint32), NULL, cancellable, error) &&
     g_output_stream_write_all (stream, &h, sizeof (guint32), NULL, cancellable, error);
 }
 
+/**
+ * byzanz_serialize_add_flags:
+ * @stream: a seekable stream containing a recording
+ * @flags: the flags to add
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Adds @flags to the header of an existing recording, like when an index
+ * is appended to it. Recordings from before flags existed can't be
+ * changed. The position of @stream is undefined afterwards.
+ *
+ * Returns: %TRUE on success
+ **/
 gboolean
-byzanz_deserialize_header (GInputStream * stream,
-                           guint *        width,
-                           guint *        height,
-                           GCancellable * cancellable,
-                           GError **      error)
+byzanz_serialize_add_flags (GIOStream *          stream,
+                            ByzanzSerializeFlags flags,
+                            GCancellable *       cancellable,
+                            GError **            error)
+{
+  /* IDENTIFICATION, 'V', byte order, version and flags */
+  guchar header[strlen (IDENTIFICATION) + 4];
+  gsize length = strlen (IDENTIFICATION);
+
+  g_return_val_if_fail (G_IS_IO_STREAM (stream), FALSE);
+  g_return_val_if_fail (G_IS_SEEKABLE (stream), FALSE);
+
+  if (!g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, cancellable, error) ||
+      !g_input_stream_read_all (g_io_stream_get_input_stream (stream), header, sizeof (header),
+          NULL, cancellable, error))
+    return FALSE;
+
+  if (memcmp (header, IDENTIFICATION, length) != 0 || header[length] != VERSIONED) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        _("Recording was created by an old version of Byzanz"));
+    return FALSE;
+  }
+
+  header[length + 3] |= flags;
+  return g_seekable_seek (G_SEEKABLE (stream), length + 3, G_SEEK_SET, cancellable, error) &&
+    g_output_stream_write_all (g_io_stream_get_output_stream (stream), &header[length + 3], 1,
+        NULL, cancellable, error);
+}
+
+/**
+ * byzanz_deserialize_header:
+ * @stream: stream to read from
+ * @width: (out): set to the width of the recording
+ * @height: (out): set to the height of the recording
+ * @flags: (out): set to the flags the recording was written with
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Reads the header of a recording. The values it returns must be passed
+ * to byzanz_deserialize() for every record.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_deserialize_header (GInputStream *         stream,
+                           guint *                width,
+                           guint *                height,
+                           ByzanzSerializeFlags * flags,
+                           GCancellable *         cancellable,
+                           GError **              error)
 {
   char result[strlen (IDENTIFICATION) + 1];
   guint32 size[2];
-  guchar endian;
+  guchar endian, version[3], padding;
 
   g_return_val_if_fail (G_IS_INPUT_STREAM (stream), FALSE);
   g_return_val_if_fail (width != NULL, FALSE);
   g_return_val_if_fail (height != NULL, FALSE);
+  g_return_val_if_fail (flags != NULL, FALSE);
 
+  *flags = 0;
   if (!g_input_stream_read_all (stream, result, sizeof (result), NULL, cancellable, error))
     return FALSE;
 
@@ -88,6 +245,21 @@ byzanz_deserialize_header (GInputStream * stream,
     return FALSE;
   }
   endian = result[strlen (IDENTIFICATION)];
+  if (endian == VERSIONED) {
+    if (!g_input_stream_read_all (stream, version, sizeof (version), NULL, cancellable, error))
+      return FALSE;
+    endian = version[0];
+    if (version[1] > VERSION ||
+        (version[2] & ~(BYZANZ_SERIALIZE_COMPRESS | BYZANZ_SERIALIZE_INDEX)) != 0) {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+          _("Recording was created by a newer version of Byzanz"));
+      return FALSE;
+    }
+    if (version[1] >= 2 &&
+        !g_input_stream_read_all (stream, &padding, 1, NULL, cancellable, error))
+      return FALSE;
+    *flags = version[2];
+  }
   if (endian != byte_order_to_uchar ()) {
     g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
         _("Unsupported byte order"));
@@ -103,16 +275,144 @@ byzanz_deserialize_header (GInputStream * stream,
   return TRUE;
 } 
 
+static gboolean
+byzanz_serialize_rectangles (ByzanzWriter *         writer,
+                             guint64                msecs,
+                             ByzanzRecordType       type,
+                             gboolean               compressed,
+                             const cairo_region_t * region,
+                             GCancellable *         cancellable,
+                             GError **              error)
+{
+  cairo_rectangle_int_t rect;
+  guint32 n;
+  int i, n_rects;
+
+  n_rects = cairo_region_num_rectangles (region);
+  if (n_rects > RECORD_N_RECTS_MASK) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        _("Too many rectangles in region"));
+    return FALSE;
+  }
+  n = (type << RECORD_TYPE_SHIFT) | n_rects;
+  if (compressed)
+    n |= RECORD_COMPRESSED;
+  if (!byzanz_writer_write (writer, &msecs, sizeof (guint64), cancellable, error) ||
+      !byzanz_writer_write (writer, &n, sizeof (guint32), cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < n_rects; i++) {
+    gint32 ints[4];
+    cairo_region_get_rectangle (region, i, &rect);
+    ints[0] = rect.x, ints[1] = rect.y, ints[2] = rect.width, ints[3] = rect.height;
+
+    g_assert (sizeof (ints) == 16);
+    if (!byzanz_writer_write (writer, ints, sizeof (ints), cancellable, error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Compresses a row into @out, which must have space for width + 1 words.
+ * Returns the number of words used. */
+static guint
+byzanz_compress_row (guint32 *       out,
+                     guint32 *       xored,
+                     const guint32 * row,
+                     const guint32 * prev,
+                     guint           width)
+{
+  guint i, run, literals, n;
+
+  if (prev) {
+    for (i = 0; i < width; i++)
+      xored[i] = row[i] ^ prev[i];
+  } else {
+    memcpy (xored, row, width * sizeof (guint32));
+  }
+
+  n = 0;
+  literals = 0;
+  for (i = 0; i < width; i += run) {
+    for (run = 1; i + run < width && xored[i + run] == xored[i]; run++);
+    if (run < RLE_MIN_RUN) {
+      literals += run;
+      continue;
+    }
+    if (literals) {
+      out[n++] = literals;
+      memcpy (out + n, xored + i - literals, literals * sizeof (guint32));
+      n += literals;
+      literals = 0;
+    }
+    out[n++] = RLE_RUN | run;
+    out[n++] = xored[i];
+  }
+  if (literals) {
+    out[n++] = literals;
+    memcpy (out + n, xored + width - literals, literals * sizeof (guint32));
+    n += literals;
+  }
+
+  return n;
+}
+
+static gboolean
+byzanz_serialize_compressed (ByzanzWriter *         writer,
+                             cairo_surface_t *      surface,
+                             const cairo_region_t * region,
+                             GCancellable *         cancellable,
+                             GError **              error)
+{
+  cairo_rectangle_int_t rect, extents;
+  double x_offset, y_offset;
+  guint32 *out, *xored, n;
+  guchar *data;
+  int i, y, stride, n_rects;
+  gboolean result = TRUE;
+
+  cairo_region_get_extents (region, &extents);
+  out = g_new (guint32, 2 * extents.width + 1);
+  xored = out + extents.width + 1;
+
+  n_rects = cairo_region_num_rectangles (region);
+  stride = cairo_image_surface_get_stride (surface);
+  cairo_surface_get_device_offset (surface, &x_offset, &y_offset);
+  for (i = 0; i < n_rects && result; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    data = cairo_image_surface_get_data (surface) 
+      + stride * (rect.y + (int) y_offset) 
+      + sizeof (guint32) * (rect.x + (int) x_offset);
+    for (y = 0; y < rect.height; y++) {
+      n = byzanz_compress_row (out, xored, (const guint32 *) data,
+          y ? (const guint32 *) (data - stride) : NULL, rect.width);
+      if (!byzanz_writer_write (writer, &n, sizeof (guint32), cancellable, error) ||
+          !byzanz_writer_write (writer, out, n * sizeof (guint32), cancellable, error)) {
+        result = FALSE;
+        break;
+      }
+      data += stride;
+    }
+  }
+
+  g_free (out);
+  return result;
+}
+
 gboolean
 byzanz_serialize (GOutputStream *        stream,
                   guint64                msecs,
                   cairo_surface_t *      surface,
                   const cairo_region_t * region,
+                  ByzanzSerializeFlags   flags,
                   GCancellable *         cancellable,
                   GError **              error)
 {
+  ByzanzWriter writer;
   guint i, stride;
-  cairo_rectangle_int_t rect, extents;
+  cairo_rectangle_int_t rect;
+  double x_offset, y_offset;
   guchar *data;
   guint32 n;
   int y, n_rects;
@@ -121,118 +421,621 @@ byzanz_serialize (GOutputStream *        stream,
   g_return_val_if_fail ((surface == NULL) == (region == NULL), FALSE);
   g_return_val_if_fail (region == NULL || !cairo_region_is_empty (region), FALSE);
 
-  if (!g_output_stream_write_all (stream, &msecs, sizeof (guint64), NULL, cancellable, error))
-    return FALSE;
-
+  byzanz_writer_init (&writer, stream);
   if (surface == 0) {
     n = 0;
-    return g_output_stream_write_all (stream, &n, sizeof (guint32), NULL, cancellable, error);
+    return byzanz_writer_write (&writer, &msecs, sizeof (guint64), cancellable, error) &&
+      byzanz_writer_write (&writer, &n, sizeof (guint32), cancellable, error) &&
+      byzanz_writer_flush (&writer, cancellable, error);
   }
 
-  n = n_rects = cairo_region_num_rectangles (region);
-  if (!g_output_stream_write_all (stream, &n, sizeof (guint32), NULL, cancellable, error))
-    return FALSE;
-  for (i = 0; i < n; i++) {
-    gint32 ints[4];
-    cairo_region_get_rectangle (region, i, &rect);
-    ints[0] = rect.x, ints[1] = rect.y, ints[2] = rect.width, ints[3] = rect.height;
-
-    g_assert (sizeof (ints) == 16);
-    if (!g_output_stream_write_all (stream, ints, sizeof (ints), NULL, cancellable, error))
-      return FALSE;
+  if (flags & BYZANZ_SERIALIZE_COMPRESS) {
+    return byzanz_serialize_rectangles (&writer, msecs, BYZANZ_RECORD_IMAGE, TRUE, region, cancellable, error) &&
+      byzanz_serialize_compressed (&writer, surface, region, cancellable, error) &&
+      byzanz_writer_flush (&writer, cancellable, error);
   }
 
+  if (!byzanz_serialize_rectangles (&writer, msecs, BYZANZ_RECORD_IMAGE, FALSE, region, cancellable, error))
+    return FALSE;
+
+  /* The region may only cover parts of the surface, so use the surface's
+   * device offset to find the pixels */
+  n = n_rects = cairo_region_num_rectangles (region);
   stride = cairo_image_surface_get_stride (surface);
-  cairo_region_get_extents (region, &extents);
+  cairo_surface_get_device_offset (surface, &x_offset, &y_offset);
   for (i = 0; i < n; i++) {
     cairo_region_get_rectangle (region, i, &rect);
     data = cairo_image_surface_get_data (surface) 
-      + stride * (rect.y - extents.y) 
-      + sizeof (guint32) * (rect.x - extents.x);
+      + stride * (rect.y + (int) y_offset) 
+      + sizeof (guint32) * (rect.x + (int) x_offset);
+    /* rows spanning the whole surface are contiguous in memory */
+    if (rect.width * sizeof (guint32) == stride) {
+      if (!byzanz_writer_write (&writer, data, (gsize) stride * rect.height, cancellable, error))
+        return FALSE;
+      continue;
+    }
     for (y = 0; y < rect.height; y++) {
-      if (!g_output_stream_write_all (G_OUTPUT_STREAM (stream), data, 
-            rect.width * sizeof (guint32), NULL, cancellable, error))
+      if (!byzanz_writer_write (&writer, data, rect.width * sizeof (guint32), cancellable, error))
         return FALSE;
       data += stride;
     }
   }
 
+  return byzanz_writer_flush (&writer, cancellable, error);
+}
+
+/**
+ * byzanz_serialize_copy:
+ * @stream: stream to write to
+ * @msecs: timestamp of the copy
+ * @region: destination region of the copy
+ * @dx: horizontal distance the contents moved
+ * @dy: vertical distance the contents moved
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Writes a record that tells readers to replace the contents of @region with
+ * the contents of @region translated by -@dx, -@dy. This is how scrolling gets
+ * recorded without storing all the pixels again.
+ * An image record with the same timestamp may follow. Readers apply the
+ * copy first and then draw the image. Without such an image, the copy
+ * alone makes the frame.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_serialize_copy (GOutputStream *        stream,
+                       guint64                msecs,
+                       const cairo_region_t * region,
+                       int                    dx,
+                       int                    dy,
+                       GCancellable *         cancellable,
+                       GError **              error)
+{
+  ByzanzWriter writer;
+  gint32 offset[2];
+
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
+  g_return_val_if_fail (region != NULL && !cairo_region_is_empty (region), FALSE);
+
+  byzanz_writer_init (&writer, stream);
+  offset[0] = dx;
+  offset[1] = dy;
+  return byzanz_serialize_rectangles (&writer, msecs, BYZANZ_RECORD_COPY, FALSE, region, cancellable, error) &&
+    byzanz_writer_write (&writer, offset, sizeof (offset), cancellable, error) &&
+    byzanz_writer_flush (&writer, cancellable, error);
+}
+
+/**
+ * byzanz_serialize_cursor:
+ * @stream: stream to write to
+ * @msecs: timestamp of the cursor change
+ * @cursor: id of the cursor image or 0 if no cursor is shown
+ * @x: X position of the cursor's hotspot
+ * @y: Y position of the cursor's hotspot
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Writes a record that changes the cursor. Readers draw the cursor on top
+ * of the images. The image for @cursor must have been written before
+ * with byzanz_serialize_cursor_image().
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_serialize_cursor (GOutputStream * stream,
+                         guint64         msecs,
+                         guint           cursor,
+                         int             x,
+                         int             y,
+                         GCancellable *  cancellable,
+                         GError **       error)
+{
+  ByzanzWriter writer;
+  guint32 data[4];
+  
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
+
+  byzanz_writer_init (&writer, stream);
+  data[0] = BYZANZ_RECORD_CURSOR << RECORD_TYPE_SHIFT;
+  data[1] = cursor;
+  data[2] = x;
+  data[3] = y;
+
+  return byzanz_writer_write (&writer, &msecs, sizeof (guint64), cancellable, error) &&
+    byzanz_writer_write (&writer, data, sizeof (data), cancellable, error) &&
+    byzanz_writer_flush (&writer, cancellable, error);
+}
+
+/**
+ * byzanz_serialize_cursor_image:
+ * @stream: stream to write to
+ * @msecs: timestamp
+ * @cursor: id to use for this image, must not be 0
+ * @image: an ARGB32 image surface with the device offset set to the hotspot
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Defines the image for the cursor with the id @cursor.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+byzanz_serialize_cursor_image (GOutputStream *   stream,
+                               guint64           msecs,
+                               guint             cursor,
+                               cairo_surface_t * image,
+                               GCancellable *    cancellable,
+                               GError **         error)
+{
+  ByzanzWriter writer;
+  guint32 data[6];
+  double xhot, yhot;
+  guchar *pixels;
+  int y, stride;
+
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
+  g_return_val_if_fail (cursor != 0, FALSE);
+  g_return_val_if_fail (cairo_image_surface_get_format (image) == CAIRO_FORMAT_ARGB32, FALSE);
+
+  cairo_surface_flush (image);
+  cairo_surface_get_device_offset (image, &xhot, &yhot);
+  data[0] = BYZANZ_RECORD_CURSOR_IMAGE << RECORD_TYPE_SHIFT;
+  data[1] = cursor;
+  data[2] = cairo_image_surface_get_width (image);
+  data[3] = cairo_image_surface_get_height (image);
+  data[4] = (int) xhot;
+  data[5] = (int) yhot;
+
+  byzanz_writer_init (&writer, stream);
+  if (!byzanz_writer_write (&writer, &msecs, sizeof (guint64), cancellable, error) ||
+      !byzanz_writer_write (&writer, data, sizeof (data), cancellable, error))
+    return FALSE;
+
+  pixels = cairo_image_surface_get_data (image);
+  stride = cairo_image_surface_get_stride (image);
+  for (y = 0; y < (int) data[3]; y++) {
+    if (!byzanz_writer_write (&writer, pixels + y * stride, data[2] * sizeof (guint32),
+          cancellable, error))
+      return FALSE;
+  }
+
+  return byzanz_writer_flush (&writer, cancellable, error);
+}
+
+static const cairo_user_data_key_t mapping_key;
+
+/* Reads an image of the given size whose rows are stored without gaps.
+ * When the stream is mapped into memory and the data is suitably aligned,
+ * the surface uses the mapped data directly instead of copying it. */
+static cairo_surface_t *
+byzanz_deserialize_surface (GInputStream *     stream,
+                            cairo_format_t     format,
+                            int                width,
+                            int                height,
+                            GCancellable *     cancellable,
+                            GError **          error)
+{
+  cairo_surface_t *surface;
+  gconstpointer data;
+  gsize size;
+  int y, stride;
+
+  size = (gsize) width * height * sizeof (guint32);
+  if (BYZANZ_IS_MAPPED_INPUT_STREAM (stream) &&
+      cairo_format_stride_for_width (format, width) == (int) (width * sizeof (guint32))) {
+    data = byzanz_mapped_input_stream_peek (BYZANZ_MAPPED_INPUT_STREAM (stream), size);
+    if (data != NULL && GPOINTER_TO_SIZE (data) % sizeof (guint32) == 0) {
+      if (g_input_stream_skip (stream, size, cancellable, error) < 0)
+        return NULL;
+      surface = cairo_image_surface_create_for_data ((guchar *) data, format,
+          width, height, width * sizeof (guint32));
+      cairo_surface_set_user_data (surface, &mapping_key,
+          g_mapped_file_ref (byzanz_mapped_input_stream_get_file (BYZANZ_MAPPED_INPUT_STREAM (stream))),
+          (cairo_destroy_func_t) g_mapped_file_unref);
+      return surface;
+    }
+  }
+
+  surface = cairo_image_surface_create (format, width, height);
+  stride = cairo_image_surface_get_stride (surface);
+  for (y = 0; y < height; y++) {
+    if (!g_input_stream_read_all (stream, cairo_image_surface_get_data (surface) + y * stride,
+          width * sizeof (guint32), NULL, cancellable, error)) {
+      cairo_surface_destroy (surface);
+      return NULL;
+    }
+  }
+  cairo_surface_mark_dirty (surface);
+
+  return surface;
+}
+
+static cairo_region_t *
+byzanz_deserialize_rectangles (GInputStream *           stream,
+                               guint                    n,
+                               cairo_rectangle_int_t ** rects_out,
+                               GCancellable *           cancellable,
+                               GError **                error)
+{
+  cairo_rectangle_int_t *rects;
+  cairo_region_t *region;
+  guint i;
+
+  region = cairo_region_create ();
+  rects = g_new (cairo_rectangle_int_t, n);
+  for (i = 0; i < n; i++) {
+    gint ints[4];
+    if (!g_input_stream_read_all (stream, ints, sizeof (ints), NULL, cancellable, error)) {
+      cairo_region_destroy (region);
+      g_free (rects);
+      return NULL;
+    }
+
+    rects[i].x = ints[0];
+    rects[i].y = ints[1];
+    rects[i].width = ints[2];
+    rects[i].height = ints[3];
+    cairo_region_union_rectangle (region, &rects[i]);
+  }
+
+  *rects_out = rects;
+  return region;
+}
+
+/* Checks that the rectangles moved by dx and dy are inside the recording,
+ * so that applying them can't touch memory outside the frame. */
+static gboolean
+byzanz_check_rectangles (const cairo_rectangle_int_t *rects,
+                         guint                        n,
+                         int                          dx,
+                         int                          dy,
+                         guint                        width,
+                         guint                        height,
+                         GError **                    error)
+{
+  gint64 x, y;
+  guint i;
+
+  for (i = 0; i < n; i++) {
+    x = (gint64) rects[i].x - dx;
+    y = (gint64) rects[i].y - dy;
+    if (rects[i].width < 0 || rects[i].height < 0 ||
+        x < 0 || x + rects[i].width > width ||
+        y < 0 || y + rects[i].height > height) {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+          _("Invalid area in recording"));
+      return FALSE;
+    }
+  }
+
   return TRUE;
 }
 
+/* Reads a row written by byzanz_compress_row(). @buffer must have space
+ * for width + 1 words. */
+static gboolean
+byzanz_deserialize_row (GInputStream *  stream,
+                        guint32 *       buffer,
+                        guint32 *       row,
+                        const guint32 * prev,
+                        guint           width,
+                        GCancellable *  cancellable,
+                        GError **       error)
+{
+  guint32 n, count;
+  guint i, x;
+
+  if (!g_input_stream_read_all (stream, &n, sizeof (guint32), NULL, cancellable, error))
+    return FALSE;
+  if (n > width + 1)
+    goto invalid;
+  if (!g_input_stream_read_all (stream, buffer, n * sizeof (guint32), NULL, cancellable, error))
+    return FALSE;
+
+  x = 0;
+  for (i = 0; i < n;) {
+    if (buffer[i] & RLE_RUN) {
+      count = buffer[i] & ~RLE_RUN;
+      if (i + 1 >= n || count > width - x)
+        goto invalid;
+      while (count--)
+        row[x++] = buffer[i + 1];
+      i += 2;
+    } else {
+      count = buffer[i++];
+      if (count > n - i || count > width - x)
+        goto invalid;
+      memcpy (row + x, buffer + i, count * sizeof (guint32));
+      x += count;
+      i += count;
+    }
+  }
+  if (x != width)
+    goto invalid;
+
+  if (prev) {
+    for (x = 0; x < width; x++)
+      row[x] ^= prev[x];
+  }
+  return TRUE;
+
+invalid:
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+      _("Invalid compressed image in recording"));
+  return FALSE;
+}
+
+/**
+ * byzanz_deserialize:
+ * @stream: stream to read from
+ * @width: width of the recording
+ * @height: height of the recording
+ * @flags: flags of the recording
+ * @record: the record to fill
+ * @cancellable: %NULL or a #GCancellable
+ * @error: %NULL or location to take an error
+ *
+ * Reads the next record from @stream. On success, the record must be freed
+ * with byzanz_record_clear(). An image record without a surface marks the
+ * end of the stream. Image and copy records that reach outside of @width
+ * and @height are rejected, so are compressed images unless @flags contains
+ * BYZANZ_SERIALIZE_COMPRESS.
+ *
+ * Returns: %TRUE on success
+ **/
 gboolean
-byzanz_deserialize (GInputStream *     stream,
-                    guint64 *          msecs_out,
-                    cairo_surface_t ** surface_out,
-                    cairo_region_t **  region_out,
-                    GCancellable *     cancellable,
-                    GError **          error)
+byzanz_deserialize (GInputStream *       stream,
+                    guint                width,
+                    guint                height,
+                    ByzanzSerializeFlags flags,
+                    ByzanzRecord *       record,
+                    GCancellable *       cancellable,
+                    GError **            error)
 {
   guint i, stride;
   cairo_rectangle_int_t extents, *rects;
   cairo_region_t *region;
   cairo_surface_t *surface;
   guchar *data;
-  guint32 n;
+  guint32 n, words[5], *buffer;
+  gint32 offset[2];
+  gboolean compressed;
   int y;
 
   g_return_val_if_fail (G_IS_INPUT_STREAM (stream), FALSE);
-  g_return_val_if_fail (msecs_out != NULL, FALSE);
-  g_return_val_if_fail (surface_out != NULL, FALSE);
-  g_return_val_if_fail (region_out != NULL, FALSE);
+  g_return_val_if_fail (record != NULL, FALSE);
 
-  if (!g_input_stream_read_all (stream, msecs_out, sizeof (guint64), NULL, cancellable, error) ||
+  memset (record, 0, sizeof (ByzanzRecord));
+  if (!g_input_stream_read_all (stream, &record->msecs, sizeof (guint64), NULL, cancellable, error) ||
       !g_input_stream_read_all (stream, &n, sizeof (guint32), NULL, cancellable, error))
     return FALSE;
 
+  compressed = (n & RECORD_COMPRESSED) != 0;
+  record->type = (n & ~RECORD_COMPRESSED) >> RECORD_TYPE_SHIFT;
+  n &= RECORD_N_RECTS_MASK;
+  /* readers that don't know the flag must be able to read the stream */
+  if (compressed && !(flags & BYZANZ_SERIALIZE_COMPRESS)) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+        _("Invalid compressed image in recording"));
+    return FALSE;
+  }
+
+  switch (record->type) {
+    case BYZANZ_RECORD_IMAGE:
+      break;
+    case BYZANZ_RECORD_COPY:
+      region = byzanz_deserialize_rectangles (stream, n, &rects, cancellable, error);
+      if (region == NULL)
+        return FALSE;
+      if (!g_input_stream_read_all (stream, offset, sizeof (offset), NULL, cancellable, error) ||
+          !byzanz_check_rectangles (rects, n, 0, 0, width, height, error) ||
+          !byzanz_check_rectangles (rects, n, offset[0], offset[1], width, height, error)) {
+        cairo_region_destroy (region);
+        g_free (rects);
+        return FALSE;
+      }
+      g_free (rects);
+      record->region = region;
+      record->dx = offset[0];
+      record->dy = offset[1];
+      return TRUE;
+    case BYZANZ_RECORD_CURSOR:
+      if (!g_input_stream_read_all (stream, words, 3 * sizeof (guint32), NULL, cancellable, error))
+        return FALSE;
+      record->cursor = words[0];
+      record->x = (gint32) words[1];
+      record->y = (gint32) words[2];
+      return TRUE;
+    case BYZANZ_RECORD_CURSOR_IMAGE:
+      if (!g_input_stream_read_all (stream, words, 5 * sizeof (guint32), NULL, cancellable, error))
+        return FALSE;
+      if (words[0] == 0 || words[1] > G_MAXINT16 || words[2] > G_MAXINT16) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+            _("Invalid cursor image in recording"));
+        return FALSE;
+      }
+      record->cursor = words[0];
+      surface = byzanz_deserialize_surface (stream, CAIRO_FORMAT_ARGB32,
+          words[1], words[2], cancellable, error);
+      if (surface == NULL)
+        return FALSE;
+      cairo_surface_set_device_offset (surface, (gint32) words[3], (gint32) words[4]);
+      record->surface = surface;
+      return TRUE;
+    default:
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+          _("Unknown record type in recording"));
+      return FALSE;
+  }
+
   if (n == 0) {
     /* end of stream */
-    *surface_out = NULL;
-    *region_out = NULL;
     return TRUE;
   }
 
-  region = cairo_region_create ();
-  rects = g_new (cairo_rectangle_int_t, n);
-  surface = NULL;
-  for (i = 0; i < n; i++) {
-    gint ints[4];
-    if (!g_input_stream_read_all (stream, ints, sizeof (ints), NULL, cancellable, error))
-      goto fail;
-
-    rects[i].x = ints[0];
-    rects[i].y = ints[1];
-    rects[i].width = ints[2];
-    rects[i].height = ints[3];
-    cairo_region_union_rectangle (region, &rects[i]);
+  region = byzanz_deserialize_rectangles (stream, n, &rects, cancellable, error);
+  if (region == NULL)
+    return FALSE;
+  if (!byzanz_check_rectangles (rects, n, 0, 0, width, height, error)) {
+    cairo_region_destroy (region);
+    g_free (rects);
+    return FALSE;
   }
 
   cairo_region_get_extents (region, &extents);
+  if (n == 1 && !compressed) {
+    /* a single rectangle is stored like an image, no need to rearrange it */
+    g_free (rects);
+    surface = byzanz_deserialize_surface (stream, CAIRO_FORMAT_RGB24,
+        extents.width, extents.height, cancellable, error);
+    if (surface == NULL) {
+      cairo_region_destroy (region);
+      return FALSE;
+    }
+    cairo_surface_set_device_offset (surface, -extents.x, -extents.y);
+    record->region = region;
+    record->surface = surface;
+    return TRUE;
+  }
+
   surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, extents.width, extents.height);
   cairo_surface_set_device_offset (surface, -extents.x, -extents.y);
   stride = cairo_image_surface_get_stride (surface);
+  buffer = compressed ? g_new (guint32, extents.width + 1) : NULL;
   for (i = 0; i < n; i++) {
     data = cairo_image_surface_get_data (surface) 
       + stride * (rects[i].y - extents.y) 
       + sizeof (guint32) * (rects[i].x - extents.x);
     for (y = 0; y < rects[i].height; y++) {
-      if (!g_input_stream_read_all (stream, data, 
-            rects[i].width * sizeof (guint32), NULL, cancellable, error))
+      if (compressed) {
+        if (!byzanz_deserialize_row (stream, buffer, (guint32 *) data,
+              y ? (const guint32 *) (data - stride) : NULL, rects[i].width,
+              cancellable, error))
+          goto fail;
+      } else if (!g_input_stream_read_all (stream, data, 
+            rects[i].width * sizeof (guint32), NULL, cancellable, error)) {
         goto fail;
+      }
       data += stride;
     }
   }
+  cairo_surface_mark_dirty (surface);
 
+  g_free (buffer);
   g_free (rects);
-  *region_out = region;
-  *surface_out = surface;
+  record->region = region;
+  record->surface = surface;
   return TRUE;
 
 fail:
-  if (surface)
-    cairo_surface_destroy (surface);
+  g_free (buffer);
+  cairo_surface_destroy (surface);
   cairo_region_destroy (region);
   g_free (rects);
   return FALSE;
 }
 
+void
+byzanz_record_clear (ByzanzRecord *record)
+{
+  g_return_if_fail (record != NULL);
+
+  if (record->surface)
+    cairo_surface_destroy (record->surface);
+  if (record->region)
+    cairo_region_destroy (record->region);
+
+  memset (record, 0, sizeof (ByzanzRecord));
+}
+
+/**
+ * byzanz_copy_region:
+ * @data: image data to modify
+ * @stride: rowstride of @data
+ * @bpp: bytes per pixel of @data
+ * @region: destination region
+ * @dx: horizontal distance the contents moved
+ * @dy: vertical distance the contents moved
+ *
+ * Applies a copy record to the image in @data. Source and destination may
+ * overlap. Both areas must be inside the image, byzanz_deserialize() makes
+ * sure of that for records read from a recording.
+ **/
+void
+byzanz_copy_region (guchar *               data,
+                    gsize                  stride,
+                    guint                  bpp,
+                    const cairo_region_t * region,
+                    int                    dx,
+                    int                    dy)
+{
+  cairo_rectangle_int_t extents, rect;
+  guchar *tmp;
+  gsize tmp_stride;
+  int i, y, num_rects;
+
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (region != NULL);
+
+  /* Copy the source to a temporary buffer first, so we don't need to care
+   * about the order of rectangles when they overlap their sources. */
+  cairo_region_get_extents (region, &extents);
+  tmp_stride = extents.width * bpp;
+  tmp = g_malloc (tmp_stride * extents.height);
+
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+      memcpy (tmp + (y - extents.y) * tmp_stride + (rect.x - extents.x) * bpp,
+          data + (y - dy) * stride + (rect.x - dx) * bpp,
+          rect.width * bpp);
+    }
+  }
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+      memcpy (data + y * stride + rect.x * bpp,
+          tmp + (y - extents.y) * tmp_stride + (rect.x - extents.x) * bpp,
+          rect.width * bpp);
+    }
+  }
+
+  g_free (tmp);
+}
+
+/**
+ * byzanz_paint_region:
+ * @target: the surface to paint to
+ * @source: the surface to paint
+ * @region: the area to paint
+ *
+ * Replaces the contents of @region in @target with the ones from @source,
+ * like image records are applied.
+ **/
+void
+byzanz_paint_region (cairo_surface_t *      target,
+                     cairo_surface_t *      source,
+                     const cairo_region_t * region)
+{
+  cairo_rectangle_int_t rect;
+  cairo_t *cr;
+  int i, num_rects;
+
+  g_return_if_fail (target != NULL);
+  g_return_if_fail (source != NULL);
+  g_return_if_fail (region != NULL);
+
+  cr = cairo_create (target);
+  num_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < num_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_clip (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, source, 0, 0);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+}
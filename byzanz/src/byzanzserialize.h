@@ -22,30 +22,94 @@
 #ifndef __HAVE_BYZANZ_SERIALIZE_H__
 #define __HAVE_BYZANZ_SERIALIZE_H__
 
+typedef enum {
+  BYZANZ_RECORD_IMAGE,
+  BYZANZ_RECORD_COPY,
+  BYZANZ_RECORD_CURSOR,
+  BYZANZ_RECORD_CURSOR_IMAGE
+} ByzanzRecordType;
+
+typedef enum {
+  BYZANZ_SERIALIZE_COMPRESS = (1 << 0),
+  BYZANZ_SERIALIZE_INDEX = (1 << 1)
+} ByzanzSerializeFlags;
+
+typedef struct _ByzanzRecord ByzanzRecord;
+struct _ByzanzRecord {
+  ByzanzRecordType      type;           /* type of this record */
+  guint64               msecs;          /* timestamp of this record */
+  cairo_surface_t *     surface;        /* IMAGE: new contents or NULL at end of stream, CURSOR_IMAGE: cursor image */
+  cairo_region_t *      region;         /* IMAGE: region that changed, COPY: destination region */
+  int                   dx;             /* COPY: horizontal distance the contents moved */
+  int                   dy;             /* COPY: vertical distance the contents moved */
+  guint                 cursor;         /* CURSOR, CURSOR_IMAGE: id of the cursor image or 0 for none */
+  int                   x;              /* CURSOR: X position of the cursor's hotspot */
+  int                   y;              /* CURSOR: Y position of the cursor's hotspot */
+};
+
+void                    byzanz_record_clear             (ByzanzRecord *         record);
 
 gboolean                byzanz_serialize_header         (GOutputStream *        stream,
                                                          guint                  width,
                                                          guint                  height,
+                                                         ByzanzSerializeFlags   flags,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+gboolean                byzanz_serialize_add_flags      (GIOStream *            stream,
+                                                         ByzanzSerializeFlags   flags,
                                                          GCancellable *         cancellable,
                                                          GError **              error);
 gboolean                byzanz_serialize                (GOutputStream *         stream,
                                                          guint64                 msecs,
                                                          cairo_surface_t *       surface,
                                                          const cairo_region_t * region,
+                                                         ByzanzSerializeFlags    flags,
                                                          GCancellable *          cancellable,
                                                          GError **               error);
+gboolean                byzanz_serialize_copy           (GOutputStream *        stream,
+                                                         guint64                msecs,
+                                                         const cairo_region_t * region,
+                                                         int                    dx,
+                                                         int                    dy,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+gboolean                byzanz_serialize_cursor         (GOutputStream *        stream,
+                                                         guint64                msecs,
+                                                         guint                  cursor,
+                                                         int                    x,
+                                                         int                    y,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+gboolean                byzanz_serialize_cursor_image   (GOutputStream *        stream,
+                                                         guint64                msecs,
+                                                         guint                  cursor,
+                                                         cairo_surface_t *      image,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
 
 gboolean                byzanz_deserialize_header       (GInputStream *         stream,
                                                          guint *                width,
                                                          guint *                height,
+                                                         ByzanzSerializeFlags * flags,
                                                          GCancellable *         cancellable,
                                                          GError **              error);
 gboolean                byzanz_deserialize              (GInputStream *         stream,
-                                                         guint64 *              msecs_out,
-                                                         cairo_surface_t **     surface_out,
-                                                         cairo_region_t **      region_out,
+                                                         guint                  width,
+                                                         guint                  height,
+                                                         ByzanzSerializeFlags   flags,
+                                                         ByzanzRecord *         record,
                                                          GCancellable *         cancellable,
                                                          GError **              error);
 
+void                    byzanz_copy_region              (guchar *               data,
+                                                         gsize                  stride,
+                                                         guint                  bpp,
+                                                         const cairo_region_t * region,
+                                                         int                    dx,
+                                                         int                    dy);
+void                    byzanz_paint_region             (cairo_surface_t *      target,
+                                                         cairo_surface_t *      source,
+                                                         const cairo_region_t * region);
+
 
 #endif /* __HAVE_BYZANZ_SERIALIZE_H__ */
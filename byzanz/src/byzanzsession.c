@@ -36,6 +36,10 @@
 #include <X11/extensions/Xfixes.h>
 
 #include "byzanzencoder.h"
+#ifdef HAVE_SYS_EVENTFD_H
+#include "byzanzencodershm.h"
+#endif
+#include "byzanzhash.h"
 #include "byzanzrecorder.h"
 #include "byzanzserialize.h"
 
@@ -50,9 +54,26 @@ enum {
   PROP_AREA,
   PROP_WINDOW,
   PROP_AUDIO,
-  PROP_ENCODER_TYPE
+  PROP_ENCODER_TYPE,
+  PROP_SCALE,
+  PROP_CURSOR_METADATA,
+  PROP_MAX_BACKLOG,
+  PROP_MAX_LATENCY,
+  PROP_COALESCED_FRAMES,
+  PROP_REPLAY_DURATION,
+  PROP_REPLAY_BUDGET,
+  PROP_TIME_LAPSE,
+  PROP_COMPRESS
+};
+
+enum {
+  REPLAY_SAVED,
+  OUTPUT_FAILED,
+  LAST_SIGNAL
 };
 
+static guint signals[LAST_SIGNAL] = { 0, };
+
 G_DEFINE_TYPE (ByzanzSession, byzanz_session, G_TYPE_OBJECT)
 
 static void
@@ -86,6 +107,33 @@ byzanz_session_get_property (GObject *object, guint param_id, GValue *value,
     case PROP_ENCODER_TYPE:
       g_value_set_gtype (value, session->encoder_type);
       break;
+    case PROP_SCALE:
+      g_value_set_uint (value, byzanz_recorder_get_scale (session->recorder));
+      break;
+    case PROP_CURSOR_METADATA:
+      g_value_set_boolean (value, byzanz_recorder_get_cursor_metadata (session->recorder));
+      break;
+    case PROP_MAX_BACKLOG:
+      g_value_set_uint64 (value, session->max_backlog);
+      break;
+    case PROP_MAX_LATENCY:
+      g_value_set_uint64 (value, session->max_latency);
+      break;
+    case PROP_COALESCED_FRAMES:
+      g_value_set_uint (value, byzanz_session_get_coalesced_frames (session));
+      break;
+    case PROP_REPLAY_DURATION:
+      g_value_set_uint64 (value, session->replay_duration);
+      break;
+    case PROP_REPLAY_BUDGET:
+      g_value_set_uint64 (value, session->replay_budget);
+      break;
+    case PROP_TIME_LAPSE:
+      g_value_set_uint (value, byzanz_recorder_get_time_lapse (session->recorder));
+      break;
+    case PROP_COMPRESS:
+      g_value_set_boolean (value, session->compress);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -97,6 +145,8 @@ byzanz_session_set_property (GObject *object, guint param_id, const GValue *valu
     GParamSpec * pspec)
 {
   ByzanzSession *session = BYZANZ_SESSION (object);
+  ByzanzSessionOutput *output;
+  guint i;
 
   switch (param_id) {
     case PROP_FILE:
@@ -114,6 +164,40 @@ byzanz_session_set_property (GObject *object, guint param_id, const GValue *valu
     case PROP_ENCODER_TYPE:
       session->encoder_type = g_value_get_gtype (value);
       break;
+    case PROP_SCALE:
+      byzanz_recorder_set_scale (session->recorder, g_value_get_uint (value));
+      break;
+    case PROP_CURSOR_METADATA:
+      byzanz_recorder_set_cursor_metadata (session->recorder, g_value_get_boolean (value));
+      break;
+    case PROP_MAX_BACKLOG:
+      session->max_backlog = g_value_get_uint64 (value);
+      for (i = 0; i < session->outputs->len; i++) {
+        output = g_ptr_array_index (session->outputs, i);
+        if (output->encoder)
+          byzanz_encoder_set_max_backlog (output->encoder, session->max_backlog);
+      }
+      break;
+    case PROP_MAX_LATENCY:
+      session->max_latency = g_value_get_uint64 (value);
+      for (i = 0; i < session->outputs->len; i++) {
+        output = g_ptr_array_index (session->outputs, i);
+        if (output->encoder)
+          byzanz_encoder_set_max_latency (output->encoder, session->max_latency);
+      }
+      break;
+    case PROP_REPLAY_DURATION:
+      session->replay_duration = g_value_get_uint64 (value);
+      break;
+    case PROP_REPLAY_BUDGET:
+      session->replay_budget = g_value_get_uint64 (value);
+      break;
+    case PROP_TIME_LAPSE:
+      byzanz_recorder_set_time_lapse (session->recorder, g_value_get_uint (value));
+      break;
+    case PROP_COMPRESS:
+      session->compress = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -138,6 +222,37 @@ byzanz_session_set_error (ByzanzSession *session, const GError *error)
   g_object_unref (session);
 }
 
+/* Stops recording to @output, the other outputs keep going. The session
+ * only fails when none of them is left. */
+static void
+byzanz_session_output_fail (ByzanzSession *       session,
+                            ByzanzSessionOutput * output,
+                            const GError *        error)
+{
+  guint i;
+
+  if (output->error != NULL)
+    return;
+
+  output->error = g_error_copy (error);
+  g_cancellable_cancel (output->cancellable);
+  /* Delete the file, it's broken after all. Don't throw errors if it fails though.
+   * Without an encoder, the file wasn't even created. */
+  if (output->encoder && output->file)
+    g_file_delete (output->file, NULL, NULL);
+
+  g_object_ref (session);
+  g_signal_emit (session, signals[OUTPUT_FAILED], 0, output->file, output->error);
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->error == NULL)
+      break;
+  }
+  if (i == session->outputs->len)
+    byzanz_session_set_error (session, error);
+  g_object_unref (session);
+}
+
 static void
 byzanz_session_encoder_notify_cb (ByzanzEncoder * encoder,
                                   GParamSpec *    pspec,
@@ -147,13 +262,22 @@ byzanz_session_encoder_notify_cb (ByzanzEncoder * encoder,
     g_object_notify (G_OBJECT (session), "encoding");
   } else if (g_str_equal (pspec->name, "error")) {
     const GError *error = byzanz_encoder_get_error (encoder);
+    ByzanzSessionOutput *output;
+    guint i;
 
-    /* Delete the file, it's broken after all. Don't throw errors if it fails though. */
-    g_file_delete (session->file, NULL, NULL);
-
-    /* Cancellation is not an error, it's been requested via _abort() */
-    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-      byzanz_session_set_error (session, error);
+    for (i = 0; i < session->outputs->len; i++) {
+      output = g_ptr_array_index (session->outputs, i);
+      if (output->encoder != encoder)
+        continue;
+      /* Cancellation is not an error, it's been requested via _abort() or
+       * the output failed already. The file is broken all the same. */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        if (output->file)
+          g_file_delete (output->file, NULL, NULL);
+      } else {
+        byzanz_session_output_fail (session, output, error);
+      }
+    }
   }
 }
 
@@ -182,6 +306,67 @@ byzanz_session_elapsed (ByzanzSession *session, const GTimeVal *tv)
   return elapsed;
 }
 
+static void
+byzanz_session_save_free (ByzanzSessionSave *save);
+
+/* Writes the record to all outputs. Encoders that keep up get it handed
+ * over directly, the others read it from their queue later. */
+static void
+byzanz_session_write (ByzanzSession *      session,
+                      const ByzanzRecord * record)
+{
+  ByzanzSessionOutput *output;
+  GOutputStream *stream;
+  GError *error = NULL;
+  gboolean success;
+  guint i;
+
+  if (session->replay && !byzanz_replay_add (session->replay, record, &error)) {
+    byzanz_session_set_error (session, error);
+    g_error_free (error);
+    return;
+  }
+
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->error)
+      continue;
+    if (output->encoder && byzanz_encoder_push (output->encoder, record))
+      continue;
+
+    stream = byzanz_queue_get_output_stream (output->queue);
+    switch (record->type) {
+      case BYZANZ_RECORD_IMAGE:
+        /* Screen contents compress well, which keeps the queue small. */
+        success = byzanz_serialize (stream, record->msecs, record->surface, record->region,
+            record->surface && session->compress ? BYZANZ_SERIALIZE_COMPRESS : 0,
+            session->cancellable, &error);
+        break;
+      case BYZANZ_RECORD_COPY:
+        success = byzanz_serialize_copy (stream, record->msecs, record->region,
+            record->dx, record->dy, session->cancellable, &error);
+        break;
+      case BYZANZ_RECORD_CURSOR:
+        success = byzanz_serialize_cursor (stream, record->msecs, record->cursor,
+            record->x, record->y, session->cancellable, &error);
+        break;
+      case BYZANZ_RECORD_CURSOR_IMAGE:
+        success = byzanz_serialize_cursor_image (stream, record->msecs, record->cursor,
+            record->surface, session->cancellable, &error);
+        break;
+      default:
+        g_assert_not_reached ();
+        success = FALSE;
+        break;
+    }
+
+    if (!success) {
+      byzanz_session_output_fail (session, output, error);
+      g_clear_error (&error);
+    }
+  }
+}
+
 static void
 byzanz_session_recorder_image_cb (ByzanzRecorder *       recorder,
                                   cairo_surface_t *      surface,
@@ -189,15 +374,105 @@ byzanz_session_recorder_image_cb (ByzanzRecorder *       recorder,
                                   const GTimeVal *       tv,
                                   ByzanzSession *        session)
 {
-  GOutputStream *stream;
-  GError *error = NULL;
+  ByzanzRecord record = { BYZANZ_RECORD_IMAGE, };
 
-  stream = byzanz_queue_get_output_stream (session->queue);
-  if (!byzanz_serialize (stream, byzanz_session_elapsed (session, tv), 
-          surface, region, session->cancellable, &error)) {
-    byzanz_session_set_error (session, error);
-    g_error_free (error);
+  record.msecs = byzanz_session_elapsed (session, tv);
+  record.surface = surface;
+  record.region = (cairo_region_t *) region;
+  byzanz_session_write (session, &record);
+}
+
+static void
+byzanz_session_recorder_copy_cb (ByzanzRecorder *       recorder,
+                                 const cairo_region_t * region,
+                                 int                    dx,
+                                 int                    dy,
+                                 const GTimeVal *       tv,
+                                 ByzanzSession *        session)
+{
+  ByzanzRecord record = { BYZANZ_RECORD_COPY, };
+
+  record.msecs = byzanz_session_elapsed (session, tv);
+  record.region = (cairo_region_t *) region;
+  record.dx = dx;
+  record.dy = dy;
+  byzanz_session_write (session, &record);
+}
+
+/* Cursors are identified by their contents, so the same image is only
+ * written once, no matter how often the cursor changes back to it. */
+static guint
+byzanz_session_lookup_cursor (ByzanzSession *   session,
+                              cairo_surface_t * cursor,
+                              gboolean *        is_new)
+{
+  double xhot, yhot;
+  guint64 hash, *key;
+  const guchar *data;
+  int y, width, height, stride;
+  guint id;
+
+  cairo_surface_flush (cursor);
+  cairo_surface_get_device_offset (cursor, &xhot, &yhot);
+  width = cairo_image_surface_get_width (cursor);
+  height = cairo_image_surface_get_height (cursor);
+  data = cairo_image_surface_get_data (cursor);
+  stride = cairo_image_surface_get_stride (cursor);
+
+  hash = ((guint64) width << 48) ^ ((guint64) height << 32) ^
+    ((guint64) (guint16) xhot << 16) ^ (guint16) yhot;
+  for (y = 0; y < height; y++)
+    hash = byzanz_hash (data + y * stride, width * sizeof (guint32), hash);
+
+  id = GPOINTER_TO_UINT (g_hash_table_lookup (session->cursor_ids, &hash));
+  *is_new = id == 0;
+  if (id == 0) {
+    id = g_hash_table_size (session->cursor_ids) + 1;
+    key = g_new (guint64, 1);
+    *key = hash;
+    g_hash_table_insert (session->cursor_ids, key, GUINT_TO_POINTER (id));
+  }
+
+  return id;
+}
+
+static void
+byzanz_session_recorder_cursor_cb (ByzanzRecorder *       recorder,
+                                   cairo_surface_t *      cursor,
+                                   int                    x,
+                                   int                    y,
+                                   const GTimeVal *       tv,
+                                   ByzanzSession *        session)
+{
+  ByzanzRecord record = { BYZANZ_RECORD_CURSOR, };
+  gboolean is_new;
+
+  record.msecs = byzanz_session_elapsed (session, tv);
+
+  if (cursor != session->cursor) {
+    if (cursor) {
+      session->cursor_id = byzanz_session_lookup_cursor (session, cursor, &is_new);
+      cairo_surface_reference (cursor);
+      if (is_new) {
+        record.type = BYZANZ_RECORD_CURSOR_IMAGE;
+        record.surface = cursor;
+        record.cursor = session->cursor_id;
+        byzanz_session_write (session, &record);
+      }
+    } else {
+      session->cursor_id = 0;
+    }
+    if (session->cursor)
+      cairo_surface_destroy (session->cursor);
+    session->cursor = cursor;
   }
+
+  record.type = BYZANZ_RECORD_CURSOR;
+  record.surface = NULL;
+  record.cursor = session->cursor_id;
+  record.x = x;
+  record.y = y;
+  byzanz_session_write (session, &record);
 }
 
 static void
@@ -214,17 +489,38 @@ static void
 byzanz_session_finalize (GObject *object)
 {
   ByzanzSession *session = BYZANZ_SESSION (object);
+  ByzanzSessionOutput *output;
+  guint i;
 
   g_assert (session != NULL);
 
   g_object_unref (session->recorder);
-  if (session->encoder) {
-    g_signal_handlers_disconnect_by_func (session->encoder, byzanz_session_encoder_notify_cb, session);
-    g_object_unref (session->encoder);
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->encoder) {
+      g_signal_handlers_disconnect_by_func (output->encoder, byzanz_session_encoder_notify_cb, session);
+      g_object_unref (output->encoder);
+    }
+    if (output->file)
+      g_object_unref (output->file);
+    g_object_unref (output->queue);
+    g_object_unref (output->cancellable);
+    if (output->error)
+      g_error_free (output->error);
+    g_slice_free (ByzanzSessionOutput, output);
   }
+  g_ptr_array_free (session->outputs, TRUE);
+  for (i = 0; i < session->saves->len; i++)
+    byzanz_session_save_free (g_ptr_array_index (session->saves, i));
+  g_ptr_array_free (session->saves, TRUE);
+  if (session->replay)
+    byzanz_replay_free (session->replay);
   g_object_unref (session->window);
-  g_object_unref (session->file);
-  g_object_unref (session->queue);
+  if (session->file)
+    g_object_unref (session->file);
+  g_hash_table_destroy (session->cursor_ids);
+  if (session->cursor)
+    cairo_surface_destroy (session->cursor);
 
   if (session->error)
     g_error_free (session->error);
@@ -236,29 +532,19 @@ static void
 byzanz_session_constructed (GObject *object)
 {
   ByzanzSession *session = BYZANZ_SESSION (object);
-  GOutputStream *stream;
 
   session->recorder = byzanz_recorder_new (session->window, &session->area);
   g_signal_connect (session->recorder, "notify::recording", 
       G_CALLBACK (byzanz_session_recorder_notify_cb), session);
   g_signal_connect (session->recorder, "image", 
       G_CALLBACK (byzanz_session_recorder_image_cb), session);
+  g_signal_connect (session->recorder, "copy", 
+      G_CALLBACK (byzanz_session_recorder_copy_cb), session);
+  g_signal_connect (session->recorder, "cursor", 
+      G_CALLBACK (byzanz_session_recorder_cursor_cb), session);
 
-  /* FIXME: make async */
-  stream = G_OUTPUT_STREAM (g_file_replace (session->file, NULL, 
-        FALSE, G_FILE_CREATE_REPLACE_DESTINATION, session->cancellable, &session->error));
-  if (stream != NULL) {
-    session->encoder = byzanz_encoder_new (session->encoder_type, 
-        byzanz_queue_get_input_stream (session->queue),
-        stream, session->record_audio, session->cancellable);
-    g_signal_connect (session->encoder, "notify", 
-        G_CALLBACK (byzanz_session_encoder_notify_cb), session);
-    g_object_unref (stream);
-    if (byzanz_encoder_get_error (session->encoder))
-      byzanz_session_set_error (session, byzanz_encoder_get_error (session->encoder));
-  }
-  byzanz_serialize_header (byzanz_queue_get_output_stream (session->queue),
-      session->area.width, session->area.height, session->cancellable, &session->error);
+  if (session->file)
+    byzanz_session_add_output (session, session->file, session->encoder_type);
 
   if (G_OBJECT_CLASS (byzanz_session_parent_class)->constructed)
     G_OBJECT_CLASS (byzanz_session_parent_class)->constructed (object);
@@ -291,7 +577,7 @@ byzanz_session_class_init (ByzanzSessionClass *klass)
       g_param_spec_boxed ("area", "area", "recorded area",
 	  GDK_TYPE_RECTANGLE, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
   g_object_class_install_property (object_class, PROP_FILE,
-      g_param_spec_object ("file", "file", "file to record to",
+      g_param_spec_object ("file", "file", "file to record to or NULL to only record to added outputs",
 	  G_TYPE_FILE, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
   g_object_class_install_property (object_class, PROP_AUDIO,
       g_param_spec_boolean ("record-audio", "record audio", "TRUE to record audio",
@@ -299,18 +585,61 @@ byzanz_session_class_init (ByzanzSessionClass *klass)
   g_object_class_install_property (object_class, PROP_ENCODER_TYPE,
       g_param_spec_gtype ("encoder-type", "encoder type", "type for the encoder to use",
 	  BYZANZ_TYPE_ENCODER, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class, PROP_SCALE,
+      g_param_spec_uint ("scale", "scale", "factor to shrink the recording by, set before starting",
+	  1, G_MAXUINT, 1, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_CURSOR_METADATA,
+      g_param_spec_boolean ("cursor-metadata", "cursor metadata", "record the cursor separately, set before starting",
+	  FALSE, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_MAX_BACKLOG,
+      g_param_spec_uint64 ("max-backlog", "max backlog", "queued bytes before the encoder merges images or 0 to never merge",
+	  0, G_MAXUINT64, BYZANZ_ENCODER_MAX_BACKLOG, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_MAX_LATENCY,
+      g_param_spec_uint64 ("max-latency", "max latency", "milliseconds an image merged by the encoder may span",
+	  0, G_MAXUINT64, BYZANZ_ENCODER_MAX_LATENCY, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_COALESCED_FRAMES,
+      g_param_spec_uint ("coalesced-frames", "coalesced frames", "number of images the encoder merged into others",
+	  0, G_MAXUINT, 0, G_PARAM_READABLE));
+  g_object_class_install_property (object_class, PROP_REPLAY_DURATION,
+      g_param_spec_uint64 ("replay-duration", "replay duration", "milliseconds kept for saving replays or 0 to not keep any, set before starting",
+	  0, G_MAXUINT64, 0, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_REPLAY_BUDGET,
+      g_param_spec_uint64 ("replay-budget", "replay budget", "bytes the recording kept for replays may use, set before starting",
+	  0, G_MAXUINT64, BYZANZ_REPLAY_BUDGET, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_TIME_LAPSE,
+      g_param_spec_uint ("time-lapse", "time lapse", "milliseconds between snapshots in time-lapse mode or 0, set before adding outputs",
+	  0, G_MAXUINT, 0, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_COMPRESS,
+      g_param_spec_boolean ("compress", "compress", "compress images in the queues to save memory and disk space, set before starting",
+	  TRUE, G_PARAM_READWRITE));
+
+  signals[REPLAY_SAVED] = g_signal_new ("replay-saved", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+      0, NULL, NULL, NULL,
+      G_TYPE_NONE, 2,
+      G_TYPE_FILE, G_TYPE_POINTER);
+  signals[OUTPUT_FAILED] = g_signal_new ("output-failed", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+      0, NULL, NULL, NULL,
+      G_TYPE_NONE, 2,
+      G_TYPE_FILE, G_TYPE_POINTER);
 }
 
 static void
 byzanz_session_init (ByzanzSession *session)
 {
   session->cancellable = g_cancellable_new ();
-  session->queue = byzanz_queue_new ();
+  session->outputs = g_ptr_array_new ();
+  session->saves = g_ptr_array_new ();
+  session->replay_budget = BYZANZ_REPLAY_BUDGET;
+  session->max_backlog = BYZANZ_ENCODER_MAX_BACKLOG;
+  session->max_latency = BYZANZ_ENCODER_MAX_LATENCY;
+  session->compress = TRUE;
+  session->cursor_ids = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
 }
 
 /**
  * byzanz_session_new:
- * @file: file to record to. Any existing file will be overwritten.
+ * @file: file to record to or %NULL to only record to outputs added later.
+ *        Any existing file will be overwritten.
  * @encoder_type: the type of encoder to use
  * @window: window to record
  * @area: area of window that should be recorded
@@ -329,7 +658,7 @@ byzanz_session_new (GFile *file, GType encoder_type,
     GdkWindow *window, const cairo_rectangle_int_t *area, gboolean record_cursor,
     gboolean record_audio)
 {
-  g_return_val_if_fail (G_IS_FILE (file), NULL);
+  g_return_val_if_fail (file == NULL || G_IS_FILE (file), NULL);
   g_return_val_if_fail (g_type_is_a (encoder_type, BYZANZ_TYPE_ENCODER), NULL);
   g_return_val_if_fail (GDK_IS_WINDOW (window), NULL);
   g_return_val_if_fail (area != NULL, NULL);
@@ -344,30 +673,333 @@ byzanz_session_new (GFile *file, GType encoder_type,
       "window", window, "area", area, "record-audio", record_audio, NULL);
 }
 
+static void
+byzanz_session_output_watch (ByzanzSession *       session,
+                             ByzanzSessionOutput * output)
+{
+  g_signal_connect (output->encoder, "notify", 
+      G_CALLBACK (byzanz_session_encoder_notify_cb), session);
+  if (byzanz_encoder_get_error (output->encoder))
+    byzanz_session_output_fail (session, output, byzanz_encoder_get_error (output->encoder));
+}
+
+static void
+byzanz_session_output_encode (ByzanzSession *       session,
+                              ByzanzSessionOutput * output,
+                              GOutputStream *       stream,
+                              GType                 encoder_type)
+{
+  /* The recorder creates new surfaces for every image, so they can be
+   * handed to all encoders as they are. Time-lapse images arrive much
+   * slower than they are played, so there's no need to hurry then. */
+  output->encoder = g_object_new (encoder_type,
+      "input", byzanz_queue_get_input_stream (output->queue),
+      "output", stream, "record-audio", session->record_audio,
+      "cancellable", output->cancellable, "direct", TRUE,
+      "realtime", byzanz_recorder_get_time_lapse (session->recorder) == 0,
+      "max-backlog", session->max_backlog, "max-latency", session->max_latency, NULL);
+  byzanz_session_output_watch (session, output);
+}
+
+static ByzanzSessionOutput *
+byzanz_session_output_new (ByzanzSession *session,
+                           GFile *        file)
+{
+  ByzanzSessionOutput *output;
+
+  output = g_slice_new0 (ByzanzSessionOutput);
+  if (file)
+    output->file = g_object_ref (file);
+  output->queue = byzanz_queue_new ();
+  output->cancellable = g_cancellable_new ();
+  g_ptr_array_add (session->outputs, output);
+
+  return output;
+}
+
+/**
+ * byzanz_session_add_output:
+ * @session: a session that hasn't been started yet
+ * @file: another file to record to. Any existing file will be overwritten.
+ * @encoder_type: the type of encoder to use for @file
+ *
+ * Records to @file in addition to the files that were given before. The
+ * screen is only captured once, every output gets its own encoding thread.
+ **/
+void
+byzanz_session_add_output (ByzanzSession *session,
+                           GFile *        file,
+                           GType          encoder_type)
+{
+  ByzanzSessionOutput *output;
+  GOutputStream *stream;
+  GError *error = NULL;
+
+  g_return_if_fail (BYZANZ_IS_SESSION (session));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (g_type_is_a (encoder_type, BYZANZ_TYPE_ENCODER));
+  g_return_if_fail (!byzanz_recorder_get_recording (session->recorder));
+
+  output = byzanz_session_output_new (session, file);
+
+  /* FIXME: make async */
+  stream = G_OUTPUT_STREAM (g_file_replace (file, NULL, 
+        FALSE, G_FILE_CREATE_REPLACE_DESTINATION, session->cancellable, &error));
+  if (stream == NULL) {
+    byzanz_session_output_fail (session, output, error);
+    g_error_free (error);
+    return;
+  }
+
+  byzanz_session_output_encode (session, output, stream, encoder_type);
+  g_object_unref (stream);
+}
+
+/**
+ * byzanz_session_add_output_stream:
+ * @session: a session that hasn't been started yet
+ * @stream: stream to record to, like standard output
+ * @encoder_type: the type of encoder to use for @stream
+ *
+ * Like byzanz_session_add_output(), but writes to @stream. The stream
+ * is closed when encoding is done.
+ **/
+void
+byzanz_session_add_output_stream (ByzanzSession * session,
+                                  GOutputStream * stream,
+                                  GType           encoder_type)
+{
+  ByzanzSessionOutput *output;
+
+  g_return_if_fail (BYZANZ_IS_SESSION (session));
+  g_return_if_fail (G_IS_OUTPUT_STREAM (stream));
+  g_return_if_fail (g_type_is_a (encoder_type, BYZANZ_TYPE_ENCODER));
+  g_return_if_fail (!byzanz_recorder_get_recording (session->recorder));
+
+  output = byzanz_session_output_new (session, NULL);
+  byzanz_session_output_encode (session, output, stream, encoder_type);
+}
+
+#ifdef HAVE_SYS_EVENTFD_H
+/**
+ * byzanz_session_add_shm_output:
+ * @session: a session that hasn't been started yet
+ * @path: path of the UNIX socket other programs connect to
+ *
+ * Publishes the recorded frames in shared memory to every program that
+ * connects to @path while recording. See byzanzshm.h for the consumer
+ * side.
+ **/
+void
+byzanz_session_add_shm_output (ByzanzSession * session,
+                               const char *    path)
+{
+  ByzanzSessionOutput *output;
+
+  g_return_if_fail (BYZANZ_IS_SESSION (session));
+  g_return_if_fail (path != NULL);
+  g_return_if_fail (!byzanz_recorder_get_recording (session->recorder));
+
+  output = byzanz_session_output_new (session, NULL);
+  output->encoder = g_object_new (BYZANZ_TYPE_ENCODER_SHM,
+      "input", byzanz_queue_get_input_stream (output->queue),
+      "path", path, "record-audio", FALSE,
+      "cancellable", output->cancellable, "direct", TRUE, "realtime", TRUE,
+      "max-backlog", session->max_backlog, "max-latency", session->max_latency, NULL);
+  byzanz_session_output_watch (session, output);
+}
+#endif
+
 void
 byzanz_session_start (ByzanzSession *session)
 {
+  ByzanzSessionOutput *output;
+  GError *error = NULL;
+  guint i, width, height;
+
   g_return_if_fail (BYZANZ_IS_SESSION (session));
 
+  /* the header is written here, as the size depends on the scale. */
+  byzanz_recorder_get_scaled_size (session->recorder, &width, &height);
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->error)
+      continue;
+    if (!byzanz_serialize_header (byzanz_queue_get_output_stream (output->queue),
+            width, height, session->compress ? BYZANZ_SERIALIZE_COMPRESS : 0,
+            session->cancellable, &error)) {
+      byzanz_session_output_fail (session, output, error);
+      g_clear_error (&error);
+    }
+  }
+  if (session->error)
+    return;
+
+  if (session->replay_duration > 0)
+    session->replay = byzanz_replay_new (width, height,
+        session->replay_duration, session->replay_budget);
+
   byzanz_recorder_set_recording (session->recorder, TRUE);
 }
 
+static void
+byzanz_session_save_free (ByzanzSessionSave *save)
+{
+  g_signal_handlers_disconnect_by_data (save->encoder, save);
+  g_object_unref (save->encoder);
+  if (save->thread) {
+    g_cancellable_cancel (save->cancellable);
+    g_thread_join (save->thread);
+  }
+  g_object_unref (save->cancellable);
+  g_object_unref (save->queue);
+  g_object_unref (save->file);
+  byzanz_replay_snapshot_free (save->snapshot);
+  if (save->error)
+    g_error_free (save->error);
+  g_slice_free (ByzanzSessionSave, save);
+}
+
+/* runs in its own thread, so capturing goes on while the replay is saved */
+static gpointer
+byzanz_session_save_thread (gpointer data)
+{
+  ByzanzSessionSave *save = data;
+  GOutputStream *output;
+
+  output = byzanz_queue_get_output_stream (save->queue);
+  byzanz_replay_snapshot_write (save->snapshot, output,
+      save->cancellable, &save->error);
+  g_output_stream_close (output, NULL, NULL);
+
+  return NULL;
+}
+
+static void
+byzanz_session_save_notify_cb (ByzanzEncoder *     encoder,
+                               GParamSpec *        pspec,
+                               ByzanzSessionSave * save)
+{
+  ByzanzSession *session = save->session;
+  const GError *error;
+
+  if (!g_str_equal (pspec->name, "running") || byzanz_encoder_is_running (encoder))
+    return;
+
+  /* When the encoder failed early, the writer may still have most of the
+   * snapshot to go. Stop it instead of waiting for it in the main loop. */
+  error = byzanz_encoder_get_error (encoder);
+  if (error)
+    g_cancellable_cancel (save->cancellable);
+  g_thread_join (save->thread);
+  save->thread = NULL;
+  if (save->error && !g_error_matches (save->error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    error = save->error;
+  /* it's broken, so don't leave it around */
+  if (error)
+    g_file_delete (save->file, NULL, NULL);
+
+  g_ptr_array_remove (session->saves, save);
+  g_signal_emit (session, signals[REPLAY_SAVED], 0, save->file, error);
+  byzanz_session_save_free (save);
+  g_object_notify (G_OBJECT (session), "encoding");
+}
+
+/**
+ * byzanz_session_save_replay:
+ * @session: a session with #ByzanzSession:replay-duration set
+ * @file: file to save the replay to. Any existing file will be overwritten.
+ * @encoder_type: the type of encoder to use for @file
+ * @error: %NULL or location to take an error
+ *
+ * Saves the recording kept for replays to @file. Writing and encoding
+ * happen in other threads, so recording continues meanwhile. The
+ * ByzanzSession::replay-saved signal is emitted when @file is done.
+ *
+ * Returns: %TRUE if saving was started
+ **/
+gboolean
+byzanz_session_save_replay (ByzanzSession * session,
+                            GFile *         file,
+                            GType           encoder_type,
+                            GError **       error)
+{
+  ByzanzReplaySnapshot *snapshot;
+  ByzanzSessionSave *save;
+  GOutputStream *stream;
+  GTimeVal tv;
+
+  g_return_val_if_fail (BYZANZ_IS_SESSION (session), FALSE);
+  g_return_val_if_fail (G_IS_FILE (file), FALSE);
+  g_return_val_if_fail (g_type_is_a (encoder_type, BYZANZ_TYPE_ENCODER), FALSE);
+
+  snapshot = NULL;
+  if (session->replay && (session->start_time.tv_sec != 0 || session->start_time.tv_usec != 0)) {
+    byzanz_recorder_get_time (session->recorder, &tv);
+    snapshot = byzanz_replay_snapshot (session->replay, byzanz_session_elapsed (session, &tv));
+  }
+  if (snapshot == NULL) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        _("Nothing was recorded for a replay yet."));
+    return FALSE;
+  }
+
+  /* FIXME: make async */
+  stream = G_OUTPUT_STREAM (g_file_replace (file, NULL, 
+        FALSE, G_FILE_CREATE_REPLACE_DESTINATION, session->cancellable, error));
+  if (stream == NULL) {
+    byzanz_replay_snapshot_free (snapshot);
+    return FALSE;
+  }
+
+  save = g_slice_new0 (ByzanzSessionSave);
+  save->session = session;
+  save->snapshot = snapshot;
+  save->file = g_object_ref (file);
+  save->queue = byzanz_queue_new ();
+  save->cancellable = g_cancellable_new ();
+  save->encoder = byzanz_encoder_new (encoder_type,
+      byzanz_queue_get_input_stream (save->queue), stream, FALSE, save->cancellable);
+  g_object_unref (stream);
+  if (byzanz_encoder_get_error (save->encoder)) {
+    g_propagate_error (error, g_error_copy (byzanz_encoder_get_error (save->encoder)));
+    byzanz_session_save_free (save);
+    g_file_delete (file, NULL, NULL);
+    return FALSE;
+  }
+  /* the replay is complete already, so every image must be encoded */
+  byzanz_encoder_set_max_backlog (save->encoder, 0);
+  g_signal_connect (save->encoder, "notify", 
+      G_CALLBACK (byzanz_session_save_notify_cb), save);
+  g_ptr_array_add (session->saves, save);
+  save->thread = g_thread_new ("replay", byzanz_session_save_thread, save);
+
+  return TRUE;
+}
+
 void
 byzanz_session_stop (ByzanzSession *session)
 {
-  GOutputStream *stream;
+  ByzanzRecord record = { BYZANZ_RECORD_IMAGE, };
+  ByzanzSessionOutput *output;
   GError *error = NULL;
   GTimeVal tv;
+  guint i;
 
   g_return_if_fail (BYZANZ_IS_SESSION (session));
 
-  stream = byzanz_queue_get_output_stream (session->queue);
-  g_get_current_time (&tv);
-  if (!byzanz_serialize (stream, byzanz_session_elapsed (session, &tv), 
-          NULL, NULL, session->cancellable, &error) || 
-      !g_output_stream_close (stream, session->cancellable, &error)) {
-    byzanz_session_set_error (session, error);
-    g_error_free (error);
+  byzanz_recorder_get_time (session->recorder, &tv);
+  record.msecs = byzanz_session_elapsed (session, &tv);
+  byzanz_session_write (session, &record);
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->error)
+      continue;
+    if (!g_output_stream_close (byzanz_queue_get_output_stream (output->queue),
+            session->cancellable, &error)) {
+      byzanz_session_output_fail (session, output, error);
+      g_clear_error (&error);
+    }
   }
 
   byzanz_recorder_set_recording (session->recorder, FALSE);
@@ -376,9 +1008,21 @@ byzanz_session_stop (ByzanzSession *session)
 void
 byzanz_session_abort (ByzanzSession *session)
 {
+  ByzanzSessionOutput *output;
+  ByzanzSessionSave *save;
+  guint i;
+
   g_return_if_fail (BYZANZ_IS_SESSION (session));
 
   g_cancellable_cancel (session->cancellable);
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    g_cancellable_cancel (output->cancellable);
+  }
+  for (i = 0; i < session->saves->len; i++) {
+    save = g_ptr_array_index (session->saves, i);
+    g_cancellable_cancel (save->cancellable);
+  }
 }
 
 gboolean
@@ -393,9 +1037,52 @@ byzanz_session_is_recording (ByzanzSession *session)
 gboolean
 byzanz_session_is_encoding (ByzanzSession *session)
 {
+  ByzanzSessionOutput *output;
+  guint i;
+
   g_return_val_if_fail (BYZANZ_IS_SESSION (session), FALSE);
 
-  return session->error == NULL && byzanz_encoder_is_running (session->encoder);
+  if (session->error)
+    return FALSE;
+
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->encoder && byzanz_encoder_is_running (output->encoder))
+      return TRUE;
+  }
+  /* replays may be saved as long as we record */
+  if (session->replay && byzanz_recorder_get_recording (session->recorder))
+    return TRUE;
+  if (session->saves->len > 0)
+    return TRUE;
+
+  return FALSE;
+}
+
+/**
+ * byzanz_session_get_coalesced_frames:
+ * @session: the session
+ *
+ * Gets the number of images the encoders merged into others because they
+ * fell behind, summed up over all outputs.
+ *
+ * Returns: the number of merged images
+ **/
+guint
+byzanz_session_get_coalesced_frames (ByzanzSession *session)
+{
+  ByzanzSessionOutput *output;
+  guint i, result = 0;
+
+  g_return_val_if_fail (BYZANZ_IS_SESSION (session), 0);
+
+  for (i = 0; i < session->outputs->len; i++) {
+    output = g_ptr_array_index (session->outputs, i);
+    if (output->encoder)
+      result += byzanz_encoder_get_coalesced_frames (output->encoder);
+  }
+
+  return result;
 }
 
 const GError *
@@ -21,6 +21,7 @@
 #include "byzanzencoder.h"
 #include "byzanzqueue.h"
 #include "byzanzrecorder.h"
+#include "byzanzreplay.h"
 
 #ifndef __HAVE_BYZANZ_SESSION_H__
 #define __HAVE_BYZANZ_SESSION_H__
@@ -28,6 +29,27 @@
 typedef struct _ByzanzSession ByzanzSession;
 typedef struct _ByzanzSessionClass ByzanzSessionClass;
 
+typedef struct _ByzanzSessionOutput ByzanzSessionOutput;
+struct _ByzanzSessionOutput {
+  GFile *               file;           /* file we're saving to or NULL when writing to a stream */
+  ByzanzQueue *         queue;          /* queue we use as data cache */
+  ByzanzEncoder *       encoder;        /* encoding thread or NULL if the file couldn't be created */
+  GCancellable *        cancellable;    /* cancellable stopping only this output */
+  GError *              error;          /* NULL or the error this output failed with */
+};
+
+typedef struct _ByzanzSessionSave ByzanzSessionSave;
+struct _ByzanzSessionSave {
+  ByzanzSession *       session;        /* session the replay is saved from */
+  ByzanzReplaySnapshot *snapshot;       /* the recording to save */
+  GFile *               file;           /* file we're saving to */
+  ByzanzQueue *         queue;          /* queue the snapshot is written to */
+  ByzanzEncoder *       encoder;        /* encoder reading from queue */
+  GCancellable *        cancellable;    /* cancellable stopping only this save */
+  GThread *             thread;         /* thread writing the snapshot to queue or NULL when done */
+  GError *              error;          /* error from writing the snapshot */
+};
+
 #define BYZANZ_TYPE_SESSION                    (byzanz_session_get_type())
 #define BYZANZ_IS_SESSION(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BYZANZ_TYPE_SESSION))
 #define BYZANZ_IS_SESSION_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_SESSION))
@@ -40,19 +62,32 @@ struct _ByzanzSession {
   
   /*< private >*/
   /* properties */
-  GFile *               file;           /* file we're saving to */
+  GFile *               file;           /* NULL or file we're saving to */
   cairo_rectangle_int_t area;           /* area of window to record */
   GdkWindow *           window;         /* window to record */
   gboolean              record_audio;   /* TRUE to record audio */
   GType                 encoder_type;   /* type of encoder to use */
-  ByzanzQueue *         queue;          /* queue we use as data cache */
   GTimeVal              start_time;     /* when we started writing to queue */
 
   /* internal objects */
   GCancellable *        cancellable;    /* cancellable to use for aborting the session */
   ByzanzRecorder *      recorder;       /* the recorder in use */
-  ByzanzEncoder *	encoder;	/* encoding thread */
+  GPtrArray *           outputs;        /* ByzanzSessionOutput, the first one for file if it's set */
+  guint64               max_backlog;    /* max-backlog of the encoders */
+  guint64               max_latency;    /* max-latency of the encoders */
+  gboolean              compress;       /* TRUE to compress images in the queues */
   GError *              error;          /* NULL or the error we're in */
+
+  /* instant replay */
+  guint64               replay_duration;/* milliseconds to keep for saving replays or 0 */
+  guint64               replay_budget;  /* bytes the kept recording may use */
+  ByzanzReplay *        replay;         /* NULL or the recording kept for replays */
+  GPtrArray *           saves;          /* ByzanzSessionSave of replays being saved */
+
+  /* cursor metadata */
+  GHashTable *          cursor_ids;     /* checksum of cursor image => id used in the stream */
+  cairo_surface_t *     cursor;         /* NULL or last cursor image written to the stream */
+  guint                 cursor_id;      /* id of cursor */
 };
 
 struct _ByzanzSessionClass {
@@ -68,6 +103,20 @@ ByzanzSession * 	byzanz_session_new		(GFile *                        file,
 							 const cairo_rectangle_int_t *	area,
 							 gboolean		        record_cursor,
                                                          gboolean                       record_audio);
+void                    byzanz_session_add_output       (ByzanzSession *        session,
+                                                         GFile *                file,
+                                                         GType                  encoder_type);
+void                    byzanz_session_add_output_stream(ByzanzSession *        session,
+                                                         GOutputStream *        stream,
+                                                         GType                  encoder_type);
+#ifdef HAVE_SYS_EVENTFD_H
+void                    byzanz_session_add_shm_output   (ByzanzSession *        session,
+                                                         const char *           path);
+#endif
+gboolean                byzanz_session_save_replay      (ByzanzSession *        session,
+                                                         GFile *                file,
+                                                         GType                  encoder_type,
+                                                         GError **              error);
 void			byzanz_session_start		(ByzanzSession *	session);
 void			byzanz_session_stop		(ByzanzSession *	session);
 void			byzanz_session_abort            (ByzanzSession *	session);
@@ -75,6 +124,8 @@ void			byzanz_session_abort            (ByzanzSession *	session);
 gboolean                byzanz_session_is_recording     (ByzanzSession *        session);
 gboolean                byzanz_session_is_encoding      (ByzanzSession *        session);
 const GError *          byzanz_session_get_error        (ByzanzSession *        session);
+guint                   byzanz_session_get_coalesced_frames
+                                                        (ByzanzSession *        session);
 					
 
 #endif /* __HAVE_BYZANZ_SESSION_H__ */
@@ -20,12 +20,24 @@
 #endif
 
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
 #include "byzanzencoder.h"
+#include "byzanzencodergstreamer.h"
+#include "byzanzindex.h"
+#include "byzanzmappedinputstream.h"
+#include "byzanzqueue.h"
 #include "byzanzserialize.h"
 
+static gboolean benchmark = FALSE;
+static gboolean build_index = FALSE;
+static int jobs = 1;
+
 static GOptionEntry entries[] = 
 {
+  { "benchmark", 0, 0, G_OPTION_ARG_NONE, &benchmark, N_("Measure compression speed and ratio instead of converting"), NULL },
+  { "index", 0, 0, G_OPTION_ARG_NONE, &build_index, N_("Add an index to a recording that has none"), NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, N_("Number of parts to encode at the same time"), N_("N") },
   { NULL }
 };
 
@@ -33,9 +45,125 @@ static void
 usage (void)
 {
   g_print (_("usage: %s [OPTIONS] INFILE OUTFILE\n"), g_get_prgname ());
+  g_print (_("       %s --benchmark INFILE\n"), g_get_prgname ());
+  g_print (_("       %s --index FILE\n"), g_get_prgname ());
   g_print (_("       %s --help\n"), g_get_prgname ());
 }
 
+/* appends an index to recordings made without one, so they can be seeked */
+static gboolean
+run_index (GFile *file, GInputStream *instream, GError **error)
+{
+  ByzanzIndex *index;
+  GFileIOStream *io;
+  gboolean result;
+
+  index = byzanz_index_read (instream, NULL, error);
+  if (index == NULL)
+    return FALSE;
+  if (index->stored) {
+    byzanz_index_free (index);
+    return TRUE;
+  }
+
+  io = g_file_open_readwrite (file, NULL, error);
+  if (io == NULL) {
+    byzanz_index_free (index);
+    return FALSE;
+  }
+  result = g_seekable_truncate (G_SEEKABLE (io), index->end, NULL, error) &&
+    g_seekable_seek (G_SEEKABLE (io), index->end, G_SEEK_SET, NULL, error) &&
+    byzanz_index_write (index, g_io_stream_get_output_stream (G_IO_STREAM (io)), NULL, error) &&
+    byzanz_serialize_add_flags (G_IO_STREAM (io), BYZANZ_SERIALIZE_INDEX, NULL, error) &&
+    g_io_stream_close (G_IO_STREAM (io), NULL, error);
+
+  g_object_unref (io);
+  byzanz_index_free (index);
+  return result;
+}
+
+/* compresses and decompresses every image in the recording and prints
+ * how fast that was and how much it saved */
+static gboolean
+run_benchmark (GInputStream *instream, GError **error)
+{
+  GOutputStream *memory;
+  GInputStream *compressed;
+  ByzanzRecord record, decoded;
+  ByzanzSerializeFlags flags;
+  cairo_rectangle_int_t rect;
+  GTimer *timer;
+  double compress_time, decompress_time;
+  guint64 raw_size, compressed_size;
+  guint width, height, n_images;
+  gsize size;
+  int i;
+
+  if (!byzanz_deserialize_header (instream, &width, &height, &flags, NULL, error))
+    return FALSE;
+
+  memory = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  timer = g_timer_new ();
+  compress_time = decompress_time = 0;
+  raw_size = compressed_size = 0;
+  n_images = 0;
+  for (;;) {
+    if (!byzanz_deserialize (instream, width, height, flags, &record, NULL, error))
+      break;
+    if (record.type != BYZANZ_RECORD_IMAGE) {
+      byzanz_record_clear (&record);
+      continue;
+    }
+    if (record.surface == NULL)
+      break;
+
+    for (i = 0; i < cairo_region_num_rectangles (record.region); i++) {
+      cairo_region_get_rectangle (record.region, i, &rect);
+      raw_size += (guint64) rect.width * rect.height * sizeof (guint32);
+    }
+
+    g_seekable_seek (G_SEEKABLE (memory), 0, G_SEEK_SET, NULL, NULL);
+    g_timer_start (timer);
+    if (!byzanz_serialize (memory, record.msecs, record.surface, record.region,
+          BYZANZ_SERIALIZE_COMPRESS, NULL, error)) {
+      byzanz_record_clear (&record);
+      break;
+    }
+    compress_time += g_timer_elapsed (timer, NULL);
+    size = g_seekable_tell (G_SEEKABLE (memory));
+    compressed_size += size;
+
+    compressed = g_memory_input_stream_new_from_data (
+        g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (memory)), size, NULL);
+    g_timer_start (timer);
+    if (!byzanz_deserialize (compressed, width, height,
+          BYZANZ_SERIALIZE_COMPRESS, &decoded, NULL, error)) {
+      g_object_unref (compressed);
+      byzanz_record_clear (&record);
+      break;
+    }
+    decompress_time += g_timer_elapsed (timer, NULL);
+    byzanz_record_clear (&decoded);
+    g_object_unref (compressed);
+
+    byzanz_record_clear (&record);
+    n_images++;
+  }
+  g_timer_destroy (timer);
+  g_object_unref (memory);
+  if (error && *error)
+    return FALSE;
+
+  g_print (_("%u images, %.1f MB raw, %.1f MB compressed, ratio %.2f\n"), n_images,
+      raw_size / 1e6, compressed_size / 1e6,
+      compressed_size ? (double) raw_size / compressed_size : 0.0);
+  g_print (_("compression: %.1f MB/s, decompression: %.1f MB/s\n"),
+      compress_time > 0 ? raw_size / 1e6 / compress_time : 0.0,
+      decompress_time > 0 ? raw_size / 1e6 / decompress_time : 0.0);
+
+  return TRUE;
+}
+
 static void
 encoder_notify (ByzanzEncoder *encoder, GParamSpec *pspec, GMainLoop *loop)
 {
@@ -50,6 +178,200 @@ encoder_notify (ByzanzEncoder *encoder, GParamSpec *pspec, GMainLoop *loop)
   }
 }
 
+typedef struct {
+  ByzanzIndex *         index;          /* index of the recording */
+  const char *          path;           /* file containing the recording */
+  guint64               start;          /* time the segment starts */
+  guint64               end;            /* time the segment ends */
+  ByzanzQueue *         queue;          /* queue the segment is written to */
+  GFile *               file;           /* file the segment is encoded to */
+  ByzanzEncoder *       encoder;        /* encoder for the segment */
+  GThread *             thread;         /* thread writing the segment */
+  GCancellable *        cancellable;    /* stops writing and encoding the segment */
+  GError *              error;          /* error from writing the segment */
+} Segment;
+
+typedef struct {
+  GMainLoop *           loop;
+  Segment *             list;           /* all segments */
+  guint                 n_segments;     /* number of segments in list */
+  guint                 running;        /* number of encoders still running */
+  gboolean              failed;         /* TRUE if an encoder failed */
+} Segments;
+
+/* runs in its own thread, using its own mapping of the recording */
+static gpointer
+segment_write (gpointer data)
+{
+  Segment *segment = data;
+  GOutputStream *output;
+  GInputStream *input;
+
+  output = byzanz_queue_get_output_stream (segment->queue);
+  input = byzanz_mapped_input_stream_new (segment->path, &segment->error);
+  if (input) {
+    byzanz_index_write_segment (segment->index, input, output,
+        segment->start, segment->end, segment->cancellable, &segment->error);
+    g_object_unref (input);
+  }
+  g_output_stream_close (output, NULL, NULL);
+
+  return NULL;
+}
+
+/* A failed segment makes the others useless, so they are stopped. Their
+ * encoders still need to finish before their files can be deleted. */
+static void
+segments_cancel (Segments *segments)
+{
+  guint i;
+
+  segments->failed = TRUE;
+  for (i = 0; i < segments->n_segments; i++) {
+    if (segments->list[i].cancellable)
+      g_cancellable_cancel (segments->list[i].cancellable);
+  }
+}
+
+static void
+segment_encoder_notify (ByzanzEncoder *encoder, GParamSpec *pspec, Segments *segments)
+{
+  const GError *error;
+
+  if (g_strcmp0 (pspec->name, "error") == 0) {
+    error = byzanz_encoder_get_error (encoder);
+    if (error == NULL || segments->failed)
+      return;
+    g_print ("%s\n", error->message);
+    segments_cancel (segments);
+  } else if (g_strcmp0 (pspec->name, "running") == 0 &&
+             !byzanz_encoder_is_running (encoder)) {
+    segments->running--;
+    if (segments->running == 0)
+      g_main_loop_quit (segments->loop);
+  }
+}
+
+/* Splits the recording into parts of equal length, encodes them in
+ * parallel and joins the results. */
+static gboolean
+run_jobs (const char *    path,
+          GInputStream *  instream,
+          GOutputStream * outstream,
+          GType           type,
+          GError **       error)
+{
+  ByzanzIndex *index;
+  GOutputStream *stream;
+  Segment *segment_list;
+  Segments segments;
+  GFile **files;
+  guint i, n_segments;
+  char *dir, *name, *filename;
+  gboolean result;
+
+  index = byzanz_index_read (instream, NULL, error);
+  if (index == NULL)
+    return FALSE;
+  dir = g_dir_make_tmp ("byzanz-XXXXXX", error);
+  if (dir == NULL) {
+    byzanz_index_free (index);
+    return FALSE;
+  }
+
+  n_segments = MIN ((guint64) jobs, MAX (byzanz_index_get_duration (index), 1));
+  segment_list = g_new0 (Segment, n_segments);
+  files = g_new (GFile *, n_segments);
+  segments.loop = g_main_loop_new (NULL, FALSE);
+  segments.list = segment_list;
+  segments.n_segments = n_segments;
+  segments.running = 0;
+  segments.failed = FALSE;
+  result = TRUE;
+  for (i = 0; i < n_segments && result; i++) {
+    Segment *segment = &segment_list[i];
+
+    segment->index = index;
+    segment->path = path;
+    segment->start = byzanz_index_get_duration (index) * i / n_segments;
+    segment->end = MAX (byzanz_index_get_duration (index) * (i + 1) / n_segments, segment->start + 1);
+    name = g_strdup_printf ("segment-%04u", i);
+    filename = g_build_filename (dir, name, NULL);
+    segment->file = files[i] = g_file_new_for_path (filename);
+    g_free (filename);
+    g_free (name);
+    segment->cancellable = g_cancellable_new ();
+
+    stream = G_OUTPUT_STREAM (g_file_replace (segment->file, NULL, FALSE,
+          G_FILE_CREATE_REPLACE_DESTINATION, NULL, error));
+    if (stream == NULL) {
+      result = FALSE;
+      break;
+    }
+    segment->queue = byzanz_queue_new ();
+    segment->encoder = byzanz_encoder_new (type,
+        byzanz_queue_get_input_stream (segment->queue), stream, FALSE, segment->cancellable);
+    /* nothing is captured live here, so every image must be encoded */
+    byzanz_encoder_set_max_backlog (segment->encoder, 0);
+    g_object_unref (stream);
+    g_signal_connect (segment->encoder, "notify", G_CALLBACK (segment_encoder_notify), &segments);
+    segments.running++;
+    segment->thread = g_thread_new ("segment", segment_write, segment);
+  }
+
+  if (!result)
+    segments_cancel (&segments);
+  /* even after a failure, wait for every encoder to let go of its file */
+  if (segments.running)
+    g_main_loop_run (segments.loop);
+
+  for (i = 0; i < n_segments; i++) {
+    Segment *segment = &segment_list[i];
+
+    if (segment->encoder) {
+      g_signal_handlers_disconnect_by_func (segment->encoder, segment_encoder_notify, &segments);
+      g_object_unref (segment->encoder);
+    }
+    if (segment->thread)
+      g_thread_join (segment->thread);
+    if (segment->queue)
+      g_object_unref (segment->queue);
+    if (segment->cancellable)
+      g_object_unref (segment->cancellable);
+    if (segment->error) {
+      /* stopped segments just report being cancelled, keep the real error */
+      if (result && !g_error_matches (segment->error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_propagate_error (error, segment->error);
+        result = FALSE;
+      } else {
+        g_error_free (segment->error);
+      }
+    }
+  }
+  if (segments.failed && result) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, _("Encoding failed"));
+    result = FALSE;
+  }
+
+  if (result)
+    result = byzanz_encoder_gstreamer_concat (type, files, n_segments, outstream, error);
+
+  for (i = 0; i < n_segments; i++) {
+    if (segment_list[i].file == NULL)
+      continue;
+    g_file_delete (segment_list[i].file, NULL, NULL);
+    g_object_unref (segment_list[i].file);
+  }
+  g_rmdir (dir);
+  g_free (dir);
+  g_free (files);
+  g_free (segment_list);
+  g_main_loop_unref (segments.loop);
+  byzanz_index_free (index);
+
+  return result;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -57,10 +379,13 @@ main (int argc, char **argv)
   GError *error = NULL;
   GFile *infile;
   GFile *outfile;
+  char *inpath;
   GInputStream *instream;
   GOutputStream *outstream;
   GMainLoop *loop;
   ByzanzEncoder *encoder;
+  GType type;
+  int result = 0;
   
   g_set_prgname (argv[0]);
 #ifdef GETTEXT_PACKAGE
@@ -81,21 +406,40 @@ main (int argc, char **argv)
     g_error_free (error);
     return 1;
   }
-  if (argc != 3) {
+  if (argc != (benchmark || build_index ? 2 : 3)) {
     usage ();
     return 0;
   }
 
   infile = g_file_new_for_commandline_arg (argv[1]);
-  outfile = g_file_new_for_commandline_arg (argv[2]);
-  loop = g_main_loop_new (NULL, FALSE);
 
-  instream = G_INPUT_STREAM (g_file_read (infile, NULL, &error));
+  /* map local files, so images can be used without copying them */
+  inpath = g_file_get_path (infile);
+  if (inpath) {
+    instream = byzanz_mapped_input_stream_new (inpath, &error);
+  } else {
+    instream = G_INPUT_STREAM (g_file_read (infile, NULL, &error));
+  }
   if (instream == NULL) {
     g_print ("%s\n", error->message);
     g_error_free (error);
     return 1;
   }
+
+  if (benchmark || build_index) {
+    if (benchmark ? !run_benchmark (instream, &error) : !run_index (infile, instream, &error)) {
+      g_print ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+    g_object_unref (instream);
+    g_object_unref (infile);
+    g_free (inpath);
+    return 0;
+  }
+
+  outfile = g_file_new_for_commandline_arg (argv[2]);
+  loop = g_main_loop_new (NULL, FALSE);
   outstream = G_OUTPUT_STREAM (g_file_replace (outfile, NULL, 
         FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL, &error));
   if (outstream == NULL) {
@@ -103,19 +447,38 @@ main (int argc, char **argv)
     g_error_free (error);
     return 1;
   }
-  encoder = byzanz_encoder_new (byzanz_encoder_get_type_from_file (outfile),
-      instream, outstream, FALSE, NULL);
+  type = byzanz_encoder_get_type_from_file (outfile);
+
+  if (jobs > 1) {
+    if (inpath && byzanz_encoder_gstreamer_can_concat (type)) {
+      if (!run_jobs (inpath, instream, outstream, type, &error)) {
+        g_print ("%s\n", error->message);
+        g_error_free (error);
+        result = 1;
+      }
+      g_output_stream_close (outstream, NULL, NULL);
+      /* it's broken, so don't leave it around */
+      if (result != 0)
+        g_file_delete (outfile, NULL, NULL);
+      goto out;
+    }
+    g_print (_("Cannot encode this format in parts, using one job.\n"));
+  }
+
+  encoder = byzanz_encoder_new (type, instream, outstream, FALSE, NULL);
   
   g_signal_connect (encoder, "notify", G_CALLBACK (encoder_notify), loop);
   
   g_main_loop_run (loop);
+  g_object_unref (encoder);
 
+out:
   g_main_loop_unref (loop);
-  g_object_unref (encoder);
   g_object_unref (instream);
   g_object_unref (outstream);
   g_object_unref (infile);
   g_object_unref (outfile);
+  g_free (inpath);
 
-  return 0;
+  return result;
 }
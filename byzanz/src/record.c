@@ -19,29 +19,61 @@
 #  include "config.h"
 #endif
 
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
+#include <gdk/gdkx.h>
+#include <gio/gunixoutputstream.h>
 
 #include "byzanzsession.h"
 
-static int duration = 10;
+static int duration = -1;
 static int delay = 1;
 static gboolean cursor = FALSE;
+static gboolean cursor_metadata = FALSE;
 static gboolean audio = FALSE;
 static gboolean verbose = FALSE;
+static int scale = 1;
+static int max_backlog = BYZANZ_ENCODER_MAX_BACKLOG / (1024 * 1024);
+static int max_latency = BYZANZ_ENCODER_MAX_LATENCY;
 static char *exec = NULL;
+static char *encoder_format = NULL;
+static char *window_id = NULL;
+static char *shm_path = NULL;
+static int time_lapse = 0;
+static int replay = 0;
+static int replay_budget = BYZANZ_REPLAY_BUDGET / (1024 * 1024);
+static GFile *replay_file = NULL;
+static GType replay_type = G_TYPE_NONE;
+static guint replay_count = 0;
 static cairo_rectangle_int_t area = { 0, 0, G_MAXINT / 2, G_MAXINT / 2 };
 
 static GOptionEntry entries[] = 
 {
-  { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, N_("Duration of animation (default: 10 seconds)"), N_("SECS") },
+  { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, N_("Duration of animation (default: 10 seconds, unlimited with --replay)"), N_("SECS") },
   { "exec", 'e', 0, G_OPTION_ARG_STRING, &exec, N_("Command to execute and time"), N_("COMMAND") },
   { "delay", 0, 0, G_OPTION_ARG_INT, &delay, N_("Delay before start (default: 1 second)"), N_("SECS") },
   { "cursor", 'c', 0, G_OPTION_ARG_NONE, &cursor, N_("Record mouse cursor"), NULL },
+  { "cursor-metadata", 0, 0, G_OPTION_ARG_NONE, &cursor_metadata, N_("Record the mouse cursor separately and draw it when encoding"), NULL },
   { "audio", 'a', 0, G_OPTION_ARG_NONE, &audio, N_("Record audio"), NULL },
+  { "window", 0, 0, G_OPTION_ARG_STRING, &window_id, N_("Record only the window with this X id"), N_("XID") },
   { "x", 'x', 0, G_OPTION_ARG_INT, &area.x, N_("X coordinate of rectangle to record"), N_("PIXEL") },
   { "y", 'y', 0, G_OPTION_ARG_INT, &area.y, N_("Y coordinate of rectangle to record"), N_("PIXEL") },
   { "width", 'w', 0, G_OPTION_ARG_INT, &area.width, N_("Width of recording rectangle"), N_("PIXEL") },
   { "height", 'h', 0, G_OPTION_ARG_INT, &area.height, N_("Height of recording rectangle"), N_("PIXEL") },
+  { "scale", 0, 0, G_OPTION_ARG_INT, &scale, N_("Shrink the recording by this factor (default: 1)"), N_("FACTOR") },
+  { "max-backlog", 0, 0, G_OPTION_ARG_INT, &max_backlog, N_("Merge frames when encoding falls this far behind, 0 to never merge (default: 32 MB)"), N_("MB") },
+  { "max-latency", 0, 0, G_OPTION_ARG_INT, &max_latency, N_("Never merge frames further apart than this (default: 1000 ms)"), N_("MSECS") },
+  { "time-lapse", 0, 0, G_OPTION_ARG_INT, &time_lapse, N_("Only take a picture every few seconds and play them back at 25 per second"), N_("SECS") },
+  { "format", 'f', 0, G_OPTION_ARG_STRING, &encoder_format, N_("Format to record to instead of guessing it from the filename"), N_("FORMAT") },
+  { "replay", 0, 0, G_OPTION_ARG_INT, &replay, N_("Only keep the last seconds in memory and save them when receiving SIGUSR1"), N_("SECS") },
+  { "replay-budget", 0, 0, G_OPTION_ARG_INT, &replay_budget, N_("Memory the replay may use (default: 64 MB)"), N_("MB") },
+#ifdef HAVE_SYS_EVENTFD_H
+  { "shm", 0, 0, G_OPTION_ARG_FILENAME, &shm_path, N_("Publish frames in shared memory to programs connecting to this socket"), N_("PATH") },
+#endif
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, N_("Be verbose"), NULL },
   { NULL }
 };
@@ -63,10 +95,19 @@ verbose_print (const gchar *format, ...)
   g_print ("%s", buffer);
 }
 
+static void
+print_to_stderr (const gchar *string)
+{
+  fputs (string, stderr);
+}
+
 static void
 usage (void)
 {
-  g_print (_("usage: %s [OPTIONS] filename\n"), g_get_prgname ());
+  g_print (_("usage: %s [OPTIONS] filename...\n"), g_get_prgname ());
+#ifdef HAVE_SYS_EVENTFD_H
+  g_print (_("       %s [OPTIONS] --shm=PATH [filename...]\n"), g_get_prgname ());
+#endif
   g_print (_("       %s --help\n"), g_get_prgname ());
 }
 
@@ -82,11 +123,32 @@ session_notify_cb (ByzanzSession *session, GParamSpec *pspec, gpointer unused)
   }
 
   if (!byzanz_session_is_encoding (session)) {
+    guint coalesced;
+
+    g_object_get (session, "coalesced-frames", &coalesced, NULL);
+    if (coalesced)
+      verbose_print (_("Encoding fell behind, %u frames were merged.\n"), coalesced);
     verbose_print (_("Recording done.\n"));
     gtk_main_quit ();
   }
 }
 
+/* the other outputs keep recording */
+static void
+output_failed_cb (ByzanzSession *session, GFile *file, const GError *error, gpointer unused)
+{
+  char *name;
+
+  if (file == NULL) {
+    g_print (_("Error during recording: %s\n"), error->message);
+    return;
+  }
+
+  name = g_file_get_parse_name (file);
+  g_print (_("Could not record to %s: %s\n"), name, error->message);
+  g_free (name);
+}
+
 static gboolean
 stop_recording (gpointer session)
 {
@@ -107,6 +169,61 @@ child_exited (GPid     pid,
   stop_recording (session);
 }
 
+/* bug.gif is saved as bug-1.gif, bug-2.gif and so on */
+static GFile *
+replay_file_next (void)
+{
+  char *basename, *dot, *name;
+  GFile *parent, *result;
+
+  basename = g_file_get_basename (replay_file);
+  dot = strrchr (basename, '.');
+  replay_count++;
+  if (dot && dot != basename) {
+    *dot = '\0';
+    name = g_strdup_printf ("%s-%u.%s", basename, replay_count, dot + 1);
+  } else {
+    name = g_strdup_printf ("%s-%u", basename, replay_count);
+  }
+  parent = g_file_get_parent (replay_file);
+  result = g_file_get_child (parent, name);
+  g_object_unref (parent);
+  g_free (name);
+  g_free (basename);
+
+  return result;
+}
+
+static gboolean
+save_replay (gpointer session)
+{
+  GError *error = NULL;
+  GFile *file;
+
+  file = replay_file_next ();
+  if (byzanz_session_save_replay (session, file, replay_type, &error)) {
+    verbose_print (_("Saving replay...\n"));
+  } else {
+    g_print (_("Could not save replay: %s\n"), error->message);
+    g_error_free (error);
+  }
+  g_object_unref (file);
+
+  return TRUE;
+}
+
+static void
+replay_saved_cb (ByzanzSession *session, GFile *file, const GError *error, gpointer unused)
+{
+  char *name = g_file_get_parse_name (file);
+
+  if (error)
+    g_print (_("Could not save replay %s: %s\n"), name, error->message);
+  else
+    g_print (_("Saved replay %s.\n"), name);
+  g_free (name);
+}
+
 static gboolean
 start_recording (gpointer session)
 {
@@ -132,6 +249,10 @@ start_recording (gpointer session)
 
     verbose_print (_("Recording starts. Will record until child exits...\n"));
     g_child_watch_add (pid, child_exited, session);
+  } else if (duration == 0) {
+    verbose_print (_("Recording starts. Will record until interrupted...\n"));
+    g_unix_signal_add (SIGINT, stop_recording, session);
+    g_unix_signal_add (SIGTERM, stop_recording, session);
   } else {
     verbose_print (_("Recording starts. Will record %d seconds...\n"), duration / 1000);
     g_timeout_add (duration, stop_recording, session);
@@ -159,7 +280,11 @@ main (int argc, char **argv)
   ByzanzSession *rec;
   GOptionContext* context;
   GError *error = NULL;
+  GdkWindow *window;
+  GOutputStream *stream;
+  GType type = G_TYPE_NONE;
   GFile *file;
+  int i;
   
   g_set_prgname (argv[0]);
 #ifdef GETTEXT_PACKAGE
@@ -180,28 +305,112 @@ main (int argc, char **argv)
     usage ();
     return 1;
   }
-  if (argc != 2) {
+  if (argc < 2 && shm_path == NULL && replay <= 0) {
     usage ();
     return 0;
   }
-  if (!clamp_to_window (&area, gdk_get_default_root_window (), &area)) {
+  if (encoder_format) {
+    type = byzanz_encoder_get_type_from_format (encoder_format);
+    if (type == G_TYPE_NONE) {
+      g_print (_("Unknown format %s.\n"), encoder_format);
+      return 1;
+    }
+  }
+  if (window_id) {
+    char *end;
+    Window xid = g_ascii_strtoull (window_id, &end, 0);
+
+    window = NULL;
+    if (*end == '\0' && xid != 0)
+      window = gdk_x11_window_foreign_new_for_display (gdk_display_get_default (), xid);
+    if (window == NULL) {
+      g_print (_("No window with id %s.\n"), window_id);
+      return 1;
+    }
+  } else {
+    window = g_object_ref (gdk_get_default_root_window ());
+  }
+  if (!clamp_to_window (&area, window, &area)) {
     g_print (_("Given area is not inside desktop.\n"));
     return 1;
   }
-  file = g_file_new_for_commandline_arg (argv[1]);
-  rec = byzanz_session_new (file, byzanz_encoder_get_type_from_file (file),
-      gdk_get_default_root_window (), &area, cursor, audio);
-  g_object_unref (file);
+  if (scale < 1 || scale > area.width || scale > area.height) {
+    g_print (_("Invalid scale factor %d.\n"), scale);
+    return 1;
+  }
+  if (time_lapse > 0 && audio) {
+    g_print (_("Audio can't be recorded in time-lapse mode.\n"));
+    return 1;
+  }
+  /* outputs are set up for time-lapse mode when they're added */
+  rec = byzanz_session_new (NULL, BYZANZ_TYPE_ENCODER, window, &area, cursor, audio);
+  g_object_set (rec, "time-lapse", (guint) MAX (time_lapse, 0) * 1000, NULL);
+  g_signal_connect (rec, "output-failed", G_CALLBACK (output_failed_cb), NULL);
+  if (replay > 0) {
+    /* the filename names the replays */
+    if (argc != 2 || g_str_equal (argv[1], "-")) {
+      g_print (_("Give exactly one filename to save replays to.\n"));
+      return 1;
+    }
+    replay_file = g_file_new_for_commandline_arg (argv[1]);
+    replay_type = type == G_TYPE_NONE ? byzanz_encoder_get_type_from_file (replay_file) : type;
+    g_object_set (rec, "replay-duration", (guint64) replay * 1000,
+        "replay-budget", (guint64) MAX (replay_budget, 1) * 1024 * 1024, NULL);
+    g_signal_connect (rec, "replay-saved", G_CALLBACK (replay_saved_cb), NULL);
+    g_unix_signal_add (SIGUSR1, save_replay, rec);
+    argc = 1;
+  }
+  /* all files are encoded from the same capture */
+  for (i = 1; i < argc; i++) {
+    GType encoder_type = type;
+
+    stream = NULL;
+    file = NULL;
+    if (g_str_equal (argv[i], "-")) {
+      if (type == G_TYPE_NONE) {
+        g_print (_("Recording to standard output needs a --format.\n"));
+        return 1;
+      }
+      /* keep messages out of the recording */
+      g_set_print_handler (print_to_stderr);
+      stream = g_unix_output_stream_new (STDOUT_FILENO, FALSE);
+    } else {
+      file = g_file_new_for_commandline_arg (argv[i]);
+      if (encoder_type == G_TYPE_NONE)
+        encoder_type = byzanz_encoder_get_type_from_file (file);
+    }
+
+    if (file)
+      byzanz_session_add_output (rec, file, encoder_type);
+    if (stream) {
+      byzanz_session_add_output_stream (rec, stream, encoder_type);
+      g_object_unref (stream);
+    }
+    if (file)
+      g_object_unref (file);
+  }
+#ifdef HAVE_SYS_EVENTFD_H
+  if (shm_path)
+    byzanz_session_add_shm_output (rec, shm_path);
+#endif
+  g_object_unref (window);
+  g_object_set (rec, "scale", (guint) scale, "cursor-metadata", cursor_metadata,
+      "max-backlog", (guint64) MAX (max_backlog, 0) * 1024 * 1024,
+      "max-latency", (guint64) MAX (max_latency, 0), NULL);
   g_signal_connect (rec, "notify", G_CALLBACK (session_notify_cb), NULL);
   
   delay = MAX (delay, 1);
   delay = (delay - 1) * 1000;
-  duration = MAX (duration, 0);
+  /* replays are saved on demand, so keep recording unless told otherwise */
+  if (duration < 0)
+    duration = replay > 0 ? 0 : 10;
   duration *= 1000;
   g_timeout_add (delay, start_recording, rec);
   
   gtk_main ();
 
   g_object_unref (rec);
+  if (replay_file)
+    g_object_unref (replay_file);
   return 0;
 }